@@ -0,0 +1,356 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * headless throughput measurement of the export pixelpipe: loads an image (and
+ * optionally an xmp sidecar) like darktable-cli does, then processes it over and over
+ * for every combination of output scale, number of openmp threads and host memory
+ * limit (which decides about tiling). the pipe caches are flushed before every run,
+ * so each run processes all modules. results are written as json:
+ * wall time, MPix/s, the time spent in every module and the peak resident memory of
+ * each configuration (or of the whole process so far, where that can't be reset).
+ *
+ * usage: darktable-bench <input file> [<xmp file>] [--runs <n>] [--scales <s,..>]
+ *        [--threads <n,..>] [--memory-limits <MB,..>] [--opencl] [--output <json file>]
+ */
+
+#include "common/darktable.h"
+#include "common/film.h"
+#include "common/image.h"
+#include "common/image_cache.h"
+#include "common/mipmap_cache.h"
+#include "common/exif.h"
+#include "common/opencl.h"
+#include "control/conf.h"
+#include "develop/develop.h"
+#include "develop/imageop.h"
+#include "develop/pixelpipe.h"
+#include "develop/pixelpipe_diskcache.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MAX_VALUES 16
+
+static void
+usage(const char* progname)
+{
+  fprintf(stderr, "usage: %s <input file> [<xmp file>] [--runs <n>] [--scales <s,..>] [--threads <n,..>] [--memory-limits <MB,..>] [--opencl] [--output <json file>]\n", progname);
+}
+
+// parses a comma separated list, returns the number of values
+static int
+parse_list(const char *str, double *values)
+{
+  int num = 0;
+  gchar **tokens = g_strsplit(str, ",", MAX_VALUES);
+  for(int k=0; tokens[k] && num<MAX_VALUES; k++)
+    if(tokens[k][0]) values[num++] = g_ascii_strtod(tokens[k], NULL);
+  g_strfreev(tokens);
+  return num;
+}
+
+// writes str as a json string, with quotes
+static void
+json_string(FILE *f, const char *str)
+{
+  fputc('"', f);
+  for(const unsigned char *c = (const unsigned char *)str; *c; c++)
+  {
+    if(*c == '"' || *c == '\\') fprintf(f, "\\%c", *c);
+    else if(*c < 0x20) fprintf(f, "\\u%04x", *c);
+    else fputc(*c, f);
+  }
+  fputc('"', f);
+}
+
+// resets the peak resident set size of this process (linux only). returns non-zero on success.
+static int
+reset_peak_memory()
+{
+  FILE *f = fopen("/proc/self/clear_refs", "w");
+  if(!f) return 0;
+  const int ok = fputs("5", f) >= 0;
+  return (fclose(f) == 0) && ok;
+}
+
+// peak resident set size since the last reset, in bytes. falls back to the peak of the
+// whole process, which only ever grows.
+static uint64_t
+peak_memory()
+{
+  FILE *f = fopen("/proc/self/status", "rb");
+  if(f)
+  {
+    char line[256];
+    uint64_t kb = 0;
+    int found = 0;
+    while(!found && fgets(line, sizeof(line), f))
+      found = sscanf(line, "VmHWM: %" SCNu64 " kB", &kb) == 1;
+    fclose(f);
+    if(found) return kb * 1024;
+  }
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage)) return 0;
+  return (uint64_t)usage.ru_maxrss * 1024;
+}
+
+static void
+reset_timings(dt_dev_pixelpipe_t *pipe)
+{
+  for(GList *nodes = pipe->nodes; nodes; nodes = g_list_next(nodes))
+  {
+    dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)nodes->data;
+    piece->process_time = 0.0;
+    piece->process_count = 0;
+  }
+}
+
+int main(int argc, char *arg[])
+{
+  gtk_init (&argc, &arg);
+
+  char *image_filename = NULL;
+  char *xmp_filename = NULL;
+  char *output_filename = NULL;
+  int runs = 3, opencl = 0;
+  double scales[MAX_VALUES] = { 1.0 }, threads[MAX_VALUES] = { 0 }, limits[MAX_VALUES] = { -1 };
+  int num_scales = 1, num_threads = 1, num_limits = 1;
+  int file_counter = 0;
+
+  for(int k=1; k<argc; k++)
+  {
+    if(arg[k][0] == '-')
+    {
+      if(!strcmp(arg[k], "--help"))
+      {
+        usage(arg[0]);
+        exit(1);
+      }
+      else if(!strcmp(arg[k], "--opencl"))
+        opencl = 1;
+      else if(k+1 >= argc)
+      {
+        usage(arg[0]);
+        exit(1);
+      }
+      else if(!strcmp(arg[k], "--runs"))
+        runs = MAX(atoi(arg[++k]), 1);
+      else if(!strcmp(arg[k], "--scales"))
+        num_scales = parse_list(arg[++k], scales);
+      else if(!strcmp(arg[k], "--threads"))
+        num_threads = parse_list(arg[++k], threads);
+      else if(!strcmp(arg[k], "--memory-limits"))
+        num_limits = parse_list(arg[++k], limits);
+      else if(!strcmp(arg[k], "--output"))
+        output_filename = arg[++k];
+      else
+      {
+        usage(arg[0]);
+        exit(1);
+      }
+    }
+    else
+    {
+      if(file_counter == 0)
+        image_filename = arg[k];
+      else if(file_counter == 1)
+        xmp_filename = arg[k];
+      file_counter++;
+    }
+  }
+
+  if(file_counter < 1 || file_counter > 2 || num_scales < 1 || num_threads < 1 || num_limits < 1)
+  {
+    usage(arg[0]);
+    exit(1);
+  }
+  for(int k=0; k<num_scales; k++)
+  {
+    if(scales[k] <= 0.0 || scales[k] > 1.0)
+    {
+      fprintf(stderr, "scales have to be in (0, 1]\n");
+      exit(1);
+    }
+  }
+
+  FILE *f = output_filename ? fopen(output_filename, "wb") : stdout;
+  if(!f)
+  {
+    fprintf(stderr, "can't write to %s\n", output_filename);
+    exit(1);
+  }
+
+  char *m_arg[] = {"darktable-bench", "--library", ":memory:", NULL, NULL};
+  int m_argc = 3;
+  if(!opencl) m_arg[m_argc++] = "--disable-opencl";
+  if(dt_init(m_argc, m_arg, 0)) exit(1);
+
+  // changed for every configuration, and put back on all ways out from here on
+  const int default_limit = dt_conf_get_int("host_memory_limit");
+  int failed = 0;
+
+  // measure the modules, not the disk:
+  dt_dev_pixelpipe_diskcache_cleanup(darktable.pixelpipe_diskcache);
+  darktable.pixelpipe_diskcache = NULL;
+
+  dt_film_t film;
+  gchar *directory = g_path_get_dirname(image_filename);
+  const int filmid = dt_film_new(&film, directory);
+  const int id = dt_image_import(filmid, image_filename, TRUE);
+  g_free(directory);
+  if(!id)
+  {
+    fprintf(stderr, "error: can't open file %s\n", image_filename);
+    failed = 1;
+    goto done;
+  }
+
+  if(xmp_filename)
+  {
+    const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, id);
+    dt_image_t *image = dt_image_cache_write_get(darktable.image_cache, cimg);
+    dt_exif_xmp_read(image, xmp_filename, 1);
+    dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
+    dt_image_cache_read_release(darktable.image_cache, image);
+  }
+
+  // same setup as dt_imageio_export_with_flags(), minus the format:
+  double start = dt_get_wtime();
+  dt_develop_t dev;
+  dt_dev_init(&dev, 0);
+  dt_mipmap_buffer_t buf;
+  dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, id, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+  if(!buf.buf)
+  {
+    fprintf(stderr, "error: can't load image %s\n", image_filename);
+    dt_dev_cleanup(&dev);
+    failed = 1;
+    goto done;
+  }
+  dt_dev_load_image(&dev, id);
+  const double load_time = dt_get_wtime() - start;
+
+  start = dt_get_wtime();
+  dt_dev_pixelpipe_t pipe;
+  if(!dt_dev_pixelpipe_init_export(&pipe, dev.image_storage.width, dev.image_storage.height))
+  {
+    fprintf(stderr, "error: failed to allocate the pixelpipe\n");
+    dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+    dt_dev_cleanup(&dev);
+    failed = 1;
+    goto done;
+  }
+  dt_dev_pixelpipe_set_input(&pipe, &dev, (float *)buf.buf, buf.width, buf.height, 1.0);
+  dt_dev_pixelpipe_create_nodes(&pipe, &dev);
+  dt_dev_pixelpipe_synch_all(&pipe, &dev);
+  dt_dev_pixelpipe_get_dimensions(&pipe, &dev, pipe.iwidth, pipe.iheight, &pipe.processed_width, &pipe.processed_height);
+  const double setup_time = dt_get_wtime() - start;
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"image\": ");
+  json_string(f, image_filename);
+  fprintf(f, ",\n  \"xmp\": ");
+  json_string(f, xmp_filename ? xmp_filename : "");
+  fprintf(f, ",\n");
+  fprintf(f, "  \"input\": { \"width\": %d, \"height\": %d },\n", buf.width, buf.height);
+  fprintf(f, "  \"output\": { \"width\": %d, \"height\": %d },\n", pipe.processed_width, pipe.processed_height);
+  fprintf(f, "  \"opencl\": %s,\n", darktable.opencl->inited && darktable.opencl->enabled ? "true" : "false");
+  fprintf(f, "  \"load_time\": %.6f,\n", load_time);
+  fprintf(f, "  \"setup_time\": %.6f,\n", setup_time);
+  fprintf(f, "  \"configurations\": [");
+
+  int first = 1;
+  for(int s=0; s<num_scales; s++) for(int t=0; t<num_threads; t++) for(int l=0; l<num_limits; l++)
+  {
+    const float scale = scales[s];
+    const int nthreads = threads[t] > 0 ? (int)threads[t] : darktable.num_openmp_threads;
+    const int limit = limits[l] >= 0 ? (int)limits[l] : default_limit;
+#ifdef _OPENMP
+    omp_set_num_threads(nthreads);
+#endif
+    // read by the tiling code on every process call:
+    dt_conf_set_int("host_memory_limit", limit);
+
+    const int width  = scale*pipe.processed_width;
+    const int height = scale*pipe.processed_height;
+    double *times = (double *)malloc(sizeof(double)*runs);
+    reset_timings(&pipe);
+    const int peak_reset = reset_peak_memory();
+    double total = 0.0, best = 0.0;
+    for(int r=0; r<runs; r++)
+    {
+      dt_dev_pixelpipe_flush_caches(&pipe);
+      start = dt_get_wtime();
+      if(dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, 0, width, height, scale)) failed = 1;
+      times[r] = dt_get_wtime() - start;
+      total += times[r];
+      if(r == 0 || times[r] < best) best = times[r];
+    }
+
+    fprintf(f, "%s\n    {\n", first ? "" : ",");
+    first = 0;
+    fprintf(f, "      \"scale\": %g, \"threads\": %d, \"host_memory_limit\": %d, \"runs\": %d,\n", scale, nthreads, limit, runs);
+    fprintf(f, "      \"width\": %d, \"height\": %d,\n", width, height);
+    fprintf(f, "      \"times\": [");
+    for(int r=0; r<runs; r++) fprintf(f, "%s%.6f", r ? ", " : "", times[r]);
+    fprintf(f, "],\n");
+    fprintf(f, "      \"mean_time\": %.6f, \"best_time\": %.6f,\n", total/runs, best);
+    // mpix/s of the output, and of the raw data pushed through the pipe:
+    fprintf(f, "      \"mpix_per_s\": %.3f, \"input_mpix_per_s\": %.3f,\n",
+            width*(double)height*1e-6*runs/total, buf.width*(double)buf.height*1e-6*runs/total);
+    fprintf(f, "      \"%s\": %" PRIu64 ",\n", peak_reset ? "peak_memory" : "process_peak_memory", peak_memory());
+    fprintf(f, "      \"modules\": [");
+    int first_module = 1;
+    for(GList *nodes = pipe.nodes; nodes; nodes = g_list_next(nodes))
+    {
+      dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)nodes->data;
+      if(!piece->enabled) continue;
+      fprintf(f, "%s\n        { \"op\": \"%s\", \"instance\": %d, \"count\": %d, \"mean_time\": %.6f }",
+              first_module ? "" : ",", piece->module->op, piece->module->instance, piece->process_count,
+              piece->process_time/runs);
+      first_module = 0;
+    }
+    fprintf(f, "\n      ]\n    }");
+    free(times);
+  }
+  fprintf(f, "\n  ]\n}\n");
+
+  dt_dev_pixelpipe_cleanup(&pipe);
+  dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+  dt_dev_cleanup(&dev);
+
+done:
+  if(f != stdout) fclose(f);
+  dt_conf_set_int("host_memory_limit", default_limit);
+#ifdef _OPENMP
+  omp_set_num_threads(darktable.num_openmp_threads);
+#endif
+  dt_cleanup();
+  return failed;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,193 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/**
+ * measures how fast compressed mipmaps can be drawn while scrolling through
+ * lighttable: a page of thumbnails is decompressed over and over again, once for
+ * each cache_compression setting (1: low quality/range fit, 2: high quality/cluster fit).
+ * the decoded pixels are checked against a plain reference dxt1 decoder.
+ *
+ * usage: darktable-bench-thumbnails [thumbnail size] [thumbnails per page] [pages]
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include "external/squish/csquish.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static double get_wtime(void)
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + (1.0/1000000.0)*time.tv_usec;
+}
+
+// straight port of squish::DecompressColour() for dxt1, one block at a time.
+static void reference_decompress(uint8_t *rgba, const int width, const int height, const uint8_t *blocks)
+{
+  const uint8_t *block = blocks;
+  for(int y=0; y<height; y+=4)
+  {
+    for(int x=0; x<width; x+=4)
+    {
+      uint8_t codes[16];
+      const int a = block[0] | (block[1] << 8);
+      const int b = block[2] | (block[3] << 8);
+      for(int k=0; k<2; k++)
+      {
+        const int v = k ? b : a;
+        const int r = (v >> 11) & 0x1f, g = (v >> 5) & 0x3f, bl = v & 0x1f;
+        codes[4*k+0] = (r << 3) | (r >> 2);
+        codes[4*k+1] = (g << 2) | (g >> 4);
+        codes[4*k+2] = (bl << 3) | (bl >> 2);
+        codes[4*k+3] = 255;
+      }
+      for(int c=0; c<3; c++)
+      {
+        if(a <= b)
+        {
+          codes[8+c] = (codes[c] + codes[4+c])/2;
+          codes[12+c] = 0;
+        }
+        else
+        {
+          codes[8+c] = (2*codes[c] + codes[4+c])/3;
+          codes[12+c] = (codes[c] + 2*codes[4+c])/3;
+        }
+      }
+      codes[11] = 255;
+      codes[15] = (a <= b) ? 0 : 255;
+      for(int py=0; py<4 && y+py<height; py++)
+        for(int px=0; px<4 && x+px<width; px++)
+          memcpy(rgba + 4*(width*(y+py) + x+px), codes + 4*((block[4+py] >> 2*px) & 3), 4);
+      block += 8;
+    }
+  }
+}
+
+// something thumbnail like: smooth gradients, a few edges and some noise.
+static void fill_thumbnail(uint8_t *rgba, const int width, const int height, const int seed)
+{
+  uint32_t state = 0x9e3779b9u * (seed+1);
+  for(int j=0; j<height; j++)
+  {
+    for(int i=0; i<width; i++)
+    {
+      state = state * 1664525u + 1013904223u;
+      const int noise = (state >> 24) & 0xf;
+      const int edge = ((i/(16+seed)) + (j/(24+seed))) & 1 ? 64 : 0;
+      rgba[4*(width*j+i)+0] = (255*i/width + noise) & 0xff;
+      rgba[4*(width*j+i)+1] = (255*j/height + edge) & 0xff;
+      rgba[4*(width*j+i)+2] = (128 + seed*16 + noise + edge) & 0xff;
+      rgba[4*(width*j+i)+3] = 0;
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const int size  = argc > 1 ? atoi(argv[1]) : 360;
+  const int thumbs = argc > 2 ? atoi(argv[2]) : 24;
+  const int pages = argc > 3 ? atoi(argv[3]) : 100;
+  if(size < 16 || thumbs < 1 || pages < 1)
+  {
+    fprintf(stderr, "usage: %s [thumbnail size] [thumbnails per page] [pages]\n", argv[0]);
+    return 1;
+  }
+
+  int *width = (int *)malloc(sizeof(int)*thumbs);
+  int *height = (int *)malloc(sizeof(int)*thumbs);
+  uint8_t **pixels = (uint8_t **)malloc(sizeof(uint8_t *)*thumbs);
+  uint8_t **blocks = (uint8_t **)malloc(sizeof(uint8_t *)*thumbs);
+  uint8_t *out = (uint8_t *)malloc(4*size*size);
+  uint8_t *ref = (uint8_t *)malloc(4*size*size);
+  size_t page_pixels = 0;
+  for(int k=0; k<thumbs; k++)
+  {
+    // mixed landscape and portrait shots, most of them not a multiple of the block size:
+    width[k]  = k & 1 ? size*2/3 - (k % 4) : size;
+    height[k] = k & 1 ? size : size*2/3 - (k % 4);
+    page_pixels += width[k]*height[k];
+    pixels[k] = (uint8_t *)malloc(4*width[k]*height[k]);
+    blocks[k] = (uint8_t *)malloc(((width[k]+3)/4) * ((height[k]+3)/4) * 8);
+    fill_thumbnail(pixels[k], width[k], height[k], k);
+  }
+
+  int failed = 0;
+  printf("page of %d thumbnails up to %dx%d, %.2f MPix\n", thumbs, size, size, page_pixels*1e-6);
+  for(int type=1; type<=2; type++)
+  {
+    // same flags as dt_mipmap_cache_compress()
+    int flags = squish_dxt1;
+    if(type == 1) flags |= squish_colour_range_fit;
+
+    double start = get_wtime();
+    for(int k=0; k<thumbs; k++)
+      squish_compress_image(pixels[k], width[k], height[k], blocks[k], flags);
+    const double compress = get_wtime() - start;
+
+    for(int k=0; k<thumbs; k++)
+    {
+      squish_decompress_image(out, width[k], height[k], blocks[k], squish_dxt1);
+      reference_decompress(ref, width[k], height[k], blocks[k]);
+      if(memcmp(out, ref, 4*width[k]*height[k]))
+      {
+        fprintf(stderr, "compression_type %d: thumbnail %d (%dx%d) differs from the reference decoder!\n",
+                type, k, width[k], height[k]);
+        failed = 1;
+      }
+    }
+
+    start = get_wtime();
+    for(int p=0; p<pages; p++)
+      for(int k=0; k<thumbs; k++)
+        squish_decompress_image(out, width[k], height[k], blocks[k], squish_dxt1);
+    const double decompress = get_wtime() - start;
+
+    start = get_wtime();
+    for(int p=0; p<pages; p++)
+      for(int k=0; k<thumbs; k++)
+        reference_decompress(ref, width[k], height[k], blocks[k]);
+    const double reference = get_wtime() - start;
+
+    printf("compression_type %d: compress %7.2f MPix/s, scroll %7.1f pages/s (%7.2f MPix/s), reference %7.1f pages/s\n",
+           type, page_pixels*1e-6/compress, pages/decompress, pages*page_pixels*1e-6/decompress, pages/reference);
+  }
+
+  for(int k=0; k<thumbs; k++)
+  {
+    free(pixels[k]);
+    free(blocks[k]);
+  }
+  free(pixels);
+  free(blocks);
+  free(width);
+  free(height);
+  free(out);
+  free(ref);
+  return failed;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,199 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_UNIT_TEST
+#include "common/darktable.h"
+#endif
+#include "common/box_blur.h"
+
+#include <xmmintrin.h>
+#include <stdlib.h>
+#include <string.h>
+
+// floats per block of the vertical pass: one cache line
+#define BOX_BLUR_BLOCK 16
+
+// sliding window along one row of single floats. the sums are updated in the same order
+// as the blurs in the modules always did, so results don't change.
+static void
+box_row_1c(float *row, float *scanline, const int width, const int hr)
+{
+  float L = 0.0f;
+  int hits = 0;
+  for(int x=-hr; x<width; x++)
+  {
+    const int op = x - hr - 1;
+    const int np = x + hr;
+    if(op >= 0)
+    {
+      L -= row[op];
+      hits--;
+    }
+    if(np < width)
+    {
+      L += row[np];
+      hits++;
+    }
+    if(x >= 0) scanline[x] = L/hits;
+  }
+  memcpy(row, scanline, sizeof(float)*width);
+}
+
+// same for a row of four channel pixels
+static void
+box_row_4c(float *row, float *scanline, const int width, const int hr)
+{
+  __m128 L = _mm_setzero_ps();
+  int hits = 0;
+  for(int x=-hr; x<width; x++)
+  {
+    const int op = x - hr - 1;
+    const int np = x + hr;
+    if(op >= 0)
+    {
+      L = _mm_sub_ps(L, _mm_loadu_ps(row + 4*op));
+      hits--;
+    }
+    if(np < width)
+    {
+      L = _mm_add_ps(L, _mm_loadu_ps(row + 4*np));
+      hits++;
+    }
+    if(x >= 0) _mm_store_ps(scanline + 4*x, _mm_div_ps(L, _mm_set1_ps(hits)));
+  }
+  memcpy(row, scanline, sizeof(float)*4*width);
+}
+
+// vertical pass on the columns x0 .. x0+BOX_BLUR_BLOCK-1 of a buffer stride floats wide.
+// reads and writes whole cache lines per row, instead of one float.
+static void
+box_column_block(float *buf, float *block, const int x0, const int stride, const int height, const int hr)
+{
+  __m128 L[BOX_BLUR_BLOCK/4];
+  for(int j=0; j<BOX_BLUR_BLOCK/4; j++) L[j] = _mm_setzero_ps();
+  int hits = 0;
+  for(int y=-hr; y<height; y++)
+  {
+    const int op = y - hr - 1;
+    const int np = y + hr;
+    if(op >= 0)
+    {
+      const float *p = buf + (size_t)op*stride + x0;
+      for(int j=0; j<BOX_BLUR_BLOCK/4; j++) L[j] = _mm_sub_ps(L[j], _mm_loadu_ps(p + 4*j));
+      hits--;
+    }
+    if(np < height)
+    {
+      const float *p = buf + (size_t)np*stride + x0;
+      for(int j=0; j<BOX_BLUR_BLOCK/4; j++) L[j] = _mm_add_ps(L[j], _mm_loadu_ps(p + 4*j));
+      hits++;
+    }
+    if(y >= 0)
+    {
+      const __m128 h = _mm_set1_ps(hits);
+      for(int j=0; j<BOX_BLUR_BLOCK/4; j++) _mm_store_ps(block + BOX_BLUR_BLOCK*y + 4*j, _mm_div_ps(L[j], h));
+    }
+  }
+  for(int y=0; y<height; y++)
+    memcpy(buf + (size_t)y*stride + x0, block + BOX_BLUR_BLOCK*y, sizeof(float)*BOX_BLUR_BLOCK);
+}
+
+// vertical pass on a single column, for what is left right of the last full block.
+static void
+box_column_1c(float *buf, float *scanline, const int x, const int stride, const int height, const int hr)
+{
+  float L = 0.0f;
+  int hits = 0;
+  for(int y=-hr; y<height; y++)
+  {
+    const int op = y - hr - 1;
+    const int np = y + hr;
+    if(op >= 0)
+    {
+      L -= buf[(size_t)op*stride + x];
+      hits--;
+    }
+    if(np < height)
+    {
+      L += buf[(size_t)np*stride + x];
+      hits++;
+    }
+    if(y >= 0) scanline[y] = L/hits;
+  }
+  for(int y=0; y<height; y++) buf[(size_t)y*stride + x] = scanline[y];
+}
+
+// the vertical pass doesn't care about channels: every float column of the buffer is blurred on its own.
+static int
+box_blur(float *buf, const int width, const int height, const int ch, const int radius, const int iterations)
+{
+  const int hr = radius;
+  const int stride = ch*width;
+  const int blocks = stride/BOX_BLUR_BLOCK;
+  // per thread: a row (or a single column) and a block of columns, rounded up to whole
+  // cache lines so every thread's part stays aligned for the sse stores.
+  const size_t scratch_size = (MAX((size_t)stride, (size_t)BOX_BLUR_BLOCK*height) + BOX_BLUR_BLOCK - 1) & ~(size_t)(BOX_BLUR_BLOCK - 1);
+  float *scratch = dt_alloc_align(64, sizeof(float)*scratch_size*dt_get_num_threads());
+  if(!scratch)
+  {
+    dt_print(DT_DEBUG_MEMORY, "[box_blur] failed to allocate scratch buffers for %dx%d\n", width, height);
+    return 1;
+  }
+
+  for(int iteration=0; iteration<iterations; iteration++)
+  {
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for(int y=0; y<height; y++)
+    {
+      float *scanline = scratch + scratch_size*dt_get_thread_num();
+      if(ch == 4) box_row_4c(buf + (size_t)y*stride, scanline, width, hr);
+      else box_row_1c(buf + (size_t)y*stride, scanline, width, hr);
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static)
+#endif
+    for(int b=0; b<=blocks; b++)
+    {
+      float *block = scratch + scratch_size*dt_get_thread_num();
+      if(b < blocks)
+        box_column_block(buf, block, b*BOX_BLUR_BLOCK, stride, height, hr);
+      else
+        for(int x=blocks*BOX_BLUR_BLOCK; x<stride; x++)
+          box_column_1c(buf, block, x, stride, height, hr);
+    }
+  }
+  free(scratch);
+  return 0;
+}
+
+int dt_box_blur_1c(float *buf, const int width, const int height, const int radius, const int iterations)
+{
+  return box_blur(buf, width, height, 1, radius, iterations);
+}
+
+int dt_box_blur_4c(float *buf, const int width, const int height, const int radius, const int iterations)
+{
+  return box_blur(buf, width, height, 4, radius, iterations);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,40 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_COMMON_BOX_BLUR_H
+#define DT_COMMON_BOX_BLUR_H
+
+/**
+ * in place box blur of radius (a window of 2*radius+1 pixels), repeated iterations times,
+ * which approximates a gaussian of sigma = sqrt((radius*(radius+1)*iterations + 2)/3).
+ * at the borders the window is cut off and the average taken over the pixels inside.
+ * horizontal and vertical passes both run in parallel, the vertical one on blocks of
+ * neighbouring columns so it walks memory row by row. the recursive gaussian of
+ * common/gaussian.h is the alternative where the shape has to be exact.
+ * both return non-zero, with buf left as it was, if there is no memory for the scratch buffers.
+ */
+
+/** blurs a single channel buffer of width*height floats. */
+int dt_box_blur_1c(float *buf, const int width, const int height, const int radius, const int iterations);
+
+/** blurs all four channels of a width*height*4 buffer. */
+int dt_box_blur_4c(float *buf, const int width, const int height, const int radius, const int iterations);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,301 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_UNIT_TEST
+#include "common/darktable.h"
+#endif
+#include "common/color_lut.h"
+
+#include <xmmintrin.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// grid sizes tried in turn, until one is accurate enough
+static const int dt_color_lut_sizes[] = {33, 65};
+// number of random points the lut is compared to lcms on
+#define DT_COLOR_LUT_VERIFY_SAMPLES 16384
+// luts no pipe uses any more which are kept for the next one
+#define DT_COLOR_LUT_CACHE_IDLE 8
+
+static void
+_lut_free(dt_color_lut_t *lut)
+{
+  free(lut->data);
+  g_free(lut->key);
+  free(lut);
+}
+
+static dt_color_lut_t *
+_lut_bake(cmsHTRANSFORM xform, const float offset[3], const float scale[3], const int size)
+{
+  dt_color_lut_t *lut = (dt_color_lut_t *)malloc(sizeof(dt_color_lut_t));
+  memset(lut, 0, sizeof(dt_color_lut_t));
+  lut->data = (float *)dt_alloc_align(64, sizeof(float)*4*size*size*size);
+  if(!lut->data)
+  {
+    free(lut);
+    return NULL;
+  }
+  lut->size = size;
+  for(int k=0; k<3; k++)
+  {
+    lut->offset[k] = offset[k];
+    lut->scale[k] = scale[k];
+  }
+
+  // one row along the first axis per call to lcms
+  float in[3*size], out[3*size];
+  for(int z=0; z<size; z++) for(int y=0; y<size; y++)
+    {
+      for(int x=0; x<size; x++)
+      {
+        in[3*x+0] = offset[0] + x/(scale[0]*(size-1.0f));
+        in[3*x+1] = offset[1] + y/(scale[1]*(size-1.0f));
+        in[3*x+2] = offset[2] + z/(scale[2]*(size-1.0f));
+      }
+      cmsDoTransform(xform, in, out, size);
+      float *node = lut->data + 4*size*(y + size*z);
+      for(int x=0; x<size; x++, node+=4)
+      {
+        node[0] = out[3*x+0];
+        node[1] = out[3*x+1];
+        node[2] = out[3*x+2];
+        node[3] = 0.0f;
+      }
+    }
+  return lut;
+}
+
+// largest cie76 difference between lut and lcms at random points of the domain. if the output is
+// rgb, only points lcms maps into the gamut count: outside it the profile clips, which no grid
+// follows exactly, and which the image can't show anyway.
+static float
+_lut_verify(const dt_color_lut_t *lut, cmsHTRANSFORM xform, cmsHTRANSFORM to_lab)
+{
+  const int batch = 256;
+  float in[3*batch], exact[3*batch], approx[3*batch], lab_exact[3*batch], lab_approx[3*batch];
+  int outside[batch];
+  uint32_t seed = 0x9e3779b9u;
+  float max_delta_e = 0.0f;
+  for(int s=0; s<DT_COLOR_LUT_VERIFY_SAMPLES; s+=batch)
+  {
+    for(int i=0; i<3*batch; i++)
+    {
+      // xorshift, uniform in [0,1)
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      const float u = (seed >> 8)*(1.0f/16777216.0f);
+      in[i] = lut->offset[i%3] + u/lut->scale[i%3];
+    }
+    cmsDoTransform(xform, in, exact, batch);
+    if(dt_color_lut_apply(lut, in, 3, approx, 3, batch, outside)) return INFINITY;
+    if(to_lab)
+    {
+      cmsDoTransform(to_lab, exact, lab_exact, batch);
+      cmsDoTransform(to_lab, approx, lab_approx, batch);
+    }
+    const float *a = to_lab ? lab_exact : exact, *b = to_lab ? lab_approx : approx;
+    for(int i=0; i<batch; i++)
+    {
+      if(to_lab && (fminf(exact[3*i], fminf(exact[3*i+1], exact[3*i+2])) < 0.0f ||
+                    fmaxf(exact[3*i], fmaxf(exact[3*i+1], exact[3*i+2])) > 1.0f)) continue;
+      const float dL = a[3*i] - b[3*i], da = a[3*i+1] - b[3*i+1], db = a[3*i+2] - b[3*i+2];
+      const float delta_e = sqrtf(dL*dL + da*da + db*db);
+      // also catches nan
+      if(!(delta_e <= max_delta_e)) max_delta_e = delta_e;
+    }
+  }
+  return max_delta_e;
+}
+
+// drops the least recently used luts no pipe holds, until at most DT_COLOR_LUT_CACHE_IDLE are left.
+// call with lock held.
+static void
+_cache_trim(dt_color_lut_cache_t *cache)
+{
+  while(1)
+  {
+    GHashTableIter iter;
+    gpointer key, value;
+    dt_color_lut_t *oldest = NULL;
+    int idle = 0;
+    g_hash_table_iter_init(&iter, cache->luts);
+    while(g_hash_table_iter_next(&iter, &key, &value))
+    {
+      dt_color_lut_t *lut = (dt_color_lut_t *)value;
+      if(lut->users) continue;
+      idle++;
+      if(!oldest || lut->tick < oldest->tick) oldest = lut;
+    }
+    if(idle <= DT_COLOR_LUT_CACHE_IDLE) return;
+    g_hash_table_remove(cache->luts, oldest->key);
+  }
+}
+
+dt_color_lut_cache_t *dt_color_lut_cache_init()
+{
+  dt_color_lut_cache_t *cache = (dt_color_lut_cache_t *)malloc(sizeof(dt_color_lut_cache_t));
+  memset(cache, 0, sizeof(dt_color_lut_cache_t));
+  dt_pthread_mutex_init(&cache->lock, NULL);
+  // the key is owned by the lut
+  cache->luts = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)_lut_free);
+  return cache;
+}
+
+void dt_color_lut_cache_cleanup(dt_color_lut_cache_t *cache)
+{
+  if(!cache) return;
+  g_hash_table_destroy(cache->luts);
+  dt_pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+gchar *dt_color_lut_key(cmsHPROFILE input, const uint32_t input_format, cmsHPROFILE output, const uint32_t output_format,
+                        cmsHPROFILE proof, const int intent, const uint32_t flags)
+{
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_MD5);
+  cmsHPROFILE profiles[3] = {input, output, proof};
+  for(int k=0; k<3; k++)
+  {
+    cmsUInt32Number len = 0;
+    if(profiles[k] && cmsSaveProfileToMem(profiles[k], NULL, &len) && len > 0)
+    {
+      guchar *buf = (guchar *)malloc(len);
+      cmsSaveProfileToMem(profiles[k], buf, &len);
+      g_checksum_update(checksum, buf, len);
+      free(buf);
+    }
+    // keeps a missing profile from matching the start of the next one
+    g_checksum_update(checksum, (const guchar *)"|", 1);
+  }
+  gchar *key = g_strdup_printf("%s %u %u %d %u", g_checksum_get_string(checksum), input_format, output_format, intent, flags);
+  g_checksum_free(checksum);
+  return key;
+}
+
+const dt_color_lut_t *dt_color_lut_cache_get(dt_color_lut_cache_t *cache, const char *key, cmsHTRANSFORM xform, cmsHTRANSFORM to_lab, const float offset[3], const float scale[3])
+{
+  if(!cache || !key || !xform) return NULL;
+  dt_pthread_mutex_lock(&cache->lock);
+  dt_color_lut_t *lut = (dt_color_lut_t *)g_hash_table_lookup(cache->luts, key);
+  if(!lut)
+  {
+    // baking under the lock keeps preview and full pipe from doing the same work twice.
+    for(int k=0; k<(int)(sizeof(dt_color_lut_sizes)/sizeof(dt_color_lut_sizes[0])); k++)
+    {
+      lut = _lut_bake(xform, offset, scale, dt_color_lut_sizes[k]);
+      if(!lut) break;
+      lut->max_delta_e = _lut_verify(lut, xform, to_lab);
+      dt_print(DT_DEBUG_PERF, "[color_lut] %d^3 lut, max delta e %f\n", lut->size, lut->max_delta_e);
+      if(lut->max_delta_e <= DT_COLOR_LUT_MAX_DELTA_E) break;
+      _lut_free(lut);
+      lut = NULL;
+    }
+    if(!lut)
+    {
+      // remember that this transform needs lcms, instead of trying again next time
+      lut = (dt_color_lut_t *)malloc(sizeof(dt_color_lut_t));
+      memset(lut, 0, sizeof(dt_color_lut_t));
+    }
+    lut->key = g_strdup(key);
+    g_hash_table_insert(cache->luts, lut->key, lut);
+  }
+  lut->tick = cache->tick++;
+  if(lut->data) lut->users++;
+  _cache_trim(cache);
+  dt_pthread_mutex_unlock(&cache->lock);
+  return lut->data ? lut : NULL;
+}
+
+void dt_color_lut_cache_release(dt_color_lut_cache_t *cache, const dt_color_lut_t *lut)
+{
+  if(!cache || !lut) return;
+  dt_pthread_mutex_lock(&cache->lock);
+  ((dt_color_lut_t *)lut)->users--;
+  _cache_trim(cache);
+  dt_pthread_mutex_unlock(&cache->lock);
+}
+
+int dt_color_lut_apply(const dt_color_lut_t *lut, const float *const in, const int in_ch, float *const out, const int out_ch, const int width, int *const outside)
+{
+  const int n = lut->size;
+  const float m = n - 1.0f;
+  // distance between neighbouring nodes along each axis, in floats
+  const int stride[3] = {4, 4*n, 4*n*n};
+  int num_outside = 0;
+  for(int i=0; i<width; i++)
+  {
+    const float *const pin = in + in_ch*i;
+    float f[3];
+    int base = 0;
+    int k = 0;
+    for(; k<3; k++)
+    {
+      const float v = (pin[k] - lut->offset[k])*lut->scale[k]*m;
+      // written such that nan is outside, too
+      if(!(v >= 0.0f && v <= m)) break;
+      const int vi = MIN((int)v, n-2);
+      f[k] = v - vi;
+      base += vi*stride[k];
+    }
+    if(k < 3)
+    {
+      outside[num_outside++] = i;
+      continue;
+    }
+
+    // walk from the lowest to the highest corner of the cell, along the axes in order of
+    // decreasing fraction. the four corners visited span the tetrahedron the point is in.
+    int a, b, c;
+    if(f[0] >= f[1])
+    {
+      if(f[1] >= f[2])      { a = 0; b = 1; c = 2; }
+      else if(f[0] >= f[2]) { a = 0; b = 2; c = 1; }
+      else                  { a = 2; b = 0; c = 1; }
+    }
+    else
+    {
+      if(f[0] >= f[2])      { a = 1; b = 0; c = 2; }
+      else if(f[1] >= f[2]) { a = 1; b = 2; c = 0; }
+      else                  { a = 2; b = 1; c = 0; }
+    }
+    const float *const c0 = lut->data + base;
+    const float *const c1 = c0 + stride[a];
+    const float *const c2 = c1 + stride[b];
+    const float *const c3 = c2 + stride[c];
+    const __m128 res = _mm_add_ps(
+                         _mm_add_ps(_mm_mul_ps(_mm_load_ps(c0), _mm_set1_ps(1.0f - f[a])),
+                                    _mm_mul_ps(_mm_load_ps(c1), _mm_set1_ps(f[a] - f[b]))),
+                         _mm_add_ps(_mm_mul_ps(_mm_load_ps(c2), _mm_set1_ps(f[b] - f[c])),
+                                    _mm_mul_ps(_mm_load_ps(c3), _mm_set1_ps(f[c]))));
+    // only three channels, a fourth one (alpha, mask) belongs to the caller
+    float tmp[4] __attribute__((aligned(16)));
+    _mm_store_ps(tmp, res);
+    float *const pout = out + out_ch*i;
+    pout[0] = tmp[0];
+    pout[1] = tmp[1];
+    pout[2] = tmp[2];
+  }
+  return num_outside;
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,92 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_COLOR_LUT_H
+#define DT_COLOR_LUT_H
+
+#include "common/dtpthread.h"
+#include <inttypes.h>
+#include <glib.h>
+#include <lcms2.h>
+
+// largest acceptable color difference (cie76) between lut and lcms, over the verification samples
+#define DT_COLOR_LUT_MAX_DELTA_E 1.0f
+
+/**
+ * an lcms float transform of three channels, sampled on a regular grid and
+ * evaluated by tetrahedral interpolation. used by colorin and colorout for
+ * profiles which are not a plain matrix and curves, where calling lcms for
+ * every pixel would be the slowest part of the whole pipe.
+ */
+typedef struct dt_color_lut_t
+{
+  // grid points per axis
+  int size;
+  // grid coordinate of input value v on axis k is (v - offset[k]) * scale[k], in [0,1]
+  float offset[3], scale[3];
+  // size^3 nodes of four floats (the last one is zero), first axis varies fastest
+  float *data;
+  // largest deviation from lcms found when verifying the lut
+  float max_delta_e;
+  // cache bookkeeping:
+  gchar *key;
+  int users;
+  uint64_t tick;
+}
+dt_color_lut_t;
+
+/** baked luts, shared by all pipes converting between the same profiles. */
+typedef struct dt_color_lut_cache_t
+{
+  dt_pthread_mutex_t lock;
+  // key -> dt_color_lut_t
+  GHashTable *luts;
+  uint64_t tick;
+}
+dt_color_lut_cache_t;
+
+dt_color_lut_cache_t *dt_color_lut_cache_init();
+void dt_color_lut_cache_cleanup(dt_color_lut_cache_t *cache);
+
+/**
+ * key identifying a transform by the contents of its profiles, in the order they were given to lcms,
+ * their pixel formats, intent and flags. proof may be NULL. free with g_free.
+ */
+gchar *dt_color_lut_key(cmsHPROFILE input, const uint32_t input_format, cmsHPROFILE output, const uint32_t output_format,
+                        cmsHPROFILE proof, const int intent, const uint32_t flags);
+
+/**
+ * returns the lut for key, baking it from xform (TYPE_RGB_FLT or TYPE_Lab_FLT in and out) if
+ * it is not in the cache yet. the domain of the lut is offset[k] .. offset[k] + 1/scale[k].
+ * to_lab converts the output of xform to Lab for verification, NULL if it already is Lab.
+ * returns NULL if no lut reproduces xform within DT_COLOR_LUT_MAX_DELTA_E.
+ * every lut returned has to be given back with dt_color_lut_cache_release().
+ */
+const dt_color_lut_t *dt_color_lut_cache_get(dt_color_lut_cache_t *cache, const char *key, cmsHTRANSFORM xform, cmsHTRANSFORM to_lab, const float offset[3], const float scale[3]);
+void dt_color_lut_cache_release(dt_color_lut_cache_t *cache, const dt_color_lut_t *lut);
+
+/**
+ * converts a row of width pixels, in_ch and out_ch floats apart (3 or 4). only the first three
+ * channels of out are written. pixels outside the domain of the lut are left alone: their
+ * indices are written to outside, and their number is returned, so they can go through lcms.
+ */
+int dt_color_lut_apply(const dt_color_lut_t *lut, const float *const in, const int in_ch, float *const out, const int out_ch, const int width, int *const outside);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -35,8 +35,12 @@
 #include "common/mipmap_cache.h"
 #include "common/opencl.h"
 #include "common/points.h"
+#include "common/similarity.h"
+#include "common/image_state.h"
+#include "common/color_lut.h"
 #include "develop/imageop.h"
 #include "develop/blend.h"
+#include "develop/pixelpipe_diskcache.h"
 #include "libs/lib.h"
 #include "views/view.h"
 #include "control/control.h"
@@ -379,6 +383,22 @@ int dt_load_from_string(const gchar* input, gboolean open_image_in_dr)
   return id;
 }
 
+uint32_t dt_detect_cpu_flags()
+{
+  uint32_t flags = 0;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  // these also check that the os saves the wide registers on context switches
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse"))  flags |= DT_CPU_FLAG_SSE;
+  if(__builtin_cpu_supports("sse2")) flags |= DT_CPU_FLAG_SSE2;
+  if(__builtin_cpu_supports("sse3")) flags |= DT_CPU_FLAG_SSE3;
+  if(__builtin_cpu_supports("avx"))  flags |= DT_CPU_FLAG_AVX;
+  if(__builtin_cpu_supports("avx2")) flags |= DT_CPU_FLAG_AVX2;
+  if(__builtin_cpu_supports("fma"))  flags |= DT_CPU_FLAG_FMA;
+#endif
+  return flags;
+}
+
 int dt_init(int argc, char *argv[], const int init_gui)
 {
 #ifndef __APPLE__
@@ -519,6 +539,14 @@ int dt_init(int argc, char *argv[], const int init_gui)
   // a signal handler.
   /* check cput caps */
   // dt_check_cpu(argc,argv);
+  darktable.cpu_flags = dt_detect_cpu_flags();
+  dt_print(DT_DEBUG_PERF, "[dt_init] simd extensions:%s%s%s%s%s%s\n",
+           (darktable.cpu_flags & DT_CPU_FLAG_SSE)  ? " sse"  : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_SSE2) ? " sse2" : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_SSE3) ? " sse3" : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_AVX)  ? " avx"  : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_AVX2) ? " avx2" : "",
+           (darktable.cpu_flags & DT_CPU_FLAG_FMA)  ? " fma"  : "");
 
 #ifdef HAVE_GEGL
   char geglpath[DT_MAX_PATH_LEN];
@@ -626,6 +654,18 @@ int dt_init(int argc, char *argv[], const int init_gui)
   memset(darktable.mipmap_cache, 0, sizeof(dt_mipmap_cache_t));
   dt_mipmap_cache_init(darktable.mipmap_cache);
 
+  // optional persistent store for intermediate pixelpipe buffers, NULL if disabled:
+  darktable.pixelpipe_diskcache = dt_dev_pixelpipe_diskcache_init();
+
+  // signatures for similarity matching, filled on first use:
+  darktable.similarity_index = dt_similarity_index_init();
+
+  // selection, history, labels and grouping of all images, for drawing thumbnails:
+  darktable.image_state = dt_image_state_init();
+
+  // 3d luts baked from color transforms, shared between pipes:
+  darktable.color_lut_cache = dt_color_lut_cache_init();
+
   // The GUI must be initialized before the views, because the init()
   // functions of the views depend on darktable.control->accels_* to register
   // their keyboard accelerators
@@ -738,6 +778,9 @@ void dt_cleanup()
   free(darktable.image_cache);
   dt_mipmap_cache_cleanup(darktable.mipmap_cache);
   free(darktable.mipmap_cache);
+  dt_dev_pixelpipe_diskcache_cleanup(darktable.pixelpipe_diskcache);
+  dt_similarity_index_cleanup(darktable.similarity_index);
+  dt_color_lut_cache_cleanup(darktable.color_lut_cache);
   if(init_gui)
   {
     dt_control_cleanup(darktable.control);
@@ -756,6 +799,7 @@ void dt_cleanup()
   dt_pwstorage_destroy(darktable.pwstorage);
   dt_fswatch_destroy(darktable.fswatch);
 
+  dt_image_state_cleanup(darktable.image_state);
   dt_database_destroy(darktable.db);
 
   dt_bauhaus_cleanup();
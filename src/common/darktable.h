@@ -123,6 +123,9 @@ struct dt_control_t;
 struct dt_develop_t;
 struct dt_mipmap_cache_t;
 struct dt_image_cache_t;
+struct dt_dev_pixelpipe_diskcache_t;
+struct dt_similarity_index_t;
+struct dt_image_state_t;
 struct dt_lib_t;
 struct dt_conf_t;
 struct dt_points_t;
@@ -148,6 +151,9 @@ dt_debug_thread_t;
 #define DT_CPU_FLAG_SSE		1
 #define DT_CPU_FLAG_SSE2		2
 #define DT_CPU_FLAG_SSE3		4
+#define DT_CPU_FLAG_AVX		8
+#define DT_CPU_FLAG_AVX2		16
+#define DT_CPU_FLAG_FMA		32
 
 typedef struct darktable_t
 {
@@ -167,6 +173,10 @@ typedef struct darktable_t
   struct dt_gui_gtk_t            *gui;
   struct dt_mipmap_cache_t       *mipmap_cache;
   struct dt_image_cache_t        *image_cache;
+  struct dt_dev_pixelpipe_diskcache_t *pixelpipe_diskcache;
+  struct dt_similarity_index_t   *similarity_index;
+  struct dt_image_state_t        *image_state;
+  struct dt_color_lut_cache_t    *color_lut_cache;
   struct dt_bauhaus_t            *bauhaus;
   const struct dt_database_t     *db;
   const struct dt_fswatch_t	     *fswatch;
@@ -205,6 +215,8 @@ void dt_print(dt_debug_thread_t thread, const char *msg, ...);
 void dt_gettime_t(char *datetime, time_t t);
 void dt_gettime(char *datetime);
 void *dt_alloc_align(size_t alignment, size_t size);
+/** simd extensions (DT_CPU_FLAG_*) of the cpu we are running on, to choose code paths at runtime */
+uint32_t dt_detect_cpu_flags();
 
 static inline double dt_get_wtime(void)
 {
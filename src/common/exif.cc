@@ -45,6 +45,7 @@ extern "C"
 #include <sstream>
 #include <cassert>
 #include <glib.h>
+#include <pthread.h>
 
 #define DT_XMP_KEYS_NUM 13 // the number of XmpBag XmpSeq keys that dt uses
 
@@ -729,6 +730,23 @@ int dt_exif_read_from_blob(dt_image_t *img, uint8_t *blob, const int size)
   }
 }
 
+// applies the exif, iptc and xmp metadata already read from a file to img, in that order.
+static bool dt_exif_read_data(dt_image_t *img, Exiv2::ExifData &exifData, Exiv2::IptcData &iptcData, Exiv2::XmpData &xmpData)
+{
+  bool res;
+
+  // EXIF metadata
+  res = dt_exif_read_exif_data(img, exifData);
+
+  // IPTC metadata.
+  res = dt_exif_read_iptc_data(img, iptcData) && res;
+
+  // XMP metadata
+  res = dt_exif_read_xmp_data(img, xmpData, false, true) && res;
+
+  return res;
+}
+
 /** read the metadata of an image.
  * XMP data trumps IPTC data trumps EXIF data
  */
@@ -740,21 +758,7 @@ int dt_exif_read(dt_image_t *img, const char* path)
     image = Exiv2::ImageFactory::open(path);
     assert(image.get() != 0);
     image->readMetadata();
-    bool res;
-
-    // EXIF metadata
-    Exiv2::ExifData &exifData = image->exifData();
-    res = dt_exif_read_exif_data(img, exifData);
-
-    // IPTC metadata.
-    Exiv2::IptcData &iptcData = image->iptcData();
-    res = dt_exif_read_iptc_data(img, iptcData) && res;
-
-    // XMP metadata
-    Exiv2::XmpData &xmpData = image->xmpData();
-    res = dt_exif_read_xmp_data(img, xmpData, false, true) && res;
-
-    return res?0:1;
+    return dt_exif_read_data(img, image->exifData(), image->iptcData(), image->xmpData())?0:1;
   }
   catch (Exiv2::AnyError& e)
   {
@@ -1140,158 +1144,162 @@ static void _exif_import_tags(dt_image_t *img,Exiv2::XmpData::iterator &pos)
   sqlite3_finalize(stmt_upd_tagxtag2);
 }
 
-// need a write lock on *img (non-const) to write stars (and soon color labels).
-int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_only)
+// applies the contents of an xmp sidecar to img and its history in the library. throws exiv2 exceptions.
+static void _exif_xmp_apply(dt_image_t *img, Exiv2::XmpData &xmpData, const int history_only)
 {
-  try
-  {
-    // read xmp sidecar
-    Exiv2::Image::AutoPtr image;
-    image = Exiv2::ImageFactory::open(filename);
-    assert(image.get() != 0);
-    image->readMetadata();
-    Exiv2::XmpData &xmpData = image->xmpData();
-
-    sqlite3_stmt *stmt;
-
-    // get rid of old meta data
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "delete from meta_data where id = ?1", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    // consistency: strip all tags from image (tagged_image, tagxtag)
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "update tagxtag set count = count - 1 where "
-                                "(id2 in (select tagid from tagged_images where imgid = ?2)) or "
-                                "(id1 in (select tagid from tagged_images where imgid = ?2))",
-                                -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    // remove from tagged_images
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                "delete from tagged_images where imgid = ?1", -1, &stmt, NULL);
-    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    if(!history_only)
-      dt_exif_read_xmp_data(img, xmpData, true, false);
+  sqlite3_stmt *stmt;
 
-    Exiv2::XmpData::iterator pos;
+  // get rid of old meta data
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "delete from meta_data where id = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
 
-    // convert legacy flip bits (will not be written anymore, convert to flip history item here):
-    if ((pos=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.raw_params"))) != xmpData.end() )
-    {
-      int32_t i = pos->toLong();
-      dt_image_raw_parameters_t raw_params = *(dt_image_raw_parameters_t *)&i;
-      int32_t user_flip = raw_params.user_flip;
-      img->legacy_flip.user_flip = user_flip;
-      img->legacy_flip.legacy = 0;
-    }
+  // consistency: strip all tags from image (tagged_image, tagxtag)
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "update tagxtag set count = count - 1 where "
+                              "(id2 in (select tagid from tagged_images where imgid = ?2)) or "
+                              "(id1 in (select tagid from tagged_images where imgid = ?2))",
+                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+
+  // remove from tagged_images
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "delete from tagged_images where imgid = ?1", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
+  sqlite3_step(stmt);
+  sqlite3_finalize(stmt);
+
+  if(!history_only)
+    dt_exif_read_xmp_data(img, xmpData, true, false);
+
+  Exiv2::XmpData::iterator pos;
+
+  // convert legacy flip bits (will not be written anymore, convert to flip history item here):
+  if ((pos=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.raw_params"))) != xmpData.end() )
+  {
+    int32_t i = pos->toLong();
+    dt_image_raw_parameters_t raw_params = *(dt_image_raw_parameters_t *)&i;
+    int32_t user_flip = raw_params.user_flip;
+    img->legacy_flip.user_flip = user_flip;
+    img->legacy_flip.legacy = 0;
+  }
 
-    // history
-    Exiv2::XmpData::iterator ver;
-    Exiv2::XmpData::iterator en;
-    Exiv2::XmpData::iterator op;
-    Exiv2::XmpData::iterator param;
-    Exiv2::XmpData::iterator blendop = xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.blendop_params"));
-    Exiv2::XmpData::iterator blendop_version = xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.blendop_version"));
-
-    if ( (ver=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.history_modversion"))) != xmpData.end() &&
-         (en=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.history_enabled")))     != xmpData.end() &&
-         (op=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.history_operation")))   != xmpData.end() &&
-         (param=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.history_params")))   != xmpData.end() )
+  // history
+  Exiv2::XmpData::iterator ver;
+  Exiv2::XmpData::iterator en;
+  Exiv2::XmpData::iterator op;
+  Exiv2::XmpData::iterator param;
+  Exiv2::XmpData::iterator blendop = xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.blendop_params"));
+  Exiv2::XmpData::iterator blendop_version = xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.blendop_version"));
+
+  if ( (ver=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.history_modversion"))) != xmpData.end() &&
+       (en=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.history_enabled")))     != xmpData.end() &&
+       (op=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.history_operation")))   != xmpData.end() &&
+       (param=xmpData.findKey(Exiv2::XmpKey("Xmp.darktable.history_params")))   != xmpData.end() )
+  {
+    const int cnt = ver->count();
+    if(cnt == en->count() && cnt == op->count() && cnt == param->count())
     {
-      const int cnt = ver->count();
-      if(cnt == en->count() && cnt == op->count() && cnt == param->count())
+      // clear history
+      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                  "delete from history where imgid = ?1", -1, &stmt, NULL);
+      DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
+      sqlite3_step(stmt);
+      sqlite3_finalize (stmt);
+      sqlite3_stmt *stmt_sel_num, *stmt_ins_hist, *stmt_upd_hist;
+      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                  "select num from history where imgid = ?1 and num = ?2",
+                                  -1, &stmt_sel_num, NULL);
+      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                  "insert into history (imgid, num) values (?1, ?2)",
+                                  -1, &stmt_ins_hist, NULL);
+      DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                  "update history set operation = ?1, op_params = ?2, "
+                                  "blendop_params = ?7, blendop_version = ?8, module = ?3, enabled = ?4 "
+                                  "where imgid = ?5 and num = ?6", -1, &stmt_upd_hist, NULL);
+      for(int i=0; i<cnt; i++)
       {
-        // clear history
-        DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                    "delete from history where imgid = ?1", -1, &stmt, NULL);
-        DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, img->id);
-        sqlite3_step(stmt);
-        sqlite3_finalize (stmt);
-        sqlite3_stmt *stmt_sel_num, *stmt_ins_hist, *stmt_upd_hist;
-        DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                    "select num from history where imgid = ?1 and num = ?2",
-                                    -1, &stmt_sel_num, NULL);
-        DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                    "insert into history (imgid, num) values (?1, ?2)",
-                                    -1, &stmt_ins_hist, NULL);
-        DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
-                                    "update history set operation = ?1, op_params = ?2, "
-                                    "blendop_params = ?7, blendop_version = ?8, module = ?3, enabled = ?4 "
-                                    "where imgid = ?5 and num = ?6", -1, &stmt_upd_hist, NULL);
-        for(int i=0; i<cnt; i++)
+        const int modversion = ver->toLong(i);
+        const int enabled = en->toLong(i);
+        const char *operation = op->toString(i).c_str();
+        const char *param_c = param->toString(i).c_str();
+        const int param_c_len = strlen(param_c);
+        const int params_len = param_c_len/2;
+        unsigned char *params = (unsigned char *)malloc(params_len);
+        dt_exif_xmp_decode(param_c, params, param_c_len);
+        // TODO: why this update set?
+        DT_DEBUG_SQLITE3_BIND_INT(stmt_sel_num, 1, img->id);
+        DT_DEBUG_SQLITE3_BIND_INT(stmt_sel_num, 2, i);
+        if(sqlite3_step(stmt_sel_num) != SQLITE_ROW)
         {
-          const int modversion = ver->toLong(i);
-          const int enabled = en->toLong(i);
-          const char *operation = op->toString(i).c_str();
-          const char *param_c = param->toString(i).c_str();
-          const int param_c_len = strlen(param_c);
-          const int params_len = param_c_len/2;
-          unsigned char *params = (unsigned char *)malloc(params_len);
-          dt_exif_xmp_decode(param_c, params, param_c_len);
-          // TODO: why this update set?
-          DT_DEBUG_SQLITE3_BIND_INT(stmt_sel_num, 1, img->id);
-          DT_DEBUG_SQLITE3_BIND_INT(stmt_sel_num, 2, i);
-          if(sqlite3_step(stmt_sel_num) != SQLITE_ROW)
-          {
-            DT_DEBUG_SQLITE3_BIND_INT(stmt_ins_hist, 1, img->id);
-            DT_DEBUG_SQLITE3_BIND_INT(stmt_ins_hist, 2, i);
-            sqlite3_step (stmt_ins_hist);
-            sqlite3_reset(stmt_ins_hist);
-            sqlite3_clear_bindings(stmt_ins_hist);
-          }
+          DT_DEBUG_SQLITE3_BIND_INT(stmt_ins_hist, 1, img->id);
+          DT_DEBUG_SQLITE3_BIND_INT(stmt_ins_hist, 2, i);
+          sqlite3_step (stmt_ins_hist);
+          sqlite3_reset(stmt_ins_hist);
+          sqlite3_clear_bindings(stmt_ins_hist);
+        }
 
-          DT_DEBUG_SQLITE3_BIND_TEXT(stmt_upd_hist, 1, operation, strlen(operation), SQLITE_TRANSIENT);
-          DT_DEBUG_SQLITE3_BIND_BLOB(stmt_upd_hist, 2, params, params_len, SQLITE_TRANSIENT);
-          DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 3, modversion);
-          DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 4, enabled);
-          DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 5, img->id);
-          DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 6, i);
-
-          /* check if we got blendop from xmp */
-          unsigned char *blendop_params = NULL;
-          unsigned int blendop_size = 0;
-          if(blendop != xmpData.end() && blendop->size() > 0 && blendop->toString(i).c_str() != NULL)
-          {
-            blendop_size = strlen(blendop->toString(i).c_str())/2;
-            blendop_params = (unsigned char *)malloc(blendop_size);
-            dt_exif_xmp_decode(blendop->toString(i).c_str(),blendop_params,strlen(blendop->toString(i).c_str()));
-            DT_DEBUG_SQLITE3_BIND_BLOB(stmt_upd_hist, 7, blendop_params, blendop_size, SQLITE_TRANSIENT);
-          }
-          else
-            sqlite3_bind_null(stmt_upd_hist, 7);
+        DT_DEBUG_SQLITE3_BIND_TEXT(stmt_upd_hist, 1, operation, strlen(operation), SQLITE_TRANSIENT);
+        DT_DEBUG_SQLITE3_BIND_BLOB(stmt_upd_hist, 2, params, params_len, SQLITE_TRANSIENT);
+        DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 3, modversion);
+        DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 4, enabled);
+        DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 5, img->id);
+        DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 6, i);
+
+        /* check if we got blendop from xmp */
+        unsigned char *blendop_params = NULL;
+        unsigned int blendop_size = 0;
+        if(blendop != xmpData.end() && blendop->size() > 0 && blendop->toString(i).c_str() != NULL)
+        {
+          blendop_size = strlen(blendop->toString(i).c_str())/2;
+          blendop_params = (unsigned char *)malloc(blendop_size);
+          dt_exif_xmp_decode(blendop->toString(i).c_str(),blendop_params,strlen(blendop->toString(i).c_str()));
+          DT_DEBUG_SQLITE3_BIND_BLOB(stmt_upd_hist, 7, blendop_params, blendop_size, SQLITE_TRANSIENT);
+        }
+        else
+          sqlite3_bind_null(stmt_upd_hist, 7);
 
-          /* check if we got blendop_version from xmp; if not assume 1 as default */
-          int blversion = 1;
-          if(blendop_version != xmpData.end())
-          {
-            blversion = blendop_version->toLong(i);
-          }
-          DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 8, blversion);
+        /* check if we got blendop_version from xmp; if not assume 1 as default */
+        int blversion = 1;
+        if(blendop_version != xmpData.end())
+        {
+          blversion = blendop_version->toLong(i);
+        }
+        DT_DEBUG_SQLITE3_BIND_INT(stmt_upd_hist, 8, blversion);
 
-          sqlite3_step (stmt_upd_hist);
-          free(params);
-          free(blendop_params);
+        sqlite3_step (stmt_upd_hist);
+        free(params);
+        free(blendop_params);
 
-          sqlite3_reset(stmt_sel_num);
-          sqlite3_clear_bindings(stmt_sel_num);
-          sqlite3_reset(stmt_upd_hist);
-          sqlite3_clear_bindings(stmt_upd_hist);
+        sqlite3_reset(stmt_sel_num);
+        sqlite3_clear_bindings(stmt_sel_num);
+        sqlite3_reset(stmt_upd_hist);
+        sqlite3_clear_bindings(stmt_upd_hist);
 
-        }
-        sqlite3_finalize(stmt_sel_num);
-        sqlite3_finalize(stmt_ins_hist);
-        sqlite3_finalize(stmt_upd_hist);
       }
+      sqlite3_finalize(stmt_sel_num);
+      sqlite3_finalize(stmt_ins_hist);
+      sqlite3_finalize(stmt_upd_hist);
     }
   }
+}
+
+// need a write lock on *img (non-const) to write stars (and soon color labels).
+int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_only)
+{
+  try
+  {
+    // read xmp sidecar
+    Exiv2::Image::AutoPtr image;
+    image = Exiv2::ImageFactory::open(filename);
+    assert(image.get() != 0);
+    image->readMetadata();
+    _exif_xmp_apply(img, image->xmpData(), history_only);
+  }
   catch (Exiv2::AnyError& e)
   {
     // actually nobody's interested in that if the file doesn't exist:
@@ -1301,6 +1309,83 @@ int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_o
   return 0;
 }
 
+struct dt_exif_data_t
+{
+  // metadata embedded in the image, if it could be read
+  bool have_image;
+  Exiv2::ExifData exifData;
+  Exiv2::IptcData iptcData;
+  Exiv2::XmpData xmpData;
+  // the xmp sidecar, if there is one
+  bool have_sidecar;
+  Exiv2::XmpData sidecarData;
+};
+
+dt_exif_data_t *dt_exif_data_read(const char *path, const char *xmp_path)
+{
+  dt_exif_data_t *data = new dt_exif_data_t;
+  data->have_image = data->have_sidecar = false;
+  if(path)
+  {
+    try
+    {
+      Exiv2::Image::AutoPtr image;
+      image = Exiv2::ImageFactory::open(path);
+      assert(image.get() != 0);
+      image->readMetadata();
+      data->exifData = image->exifData();
+      data->iptcData = image->iptcData();
+      data->xmpData = image->xmpData();
+      data->have_image = true;
+    }
+    catch (Exiv2::AnyError& e)
+    {
+      std::string s(e.what());
+      std::cerr << "[exiv2] " << path << ": " << s << std::endl;
+    }
+  }
+  if(xmp_path)
+  {
+    try
+    {
+      Exiv2::Image::AutoPtr image;
+      image = Exiv2::ImageFactory::open(xmp_path);
+      assert(image.get() != 0);
+      image->readMetadata();
+      data->sidecarData = image->xmpData();
+      data->have_sidecar = true;
+    }
+    catch (Exiv2::AnyError& e)
+    {
+      // most images don't come with a sidecar, not worth a message.
+    }
+  }
+  return data;
+}
+
+int dt_exif_data_apply(dt_exif_data_t *data, dt_image_t *img)
+{
+  int res = 1;
+  try
+  {
+    if(data->have_image)
+      res = dt_exif_read_data(img, data->exifData, data->iptcData, data->xmpData)?0:1;
+    if(data->have_sidecar)
+      _exif_xmp_apply(img, data->sidecarData, 0);
+  }
+  catch (Exiv2::AnyError& e)
+  {
+    std::string s(e.what());
+    std::cerr << "[exiv2] " << s << std::endl;
+  }
+  return res;
+}
+
+void dt_exif_data_free(dt_exif_data_t *data)
+{
+  delete data;
+}
+
 // helper to create an xmp data thing. throws exiv2 exceptions if stuff goes wrong.
 static void
 dt_exif_xmp_read_data(Exiv2::XmpData &xmpData, const int imgid)
@@ -1579,12 +1664,21 @@ int dt_exif_xmp_write (const int imgid, const char* filename)
   }
 }
 
+// the xmp toolkit keeps global state, it has to be serialized when images are read in parallel.
+static pthread_mutex_t _exif_xmp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void _exif_xmp_lock(void *data, bool lock)
+{
+  if(lock) pthread_mutex_lock((pthread_mutex_t *)data);
+  else pthread_mutex_unlock((pthread_mutex_t *)data);
+}
+
 void dt_exif_init()
 {
   // mute exiv2:
   // Exiv2::LogMsg::setLevel(Exiv2::LogMsg::error);
 
-  Exiv2::XmpParser::initialize();
+  Exiv2::XmpParser::initialize(_exif_xmp_lock, &_exif_xmp_mutex);
   // this has te stay with the old url (namespace already propagated outside dt)
   Exiv2::XmpProperties::registerNs("http://darktable.sf.net/", "darktable");
   Exiv2::XmpProperties::registerNs("http://ns.adobe.com/lightroom/1.0/", "lr");
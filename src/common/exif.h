@@ -48,6 +48,19 @@ extern "C"
   /** read xmp sidecar file. */
   int dt_exif_xmp_read (dt_image_t * img, const char* filename, const int history_only);
 
+  /** metadata of an image and its sidecar, read from disk but not yet applied to anything. */
+  typedef struct dt_exif_data_t dt_exif_data_t;
+
+  /** reads the metadata of the image at path and of the xmp sidecar at xmp_path, either may be NULL.
+   *  doesn't touch the library, so it can run in parallel for many images. */
+  dt_exif_data_t *dt_exif_data_read(const char *path, const char *xmp_path);
+
+  /** same as dt_exif_read() followed by dt_exif_xmp_read() with what dt_exif_data_read() found.
+   *  img->id has to be set. returns 0 if the image metadata could be used. */
+  int dt_exif_data_apply(dt_exif_data_t *data, dt_image_t *img);
+
+  void dt_exif_data_free(dt_exif_data_t *data);
+
   /** thread safe init and cleanup. */
   void dt_exif_init();
   void dt_exif_cleanup();
@@ -414,6 +414,40 @@ int _film_filename_cmp(gchar *a, gchar *b)
   return g_strcmp0(g_path_get_basename(a), g_path_get_basename(b));
 }
 
+typedef struct _film_import_progress_t
+{
+  const guint *jid;
+  // files of the film rolls done before the current one, and of all of them
+  uint32_t offset, total;
+}
+_film_import_progress_t;
+
+static void _film_import_progress(void *data, const int done)
+{
+  _film_import_progress_t *p = (_film_import_progress_t *)data;
+  dt_control_backgroundjobs_progress(darktable.control, p->jid, (p->offset + done)/(double)p->total);
+  dt_control_queue_redraw_center();
+}
+
+/* check if we can find a gpx data file to be auto applied
+   to images in the just imported filmroll */
+static void _film_import_gpx(dt_film_t *film)
+{
+  g_dir_rewind(film->dir);
+  const gchar *dfn = NULL;
+  while ((dfn = g_dir_read_name(film->dir)) != NULL)
+  {
+    /* check if we have a gpx to be auto applied to filmroll */
+    if(strcmp(dfn+strlen(dfn)-4,".gpx") == 0 ||
+        strcmp(dfn+strlen(dfn)-4,".GPX") == 0)
+    {
+      gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, film->dirname, dfn, NULL);
+      dt_control_gpx_apply(gpx_file, film->id, dt_conf_get_string("plugins/lighttable/geotagging/tz"));
+      g_free(gpx_file);
+    }
+  }
+}
+
 void dt_film_import1(dt_film_t *film)
 {
   gboolean recursive = dt_conf_get_bool("ui_last/import_recursive");
@@ -432,38 +466,36 @@ void dt_film_import1(dt_film_t *film)
 
   /* let's start import of images */
   gchar message[512] = {0};
-  double fraction = 0;
   uint32_t total = g_list_length(images);
   g_snprintf(message, sizeof(message) - 1,
              ngettext("importing %d image","importing %d images", total), total);
   const guint *jid = dt_control_backgroundjobs_create(darktable.control, 0, message);
+  _film_import_progress_t progress = { jid, 0, total };
 
-  /* loop thru the images and import to current film roll */
+  /* loop thru the runs of images in the same directory and import each into its film roll */
   dt_film_t *cfr = film;
   GList *image = g_list_first(images);
-  do
+  while(image)
   {
     gchar *cdn = g_path_get_dirname((const gchar *)image->data);
 
+    /* the run of images ends where the directory changes */
+    GList *run = NULL;
+    uint32_t count = 0;
+    for(; image; image = g_list_next(image), count++)
+    {
+      gchar *dn = g_path_get_dirname((const gchar *)image->data);
+      const int same = !g_strcmp0(dn, cdn);
+      g_free(dn);
+      if(!same) break;
+      run = g_list_prepend(run, image->data);
+    }
+    run = g_list_reverse(run);
+
     /* check if we need to initialize a new filmroll */
     if(!cfr || g_strcmp0(cfr->dirname, cdn) != 0)
     {
-
-      /* check if we can find a gpx data file to be auto applied
-         to images in the jsut imported filmroll */
-      g_dir_rewind(cfr->dir);
-      const gchar *dfn = NULL;
-      while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
-      {
-        /* check if we have a gpx to be auto applied to filmroll */
-        if(strcmp(dfn+strlen(dfn)-4,".gpx") == 0 ||
-            strcmp(dfn+strlen(dfn)-4,".GPX") == 0)
-        {
-          gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
-          dt_control_gpx_apply(gpx_file, cfr->id, dt_conf_get_string("plugins/lighttable/geotagging/tz"));
-          g_free(gpx_file);
-        }
-      }
+      _film_import_gpx(cfr);
 
       /* cleanup previously imported filmroll*/
       if(cfr && cfr!=film)
@@ -478,36 +510,18 @@ void dt_film_import1(dt_film_t *film)
       dt_film_init(cfr);
       dt_film_new(cfr, cdn);
     }
+    g_free(cdn);
 
-    /* import image */
-    if(dt_image_import(cfr->id, (const gchar *)image->data, FALSE))
-      dt_control_queue_redraw_center();
-
-    fraction+=1.0/total;
-    dt_control_backgroundjobs_progress(darktable.control, jid, fraction);
-
+    /* import images */
+    dt_image_import_files(cfr->id, run, FALSE, _film_import_progress, &progress);
+    progress.offset += count;
+    g_list_free(run);
   }
-  while( (image = g_list_next(image)) != NULL);
 
   dt_control_backgroundjobs_destroy(darktable.control, jid);
   dt_control_signal_raise(darktable.signals , DT_SIGNAL_FILMROLLS_CHANGED);
 
-  /* check if we can find a gpx data file to be auto applied
-     to images in the just imported filmroll */
-  g_dir_rewind(cfr->dir);
-  const gchar *dfn = NULL;
-  while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
-  {
-    /* check if we have a gpx to be auto applied to filmroll */
-    if(strcmp(dfn+strlen(dfn)-4,".gpx") == 0 ||
-        strcmp(dfn+strlen(dfn)-4,".GPX") == 0)
-    {
-      gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
-      dt_control_gpx_apply(gpx_file, cfr->id, dt_conf_get_string("plugins/lighttable/geotagging/tz"));
-      g_free(gpx_file);
-    }
-  }
-
+  _film_import_gpx(cfr);
 }
 
 int dt_film_import(const char *dirname)
@@ -25,10 +25,12 @@
 #include "common/imageio.h"
 #include "common/grouping.h"
 #include "common/mipmap_cache.h"
+#include "common/similarity.h"
 #include "common/tags.h"
 #include "control/control.h"
 #include "control/conf.h"
 #include "control/jobs.h"
+#include "develop/pixelpipe_diskcache.h"
 #include <math.h>
 #include <sqlite3.h>
 #include <string.h>
@@ -363,6 +365,9 @@ void dt_image_remove(const int32_t imgid)
   // also clear all thumbnails in mipmap_cache.
   dt_image_cache_remove(darktable.image_cache, imgid);
   dt_mipmap_cache_remove(darktable.mipmap_cache, imgid);
+  // the id might be reused, so drop stored pixelpipe buffers, too.
+  dt_dev_pixelpipe_diskcache_remove_image(darktable.pixelpipe_diskcache, imgid);
+  dt_similarity_index_remove(darktable.similarity_index, imgid);
 }
 
 int dt_image_altered(const uint32_t imgid)
@@ -381,19 +386,23 @@ int dt_image_altered(const uint32_t imgid)
 }
 
 
-uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs)
+/* returns the lower case extension of filename if it is an image to be imported, NULL otherwise. */
+static gchar *_image_import_ext(const char *filename, gboolean override_ignore_jpegs)
 {
   if(!g_file_test(filename, G_FILE_TEST_IS_REGULAR))
-    return 0;
+    return NULL;
   const char *cc = filename + strlen(filename);
   for(; *cc!='.'&&cc>filename; cc--);
-  if(!strcmp(cc, ".dt")) return 0;
-  if(!strcmp(cc, ".dttags")) return 0;
-  if(!strcmp(cc, ".xmp")) return 0;
+  if(!strcmp(cc, ".dt")) return NULL;
+  if(!strcmp(cc, ".dttags")) return NULL;
+  if(!strcmp(cc, ".xmp")) return NULL;
   char *ext = g_ascii_strdown(cc+1, -1);
   if(override_ignore_jpegs == FALSE && (!strcmp(ext, "jpg") ||
                                         !strcmp(ext, "jpeg")) && dt_conf_get_bool("ui_last/import_ignore_jpegs"))
-    return 0;
+  {
+    g_free(ext);
+    return NULL;
+  }
   int supported = 0;
   char **extensions = g_strsplit(dt_supported_extensions, ",", 100);
   for(char **i=extensions; *i!=NULL; i++)
@@ -406,8 +415,66 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
   if(!supported)
   {
     g_free(ext);
-    return 0;
+    return NULL;
   }
+  return ext;
+}
+
+/* the initial rating of newly imported images, as flags. */
+static uint32_t _image_import_flags()
+{
+  uint32_t flags = dt_conf_get_int("ui_last/import_initial_rating");
+  if(flags > 5)
+  {
+    flags = 1;
+    dt_conf_set_int("ui_last/import_initial_rating", 1);
+  }
+  return flags;
+}
+
+/* returns the sidecars of duplicates of filename (name_NN.ext.xmp) in a list to be freed with g_list_free_full(.., g_free). */
+static GList *_image_import_duplicates(const char *filename)
+{
+  GList *result = NULL;
+  glob_t *globbuf = g_malloc(sizeof(glob_t));
+
+  // Add version wildcard
+  gchar *fname = g_strdup(filename);
+  gchar pattern[DT_MAX_PATH_LEN];
+  g_snprintf(pattern, DT_MAX_PATH_LEN, "%s", filename);
+  char *c1 = pattern + strlen(pattern);
+  while(*c1 != '.' && c1 > pattern) c1--;
+  snprintf(c1, pattern + DT_MAX_PATH_LEN - c1, "_*");
+  char *c2 = fname + strlen(fname);
+  while(*c2 != '.' && c2 > fname) c2--;
+  snprintf(c1+2, pattern + DT_MAX_PATH_LEN - c1 - 2, "%s.xmp", c2);
+
+  if (!glob(pattern, 0, NULL, globbuf))
+  {
+    for (int i=0; i < globbuf->gl_pathc; i++)
+      result = g_list_append(result, g_strdup(globbuf->gl_pathv[i]));
+    globfree(globbuf);
+  }
+
+  g_free(fname);
+  g_free(globbuf);
+  return result;
+}
+
+/* adds a tag with the file extension */
+static void _image_import_tag(const int32_t id, const char *ext)
+{
+  guint tagid = 0;
+  char tagname[512];
+  snprintf(tagname, 512, "darktable|format|%s", ext);
+  dt_tag_new(tagname, &tagid);
+  dt_tag_attach(tagid,id);
+}
+
+uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs)
+{
+  char *ext = _image_import_ext(filename, override_ignore_jpegs);
+  if(!ext) return 0;
   int rc;
   uint32_t id = 0;
   // select from images; if found => return
@@ -429,12 +496,7 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
   }
   sqlite3_finalize(stmt);
 
-  uint32_t flags = dt_conf_get_int("ui_last/import_initial_rating");
-  if(flags > 5)
-  {
-    flags = 1;
-    dt_conf_set_int("ui_last/import_initial_rating", 1);
-  }
+  const uint32_t flags = _image_import_flags();
   // insert dummy image entry in database
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "insert into images (id, film_id, filename, caption, description, "
@@ -497,52 +559,286 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
   dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
   dt_image_cache_read_release(darktable.image_cache, img);
 
-  // add a tag with the file extension
-  guint tagid = 0;
-  char tagname[512];
-  snprintf(tagname, 512, "darktable|format|%s", ext);
+  _image_import_tag(id, ext);
   g_free(ext);
-  dt_tag_new(tagname, &tagid);
-  dt_tag_attach(tagid,id);
 
   // Search for sidecar files and import them if found.
-  glob_t *globbuf = g_malloc(sizeof(glob_t));
+  GList *duplicates = _image_import_duplicates(filename);
+  for(GList *iter = duplicates; iter; iter = g_list_next(iter))
+  {
+    int newid = -1;
+    newid = dt_image_duplicate(id);
 
-  // Add version wildcard
-  gchar *fname = g_strdup(filename);
-  gchar pattern[DT_MAX_PATH_LEN];
-  g_snprintf(pattern, DT_MAX_PATH_LEN, "%s", filename);
-  char *c1 = pattern + strlen(pattern);
-  while(*c1 != '.' && c1 > pattern) c1--;
-  snprintf(c1, pattern + DT_MAX_PATH_LEN - c1, "_*");
-  char *c2 = fname + strlen(fname);
-  while(*c2 != '.' && c2 > fname) c2--;
-  snprintf(c1+2, pattern + DT_MAX_PATH_LEN - c1 - 2, "%s.xmp", c2);
+    const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, newid);
+    dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+    (void)dt_exif_xmp_read(img, (const char *)iter->data, 0);
+    dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+    dt_image_cache_read_release(darktable.image_cache, img);
+  }
+  g_list_free_full(duplicates, g_free);
 
-  if (!glob(pattern, 0, NULL, globbuf))
+  g_free(imgfname);
+  g_free(basename);
+  g_free(sql_pattern);
+
+  dt_control_signal_raise(darktable.signals,DT_SIGNAL_IMAGE_IMPORT,id);
+  return id;
+}
+
+/* key under which images are grouped: the file name up to the last dot, case folded like sqlite's like. */
+static gchar *_image_import_group_key(const char *imgfname)
+{
+  const char *c = imgfname + strlen(imgfname);
+  for(; *c!='.'&&c>imgfname; c--);
+  return g_ascii_strdown(imgfname, c - imgfname);
+}
+
+typedef struct dt_image_import_job_t
+{
+  const char *filename;
+  gchar *ext;
+  // metadata of the image and its sidecar, then of the sidecars of duplicates
+  dt_exif_data_t *exif;
+  GList *duplicates;
+  int read;
+}
+dt_image_import_job_t;
+
+typedef struct dt_image_import_queue_t
+{
+  dt_pthread_mutex_t lock;
+  // signalled whenever a job has been read or written
+  pthread_cond_t cond;
+  dt_image_import_job_t *jobs;
+  int num_jobs;
+  // next job to be read
+  int next;
+  // jobs written to the library so far
+  int written;
+}
+dt_image_import_queue_t;
+
+static void _image_import_read(dt_image_import_job_t *job)
+{
+  // a freshly imported image is version 0, its sidecar has no version suffix
+  gchar *xmpfilename = g_strconcat(job->filename, ".xmp", NULL);
+  job->exif = dt_exif_data_read(job->filename, xmpfilename);
+  g_free(xmpfilename);
+  GList *sidecars = _image_import_duplicates(job->filename);
+  for(GList *iter = sidecars; iter; iter = g_list_next(iter))
+    job->duplicates = g_list_append(job->duplicates, dt_exif_data_read(NULL, (const char *)iter->data));
+  g_list_free_full(sidecars, g_free);
+}
+
+static void *_image_import_worker(void *data)
+{
+  dt_image_import_queue_t *q = (dt_image_import_queue_t *)data;
+  dt_pthread_mutex_lock(&q->lock);
+  while(1)
   {
-    for (int i=0; i < globbuf->gl_pathc; i++)
+    // don't read too far ahead of the writer, the metadata of a raw can be a few hundred kB
+    while(q->next < q->num_jobs && q->next >= q->written + DT_IMAGE_IMPORT_AHEAD)
+      dt_pthread_cond_wait(&q->cond, &q->lock);
+    if(q->next >= q->num_jobs) break;
+    dt_image_import_job_t *job = q->jobs + q->next++;
+    dt_pthread_mutex_unlock(&q->lock);
+
+    _image_import_read(job);
+
+    dt_pthread_mutex_lock(&q->lock);
+    job->read = 1;
+    pthread_cond_broadcast(&q->cond);
+  }
+  dt_pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+int dt_image_import_files(const int32_t film_id, GList *files, gboolean override_ignore_jpegs,
+                          dt_image_import_progress_t progress, void *data)
+{
+  const double start = dt_get_wtime();
+  const int num_files = g_list_length(files);
+  int done = 0;
+  sqlite3_stmt *stmt;
+
+  dt_image_import_queue_t q;
+  memset(&q, 0, sizeof(q));
+  q.jobs = (dt_image_import_job_t *)g_malloc0(sizeof(dt_image_import_job_t)*MAX(num_files, 1));
+
+  // files already in the film count as imported, like in dt_image_import(). everything else becomes a job.
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "select id from images where film_id = ?1 and filename = ?2",
+                              -1, &stmt, NULL);
+  for(GList *iter = files; iter; iter = g_list_next(iter))
+  {
+    const char *filename = (const char *)iter->data;
+    gchar *ext = _image_import_ext(filename, override_ignore_jpegs);
+    if(!ext) continue;
+    gchar *imgfname = g_path_get_basename(filename);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, film_id);
+    DT_DEBUG_SQLITE3_BIND_TEXT(stmt, 2, imgfname, -1, SQLITE_TRANSIENT);
+    if(sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      done++;
+      g_free(ext);
+    }
+    else
     {
-      int newid = -1;
-      newid = dt_image_duplicate(id);
+      q.jobs[q.num_jobs].filename = filename;
+      q.jobs[q.num_jobs].ext = ext;
+      q.num_jobs++;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    g_free(imgfname);
+  }
+  sqlite3_finalize(stmt);
+
+  if(q.num_jobs == 0)
+  {
+    g_free(q.jobs);
+    if(progress) progress(data, done);
+    return done;
+  }
 
-      const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, newid);
+  // start reading metadata
+  dt_pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.cond, NULL);
+  const int max_workers = MIN(dt_get_num_threads(), q.num_jobs);
+  pthread_t *workers = (pthread_t *)g_malloc(sizeof(pthread_t)*max_workers);
+  int num_workers = 0;
+  for(int k=0; k<max_workers; k++)
+    if(!pthread_create(workers + num_workers, NULL, _image_import_worker, &q)) num_workers++;
+  // without any reader, the metadata is read right before each image is written
+  if(num_workers == 0) fprintf(stderr, "[image_import] could not start reader threads, reading on the calling thread\n");
+
+  // meanwhile, look up what the new images will be grouped with
+  GHashTable *groups = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "select group_id, filename from images where film_id = ?1 order by id",
+                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, film_id);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    gchar *key = _image_import_group_key((const char *)sqlite3_column_text(stmt, 1));
+    if(g_hash_table_lookup(groups, key)) g_free(key);
+    else g_hash_table_insert(groups, key, GINT_TO_POINTER(sqlite3_column_int(stmt, 0)));
+  }
+  sqlite3_finalize(stmt);
+
+  // all statements of the import are only prepared once
+  const uint32_t flags = _image_import_flags();
+  sqlite3_stmt *insert_stmt, *select_stmt, *update_stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "insert into images (id, film_id, filename, caption, description, "
+                              "license, sha1sum, flags) values (null, ?1, ?2, '', '', '', '', ?3)",
+                              -1, &insert_stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "select id from images where film_id = ?1 and filename = ?2",
+                              -1, &select_stmt, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "update images set group_id = ?1 where id = ?2", -1, &update_stmt, NULL);
+
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "begin", NULL, NULL, NULL);
+  for(int i=0; i<q.num_jobs; i++)
+  {
+    dt_image_import_job_t *job = q.jobs + i;
+    if(num_workers)
+    {
+      dt_pthread_mutex_lock(&q.lock);
+      while(!job->read) dt_pthread_cond_wait(&q.cond, &q.lock);
+      dt_pthread_mutex_unlock(&q.lock);
+    }
+    else _image_import_read(job);
+
+    gchar *imgfname = g_path_get_basename(job->filename);
+    uint32_t id = 0;
+    DT_DEBUG_SQLITE3_BIND_INT(insert_stmt, 1, film_id);
+    DT_DEBUG_SQLITE3_BIND_TEXT(insert_stmt, 2, imgfname, -1, SQLITE_TRANSIENT);
+    DT_DEBUG_SQLITE3_BIND_INT(insert_stmt, 3, flags);
+    const int rc = sqlite3_step(insert_stmt);
+    if (rc != SQLITE_DONE) fprintf(stderr, "sqlite3 error %d\n", rc);
+    sqlite3_reset(insert_stmt);
+    sqlite3_clear_bindings(insert_stmt);
+
+    DT_DEBUG_SQLITE3_BIND_INT(select_stmt, 1, film_id);
+    DT_DEBUG_SQLITE3_BIND_TEXT(select_stmt, 2, imgfname, -1, SQLITE_TRANSIENT);
+    if(sqlite3_step(select_stmt) == SQLITE_ROW) id = sqlite3_column_int(select_stmt, 0);
+    sqlite3_reset(select_stmt);
+    sqlite3_clear_bindings(select_stmt);
+
+    if(id)
+    {
+      // group with the first image of the same name, like dt_image_import() does
+      gchar *key = _image_import_group_key(imgfname);
+      int group_id = GPOINTER_TO_INT(g_hash_table_lookup(groups, key));
+      if(group_id) g_free(key);
+      else
+      {
+        group_id = id;
+        g_hash_table_insert(groups, key, GINT_TO_POINTER(group_id));
+      }
+      DT_DEBUG_SQLITE3_BIND_INT(update_stmt, 1, group_id);
+      DT_DEBUG_SQLITE3_BIND_INT(update_stmt, 2, id);
+      sqlite3_step(update_stmt);
+      sqlite3_reset(update_stmt);
+      sqlite3_clear_bindings(update_stmt);
+
+      const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, id);
       dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
-      (void)dt_exif_xmp_read(img, globbuf->gl_pathv[i], 0);
+      img->group_id = group_id;
+      (void)dt_exif_data_apply(job->exif, img);
       dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
       dt_image_cache_read_release(darktable.image_cache, img);
+
+      _image_import_tag(id, job->ext);
+
+      for(GList *iter = job->duplicates; iter; iter = g_list_next(iter))
+      {
+        const int32_t newid = dt_image_duplicate(id);
+        const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, newid);
+        dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+        (void)dt_exif_data_apply((dt_exif_data_t *)iter->data, img);
+        dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+        dt_image_cache_read_release(darktable.image_cache, img);
+      }
+
+      dt_control_signal_raise(darktable.signals,DT_SIGNAL_IMAGE_IMPORT,id);
+      done++;
     }
-    globfree(globbuf);
-  }
+    g_free(imgfname);
+    dt_exif_data_free(job->exif);
+    g_list_free_full(job->duplicates, (GDestroyNotify)dt_exif_data_free);
+    g_free(job->ext);
 
-  g_free(imgfname);
-  g_free(fname);
-  g_free(basename);
-  g_free(sql_pattern);
-  g_free(globbuf);
+    dt_pthread_mutex_lock(&q.lock);
+    q.written = i + 1;
+    pthread_cond_broadcast(&q.cond);
+    dt_pthread_mutex_unlock(&q.lock);
 
-  dt_control_signal_raise(darktable.signals,DT_SIGNAL_IMAGE_IMPORT,id);
-  return id;
+    if((i + 1) % DT_IMAGE_IMPORT_BATCH == 0 || i + 1 == q.num_jobs)
+    {
+      DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "commit", NULL, NULL, NULL);
+      if(progress) progress(data, done);
+      if(i + 1 < q.num_jobs)
+        DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "begin", NULL, NULL, NULL);
+    }
+  }
+
+  sqlite3_finalize(insert_stmt);
+  sqlite3_finalize(select_stmt);
+  sqlite3_finalize(update_stmt);
+  for(int k=0; k<num_workers; k++)
+    pthread_join(workers[k], NULL);
+  g_free(workers);
+  pthread_cond_destroy(&q.cond);
+  dt_pthread_mutex_destroy(&q.lock);
+  g_hash_table_destroy(groups);
+  g_free(q.jobs);
+
+  dt_print(DT_DEBUG_PERF, "[image_import] imported %d of %d files in %.3f secs with %d readers\n",
+           done, num_files, dt_get_wtime() - start, num_workers);
+  return done;
 }
 
 void dt_image_init(dt_image_t *img)
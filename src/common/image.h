@@ -131,6 +131,17 @@ void dt_image_path_append_version(int imgid, char *pathname, const int len);
 void dt_image_print_exif(const dt_image_t *img, char *line, int len);
 /** imports a new image from raw/etc file and adds it to the data base and image cache. */
 uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs);
+/** images written to the library per transaction by dt_image_import_files() */
+#define DT_IMAGE_IMPORT_BATCH 256
+/** how many images the metadata readers of dt_image_import_files() may be ahead of the library */
+#define DT_IMAGE_IMPORT_AHEAD (2*DT_IMAGE_IMPORT_BATCH)
+/** called after every transaction of dt_image_import_files() with the number of files imported so far. */
+typedef void (*dt_image_import_progress_t)(void *data, const int done);
+/** imports a list of files (full paths) into the film, same as dt_image_import() on each of them, but fit for a
+ *  whole card: the metadata is read by a pool of threads while the images go into the library in large
+ *  transactions. returns the number of files which are in the film afterwards. */
+int dt_image_import_files(const int32_t film_id, GList *files, gboolean override_ignore_jpegs,
+                          dt_image_import_progress_t progress, void *data);
 /** removes the given image from the database. */
 void dt_image_remove(const int32_t imgid);
 /** duplicates the given image in the database. */
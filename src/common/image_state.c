@@ -0,0 +1,269 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "common/darktable.h"
+#include "common/database.h"
+#include "common/debug.h"
+#include "common/image_state.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// what a trigger reports to dt_image_state_changed(what, imgid, value, old_value)
+typedef enum dt_image_state_change_t
+{
+  DT_IMAGE_STATE_CHANGE_SELECTED = 0,     // value: 1 selected, 0 unselected
+  DT_IMAGE_STATE_CHANGE_HISTORY = 1,      // value: +1 item added, -1 removed
+  DT_IMAGE_STATE_CHANGE_COLOR_ADD = 2,    // value: color
+  DT_IMAGE_STATE_CHANGE_COLOR_REMOVE = 3, // value: color
+  DT_IMAGE_STATE_CHANGE_GROUP = 4,        // value: new group id, old_value: old one (NULL for new images)
+  DT_IMAGE_STATE_CHANGE_FLAGS = 5,        // value: images.flags
+  DT_IMAGE_STATE_CHANGE_REMOVE = 6        // old_value: group id
+}
+dt_image_state_change_t;
+
+static const char *_image_state_triggers[] =
+{
+  "create temp trigger dt_image_state_selected_insert after insert on main.selected_images "
+  "begin select dt_image_state_changed(0, new.imgid, 1, 0); end",
+  "create temp trigger dt_image_state_selected_delete after delete on main.selected_images "
+  "begin select dt_image_state_changed(0, old.imgid, 0, 0); end",
+  "create temp trigger dt_image_state_history_insert after insert on main.history "
+  "begin select dt_image_state_changed(1, new.imgid, 1, 0); end",
+  "create temp trigger dt_image_state_history_delete after delete on main.history "
+  "begin select dt_image_state_changed(1, old.imgid, -1, 0); end",
+  "create temp trigger dt_image_state_color_insert after insert on main.color_labels "
+  "begin select dt_image_state_changed(2, new.imgid, new.color, 0); end",
+  "create temp trigger dt_image_state_color_update after update on main.color_labels "
+  "begin select dt_image_state_changed(3, old.imgid, old.color, 0); "
+  "select dt_image_state_changed(2, new.imgid, new.color, 0); end",
+  "create temp trigger dt_image_state_color_delete after delete on main.color_labels "
+  "begin select dt_image_state_changed(3, old.imgid, old.color, 0); end",
+  "create temp trigger dt_image_state_images_insert after insert on main.images "
+  "begin select dt_image_state_changed(4, new.id, new.group_id, null); "
+  "select dt_image_state_changed(5, new.id, new.flags, 0); end",
+  "create temp trigger dt_image_state_group_update after update of group_id on main.images "
+  "begin select dt_image_state_changed(4, new.id, new.group_id, old.group_id); end",
+  "create temp trigger dt_image_state_flags_update after update of flags on main.images "
+  "begin select dt_image_state_changed(5, new.id, new.flags, 0); end",
+  "create temp trigger dt_image_state_images_delete after delete on main.images "
+  "begin select dt_image_state_changed(6, old.id, 0, old.group_id); end",
+  NULL
+};
+
+static const char *_image_state_trigger_names[] =
+{
+  "selected_insert", "selected_delete", "history_insert", "history_delete",
+  "color_insert", "color_update", "color_delete", "images_insert",
+  "group_update", "flags_update", "images_delete", NULL
+};
+
+// makes sure imgid fits into the columns. expects state->lock to be held.
+static int _image_state_reserve(dt_image_state_t *state, const int imgid)
+{
+  if(imgid < 0) return 1;
+  if((uint32_t)imgid < state->capacity) return 0;
+  const uint32_t capacity = MAX(1024, MAX(2*state->capacity, (uint32_t)imgid+1));
+  uint8_t *flags    = (uint8_t *)realloc(state->flags,    sizeof(uint8_t)*capacity);
+  if(flags) state->flags = flags;
+  uint8_t *colors   = (uint8_t *)realloc(state->colors,   sizeof(uint8_t)*capacity);
+  if(colors) state->colors = colors;
+  uint8_t *rating   = (uint8_t *)realloc(state->rating,   sizeof(uint8_t)*capacity);
+  if(rating) state->rating = rating;
+  int32_t *group_id = (int32_t *)realloc(state->group_id, sizeof(int32_t)*capacity);
+  if(group_id) state->group_id = group_id;
+  int32_t *history  = (int32_t *)realloc(state->history,  sizeof(int32_t)*capacity);
+  if(history) state->history = history;
+  if(!flags || !colors || !rating || !group_id || !history) return 1;
+
+  const uint32_t added = capacity - state->capacity;
+  memset(state->flags    + state->capacity, 0, sizeof(uint8_t)*added);
+  memset(state->colors   + state->capacity, 0, sizeof(uint8_t)*added);
+  memset(state->rating   + state->capacity, 0, sizeof(uint8_t)*added);
+  memset(state->history  + state->capacity, 0, sizeof(int32_t)*added);
+  for(uint32_t k=state->capacity; k<capacity; k++) state->group_id[k] = -1;
+  state->capacity = capacity;
+  return 0;
+}
+
+// expects state->lock to be held.
+static void _image_state_group_add(dt_image_state_t *state, const int group_id, const int count)
+{
+  if(group_id < 0) return;
+  const int size = GPOINTER_TO_INT(g_hash_table_lookup(state->group_size, GINT_TO_POINTER(group_id))) + count;
+  if(size > 0) g_hash_table_insert(state->group_size, GINT_TO_POINTER(group_id), GINT_TO_POINTER(size));
+  else         g_hash_table_remove(state->group_size, GINT_TO_POINTER(group_id));
+}
+
+// called from the triggers, in whatever thread writes to the database. must not touch the database.
+static void _image_state_changed(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+  dt_image_state_t *state = (dt_image_state_t *)sqlite3_user_data(context);
+  const int what  = sqlite3_value_int(argv[0]);
+  const int imgid = sqlite3_value_int(argv[1]);
+  const int value = sqlite3_value_int(argv[2]);
+  const int has_old = sqlite3_value_type(argv[3]) != SQLITE_NULL;
+  const int old_value = sqlite3_value_int(argv[3]);
+
+  dt_pthread_mutex_lock(&state->lock);
+  if(!_image_state_reserve(state, imgid))
+  {
+    switch(what)
+    {
+      case DT_IMAGE_STATE_CHANGE_SELECTED:
+        if(value) state->flags[imgid] |= DT_IMAGE_STATE_SELECTED;
+        else      state->flags[imgid] &= ~DT_IMAGE_STATE_SELECTED;
+        break;
+      case DT_IMAGE_STATE_CHANGE_HISTORY:
+        state->history[imgid] = MAX(0, state->history[imgid] + value);
+        if(state->history[imgid]) state->flags[imgid] |= DT_IMAGE_STATE_ALTERED;
+        else                      state->flags[imgid] &= ~DT_IMAGE_STATE_ALTERED;
+        break;
+      case DT_IMAGE_STATE_CHANGE_COLOR_ADD:
+        if(value >= 0 && value < 8) state->colors[imgid] |= 1<<value;
+        break;
+      case DT_IMAGE_STATE_CHANGE_COLOR_REMOVE:
+        if(value >= 0 && value < 8) state->colors[imgid] &= ~(1<<value);
+        break;
+      case DT_IMAGE_STATE_CHANGE_GROUP:
+        if(has_old) _image_state_group_add(state, old_value, -1);
+        state->group_id[imgid] = sqlite3_value_type(argv[2]) == SQLITE_NULL ? -1 : value;
+        _image_state_group_add(state, state->group_id[imgid], 1);
+        break;
+      case DT_IMAGE_STATE_CHANGE_FLAGS:
+        state->rating[imgid] = value & 0x7;
+        break;
+      case DT_IMAGE_STATE_CHANGE_REMOVE:
+        _image_state_group_add(state, state->group_id[imgid], -1);
+        state->flags[imgid] = state->colors[imgid] = state->rating[imgid] = 0;
+        state->history[imgid] = 0;
+        state->group_id[imgid] = -1;
+        break;
+    }
+  }
+  dt_pthread_mutex_unlock(&state->lock);
+  sqlite3_result_null(context);
+}
+
+dt_image_state_t *dt_image_state_init()
+{
+  dt_image_state_t *state = (dt_image_state_t *)malloc(sizeof(dt_image_state_t));
+  memset(state, 0, sizeof(dt_image_state_t));
+  dt_pthread_mutex_init(&state->lock, NULL);
+  state->group_size = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  sqlite3 *db = dt_database_get(darktable.db);
+  sqlite3_stmt *stmt;
+  const double start = dt_get_wtime();
+
+  // nobody else is using the library yet, so the columns can be filled without watching out
+  // for concurrent writes. from now on the triggers keep them up to date.
+  dt_pthread_mutex_lock(&state->lock);
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "select max(id) from images", -1, &stmt, NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW) _image_state_reserve(state, sqlite3_column_int(stmt, 0));
+  sqlite3_finalize(stmt);
+
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "select id, group_id, flags from images", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int imgid = sqlite3_column_int(stmt, 0);
+    if(_image_state_reserve(state, imgid)) continue;
+    state->group_id[imgid] = sqlite3_column_type(stmt, 1) == SQLITE_NULL ? -1 : sqlite3_column_int(stmt, 1);
+    state->rating[imgid] = sqlite3_column_int(stmt, 2) & 0x7;
+    _image_state_group_add(state, state->group_id[imgid], 1);
+  }
+  sqlite3_finalize(stmt);
+
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "select imgid from selected_images", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int imgid = sqlite3_column_int(stmt, 0);
+    if(!_image_state_reserve(state, imgid)) state->flags[imgid] |= DT_IMAGE_STATE_SELECTED;
+  }
+  sqlite3_finalize(stmt);
+
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "select imgid, count(*) from history group by imgid", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int imgid = sqlite3_column_int(stmt, 0);
+    if(_image_state_reserve(state, imgid)) continue;
+    state->history[imgid] = sqlite3_column_int(stmt, 1);
+    if(state->history[imgid] > 0) state->flags[imgid] |= DT_IMAGE_STATE_ALTERED;
+  }
+  sqlite3_finalize(stmt);
+
+  DT_DEBUG_SQLITE3_PREPARE_V2(db, "select imgid, color from color_labels", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    const int imgid = sqlite3_column_int(stmt, 0);
+    const int color = sqlite3_column_int(stmt, 1);
+    if(!_image_state_reserve(state, imgid) && color >= 0 && color < 8) state->colors[imgid] |= 1<<color;
+  }
+  sqlite3_finalize(stmt);
+  dt_pthread_mutex_unlock(&state->lock);
+
+  sqlite3_create_function(db, "dt_image_state_changed", 4, SQLITE_UTF8, state, _image_state_changed, NULL, NULL);
+  for(int k=0; _image_state_triggers[k]; k++)
+    DT_DEBUG_SQLITE3_EXEC(db, _image_state_triggers[k], NULL, NULL, NULL);
+
+  dt_print(DT_DEBUG_PERF, "[image_state] loaded state of %u image ids in %.3f secs\n",
+           state->capacity, dt_get_wtime() - start);
+  return state;
+}
+
+void dt_image_state_cleanup(dt_image_state_t *state)
+{
+  if(!state) return;
+  // the triggers would call into freed memory otherwise:
+  sqlite3 *db = dt_database_get(darktable.db);
+  for(int k=0; _image_state_trigger_names[k]; k++)
+  {
+    gchar *query = g_strdup_printf("drop trigger if exists temp.dt_image_state_%s", _image_state_trigger_names[k]);
+    DT_DEBUG_SQLITE3_EXEC(db, query, NULL, NULL, NULL);
+    g_free(query);
+  }
+  g_hash_table_destroy(state->group_size);
+  free(state->flags);
+  free(state->colors);
+  free(state->rating);
+  free(state->group_id);
+  free(state->history);
+  dt_pthread_mutex_destroy(&state->lock);
+  free(state);
+}
+
+void dt_image_state_get(dt_image_state_t *state, const int imgid, dt_image_state_entry_t *entry)
+{
+  memset(entry, 0, sizeof(dt_image_state_entry_t));
+  entry->group_id = -1;
+  dt_pthread_mutex_lock(&state->lock);
+  if(imgid >= 0 && (uint32_t)imgid < state->capacity)
+  {
+    entry->selected = (state->flags[imgid] & DT_IMAGE_STATE_SELECTED) != 0;
+    entry->altered  = (state->flags[imgid] & DT_IMAGE_STATE_ALTERED) != 0;
+    entry->colors   = state->colors[imgid];
+    entry->rating   = state->rating[imgid];
+    entry->group_id = state->group_id[imgid];
+    entry->grouped  = entry->group_id >= 0 &&
+                      GPOINTER_TO_INT(g_hash_table_lookup(state->group_size, GINT_TO_POINTER(entry->group_id))) > 1;
+  }
+  dt_pthread_mutex_unlock(&state->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,72 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_IMAGE_STATE_H
+#define DT_IMAGE_STATE_H
+
+#include "common/dtpthread.h"
+#include <inttypes.h>
+#include <glib.h>
+
+#define DT_IMAGE_STATE_SELECTED 1
+#define DT_IMAGE_STATE_ALTERED  2
+
+/**
+ * in-memory copy of the per image state drawn on every thumbnail: selection, history,
+ * color labels, grouping and rating. one column per attribute, indexed by image id.
+ * it is read from the library once at startup and then updated by temporary triggers
+ * on the tables it mirrors, so every write to the database is seen no matter where it
+ * comes from, and drawing lighttable never has to query sqlite.
+ */
+typedef struct dt_image_state_t
+{
+  dt_pthread_mutex_t lock;
+  // all columns hold ids < capacity
+  uint32_t capacity;
+  uint8_t *flags;     // DT_IMAGE_STATE_*
+  uint8_t *colors;    // bit (1<<color) for every color label
+  uint8_t *rating;    // images.flags & 0x7, 6 is rejected
+  int32_t *group_id;
+  int32_t *history;   // number of history items
+  // group id -> number of images in it
+  GHashTable *group_size;
+}
+dt_image_state_t;
+
+/** state of one image, as needed to draw its thumbnail. */
+typedef struct dt_image_state_entry_t
+{
+  int selected;
+  int altered;
+  int grouped;        // there is at least one other image in the group
+  int group_id;
+  int rating;
+  uint8_t colors;
+}
+dt_image_state_entry_t;
+
+/** loads the state of all images and installs the triggers keeping it up to date. */
+dt_image_state_t *dt_image_state_init();
+void dt_image_state_cleanup(dt_image_state_t *state);
+
+/** copies the state of the image, without touching the database. */
+void dt_image_state_get(dt_image_state_t *state, const int imgid, dt_image_state_entry_t *entry);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
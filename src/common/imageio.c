@@ -50,6 +50,7 @@
 #include <string.h>
 #include <strings.h>
 #include <glib/gstdio.h>
+#include <emmintrin.h>
 
 // =================================================
 //   begin libraw wrapper functions:
@@ -199,6 +200,125 @@ dt_imageio_flip_buffers_ui8_to_float(float *out, const uint8_t *in, const float
   }
 }
 
+// 4x4 bayer matrix, as thresholds in [0,1) of one output quantization step
+static const float _dither_thresholds[4][4] =
+{
+  {  0.5f/16.0f,  8.5f/16.0f,  2.5f/16.0f, 10.5f/16.0f },
+  { 12.5f/16.0f,  4.5f/16.0f, 14.5f/16.0f,  6.5f/16.0f },
+  {  3.5f/16.0f, 11.5f/16.0f,  1.5f/16.0f,  9.5f/16.0f },
+  { 15.5f/16.0f,  7.5f/16.0f, 13.5f/16.0f,  5.5f/16.0f }
+};
+
+static inline void
+_convert_row(
+  uint8_t       *out,
+  const uint8_t *in,
+  const int      in_bpp,
+  const int      out_bpp,
+  const int      width,
+  const int      y,
+  const int      flags)
+{
+  const int ch = (flags & DT_IMAGEIO_CONVERT_PACK_RGB) ? 3 : 4;
+  // every pixel is loaded completely before its output is stored, and outputs never
+  // reach past the input pixel they come from, so out may alias in.
+  if(in_bpp == 32)
+  {
+    const float *inf = (const float *)in;
+    const __m128 zero  = _mm_setzero_ps();
+    const __m128 scale = _mm_set1_ps(out_bpp == 8 ? 0xff : 0x10000);
+    const __m128 max   = _mm_set1_ps(out_bpp == 8 ? 0xff : 0xffff);
+    for(int x=0; x<width; x++)
+    {
+      __m128 p = _mm_loadu_ps(inf + 4*x);
+      if(flags & DT_IMAGEIO_CONVERT_SWAP_RB) p = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 0, 1, 2));
+      p = _mm_mul_ps(p, scale);
+      if(flags & DT_IMAGEIO_CONVERT_DITHER) p = _mm_add_ps(p, _mm_set1_ps(_dither_thresholds[y&3][x&3]));
+      // max first, so nan ends up as zero:
+      __m128i i = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(p, zero), max));
+      if(out_bpp == 8)
+      {
+        i = _mm_packs_epi32(i, i);
+        i = _mm_packus_epi16(i, i);
+        const uint32_t px = _mm_cvtsi128_si32(i);
+        memcpy(out + ch*x, &px, ch);
+      }
+      else
+      {
+        // no unsigned saturating pack in sse2, shift into the signed range and back:
+        i = _mm_sub_epi32(i, _mm_set1_epi32(0x8000));
+        i = _mm_xor_si128(_mm_packs_epi32(i, i), _mm_set1_epi16(0x8000));
+        if(flags & DT_IMAGEIO_CONVERT_BIG_ENDIAN) i = _mm_or_si128(_mm_slli_epi16(i, 8), _mm_srli_epi16(i, 8));
+        uint16_t px[8];
+        _mm_storeu_si128((__m128i *)px, i);
+        memcpy(out + 2*ch*x, px, 2*ch);
+      }
+    }
+  }
+  else if(in_bpp == 16)
+  {
+    const uint16_t *in16 = (const uint16_t *)in;
+    uint16_t *out16 = (uint16_t *)out;
+    const int r = (flags & DT_IMAGEIO_CONVERT_SWAP_RB) ? 2 : 0;
+    for(int x=0; x<width; x++)
+    {
+      uint16_t px[4] = { in16[4*x+r], in16[4*x+1], in16[4*x+2-r], in16[4*x+3] };
+      if(flags & DT_IMAGEIO_CONVERT_BIG_ENDIAN)
+        for(int k=0; k<4; k++) px[k] = (0xff00 & (px[k]<<8))|(px[k]>>8);
+      for(int k=0; k<ch; k++) out16[ch*x+k] = px[k];
+    }
+  }
+  else
+  {
+    const int r = (flags & DT_IMAGEIO_CONVERT_SWAP_RB) ? 2 : 0;
+    for(int x=0; x<width; x++)
+    {
+      const uint8_t px[4] = { in[4*x+r], in[4*x+1], in[4*x+2-r], in[4*x+3] };
+      for(int k=0; k<ch; k++) out[ch*x+k] = px[k];
+    }
+  }
+}
+
+void
+dt_imageio_convert(
+  void       *out,
+  const void *in,
+  const int   in_bpp,
+  const int   out_bpp,
+  const int   width,
+  const int   height,
+  const int   flags)
+{
+  const int ch = (flags & DT_IMAGEIO_CONVERT_PACK_RGB) ? 3 : 4;
+  const size_t in_stride  = (size_t)width*4*(in_bpp/8);
+  const size_t out_stride = (size_t)width*ch*(out_bpp/8);
+  uint8_t *const out8 = (uint8_t *)out;
+  const uint8_t *const in8 = (const uint8_t *)in;
+  if(out != in || out_stride == in_stride)
+  {
+    // rows are independent:
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if(height > 16)
+#endif
+    for(int j=0; j<height; j++)
+      _convert_row(out8 + out_stride*j, in8 + in_stride*j, in_bpp, out_bpp, width, j, flags);
+    return;
+  }
+  // in place and shrinking: the output of row j only overwrites input of rows up to j.
+  // a block of rows [j0, j1) can thus run in parallel once all of its output lies before
+  // the input of row j0, which lets the blocks grow geometrically after the first row.
+  for(int j0=0; j0<height;)
+  {
+    const int j1 = MIN(height, MAX(j0 + 1, (int)(j0*in_stride/out_stride)));
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) if(j1 - j0 > 16)
+#endif
+    for(int j=j0; j<j1; j++)
+      _convert_row(out8 + out_stride*j, in8 + in_stride*j, in_bpp, out_bpp, width, j, flags);
+    j0 = j1;
+  }
+}
+
 int dt_imageio_write_pos(int i, int j, int wd, int ht, float fwd, float fht, int orientation)
 {
   int ii = i, jj = j, w = wd, fw = fwd, fh = fht;
@@ -470,6 +590,27 @@ int dt_imageio_export(
 }
 
 // internal function: to avoid exif blob reading + 8-bit byteorder flag + high-quality override
+// downconversion of processed pixels to the low-precision formats, in place.
+// 8-bit buffers come out of the gamma module in display byte order, unless they are
+// still floats after high quality downscaling.
+static void
+_export_convert(
+  uint8_t    *outbuf,
+  const int   width,
+  const int   height,
+  const int   bpp,
+  const int   from_float)
+{
+  if(bpp == 8 && from_float)
+    dt_imageio_convert(outbuf, outbuf, 32, 8, width, height,
+                       dt_conf_get_bool("plugins/lighttable/export/dither") ? DT_IMAGEIO_CONVERT_DITHER : 0);
+  else if(bpp == 8)
+    dt_imageio_convert(outbuf, outbuf, 8, 8, width, height, DT_IMAGEIO_CONVERT_SWAP_RB);
+  else if(bpp == 16)
+    dt_imageio_convert(outbuf, outbuf, 32, 16, width, height, 0);
+  // else output float, no further harm done to the pixels :)
+}
+
 int dt_imageio_export_with_flags(
   const uint32_t              imgid,
   const char                 *filename,
@@ -480,6 +621,9 @@ int dt_imageio_export_with_flags(
   const gboolean              high_quality,
   const int32_t               thumbnail_export)
 {
+  // don't even start decoding for a job that has been cancelled already
+  if(dt_control_job_cancelled()) return 1;
+
   dt_develop_t dev;
   dt_dev_init(&dev, 0);
   dt_mipmap_buffer_t buf;
@@ -493,8 +637,14 @@ int dt_imageio_export_with_flags(
 
   dt_times_t start;
   dt_get_times(&start);
+  // streaming export processes and writes bands of rows, so the pipe only needs buffers
+  // for one band. high quality processing still needs the full image, the pipe cache
+  // grows on demand in that case.
+  const int streaming = !thumbnail_export && !display_byteorder && format->write_image_begin &&
+                        dt_conf_get_bool("plugins/lighttable/export/streaming");
+  const int band_height = MAX(64, (64<<20)/(4*sizeof(float)*MAX(1, wd)));
   dt_dev_pixelpipe_t pipe;
-  res = thumbnail_export ? dt_dev_pixelpipe_init_thumbnail(&pipe, wd, ht) : dt_dev_pixelpipe_init_export(&pipe, wd, ht);
+  res = thumbnail_export ? dt_dev_pixelpipe_init_thumbnail(&pipe, wd, ht) : dt_dev_pixelpipe_init_export(&pipe, wd, streaming ? MIN(ht, band_height) : ht);
   if(!res)
   {
     dt_control_log(_("failed to allocate memory for export, please lower the threads used for export or buy more memory."));
@@ -559,103 +709,84 @@ int dt_imageio_export_with_flags(
   int processed_height = scale*pipe.processed_height;
   const int bpp = format->bpp(format_params);
 
+  int length = 0;
+  uint8_t exif_profile[65535]; // C++ alloc'ed buffer is uncool, so we waste some bits here.
+  if(!ignore_exif)
+  {
+    char pathname[1024];
+    dt_image_full_path(imgid, pathname, 1024);
+    length = dt_exif_read_blob(exif_profile, pathname, sRGB, imgid);
+  }
+  uint8_t *exif = ignore_exif ? NULL : exif_profile;
+
   // downsampling done last, if high quality processing was requested:
   uint8_t *outbuf = pipe.backbuf;
   uint8_t *moutbuf = NULL; // keep track of alloc'ed memory
-  if(high_quality_processing)
-  {
-    dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
-    const float scalex = format_params->max_width  > 0 ? fminf(format_params->max_width /(float)pipe.processed_width,  1.0) : 1.0;
-    const float scaley = format_params->max_height > 0 ? fminf(format_params->max_height/(float)pipe.processed_height, 1.0) : 1.0;
-    const float scale = fminf(scalex, scaley);
-    processed_width  = scale*pipe.processed_width  + .5f;
-    processed_height = scale*pipe.processed_height + .5f;
-    moutbuf = (uint8_t *)dt_alloc_align(64, sizeof(float)*processed_width*processed_height*4);
-    outbuf = moutbuf;
-    // now downscale into the new buffer:
-    dt_iop_roi_t roi_in, roi_out;
-    roi_in.x = roi_in.y = roi_out.x = roi_out.y = 0;
-    roi_in.scale = 1.0;
-    roi_out.scale = scale;
-    roi_in.width = pipe.processed_width;
-    roi_in.height = pipe.processed_height;
-    roi_out.width = processed_width;
-    roi_out.height = processed_height;
-    dt_iop_clip_and_zoom((float *)outbuf, (float *)pipe.backbuf, &roi_out, &roi_in, processed_width, pipe.processed_width);
+  if(streaming && !high_quality_processing)
+  {
+    // process and write one band of rows at a time:
+    format_params->width  = processed_width;
+    format_params->height = processed_height;
+    void *handle = format->write_image_begin(format_params, filename, exif, length, imgid);
+    res = handle ? 0 : 1;
+    for(int y=0; !res && y<processed_height; y+=band_height)
+    {
+      const int rows = MIN(band_height, processed_height - y);
+      if(bpp == 8)
+        res = dt_dev_pixelpipe_process(&pipe, &dev, 0, y, processed_width, rows, scale);
+      else
+        res = dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, y, processed_width, rows, scale);
+      if(res) break;
+      _export_convert(pipe.backbuf, processed_width, rows, bpp, 0);
+      res = format->write_image_rows(format_params, handle, pipe.backbuf, rows);
+    }
+    if(handle && format->write_image_end(format_params, handle)) res = 1;
   }
   else
   {
-    // do the processing (8-bit with special treatment, to make sure we can use openmp further down):
-    if(bpp == 8)
-      dt_dev_pixelpipe_process(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
-    else
-      dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
-    outbuf = pipe.backbuf;
-  }
-
-  // downconversion to low-precision formats:
-  if(bpp == 8 && !display_byteorder)
-  {
-    // ldr output: char
     if(high_quality_processing)
     {
-      const float *const inbuf = (float *)outbuf;
-      for(int k=0; k<processed_width*processed_height; k++)
-      {
-        // convert in place, this is unfortunately very serial..
-        const uint8_t r = CLAMP(inbuf[4*k+0]*0xff, 0, 0xff);
-        const uint8_t g = CLAMP(inbuf[4*k+1]*0xff, 0, 0xff);
-        const uint8_t b = CLAMP(inbuf[4*k+2]*0xff, 0, 0xff);
-        outbuf[4*k+0] = r;
-        outbuf[4*k+1] = g;
-        outbuf[4*k+2] = b;
-      }
+      res = dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
+      const float scalex = format_params->max_width  > 0 ? fminf(format_params->max_width /(float)pipe.processed_width,  1.0) : 1.0;
+      const float scaley = format_params->max_height > 0 ? fminf(format_params->max_height/(float)pipe.processed_height, 1.0) : 1.0;
+      const float scale = fminf(scalex, scaley);
+      processed_width  = scale*pipe.processed_width  + .5f;
+      processed_height = scale*pipe.processed_height + .5f;
+      moutbuf = (uint8_t *)dt_alloc_align(64, sizeof(float)*processed_width*processed_height*4);
+      outbuf = moutbuf;
+      // now downscale into the new buffer:
+      dt_iop_roi_t roi_in, roi_out;
+      roi_in.x = roi_in.y = roi_out.x = roi_out.y = 0;
+      roi_in.scale = 1.0;
+      roi_out.scale = scale;
+      roi_in.width = pipe.processed_width;
+      roi_in.height = pipe.processed_height;
+      roi_out.width = processed_width;
+      roi_out.height = processed_height;
+      if(!res) dt_iop_clip_and_zoom((float *)outbuf, (float *)pipe.backbuf, &roi_out, &roi_in, processed_width, pipe.processed_width);
     }
     else
     {
-      uint8_t *const buf8 = pipe.backbuf;
-#ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(processed_width, processed_height) schedule(static)
-#endif
-      // just flip byte order
-      for(int k=0; k<processed_width*processed_height; k++)
-      {
-        uint8_t tmp = buf8[4*k+0];
-        buf8[4*k+0] = buf8[4*k+2];
-        buf8[4*k+2] = tmp;
-      }
+      // do the processing (8-bit with special treatment, to make sure we can use openmp further down):
+      if(bpp == 8)
+        res = dt_dev_pixelpipe_process(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
+      else
+        res = dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
+      outbuf = pipe.backbuf;
     }
-  }
-  else if(bpp == 16)
-  {
-    // uint16_t per color channel
-    float    *buff  = (float *)   outbuf;
-    uint16_t *buf16 = (uint16_t *)outbuf;
-    for(int y=0; y<processed_height; y++) for(int x=0; x<processed_width ; x++)
-      {
-        // convert in place
-        const int k = x + processed_width*y;
-        for(int i=0; i<3; i++) buf16[4*k+i] = CLAMP(buff[4*k+i]*0x10000, 0, 0xffff);
-      }
-  }
-  // else output float, no further harm done to the pixels :)
 
-  format_params->width  = processed_width;
-  format_params->height = processed_height;
+    // nothing to write if processing was aborted, for example because the job got cancelled:
+    if(!res)
+    {
+      // downconversion to low-precision formats:
+      if(bpp != 8 || !display_byteorder)
+        _export_convert(outbuf, processed_width, processed_height, bpp, high_quality_processing);
 
-  if(!ignore_exif)
-  {
-    int length;
-    uint8_t exif_profile[65535]; // C++ alloc'ed buffer is uncool, so we waste some bits here.
-    char pathname[1024];
-    dt_image_full_path(imgid, pathname, 1024);
-    length = dt_exif_read_blob(exif_profile, pathname, sRGB, imgid);
+      format_params->width  = processed_width;
+      format_params->height = processed_height;
 
-    res = format->write_image (format_params, filename, outbuf, exif_profile, length, imgid);
-  }
-  else
-  {
-    res = format->write_image (format_params, filename, outbuf, NULL, 0, imgid);
+      res = format->write_image (format_params, filename, outbuf, exif, length, imgid);
+    }
   }
 
   dt_dev_pixelpipe_cleanup(&pipe);
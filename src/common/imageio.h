@@ -72,6 +72,20 @@ dt_imageio_flip_buffers(
 
 void dt_imageio_flip_buffers_ui16_to_float(float *out, const uint16_t *in, const float black, const float white, const int ch, const int wd, const int ht, const int fwd, const int fht, const int stride, const int orientation);
 void dt_imageio_flip_buffers_ui8_to_float(float *out, const uint8_t *in, const float black, const float white, const int ch, const int wd, const int ht, const int fwd, const int fht, const int stride, const int orientation);
+
+typedef enum dt_imageio_convert_flags_t
+{
+  DT_IMAGEIO_CONVERT_SWAP_RB    = 1 << 0, // input is in display byte order (bgra)
+  DT_IMAGEIO_CONVERT_PACK_RGB   = 1 << 1, // drop the fourth channel, three channels per output pixel
+  DT_IMAGEIO_CONVERT_BIG_ENDIAN = 1 << 2, // 16-bit output in network byte order
+  DT_IMAGEIO_CONVERT_DITHER     = 1 << 3  // ordered dithering when quantizing floats
+}
+dt_imageio_convert_flags_t;
+
+// fused, parallel conversion of four channel pixels to the low precision output formats:
+// clamps, scales, swizzles and packs in one pass. in_bpp may be 32 (float), 16 or 8 and out_bpp
+// 16 or 8, integer input keeps its precision. out may be the same buffer as in.
+void dt_imageio_convert(void *out, const void *in, const int in_bpp, const int out_bpp, const int width, const int height, const int flags);
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
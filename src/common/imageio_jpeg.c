@@ -96,6 +96,31 @@ int dt_imageio_jpeg_decompress_header(const void *in, size_t length, dt_imageio_
   return 0;
 }
 
+int dt_imageio_jpeg_set_scale(dt_imageio_jpeg_t *jpg, const int max_width, const int max_height)
+{
+  struct dt_imageio_jpeg_error_mgr jerr;
+  jpg->dinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = dt_imageio_jpeg_error_exit;
+  if (setjmp(jerr.setjmp_buffer))
+  {
+    jpg->dinfo.scale_denom = 1;
+    return 1;
+  }
+  // largest power of two the idct can skip, such that the image still has to be
+  // downscaled (and not blown up) to fit into max_width x max_height:
+  const unsigned int wd = max_width  > 0 ? max_width  : 1;
+  const unsigned int ht = max_height > 0 ? max_height : 1;
+  unsigned int denom = 1;
+  while(denom < 8 && (jpg->dinfo.image_width >= 2*denom*wd || jpg->dinfo.image_height >= 2*denom*ht))
+    denom *= 2;
+  jpg->dinfo.scale_num = 1;
+  jpg->dinfo.scale_denom = denom;
+  jpeg_calc_output_dimensions(&(jpg->dinfo));
+  jpg->width  = jpg->dinfo.output_width;
+  jpg->height = jpg->dinfo.output_height;
+  return 0;
+}
+
 int dt_imageio_jpeg_decompress(dt_imageio_jpeg_t *jpg, uint8_t *out)
 {
   struct dt_imageio_jpeg_error_mgr jerr;
@@ -109,14 +134,14 @@ int dt_imageio_jpeg_decompress(dt_imageio_jpeg_t *jpg, uint8_t *out)
   JSAMPROW row_pointer[1];
   row_pointer[0] = (uint8_t *)malloc(jpg->dinfo.output_width*jpg->dinfo.num_components);
   uint8_t *tmp = out;
-  while(jpg->dinfo.output_scanline < jpg->dinfo.image_height)
+  while(jpg->dinfo.output_scanline < jpg->dinfo.output_height)
   {
     if(jpeg_read_scanlines(&(jpg->dinfo), row_pointer, 1) != 1)
     {
       free(row_pointer[0]);
       return 1;
     }
-    for(unsigned int i=0; i<jpg->dinfo.image_width; i++) for(int k=0; k<3; k++)
+    for(unsigned int i=0; i<jpg->dinfo.output_width; i++) for(int k=0; k<3; k++)
         tmp[4*i+k] = row_pointer[0][3*i+k];
     tmp += 4*jpg->width;
   }
@@ -514,7 +539,7 @@ int dt_imageio_jpeg_read(dt_imageio_jpeg_t *jpg, uint8_t *out)
   JSAMPROW row_pointer[1];
   row_pointer[0] = (uint8_t *)malloc(jpg->dinfo.output_width*jpg->dinfo.num_components);
   uint8_t *tmp = out;
-  while(jpg->dinfo.output_scanline < jpg->dinfo.image_height)
+  while(jpg->dinfo.output_scanline < jpg->dinfo.output_height)
   {
     if(jpeg_read_scanlines(&(jpg->dinfo), row_pointer, 1) != 1)
     {
@@ -524,10 +549,10 @@ int dt_imageio_jpeg_read(dt_imageio_jpeg_t *jpg, uint8_t *out)
       return 1;
     }
     if(jpg->dinfo.num_components < 3)
-      for(unsigned int i=0; i<jpg->dinfo.image_width; i++) for(int k=0; k<3; k++)
+      for(unsigned int i=0; i<jpg->dinfo.output_width; i++) for(int k=0; k<3; k++)
           tmp[4*i+k] = row_pointer[0][jpg->dinfo.num_components*i+0];
     else
-      for(unsigned int i=0; i<jpg->dinfo.image_width; i++) for(int k=0; k<3; k++)
+      for(unsigned int i=0; i<jpg->dinfo.output_width; i++) for(int k=0; k<3; k++)
           tmp[4*i+k] = row_pointer[0][3*i+k];
     tmp += 4*jpg->width;
   }
@@ -41,6 +41,10 @@ dt_imageio_jpeg_t;
 
 /** reads the header and fills width/height in jpg struct. */
 int dt_imageio_jpeg_decompress_header(const void *in, size_t length, dt_imageio_jpeg_t *jpg);
+/** lets libjpeg decode at 1/2, 1/4 or 1/8 size in the idct, as long as the result is still larger
+ *  than max_width x max_height in one dimension. call after reading the header, updates width/height.
+ *  returns non-zero (and decodes at full size) on failure. */
+int dt_imageio_jpeg_set_scale(dt_imageio_jpeg_t *jpg, const int max_width, const int max_height);
 /** reads the whole image to the out buffer, which has to be large enough. */
 int dt_imageio_jpeg_decompress(dt_imageio_jpeg_t *jpg, uint8_t *out);
 /** compresses in to out buffer with given quality (0..100). out buffer must be large enough. returns actual data length. */
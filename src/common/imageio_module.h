@@ -101,6 +101,14 @@ typedef struct dt_imageio_module_format_t
   /* write to file, with exif if not NULL, and icc profile if supported. */
   int (*write_image)(dt_imageio_module_data_t *data, const char *filename, const void *in, void *exif, int exif_len, int imgid);
 
+  // optional: write the image in bands of rows, so the whole image never needs to be in memory:
+  /* open the file, write headers. exif has to stay valid until write_image_end. returns a handle or NULL on fail. */
+  void *(*write_image_begin)(dt_imageio_module_data_t *data, const char *filename, void *exif, int exif_len, int imgid);
+  /* write the next num_rows rows (top to bottom), same pixel layout as for write_image. */
+  int (*write_image_rows)(dt_imageio_module_data_t *data, void *handle, const void *in, const int num_rows);
+  /* finish the file and free the handle. has to be called even if writing rows failed. */
+  int (*write_image_end)(dt_imageio_module_data_t *data, void *handle);
+
   // sometimes we want to tell the world about what we can do
   int (*flags)();
 
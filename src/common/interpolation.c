@@ -16,16 +16,19 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 * ------------------------------------------------------------------------*/
 
+#ifndef DT_UNIT_TEST
 #include "common/darktable.h"
-#include "common/interpolation.h"
 #include "control/conf.h"
+#include <glib.h>
+#endif
+#include "common/interpolation.h"
 
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
-#include <glib.h>
 #include <assert.h>
+#include <immintrin.h>
 
 /** Border extrapolation modes */
 enum border_mode
@@ -1077,6 +1080,7 @@ dt_interpolation_new(
  * @param pindex [out] Array of sample indexes to be used for applying each kernel tap
  * arrays of informations
  * @param pmeta [out] Array of int triplets (length, kernel, index) telling where to start for an arbitrary out position meta[3*out]
+ * @param sse [in] compute the kernels with sse instructions
  * @return 0 for success, !0 for failure
  */
 static int
@@ -1090,7 +1094,8 @@ prepare_resampling_plan(
   int** plength,
   float** pkernel,
   int** pindex,
-  int** pmeta)
+  int** pmeta,
+  const int sse)
 {
   // Safe return values
   *plength = NULL;
@@ -1176,7 +1181,14 @@ prepare_resampling_plan(
 
       // Compute the filter kernel at that position
       int first;
-      compute_upsampling_kernel_sse(itor, scratchpad, NULL, &first, fx);
+      if (sse)
+      {
+        compute_upsampling_kernel_sse(itor, scratchpad, NULL, &first, fx);
+      }
+      else
+      {
+        compute_upsampling_kernel(itor, scratchpad, NULL, &first, fx);
+      }
 
       /* Check lower and higher bound pixel index and skip as many pixels as
        * necessary to fall into range */
@@ -1225,7 +1237,14 @@ prepare_resampling_plan(
       // Compute downsampling kernel centered on output position
       int taps;
       int first;
-      compute_downsampling_kernel_sse(itor, &taps, &first, scratchpad, NULL, scale, out_x0 + x);
+      if (sse)
+      {
+        compute_downsampling_kernel_sse(itor, &taps, &first, scratchpad, NULL, scale, out_x0 + x);
+      }
+      else
+      {
+        compute_downsampling_kernel(itor, &taps, &first, scratchpad, NULL, scale, out_x0 + x);
+      }
 
       /* Check lower and higher bound pixel index and skip as many pixels as
        * necessary to fall into range */
@@ -1268,13 +1287,217 @@ prepare_resampling_plan(
   return 0;
 }
 
-void
-dt_interpolation_resample(
+/* --------------------------------------------------------------------------
+ * Resampling of one output line
+ *
+ * There is one version per instruction set, the best one the cpu supports
+ * is picked at runtime. resample_row_plain() is used without sse2, and is
+ * the reference the others are checked against in src/tests/interpolation.c
+ * ------------------------------------------------------------------------*/
+
+/** Resamples one output line
+ *
+ * @param out [out] output line, width four component pixels
+ * @param width [in] number of output pixels
+ * @param in [in] input image
+ * @param in_stride [in] input line stride in bytes
+ * @param vl [in] number of input lines contributing to this output line
+ * @param vindex [in] vl input line indexes
+ * @param vkernel [in] vl vertical filter taps
+ * @param hlength [in] number of horizontal taps for each output pixel
+ * @param hindex [in] input pixel indexes of all horizontal taps
+ * @param hkernel [in] all horizontal filter taps */
+typedef void (*resample_row_func)(
+  float* out,
+  const int width,
+  const float* const in,
+  const int32_t in_stride,
+  const int vl,
+  const int* vindex,
+  const float* vkernel,
+  const int* hlength,
+  const int* hindex,
+  const float* hkernel);
+
+static void
+resample_row_plain(
+  float* out,
+  const int width,
+  const float* const in,
+  const int32_t in_stride,
+  const int vl,
+  const int* vindex,
+  const float* vkernel,
+  const int* hlength,
+  const int* hindex,
+  const float* hkernel)
+{
+  for (int ox=0; ox<width; ox++)
+  {
+    const int hl = hlength[ox];
+    float vs[4] = { 0.f, 0.f, 0.f, 0.f };
+
+    for (int iy=0; iy<vl; iy++)
+    {
+      const float* i = (float*)((char*)in + in_stride*vindex[iy]);
+      float vhs[4] = { 0.f, 0.f, 0.f, 0.f };
+
+      for (int ix=0; ix<hl; ix++)
+      {
+        const float* p = i + hindex[ix]*4;
+        for (int c=0; c<4; c++)
+        {
+          vhs[c] += p[c]*hkernel[ix];
+        }
+      }
+
+      for (int c=0; c<4; c++)
+      {
+        vs[c] += vhs[c]*vkernel[iy];
+      }
+    }
+
+    for (int c=0; c<4; c++)
+    {
+      out[4*ox + c] = vs[c];
+    }
+
+    hindex += hl;
+    hkernel += hl;
+  }
+}
+
+static void
+resample_row_sse(
+  float* out,
+  const int width,
+  const float* const in,
+  const int32_t in_stride,
+  const int vl,
+  const int* vindex,
+  const float* vkernel,
+  const int* hlength,
+  const int* hindex,
+  const float* hkernel)
+{
+  for (int ox=0; ox<width; ox++)
+  {
+    const int hl = hlength[ox];
+
+    // This will hold the resulting pixel
+    __m128 vs = _mm_setzero_ps();
+
+    for (int iy=0; iy<vl; iy++)
+    {
+      // This is our input line
+      const float* i = (float*)((char*)in + in_stride*vindex[iy]);
+
+      __m128 vhs = _mm_setzero_ps();
+
+      for (int ix=0; ix<hl; ix++)
+      {
+        // Apply the precomputed filter kernel
+        __m128 vhtap = _mm_set_ps1(hkernel[ix]);
+        vhs = _mm_add_ps(vhs, _mm_mul_ps(*(__m128*)&i[hindex[ix]*4], vhtap));
+      }
+
+      // Accumulate contribution from this line
+      __m128 vvtap = _mm_set_ps1(vkernel[iy]);
+      vs = _mm_add_ps(vs, _mm_mul_ps(vhs, vvtap));
+    }
+
+    // Output pixel is ready
+    _mm_stream_ps(out + 4*ox, vs);
+
+    // Progress in horizontal context
+    hindex += hl;
+    hkernel += hl;
+  }
+}
+
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define HAVE_RESAMPLE_ROW_AVX2 1
+
+/* two horizontal taps per step, one pixel in each 128 bit lane, with fused
+ * multiply-adds. Built for avx2/fma whatever the compiler flags are, and
+ * only called after checking the cpu for it. */
+__attribute__((target("avx2,fma")))
+static void
+resample_row_avx2(
+  float* out,
+  const int width,
+  const float* const in,
+  const int32_t in_stride,
+  const int vl,
+  const int* vindex,
+  const float* vkernel,
+  const int* hlength,
+  const int* hindex,
+  const float* hkernel)
+{
+  for (int ox=0; ox<width; ox++)
+  {
+    const int hl = hlength[ox];
+    __m128 vs = _mm_setzero_ps();
+
+    for (int iy=0; iy<vl; iy++)
+    {
+      const float* i = (float*)((char*)in + in_stride*vindex[iy]);
+
+      __m256 vhs2 = _mm256_setzero_ps();
+      int ix = 0;
+      for (; ix+1<hl; ix+=2)
+      {
+        const __m256 p = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(&i[hindex[ix]*4])),
+                                              _mm_load_ps(&i[hindex[ix+1]*4]), 1);
+        const __m256 k = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(hkernel[ix])),
+                                              _mm_set1_ps(hkernel[ix+1]), 1);
+        vhs2 = _mm256_fmadd_ps(p, k, vhs2);
+      }
+      __m128 vhs = _mm_add_ps(_mm256_castps256_ps128(vhs2), _mm256_extractf128_ps(vhs2, 1));
+      if (ix<hl)
+      {
+        vhs = _mm_fmadd_ps(_mm_load_ps(&i[hindex[ix]*4]), _mm_set1_ps(hkernel[ix]), vhs);
+      }
+
+      vs = _mm_fmadd_ps(vhs, _mm_set1_ps(vkernel[iy]), vs);
+    }
+
+    _mm_stream_ps(out + 4*ox, vs);
+
+    hindex += hl;
+    hkernel += hl;
+  }
+}
+#endif
+
+/** Picks the fastest line resampler the cpu supports */
+static resample_row_func
+resample_row_dispatch()
+{
+#ifdef HAVE_RESAMPLE_ROW_AVX2
+  const uint32_t avx2 = DT_CPU_FLAG_AVX2 | DT_CPU_FLAG_FMA;
+  if ((darktable.cpu_flags & avx2) == avx2)
+  {
+    return resample_row_avx2;
+  }
+#endif
+  if (darktable.cpu_flags & DT_CPU_FLAG_SSE2)
+  {
+    return resample_row_sse;
+  }
+  return resample_row_plain;
+}
+
+static void
+resample(
   const struct dt_interpolation* itor,
+  resample_row_func resample_row,
   float *out,
   const dt_iop_roi_t* const roi_out,
   const int32_t out_stride,
   const float* const in,
+  const int in_y0,
   const dt_iop_roi_t* const roi_in,
   const int32_t in_stride)
 {
@@ -1308,7 +1531,7 @@ dt_interpolation_resample(
 #endif
     for (int y=0; y<roi_out->height; y++)
     {
-      float* i = (float*)((char*)in + in_stride*(y + roi_out->y) + x0);
+      float* i = (float*)((char*)in + in_stride*(y + roi_out->y - in_y0) + x0);
       float* o = (float*)((char*)out + out_stride*y);
       memcpy(o, i, l);
     }
@@ -1326,18 +1549,33 @@ dt_interpolation_resample(
 #endif
 
   // Prepare resampling plans once and for all
-  r = prepare_resampling_plan(itor, roi_in->width, roi_in->x, roi_out->width, roi_out->x, roi_out->scale, &hlength, &hkernel, &hindex, NULL);
+  // Filter kernels with sse where the cpu has it, as resample_row_dispatch()
+  const int sse = (darktable.cpu_flags & DT_CPU_FLAG_SSE2) != 0;
+  r = prepare_resampling_plan(itor, roi_in->width, roi_in->x, roi_out->width, roi_out->x, roi_out->scale, &hlength, &hkernel, &hindex, NULL, sse);
   if (r)
   {
     goto exit;
   }
 
-  r = prepare_resampling_plan(itor, roi_in->height, roi_in->y, roi_out->height, roi_out->y, roi_out->scale, &vlength, &vkernel, &vindex, &vmeta);
+  r = prepare_resampling_plan(itor, roi_in->height, roi_in->y, roi_out->height, roi_out->y, roi_out->scale, &vlength, &vkernel, &vindex, &vmeta, sse);
   if (r)
   {
     goto exit;
   }
 
+  // Make the line indexes relative to the first line held in the buffer
+  if (in_y0)
+  {
+    for (int oy=0; oy<roi_out->height; oy++)
+    {
+      int* index = vindex + vmeta[3*oy + 2];
+      for (int iy=0; iy<vlength[vmeta[3*oy + 0]]; iy++)
+      {
+        index[iy] -= in_y0;
+      }
+    }
+  }
+
 #if DEBUG_RESAMPLING_TIMING
   ts_plan = getts() - ts_plan;
 #endif
@@ -1348,7 +1586,7 @@ dt_interpolation_resample(
 
   // Process each output line
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(out, hindex, hlength, hkernel, vindex, vlength, vkernel, vmeta)
+  #pragma omp parallel for default(none) shared(out, hindex, hlength, hkernel, vindex, vlength, vkernel, vmeta, resample_row)
 #endif
   for (int oy=0; oy<roi_out->height; oy++)
   {
@@ -1357,67 +1595,12 @@ dt_interpolation_resample(
     int vkidx = vmeta[3*oy + 1]; // V(ertical) K(ernel) I(n)d(e)x
     int viidx = vmeta[3*oy + 2]; // V(ertical) I(ndex) I(n)d(e)x
 
-    // Initialize row resampling indexes
-    int hlidx = 0; // H(orizontal) L(ength) I(n)d(e)x
-    int hkidx = 0; // H(orizontal) K(ernel) I(n)d(e)x
-    int hiidx = 0; // H(orizontal) I(ndex) I(n)d(e)x
-
-    // Number of lines contributing to the output line
-    int vl = vlength[vlidx++]; // V(ertical) L(ength)
-
-    // Process each output column
-    for (int ox=0; ox < roi_out->width; ox++)
-    {
-      debug_extra("output %p [% 4d % 4d]\n", out, ox, oy);
-
-      // This will hold the resulting pixel
-      __m128 vs = _mm_setzero_ps();
-
-      // Number of horizontal samples contributing to the output
-      int hl = hlength[hlidx++]; // H(orizontal) L(ength)
-
-      for (int iy=0; iy < vl; iy++)
-      {
-        // This is our input line
-        const float* i = (float*)((char*)in + in_stride*vindex[viidx++]);
-
-        __m128 vhs = _mm_setzero_ps();
-
-        for (int ix=0; ix< hl; ix++)
-        {
-          // Apply the precomputed filter kernel
-          int baseidx = hindex[hiidx++]*4;
-          float htap = hkernel[hkidx++];
-          __m128 vhtap = _mm_set_ps1(htap);
-          vhs = _mm_add_ps(vhs, _mm_mul_ps(*(__m128*)&i[baseidx], vhtap));
-        }
-
-        // Accumulate contribution from this line
-        float vtap = vkernel[vkidx++];
-        __m128 vvtap = _mm_set_ps1(vtap);
-        vs = _mm_add_ps(vs, _mm_mul_ps(vhs, vvtap));
-
-        // Reset horizontal resampling context
-        hkidx -= hl;
-        hiidx -= hl;
-      }
-
-      // Output pixel is ready
-      float* o = (float*)((char*)out + oy*out_stride + ox*4*sizeof(float));
-      _mm_stream_ps(o, vs);
+    debug_extra("output %p [.... % 4d]\n", out, oy);
 
-      // Reset vertical resampling context
-      viidx -= vl;
-      vkidx -= vl;
-
-      // Progress in horizontal context
-      hiidx += hl;
-      hkidx += hl;
-    }
-
-    // Progress in vertical context
-    viidx += vl;
-    vkidx += vl;
+    // Number of lines contributing to the output line, and the whole line
+    resample_row((float*)((char*)out + oy*out_stride), roi_out->width, in, in_stride,
+                 vlength[vlidx], vindex + viidx, vkernel + vkidx,
+                 hlength, hindex, hkernel);
   }
 
   _mm_sfence();
@@ -1434,6 +1617,57 @@ exit:
   free(hlength);
   free(vlength);
 }
+
+void
+dt_interpolation_resample(
+  const struct dt_interpolation* itor,
+  float *out,
+  const dt_iop_roi_t* const roi_out,
+  const int32_t out_stride,
+  const float* const in,
+  const dt_iop_roi_t* const roi_in,
+  const int32_t in_stride)
+{
+  resample(itor, resample_row_dispatch(), out, roi_out, out_stride, in, 0, roi_in, in_stride);
+}
+
+void
+dt_interpolation_resample_lines(
+  const struct dt_interpolation* itor,
+  const dt_iop_roi_t* const roi_out,
+  const dt_iop_roi_t* const roi_in,
+  int* y0,
+  int* y1)
+{
+  if (roi_out->scale == 1.f)
+  {
+    *y0 = roi_out->y;
+    *y1 = roi_out->y + roi_out->height;
+    return;
+  }
+
+  /* Kernel support in input lines, on either side of the projected position.
+   * Downscaling stretches the kernel by 1/scale, see prepare_resampling_plan() */
+  const float support = (float)itor->width/fminf(roi_out->scale, 1.f) + 1.f;
+  const int first = (int)floorf((float)roi_out->y/roi_out->scale - support);
+  const int last = (int)ceilf((float)(roi_out->y + roi_out->height - 1)/roi_out->scale + support) + 1;
+  *y0 = CLAMPS(first, 0, roi_in->height);
+  *y1 = CLAMPS(last, 0, roi_in->height);
+}
+
+void
+dt_interpolation_resample_band(
+  const struct dt_interpolation* itor,
+  float *out,
+  const dt_iop_roi_t* const roi_out,
+  const int32_t out_stride,
+  const float* const in,
+  const int in_y0,
+  const dt_iop_roi_t* const roi_in,
+  const int32_t in_stride)
+{
+  resample(itor, resample_row_dispatch(), out, roi_out, out_stride, in, in_y0, roi_in, in_stride);
+}
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -19,7 +19,9 @@
 #ifndef INTERPOLATION_H
 #define INTERPOLATION_H
 
+#ifndef DT_UNIT_TEST
 #include "develop/pixelpipe_hb.h"
+#endif
 
 #include <xmmintrin.h>
 
@@ -152,6 +154,54 @@ dt_interpolation_resample(
   const dt_iop_roi_t* const roi_in,
   const int32_t in_stride);
 
+/** Input lines needed to resample a band of output lines.
+ *
+ * Reports the range [y0, y1) of input lines dt_interpolation_resample()
+ * reads to compute the output lines roi_out->y .. roi_out->y + roi_out->height - 1.
+ * The range is conservative, it may contain a few lines more than needed.
+ *
+ * @param itor [in] Interpolator to use
+ * @param roi_out [in] Region of interest of the output band
+ * @param roi_in [in] Region of interest of the whole original image
+ * @param y0 [out] First input line needed
+ * @param y1 [out] One past the last input line needed
+ */
+void
+dt_interpolation_resample_lines(
+  const struct dt_interpolation* itor,
+  const dt_iop_roi_t* const roi_out,
+  const dt_iop_roi_t* const roi_in,
+  int* y0,
+  int* y1);
+
+/** Resamples a band of output lines from a partial input buffer.
+ *
+ * Same as dt_interpolation_resample(), but in only holds the input lines
+ * starting at in_y0, at least the ones dt_interpolation_resample_lines()
+ * reports for roi_out. Lets callers which produce their input line by line
+ * downscale it without ever holding the whole original image. The image
+ * borders are still the ones of roi_in.
+ *
+ * @param itor [in] Interpolator to use
+ * @param out [out] Will hold the resampled band
+ * @param roi_out [in] Region of interest of the output band
+ * @param out_stride [in] Output line stride in <strong>bytes</strong>
+ * @param in [in] Input lines, the first one being line in_y0 of the original image
+ * @param in_y0 [in] Index of the first line in the input buffer
+ * @param roi_in [in] Region of interest of the whole original image
+ * @param in_stride [in] Input line stride in <strong>bytes</strong>
+ */
+void
+dt_interpolation_resample_band(
+  const struct dt_interpolation* itor,
+  float *out,
+  const dt_iop_roi_t* const roi_out,
+  const int32_t out_stride,
+  const float* const in,
+  const int in_y0,
+  const dt_iop_roi_t* const roi_in,
+  const int32_t in_stride);
+
 #endif /* INTERPOLATION_H */
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
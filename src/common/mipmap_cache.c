@@ -39,9 +39,9 @@
 #include <errno.h>
 #include <xmmintrin.h>
 
-#define DT_MIPMAP_CACHE_FILE_MAGIC 0xD71337
-#define DT_MIPMAP_CACHE_FILE_VERSION 22
 #define DT_MIPMAP_CACHE_DEFAULT_FILE_NAME "mipmaps"
+// only the smallest thumbs are kept on disk.
+#define DT_MIPMAP_STORE_LEVEL DT_MIPMAP_2
 
 #define DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE (1<<0)
 
@@ -149,62 +149,6 @@ get_size(const uint32_t key)
   return (dt_mipmap_size_t)(key >> 29);
 }
 
-typedef struct _iterate_data_t
-{
-  FILE *f;
-  uint8_t *blob;
-  int compression_type;
-  dt_mipmap_size_t mip;
-}
-_iterate_data_t;
-
-static int
-_write_buffer(const uint32_t key, const void *data, void *user_data)
-{
-  if(!data) return 1;
-  struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)data;
-  // too small to write. no error, but don't write.
-  if(dsc->width <= 8 && dsc->height <= 8) return 0;
-
-  _iterate_data_t *d = (_iterate_data_t *)user_data;
-  int written = fwrite(&(d->mip), sizeof(dt_mipmap_size_t), 1, d->f);
-  if(written != 1) return 1;
-  written = fwrite(&key, sizeof(uint32_t), 1, d->f);
-  if(written != 1) return 1;
-
-  if(d->compression_type)
-  {
-    // write buffer size, wd, ht and the full blob, as it is in memory.
-    const int32_t length = compressed_buffer_size(d->compression_type, dsc->width, dsc->height);
-    written = fwrite(&length, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(&dsc->width, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(&dsc->height, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(dsc+1, sizeof(uint8_t), length, d->f);
-    if(written != length) return 1;
-  }
-  else
-  {
-    dt_mipmap_buffer_t buf;
-    buf.width  = dsc->width;
-    buf.height = dsc->height;
-    buf.imgid  = get_imgid(key);
-    buf.size   = get_size(key);
-    // skip to next 8-byte alignment, for sse buffers.
-    buf.buf    = (uint8_t *)(dsc+1);
-
-    const int32_t length = dt_imageio_jpeg_compress(buf.buf, d->blob, buf.width, buf.height, MIN(100, MAX(10, dt_conf_get_int("database_cache_quality"))));
-    written = fwrite(&length, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(d->blob, sizeof(uint8_t), length, d->f);
-    if(written != length) return 1;
-  }
-
-  return 0;
-}
-
 static int
 dt_mipmap_cache_get_filename(
   gchar* mipmapfilename, size_t size)
@@ -250,217 +194,156 @@ exit:
   return r;
 }
 
+// reads the thumbnail from the disk store into the write locked buffer.
+// returns non-zero if it was found.
 static int
-dt_mipmap_cache_serialize(dt_mipmap_cache_t *cache)
+_read_from_store(dt_mipmap_cache_t *cache, struct dt_mipmap_buffer_dsc *dsc, const uint32_t imgid, const dt_mipmap_size_t mip)
 {
-  gchar dbfilename[DT_MAX_PATH_LEN];
-  if (dt_mipmap_cache_get_filename(dbfilename, sizeof(dbfilename)))
-  {
-    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; not serializing\n");
-    return 1;
-  }
-  if (!strcmp(dbfilename, ":memory:"))
-  {
-    // fprintf(stderr, "[mipmap_cache] library is in memory; not serializing\n");
-    return 0;
-  }
-
-  // only store smallest thumbs.
-  const dt_mipmap_size_t mip = DT_MIPMAP_2;
-
-  _iterate_data_t d;
-  d.f = NULL;
-  d.blob = (uint8_t *)malloc(cache->mip[mip].buffer_size);
-  int written = 0;
-  FILE *f = fopen(dbfilename, "wb");
-  if(!f) goto write_error;
-  d.f = f;
-  // fprintf(stderr, "[mipmap_cache] serializing to `%s'\n", dbfilename);
-
-  // write version info:
-  const int32_t magic = DT_MIPMAP_CACHE_FILE_MAGIC + DT_MIPMAP_CACHE_FILE_VERSION;
-  written = fwrite(&magic, sizeof(int32_t), 1, f);
-  if(written != 1) goto write_error;
-
-  // store compression type
-  written = fwrite(&cache->compression_type, sizeof(int32_t), 1, f);
-  if(written != 1) goto write_error;
-
-  for(int i=0; i<=mip; i++)
+  if(!cache->store || mip > DT_MIPMAP_STORE_LEVEL) return 0;
+  uint32_t length, wd, ht;
+  if(cache->compression_type)
   {
-    // print max sizes for this cache
-    written = fwrite(&cache->mip[i].max_width, sizeof(int32_t), 1, f);
-    if(written != 1) goto write_error;
-    written = fwrite(&cache->mip[i].max_height, sizeof(int32_t), 1, f);
-    if(written != 1) goto write_error;
+    // directly read from disk into cache:
+    const uint32_t max_length = compressed_buffer_size(cache->compression_type, cache->mip[mip].max_width, cache->mip[mip].max_height);
+    if(dt_mipmap_store_read(cache->store, imgid, mip, (uint8_t *)(dsc+1), max_length, &length, &wd, &ht)) return 0;
+    if(length != compressed_buffer_size(cache->compression_type, wd, ht)) return 0;
   }
-
-  for(int i=0; i<=mip; i++)
+  else
   {
-    d.mip = (dt_mipmap_size_t)i;
-    d.compression_type = cache->compression_type;
-    if(dt_cache_for_all(&cache->mip[i].cache, _write_buffer, &d)) goto write_error;
+    // no compression, the image is still compressed on disk, as jpg
+    const uint32_t max_length = sizeof(uint32_t)*cache->mip[mip].max_width*cache->mip[mip].max_height;
+    uint8_t *blob = (uint8_t *)malloc(max_length);
+    dt_imageio_jpeg_t jpg;
+    if(dt_mipmap_store_read(cache->store, imgid, mip, blob, max_length, &length, &wd, &ht) ||
+        dt_imageio_jpeg_decompress_header(blob, length, &jpg) ||
+        jpg.width > cache->mip[mip].max_width || jpg.height > cache->mip[mip].max_height ||
+        dt_imageio_jpeg_decompress(&jpg, (uint8_t *)(dsc+1)))
+    {
+      free(blob);
+      return 0;
+    }
+    free(blob);
+    wd = jpg.width;
+    ht = jpg.height;
   }
-
-  free(d.blob);
-  fclose(f);
-  return 0;
-
-write_error:
-  fprintf(stderr, "[mipmap_cache] serialization to `%s' failed!\n", dbfilename);
-  if(f) fclose(f);
-  free(d.blob);
+  dsc->width = wd;
+  dsc->height = ht;
   return 1;
 }
 
-static int
-dt_mipmap_cache_deserialize(dt_mipmap_cache_t *cache)
+// appends a freshly generated thumbnail to the disk store.
+static void
+_write_to_store(dt_mipmap_cache_t *cache, const struct dt_mipmap_buffer_dsc *dsc, const uint32_t imgid, const dt_mipmap_size_t mip)
 {
-  int32_t rd = 0;
-  const dt_mipmap_size_t mip = DT_MIPMAP_2;
-  uint8_t *blob = NULL;
-  int file_width[mip+1], file_height[mip+1];
-
-  gchar dbfilename[DT_MAX_PATH_LEN];
-  if (dt_mipmap_cache_get_filename(dbfilename, sizeof(dbfilename)))
-  {
-    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; not deserializing\n");
-    return 1;
-  }
-  if (!strcmp(dbfilename, ":memory:"))
-  {
-    // fprintf(stderr, "[mipmap_cache] library is in memory; not deserializing\n");
-    return 0;
-  }
-
-  FILE *f = fopen(dbfilename, "rb");
-  if(!f)
-  {
-    if (errno == ENOENT)
-    {
-      fprintf(stderr, "[mipmap_cache] cache is empty, file `%s' doesn't exist\n", dbfilename);
-    }
-    else
-    {
-      fprintf(stderr, "[mipmap_cache] failed to open the cache from `%s'\n", dbfilename);
-    }
-    goto read_finalize;
-  }
+  if(!cache->store || mip > DT_MIPMAP_STORE_LEVEL) return;
+  // too small to write: skulls and failed loads are retried next time.
+  if(dsc->width <= 8 && dsc->height <= 8) return;
 
-  // read version info:
-  const int32_t magic = DT_MIPMAP_CACHE_FILE_MAGIC + DT_MIPMAP_CACHE_FILE_VERSION;
-  int32_t magic_file = 0;
-  rd = fread(&magic_file, sizeof(int32_t), 1, f);
-  if(rd != 1) goto read_error;
-  if(magic_file != magic)
+  if(cache->compression_type)
   {
-    if(magic_file > DT_MIPMAP_CACHE_FILE_MAGIC && magic_file < magic)
-      fprintf(stderr, "[mipmap_cache] cache version too old, dropping `%s' cache\n", dbfilename);
-    else
-      fprintf(stderr, "[mipmap_cache] invalid cache file, dropping `%s' cache\n", dbfilename);
-    goto read_finalize;
+    dt_mipmap_store_write(cache->store, imgid, mip, (const uint8_t *)(dsc+1),
+                          compressed_buffer_size(cache->compression_type, dsc->width, dsc->height),
+                          dsc->width, dsc->height);
   }
-
-  // also read compression type and yell out on missmatch.
-  int32_t compression = -1;
-  rd = fread(&compression, sizeof(int32_t), 1, f);
-  if(rd != 1) goto read_error;
-  if(compression != cache->compression_type)
+  else
   {
-    fprintf(stderr, "[mipmap_cache] cache is %s, but settings say we should use %s, dropping `%s' cache\n",
-            compression == 0 ? "uncompressed" : (compression == 1 ? "low quality compressed" : "high quality compressed"),
-            cache->compression_type == 0 ? "no compression" : (cache->compression_type == 1 ? "low quality compression" : "high quality compression"),
-            dbfilename);
-    goto read_finalize;
+    uint8_t *blob = (uint8_t *)malloc(cache->mip[mip].buffer_size);
+    const int32_t length = dt_imageio_jpeg_compress((const uint8_t *)(dsc+1), blob, dsc->width, dsc->height,
+                                                    MIN(100, MAX(10, dt_conf_get_int("database_cache_quality"))));
+    if(length > 0) dt_mipmap_store_write(cache->store, imgid, mip, blob, length, dsc->width, dsc->height);
+    free(blob);
   }
+}
 
-  for (int i=0; i<=mip; i++)
+// fills all mip levels below mip from the freshly generated 8-bit thumbnail rgba of size wd x ht,
+// by successive 2x2 box downsampling, so changing the lighttable zoom does not decode the image again.
+// levels which are already cached (or being generated by someone else) are skipped.
+static void
+_init_smaller_mips(dt_mipmap_cache_t *cache, const uint32_t imgid, const dt_mipmap_size_t mip,
+                   const uint8_t *rgba, uint32_t wd, uint32_t ht)
+{
+  if(mip <= DT_MIPMAP_0 || mip >= DT_MIPMAP_F || wd <= 16 || ht <= 16) return;
+
+  // the first step downsamples into tmp, all further steps work in place in tmp.
+  // this is safe since every output pixel only overwrites input which has been consumed already.
+  uint8_t *tmp = (uint8_t *)dt_alloc_align(64, sizeof(uint32_t)*(wd/2)*(ht/2));
+  if(!tmp) return;
+  const uint8_t *in = rgba;
+  for(int k=mip-1; k>=DT_MIPMAP_0 && wd > 16 && ht > 16; k--)
   {
-    rd = fread(&file_width[i], sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-    rd = fread(&file_height[i], sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-    if(file_width[i]  != cache->mip[i].max_width ||
-        file_height[i] != cache->mip[i].max_height)
+    const uint32_t w2 = wd/2, h2 = ht/2;
+    for(uint32_t j=0; j<h2; j++)
     {
-      fprintf(stderr, "[mipmap_cache] cache settings changed, dropping `%s' cache\n", dbfilename);
-      goto read_finalize;
+      const uint8_t *row0 = in + 4*wd*2*j;
+      const uint8_t *row1 = row0 + 4*wd;
+      uint8_t *out = tmp + 4*w2*j;
+      for(uint32_t i=0; i<w2; i++)
+        for(int c=0; c<4; c++)
+          out[4*i+c] = (row0[8*i+c] + row0[8*i+4+c] + row1[8*i+c] + row1[8*i+4+c] + 2) >> 2;
     }
-  }
+    in = tmp;
+    wd = w2;
+    ht = h2;
 
-  if(cache->compression_type) blob = NULL;
-  else blob = malloc(sizeof(uint32_t)*file_width[mip]*file_height[mip]);
-
-  while(!feof(f))
-  {
-    int level = 0;
-    rd = fread(&level, sizeof(int), 1, f);
-    if (level > mip) break;
-
-    int32_t key = 0;
-    rd = fread(&key, sizeof(int32_t), 1, f);
-    if(rd != 1) break; // first value is break only, goes to eof.
-    int32_t length = 0;
-    rd = fread(&length, sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-
-    uint8_t *data = (uint8_t *)dt_cache_read_get(&cache->mip[level].cache, key);
-    struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)data;
+    const uint32_t key = get_key(imgid, k);
+    if(dt_cache_contains(&cache->mip[k].cache, key)) continue;
+    struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)dt_cache_read_get(&cache->mip[k].cache, key);
+    if(!dsc) continue;
     if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE)
     {
+      // write locked by the alloc callback, as in dt_mipmap_cache_read_get().
+      dsc->width = wd;
+      dsc->height = ht;
       if(cache->compression_type)
       {
-        int32_t wd, ht;
-        rd = fread(&wd, sizeof(int32_t), 1, f);
-        if(rd != 1) goto read_error;
-        rd = fread(&ht, sizeof(int32_t), 1, f);
-        if(rd != 1) goto read_error;
-        dsc->width = wd;
-        dsc->height = ht;
-        if(length != compressed_buffer_size(cache->compression_type, wd, ht)) goto read_error;
-        // directly read from disk into cache:
-        rd = fread(data + sizeof(*dsc), 1, length, f);
-        if(rd != length) goto read_error;
+        dt_mipmap_buffer_t buf;
+        buf.width  = wd;
+        buf.height = ht;
+        buf.imgid  = imgid;
+        buf.size   = k;
+        buf.buf    = (uint8_t *)(dsc+1);
+        dt_mipmap_cache_compress(&buf, tmp);
       }
       else
       {
-        // jpg too large?
-        if(length > sizeof(uint32_t)*file_width[mip]*file_height[mip]) goto read_error;
-        rd = fread(blob, sizeof(uint8_t), length, f);
-        if(rd != length) goto read_error;
-        // no compression, the image is still compressed on disk, as jpg
-        dt_imageio_jpeg_t jpg;
-        if(dt_imageio_jpeg_decompress_header(blob, length, &jpg) ||
-            (jpg.width > file_width[level] || jpg.height > file_height[level]) ||
-            dt_imageio_jpeg_decompress(&jpg, data+sizeof(*dsc)))
-        {
-          fprintf(stderr, "[mipmap_cache] failed to decompress thumbnail for image %d!\n", get_imgid(key));
-        }
-        dsc->width = jpg.width;
-        dsc->height = jpg.height;
+        memcpy(dsc+1, tmp, sizeof(uint32_t)*wd*ht);
       }
+      _write_to_store(cache, dsc, imgid, k);
       dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
-      // these come write locked in case idata[3] == 1, so release that!
-      dt_cache_write_release(&cache->mip[level].cache, key);
+      dt_cache_write_release(&cache->mip[k].cache, key);
     }
-    dt_cache_read_release(&cache->mip[level].cache, key);
+    dt_cache_read_release(&cache->mip[k].cache, key);
   }
+  free(tmp);
+}
 
-  fclose(f);
-  free(blob);
-  return 0;
+static void
+_open_store(dt_mipmap_cache_t *cache)
+{
+  cache->store = NULL;
+  gchar filename[DT_MAX_PATH_LEN];
+  if(dt_mipmap_cache_get_filename(filename, sizeof(filename)))
+  {
+    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; not storing thumbnails\n");
+    return;
+  }
+  // library is in memory, so are the thumbnails:
+  if(!strcmp(filename, ":memory:")) return;
 
-read_error:
-  fprintf(stderr, "[mipmap_cache] failed to recover the cache from `%s'\n", dbfilename);
-read_finalize:
-  if(f) fclose(f);
-  free(blob);
-  g_unlink(dbfilename);
-  return 1;
+  // the whole cache used to be serialized into this file at shutdown:
+  g_unlink(filename);
+
+  uint32_t max_width[DT_MIPMAP_STORE_LEVEL+1], max_height[DT_MIPMAP_STORE_LEVEL+1];
+  for(int k=0; k<=DT_MIPMAP_STORE_LEVEL; k++)
+  {
+    max_width[k] = cache->mip[k].max_width;
+    max_height[k] = cache->mip[k].max_height;
+  }
+  cache->store = dt_mipmap_store_open(filename, DT_MIPMAP_STORE_LEVEL+1, cache->compression_type, max_width, max_height);
 }
 
 static void _init_f(float   *buf, uint32_t *width, uint32_t *height, const uint32_t imgid);
-static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, const uint32_t imgid, const dt_mipmap_size_t size);
+static void _init_8(dt_mipmap_cache_t *cache, uint8_t *buf, uint32_t *width, uint32_t *height, const uint32_t imgid, const dt_mipmap_size_t size);
 
 static int32_t
 scratchmem_allocate(void *data, const uint32_t key, int32_t *cost, void **buf)
@@ -617,6 +500,14 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   struct dt_mipmap_buffer_dsc *dsc = (struct dt_mipmap_buffer_dsc *)dt_mipmap_cache_static_dead_image;
   dead_image_f((dt_mipmap_buffer_t *)(dsc+1));
 
+  dt_pthread_mutex_init(&cache->decode_lock, NULL);
+  for(int k=0; k<DT_MIPMAP_DECODE_BUFFERS; k++)
+  {
+    cache->decode_buf[k] = NULL;
+    cache->decode_size[k] = 0;
+    cache->decode_used[k] = 0;
+  }
+
   cache->compression_type = 0;
   gchar *compression = dt_conf_get_string("cache_compression");
   if(compression)
@@ -737,12 +628,13 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   cache->mip[DT_MIPMAP_F].size = DT_MIPMAP_F;
   cache->mip[DT_MIPMAP_F].buf = NULL;
 
-  dt_mipmap_cache_deserialize(cache);
+  _open_store(cache);
 }
 
 void dt_mipmap_cache_cleanup(dt_mipmap_cache_t *cache)
 {
-  dt_mipmap_cache_serialize(cache);
+  dt_mipmap_store_close(cache->store);
+  cache->store = NULL;
   for(int k=0; k<DT_MIPMAP_F; k++)
   {
     dt_cache_cleanup(&cache->mip[k].cache);
@@ -758,6 +650,9 @@ void dt_mipmap_cache_cleanup(dt_mipmap_cache_t *cache)
     dt_cache_cleanup(&cache->scratchmem.cache);
     free(cache->scratchmem.buf);
   }
+  for(int k=0; k<DT_MIPMAP_DECODE_BUFFERS; k++)
+    free(cache->decode_buf[k]);
+  dt_pthread_mutex_destroy(&cache->decode_lock);
 }
 
 void dt_mipmap_cache_print(dt_mipmap_cache_t *cache)
@@ -830,7 +725,14 @@ dt_mipmap_cache_read_get(
     dt_image_load_job_init(&j, imgid, mip);
     // if the job already exists, make it high-priority, if not, add it:
     if(dt_control_revive_job(darktable.control, &j) < 0)
-      dt_control_add_job(darktable.control, &j);
+    {
+      // thumbnails are processed from the full buffer: if that is being loaded already,
+      // wait for it instead of decoding the raw a second time. stored ones are just read back.
+      dt_job_t full;
+      dt_image_load_job_init(&full, imgid, DT_MIPMAP_FULL);
+      const int stored = dt_mipmap_store_has(cache->store, imgid, mip);
+      dt_control_add_job_after(darktable.control, &j, (mip < DT_MIPMAP_FULL && !stored) ? &full : NULL);
+    }
   }
   else if(flags == DT_MIPMAP_BLOCKING)
   {
@@ -905,7 +807,7 @@ dt_mipmap_cache_read_get(
         {
           _init_f((float *)(dsc+1), &dsc->width, &dsc->height, imgid);
         }
-        else
+        else if(!_read_from_store(cache, dsc, imgid, mip))
         {
           // 8-bit thumbs, possibly need to be compressed:
           if(cache->compression_type)
@@ -915,19 +817,23 @@ dt_mipmap_cache_read_get(
             // const void *cbuf =
             dt_cache_read_get(&cache->scratchmem.cache, key);
             uint8_t *scratchmem = (uint8_t *)dt_cache_write_get(&cache->scratchmem.cache, key);
-            _init_8(scratchmem, &dsc->width, &dsc->height, imgid, mip);
+            _init_8(cache, scratchmem, &dsc->width, &dsc->height, imgid, mip);
             buf->width  = dsc->width;
             buf->height = dsc->height;
             buf->imgid  = imgid;
             buf->size   = mip;
             buf->buf = (uint8_t *)(dsc+1);
             dt_mipmap_cache_compress(buf, scratchmem);
+            _write_to_store(cache, dsc, imgid, mip);
+            _init_smaller_mips(cache, imgid, mip, scratchmem, dsc->width, dsc->height);
             dt_cache_write_release(&cache->scratchmem.cache, key);
             dt_cache_read_release(&cache->scratchmem.cache, key);
           }
           else
           {
-            _init_8((uint8_t *)(dsc+1), &dsc->width, &dsc->height, imgid, mip);
+            _init_8(cache, (uint8_t *)(dsc+1), &dsc->width, &dsc->height, imgid, mip);
+            _write_to_store(cache, dsc, imgid, mip);
+            _init_smaller_mips(cache, imgid, mip, (uint8_t *)(dsc+1), dsc->width, dsc->height);
           }
         }
         dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
@@ -1056,6 +962,7 @@ dt_mipmap_cache_remove(
     const uint32_t key = get_key(imgid, k);
     dt_cache_remove(&cache->mip[k].cache, key);
   }
+  dt_mipmap_store_remove(cache->store, imgid);
 }
 
 static void
@@ -1160,8 +1067,52 @@ _write_image(
   return 0;
 }
 
+// hands out one of the reusable jpeg decode buffers, sized to at least size bytes.
+// falls back to malloc if all of them are busy or size is too large to keep around.
+// *slot is -1 in that case.
+static uint8_t *
+_decode_buffer_get(dt_mipmap_cache_t *cache, const size_t size, int *slot)
+{
+  *slot = -1;
+  if(size > DT_MIPMAP_DECODE_MAX_SIZE) return (uint8_t *)dt_alloc_align(64, size);
+  dt_pthread_mutex_lock(&cache->decode_lock);
+  for(int k=0; k<DT_MIPMAP_DECODE_BUFFERS; k++)
+  {
+    if(cache->decode_used[k]) continue;
+    // prefer a buffer which is large enough, but not by far:
+    const int fits = cache->decode_size[k] >= size && cache->decode_size[k] <= 4*size;
+    if(*slot < 0 || (fits && !(cache->decode_size[*slot] >= size && cache->decode_size[*slot] <= 4*size))) *slot = k;
+  }
+  if(*slot >= 0) cache->decode_used[*slot] = 1;
+  dt_pthread_mutex_unlock(&cache->decode_lock);
+
+  if(*slot < 0) return (uint8_t *)dt_alloc_align(64, size);
+  // grow it, or give back what a much larger image left behind:
+  if(cache->decode_size[*slot] < size || cache->decode_size[*slot] > 4*size)
+  {
+    free(cache->decode_buf[*slot]);
+    cache->decode_buf[*slot] = (uint8_t *)dt_alloc_align(64, size);
+    cache->decode_size[*slot] = cache->decode_buf[*slot] ? size : 0;
+  }
+  return cache->decode_buf[*slot];
+}
+
+static void
+_decode_buffer_release(dt_mipmap_cache_t *cache, uint8_t *buf, const int slot)
+{
+  if(slot < 0)
+  {
+    free(buf);
+    return;
+  }
+  dt_pthread_mutex_lock(&cache->decode_lock);
+  cache->decode_used[slot] = 0;
+  dt_pthread_mutex_unlock(&cache->decode_lock);
+}
+
 static void
 _init_8(
+  dt_mipmap_cache_t      *cache,
   uint8_t                *buf,
   uint32_t               *width,
   uint32_t               *height,
@@ -1203,14 +1154,23 @@ _init_8(
       dt_imageio_jpeg_t jpg;
       if(!dt_imageio_jpeg_read_header(filename, &jpg))
       {
-        uint8_t *tmp = (uint8_t *)malloc(sizeof(uint8_t)*jpg.width*jpg.height*4);
-        if(!dt_imageio_jpeg_read(&jpg, tmp))
+        // let the idct do most of the downscaling:
+        if(orientation & 4) dt_imageio_jpeg_set_scale(&jpg, ht, wd);
+        else                dt_imageio_jpeg_set_scale(&jpg, wd, ht);
+        int slot;
+        uint8_t *tmp = _decode_buffer_get(cache, sizeof(uint8_t)*jpg.width*jpg.height*4, &slot);
+        if(tmp && !dt_imageio_jpeg_read(&jpg, tmp))
         {
           // scale to fit
           dt_iop_flip_and_zoom_8(tmp, jpg.width, jpg.height, buf, wd, ht, orientation, width, height);
           res = 0;
         }
-        free(tmp);
+        else if(!tmp)
+        {
+          jpeg_destroy_decompress(&jpg.dinfo);
+          fclose(jpg.f);
+        }
+        _decode_buffer_release(cache, tmp, slot);
       }
     }
     else
@@ -1230,19 +1190,27 @@ _init_8(
       const int orientation = raw->sizes.flip;
       if(image->type == LIBRAW_IMAGE_JPEG)
       {
-        // JPEG: decode (directly rescaled to mip4)
+        // JPEG: decode (already downscaled by the idct, as far as the mip size allows)
         dt_imageio_jpeg_t jpg;
         if(dt_imageio_jpeg_decompress_header(image->data, image->data_size, &jpg)) goto libraw_fail;
-        uint8_t *tmp = (uint8_t *)malloc(sizeof(uint8_t)*jpg.width*jpg.height*4);
+        if(orientation & 4) dt_imageio_jpeg_set_scale(&jpg, ht, wd);
+        else                dt_imageio_jpeg_set_scale(&jpg, wd, ht);
+        int slot;
+        uint8_t *tmp = _decode_buffer_get(cache, sizeof(uint8_t)*jpg.width*jpg.height*4, &slot);
+        if(!tmp)
+        {
+          jpeg_destroy_decompress(&jpg.dinfo);
+          goto libraw_fail;
+        }
         if(dt_imageio_jpeg_decompress(&jpg, tmp))
         {
-          free(tmp);
+          _decode_buffer_release(cache, tmp, slot);
           goto libraw_fail;
         }
         // scale to fit
         dt_iop_flip_and_zoom_8(tmp, jpg.width, jpg.height, buf, wd, ht, orientation, width, height);
 
-        free(tmp);
+        _decode_buffer_release(cache, tmp, slot);
         res = 0;
       }
 
@@ -1265,6 +1233,7 @@ libraw_fail:
     // try the real thing: rawspeed + pixelpipe
     dt_imageio_module_format_t format;
     _dummy_data_t dat;
+    memset(&format, 0, sizeof(format));
     format.bpp = _bpp;
     format.write_image = _write_image;
     dat.head.max_width  = wd;
@@ -1291,7 +1260,6 @@ libraw_fail:
   }
 
   // TODO: various speed optimizations:
-  // TODO: also init all smaller mips!
   // TODO: use mipf, but:
   // TODO: if output is cropped, don't use mipf!
 }
@@ -1346,7 +1314,7 @@ dt_mipmap_cache_compress(
     int flags = squish_dxt1;
     // low quality:
     if(darktable.mipmap_cache->compression_type == 1) flags |= squish_colour_range_fit;
-    squish_compress_image(scratchmem, buf->width, buf->height, buf->buf, squish_dxt1);
+    squish_compress_image(scratchmem, buf->width, buf->height, buf->buf, flags);
   }
 }
 
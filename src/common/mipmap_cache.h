@@ -20,7 +20,12 @@
 
 #include "common/cache.h"
 #include "common/image.h"
+#include "common/mipmap_store.h"
 
+// number of jpeg decode buffers kept around for thumbnail generation
+#define DT_MIPMAP_DECODE_BUFFERS 8
+// largest decode buffer kept in there, anything bigger is allocated for the one decode only
+#define DT_MIPMAP_DECODE_MAX_SIZE (32*1024*1024)
 
 // sizes stored in the mipmap cache.
 // _4 can be a user-supplied size. down to _0,
@@ -102,6 +107,13 @@ typedef struct dt_mipmap_cache_t
   int compression_type; // 0 - none, 1 - low quality, 2 - slow
   // per-thread cache of uncompressed buffers, in case compression is requested.
   dt_mipmap_cache_one_t scratchmem;
+  // small thumbnails on disk, NULL for in-memory libraries.
+  dt_mipmap_store_t *store;
+  // reusable buffers for decoding embedded jpegs, one per thread generating thumbnails.
+  dt_pthread_mutex_t decode_lock;
+  uint8_t *decode_buf[DT_MIPMAP_DECODE_BUFFERS];
+  size_t decode_size[DT_MIPMAP_DECODE_BUFFERS];
+  int decode_used[DT_MIPMAP_DECODE_BUFFERS];
 }
 dt_mipmap_cache_t;
 
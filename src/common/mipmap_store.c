@@ -0,0 +1,362 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "common/darktable.h"
+#include "common/mipmap_store.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define DT_MIPMAP_STORE_MAGIC 0xD71338
+#define DT_MIPMAP_STORE_VERSION 1
+// index grows in steps of this many image ids
+#define DT_MIPMAP_STORE_SLOT_CHUNK 4096
+// data files are rewritten on close if more than half of them and at least this much is garbage
+#define DT_MIPMAP_STORE_COMPACT_MIN (16u<<20)
+
+typedef struct dt_mipmap_store_header_t
+{
+  int32_t magic;
+  int32_t compression;
+  uint32_t max_width, max_height;
+  // append position in the data file, and bytes referenced by the slots
+  uint64_t data_size;
+  uint64_t live_size;
+  uint32_t reserved[8];
+}
+dt_mipmap_store_header_t;
+
+typedef struct dt_mipmap_store_slot_t
+{
+  uint64_t offset;
+  uint32_t length;
+  uint16_t width, height;
+  // checksum of the payload, 0 for empty slots
+  uint32_t check;
+  uint32_t reserved;
+}
+dt_mipmap_store_slot_t;
+
+static uint32_t
+_checksum(const uint8_t *buf, const uint32_t length)
+{
+  // fnv-1a
+  uint32_t h = 2166136261u;
+  for(uint32_t k=0; k<length; k++) h = (h ^ buf[k]) * 16777619u;
+  return h ? h : 1;
+}
+
+static void
+_filename(const dt_mipmap_store_t *store, const int level, const char *ext, char *filename, size_t len)
+{
+  snprintf(filename, len, "%s.%d.%s", store->filename, level, ext);
+}
+
+// (re)maps the index file so it has room for at least num_slots slots.
+// expects store->lock to be held, or the store to not be shared yet.
+static int
+_map_index(dt_mipmap_store_level_t *l, uint32_t num_slots)
+{
+  num_slots = (num_slots + DT_MIPMAP_STORE_SLOT_CHUNK-1) & ~(DT_MIPMAP_STORE_SLOT_CHUNK-1);
+  const size_t size = sizeof(dt_mipmap_store_header_t) + (size_t)num_slots * sizeof(dt_mipmap_store_slot_t);
+  struct stat st;
+  if(fstat(l->index_fd, &st)) return 1;
+  // new slots are sparse zeroes, i.e. empty:
+  if(st.st_size < size && ftruncate(l->index_fd, size)) return 1;
+  if(l->header) munmap(l->header, l->mapped_size);
+  l->header = NULL;
+  l->slot = NULL;
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, l->index_fd, 0);
+  if(map == MAP_FAILED) return 1;
+  l->header = (dt_mipmap_store_header_t *)map;
+  l->slot = (dt_mipmap_store_slot_t *)(l->header + 1);
+  l->num_slots = num_slots;
+  l->mapped_size = size;
+  return 0;
+}
+
+static void
+_close_level(dt_mipmap_store_level_t *l)
+{
+  if(l->header)
+  {
+    msync(l->header, l->mapped_size, MS_ASYNC);
+    munmap(l->header, l->mapped_size);
+  }
+  if(l->index_fd >= 0) close(l->index_fd);
+  if(l->data_fd >= 0) close(l->data_fd);
+  memset(l, 0, sizeof(*l));
+  l->index_fd = l->data_fd = -1;
+}
+
+static int
+_open_level(dt_mipmap_store_t *store, const int level, const int32_t compression,
+            const uint32_t max_width, const uint32_t max_height)
+{
+  dt_mipmap_store_level_t *l = store->level + level;
+  char index[DT_MAX_PATH_LEN], data[DT_MAX_PATH_LEN];
+  _filename(store, level, "index", index, sizeof(index));
+  _filename(store, level, "data", data, sizeof(data));
+  l->index_fd = open(index, O_RDWR | O_CREAT, 0644);
+  l->data_fd = open(data, O_RDWR | O_CREAT, 0644);
+  if(l->index_fd < 0 || l->data_fd < 0) goto error;
+
+  struct stat st_index, st_data;
+  if(fstat(l->index_fd, &st_index) || fstat(l->data_fd, &st_data)) goto error;
+  const uint32_t num_slots = st_index.st_size > sizeof(dt_mipmap_store_header_t) ?
+                             (st_index.st_size - sizeof(dt_mipmap_store_header_t)) / sizeof(dt_mipmap_store_slot_t) : 0;
+  if(_map_index(l, num_slots)) goto error;
+
+  dt_mipmap_store_header_t *h = l->header;
+  const int32_t magic = DT_MIPMAP_STORE_MAGIC + DT_MIPMAP_STORE_VERSION;
+  if(h->magic != magic || h->compression != compression ||
+     h->max_width != max_width || h->max_height != max_height)
+  {
+    if(h->magic)
+      dt_print(DT_DEBUG_CACHE, "[mipmap_store] settings changed or file damaged, dropping level %d\n", level);
+    munmap(l->header, l->mapped_size);
+    l->header = NULL;
+    if(ftruncate(l->index_fd, 0) || ftruncate(l->data_fd, 0) || _map_index(l, 0)) goto error;
+    h = l->header;
+    h->magic = magic;
+    h->compression = compression;
+    h->max_width = max_width;
+    h->max_height = max_height;
+    h->data_size = h->live_size = 0;
+  }
+  // space reserved by writes that never finished, the slots don't point there:
+  if(h->data_size > st_data.st_size) h->data_size = st_data.st_size;
+  dt_print(DT_DEBUG_CACHE, "[mipmap_store] level %d: %.2f MB stored, %.2f MB in use\n",
+           level, h->data_size/(1024.0*1024.0), h->live_size/(1024.0*1024.0));
+  return 0;
+
+error:
+  fprintf(stderr, "[mipmap_store] could not open `%s'\n", index);
+  _close_level(l);
+  return 1;
+}
+
+dt_mipmap_store_t *
+dt_mipmap_store_open(const char *filename, const int levels, const int32_t compression,
+                     const uint32_t *max_width, const uint32_t *max_height)
+{
+  if(levels <= 0 || levels > DT_MIPMAP_STORE_MAX_LEVELS) return NULL;
+  dt_mipmap_store_t *store = (dt_mipmap_store_t *)malloc(sizeof(dt_mipmap_store_t));
+  memset(store, 0, sizeof(*store));
+  store->filename = g_strdup(filename);
+  store->levels = levels;
+  for(int k=0; k<DT_MIPMAP_STORE_MAX_LEVELS; k++)
+    store->level[k].index_fd = store->level[k].data_fd = -1;
+  for(int k=0; k<levels; k++)
+  {
+    if(_open_level(store, k, compression, max_width[k], max_height[k]))
+    {
+      for(int i=0; i<k; i++) _close_level(store->level + i);
+      g_free(store->filename);
+      free(store);
+      return NULL;
+    }
+  }
+  dt_pthread_mutex_init(&store->lock, NULL);
+  return store;
+}
+
+// rewrites the data file with only the referenced payloads, in slot order.
+static void
+_compact_level(dt_mipmap_store_t *store, const int level)
+{
+  dt_mipmap_store_level_t *l = store->level + level;
+  dt_mipmap_store_header_t *h = l->header;
+  if(h->data_size - h->live_size < DT_MIPMAP_STORE_COMPACT_MIN || h->data_size < 2*h->live_size) return;
+
+  char data[DT_MAX_PATH_LEN], tmp[DT_MAX_PATH_LEN];
+  _filename(store, level, "data", data, sizeof(data));
+  _filename(store, level, "data.tmp", tmp, sizeof(tmp));
+  const int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) return;
+
+  dt_print(DT_DEBUG_CACHE, "[mipmap_store] compacting level %d from %.2f to %.2f MB\n",
+           level, h->data_size/(1024.0*1024.0), h->live_size/(1024.0*1024.0));
+  uint64_t *offset = (uint64_t *)malloc(sizeof(uint64_t)*l->num_slots);
+  uint8_t *buf = NULL;
+  uint32_t buf_size = 0;
+  uint64_t pos = 0;
+  for(uint32_t k=0; k<l->num_slots; k++)
+  {
+    const dt_mipmap_store_slot_t *s = l->slot + k;
+    if(!s->check) continue;
+    if(s->length > buf_size)
+    {
+      free(buf);
+      buf_size = s->length;
+      buf = (uint8_t *)malloc(buf_size);
+    }
+    if(pread(l->data_fd, buf, s->length, s->offset) != s->length ||
+       pwrite(fd, buf, s->length, pos) != s->length)
+      goto error;
+    offset[k] = pos;
+    pos += s->length;
+  }
+  if(fsync(fd) || g_rename(tmp, data)) goto error;
+
+  // the old file is gone now, point the index at the new one:
+  close(l->data_fd);
+  l->data_fd = fd;
+  for(uint32_t k=0; k<l->num_slots; k++)
+    if(l->slot[k].check) l->slot[k].offset = offset[k];
+  h->data_size = h->live_size = pos;
+  free(offset);
+  free(buf);
+  return;
+
+error:
+  fprintf(stderr, "[mipmap_store] failed to compact level %d\n", level);
+  close(fd);
+  g_unlink(tmp);
+  free(offset);
+  free(buf);
+}
+
+void
+dt_mipmap_store_close(dt_mipmap_store_t *store)
+{
+  if(!store) return;
+  for(int k=0; k<store->levels; k++)
+  {
+    _compact_level(store, k);
+    _close_level(store->level + k);
+  }
+  dt_pthread_mutex_destroy(&store->lock);
+  g_free(store->filename);
+  free(store);
+}
+
+int
+dt_mipmap_store_has(dt_mipmap_store_t *store, const uint32_t imgid, const int level)
+{
+  if(!store || level < 0 || level >= store->levels) return 0;
+  dt_pthread_mutex_lock(&store->lock);
+  const dt_mipmap_store_level_t *l = store->level + level;
+  const int has = imgid < l->num_slots && l->slot[imgid].check;
+  dt_pthread_mutex_unlock(&store->lock);
+  return has;
+}
+
+int
+dt_mipmap_store_read(dt_mipmap_store_t *store, const uint32_t imgid, const int level,
+                     uint8_t *buf, const uint32_t max_length,
+                     uint32_t *length, uint32_t *width, uint32_t *height)
+{
+  if(!store || level < 0 || level >= store->levels) return 1;
+  dt_mipmap_store_level_t *l = store->level + level;
+  dt_mipmap_store_slot_t s;
+  dt_pthread_mutex_lock(&store->lock);
+  if(imgid < l->num_slots) s = l->slot[imgid];
+  else s.check = 0;
+  const int fd = l->data_fd;
+  dt_pthread_mutex_unlock(&store->lock);
+
+  if(!s.check || s.length > max_length) return 1;
+  // payloads are never overwritten while the store is open, no need to hold the lock:
+  if(pread(fd, buf, s.length, s.offset) != s.length || _checksum(buf, s.length) != s.check)
+  {
+    dt_print(DT_DEBUG_CACHE, "[mipmap_store] damaged thumbnail for image %u level %d\n", imgid, level);
+    dt_pthread_mutex_lock(&store->lock);
+    if(imgid < l->num_slots && l->slot[imgid].check == s.check)
+    {
+      l->header->live_size -= s.length;
+      l->slot[imgid].check = 0;
+    }
+    dt_pthread_mutex_unlock(&store->lock);
+    return 1;
+  }
+  *length = s.length;
+  *width = s.width;
+  *height = s.height;
+  return 0;
+}
+
+int
+dt_mipmap_store_write(dt_mipmap_store_t *store, const uint32_t imgid, const int level,
+                      const uint8_t *buf, const uint32_t length,
+                      const uint32_t width, const uint32_t height)
+{
+  if(!store || level < 0 || level >= store->levels || !length) return 1;
+  dt_mipmap_store_level_t *l = store->level + level;
+  const uint32_t check = _checksum(buf, length);
+
+  // reserve space at the end, then write without holding the lock.
+  dt_pthread_mutex_lock(&store->lock);
+  const uint64_t offset = l->header->data_size;
+  l->header->data_size += length;
+  const int fd = l->data_fd;
+  dt_pthread_mutex_unlock(&store->lock);
+
+  if(pwrite(fd, buf, length, offset) != length)
+  {
+    fprintf(stderr, "[mipmap_store] failed to write thumbnail for image %u\n", imgid);
+    return 1;
+  }
+
+  // only now the payload is complete, publish it:
+  dt_pthread_mutex_lock(&store->lock);
+  if(imgid >= l->num_slots && _map_index(l, imgid+1))
+  {
+    dt_pthread_mutex_unlock(&store->lock);
+    fprintf(stderr, "[mipmap_store] failed to grow the index for image %u\n", imgid);
+    return 1;
+  }
+  dt_mipmap_store_slot_t *s = l->slot + imgid;
+  if(s->check) l->header->live_size -= s->length;
+  s->check = 0;
+  s->offset = offset;
+  s->length = length;
+  s->width = width;
+  s->height = height;
+  // the checksum marks the slot valid, make sure it is stored last:
+  __sync_synchronize();
+  s->check = check;
+  l->header->live_size += length;
+  dt_pthread_mutex_unlock(&store->lock);
+  return 0;
+}
+
+void
+dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t imgid)
+{
+  if(!store) return;
+  dt_pthread_mutex_lock(&store->lock);
+  for(int k=0; k<store->levels; k++)
+  {
+    dt_mipmap_store_level_t *l = store->level + k;
+    if(imgid >= l->num_slots || !l->slot[imgid].check) continue;
+    l->header->live_size -= l->slot[imgid].length;
+    l->slot[imgid].check = 0;
+  }
+  dt_pthread_mutex_unlock(&store->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,87 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_MIPMAP_STORE_H
+#define DT_MIPMAP_STORE_H
+
+#include "common/dtpthread.h"
+#include <inttypes.h>
+#include <stddef.h>
+
+#define DT_MIPMAP_STORE_MAX_LEVELS 4
+
+struct dt_mipmap_store_header_t;
+struct dt_mipmap_store_slot_t;
+
+typedef struct dt_mipmap_store_level_t
+{
+  int data_fd, index_fd;
+  // mapped index file: a header followed by one slot per image id
+  struct dt_mipmap_store_header_t *header;
+  struct dt_mipmap_store_slot_t *slot;
+  uint32_t num_slots;
+  size_t mapped_size;
+}
+dt_mipmap_store_level_t;
+
+/**
+ * on-disk backing of the small thumbnail levels of the mipmap cache.
+ * every level has an append-only data file and a memory mapped index with a fixed
+ * size slot per image id, so opening the store does not depend on the number of
+ * thumbnails in it and a lookup is one array access. thumbnails are appended as soon
+ * as they are generated and read back on the first miss in memory. a slot is only
+ * filled after its payload has been written and carries a checksum of it, so a crash
+ * loses at most the thumbnails which were being written.
+ */
+typedef struct dt_mipmap_store_t
+{
+  dt_pthread_mutex_t lock;
+  char *filename;
+  int levels;
+  dt_mipmap_store_level_t level[DT_MIPMAP_STORE_MAX_LEVELS];
+}
+dt_mipmap_store_t;
+
+/** opens (or creates) the files filename.<level>.{index,data}. levels stored with a different
+ *  compression or size are dropped. returns NULL if the store can't be used. */
+dt_mipmap_store_t *dt_mipmap_store_open(const char *filename, const int levels, const int32_t compression,
+                                        const uint32_t *max_width, const uint32_t *max_height);
+
+/** unmaps the index and compacts data files which are mostly garbage. */
+void dt_mipmap_store_close(dt_mipmap_store_t *store);
+
+/** non-zero if a thumbnail for this image and level is stored. */
+int dt_mipmap_store_has(dt_mipmap_store_t *store, const uint32_t imgid, const int level);
+
+/** reads a stored thumbnail into buf (at most max_length bytes). returns non-zero if there is
+ *  none, or if it is damaged. */
+int dt_mipmap_store_read(dt_mipmap_store_t *store, const uint32_t imgid, const int level,
+                         uint8_t *buf, const uint32_t max_length,
+                         uint32_t *length, uint32_t *width, uint32_t *height);
+
+/** appends a thumbnail and points the index at it. returns non-zero on failure. */
+int dt_mipmap_store_write(dt_mipmap_store_t *store, const uint32_t imgid, const int level,
+                          const uint8_t *buf, const uint32_t length,
+                          const uint32_t width, const uint32_t height);
+
+/** forgets all levels of the image, for example after its history changed. */
+void dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t imgid);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -25,6 +25,7 @@
 #include "common/dlopencl.h"
 #include "common/nvidia_gpus.h"
 #include "control/conf.h"
+#include "control/control.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -32,14 +33,156 @@
 
 #include <sys/stat.h>
 #include <errno.h>
-#include <libgen.h>
 #include <ctype.h>
 
 #define max(a,b) ((a) > (b) ? (a) : (b))
 
+static int32_t _opencl_build_programs_job_run(dt_job_t *job);
+
+/* reads the list of programs from programs.conf, their position in there is their number. */
+static int _opencl_read_programs(dt_opencl_t *cl)
+{
+  char dtpath[DT_MAX_PATH_LEN];
+  char filename[DT_MAX_PATH_LEN];
+  char programname[DT_MAX_PATH_LEN];
+  dt_loc_get_datadir(dtpath, DT_MAX_PATH_LEN);
+  snprintf(filename, DT_MAX_PATH_LEN, "%s/kernels/programs.conf", dtpath);
+  FILE *f = fopen(filename, "rb");
+  if(!f)
+  {
+    dt_print(DT_DEBUG_OPENCL, "[opencl_init] could not open `%s'!\n", filename);
+    return 1;
+  }
+  while(!feof(f))
+  {
+    int rd = fscanf(f, "%[^\n]\n", programname);
+    if(rd != 1) continue;
+    // remove comments:
+    for(int pos=0; pos<strlen(programname); pos++)
+      if(programname[pos] == '#')
+      {
+        programname[pos] = '\0';
+        for(int l=pos-1; l>=0; l--)
+        {
+          if (programname[l] == ' ')
+            programname[l] = '\0';
+          else
+            break;
+        }
+        break;
+      }
+    if(programname[0] == '\0') continue;
+    if(cl->num_programs >= DT_OPENCL_MAX_PROGRAMS)
+    {
+      dt_print(DT_DEBUG_OPENCL, "[opencl_init] too many programs! can't add `%s'\n", programname);
+      break;
+    }
+    cl->program_name[cl->num_programs++] = g_strdup(programname);
+  }
+  fclose(f);
+  return 0;
+}
+
+/* the index of the binary cache has one line per device and program: md5sum device program */
+static void _opencl_cache_index_read(dt_opencl_t *cl)
+{
+  cl->cache_index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  char filename[DT_MAX_PATH_LEN];
+  snprintf(filename, DT_MAX_PATH_LEN, "%s/index", cl->cachedir);
+  FILE *f = fopen(filename, "rb");
+  if(!f) return;
+  char md5sum[33], device[1024], program[DT_MAX_PATH_LEN];
+  while(fscanf(f, "%32s %1023s %1023s\n", md5sum, device, program) == 3)
+    g_hash_table_insert(cl->cache_index, g_strdup_printf("%s/%s", device, program), g_strdup(md5sum));
+  fclose(f);
+}
+
+static void _opencl_cache_index_write_entry(gpointer key, gpointer value, gpointer data)
+{
+  // key is device/program, and neither contains a blank
+  gchar *entry = g_strdup((const gchar *)key);
+  char *slash = strchr(entry, '/');
+  if(slash) *slash = ' ';
+  fprintf((FILE *)data, "%s %s\n", (const char *)value, entry);
+  g_free(entry);
+}
+
+static void _opencl_cache_index_write(dt_opencl_t *cl)
+{
+  char filename[DT_MAX_PATH_LEN], tmpname[DT_MAX_PATH_LEN];
+  snprintf(filename, DT_MAX_PATH_LEN, "%s/index", cl->cachedir);
+  snprintf(tmpname, DT_MAX_PATH_LEN, "%s/index.tmp", cl->cachedir);
+  FILE *f = fopen(tmpname, "wb");
+  if(!f) return;
+  g_hash_table_foreach(cl->cache_index, _opencl_cache_index_write_entry, f);
+  fclose(f);
+  // other instances of darktable only ever see a complete index
+  rename(tmpname, filename);
+}
+
+static gboolean _opencl_cache_index_find_md5(gpointer key, gpointer value, gpointer data)
+{
+  return !strcmp((const char *)value, (const char *)data);
+}
+
+/* records md5sum as the binary of program on dev, and deletes the binary it replaces if nothing else uses it. */
+static void _opencl_cache_index_update(dt_opencl_t *cl, const int dev, const int prog, const char *md5sum)
+{
+  dt_pthread_mutex_lock(&cl->cache_lock);
+  gchar *key = g_strdup_printf("%s/%s", cl->dev[dev].name, cl->program_name[prog]);
+  gchar *old = g_strdup((const gchar *)g_hash_table_lookup(cl->cache_index, key));
+  g_hash_table_insert(cl->cache_index, key, g_strdup(md5sum));
+  if(old && strcmp(old, md5sum) && !g_hash_table_find(cl->cache_index, _opencl_cache_index_find_md5, old))
+  {
+    char binname[DT_MAX_PATH_LEN];
+    snprintf(binname, DT_MAX_PATH_LEN, "%s/%s.bin", cl->cachedir, old);
+    unlink(binname);
+  }
+  g_free(old);
+  _opencl_cache_index_write(cl);
+  dt_pthread_mutex_unlock(&cl->cache_lock);
+}
+
+/* deletes the per-device binary caches of earlier versions, everything lives in cached_kernels now. */
+static void _opencl_remove_old_caches(const char *dtcache)
+{
+  GDir *dir = g_dir_open(dtcache, 0, NULL);
+  if(!dir) return;
+  const gchar *d_name;
+  while((d_name = g_dir_read_name(dir)))
+  {
+    if(strncmp(d_name, "cached_kernels_for_", strlen("cached_kernels_for_"))) continue;
+    gchar *path = g_build_filename(dtcache, d_name, NULL);
+    GDir *old = g_dir_open(path, 0, NULL);
+    if(old)
+    {
+      // only md5sums and symlinks to the binaries in there
+      const gchar *f_name;
+      while((f_name = g_dir_read_name(old)))
+      {
+        gchar *file = g_build_filename(path, f_name, NULL);
+        unlink(file);
+        g_free(file);
+      }
+      g_dir_close(old);
+      if(rmdir(path))
+        dt_print(DT_DEBUG_OPENCL, "[opencl_init] could not remove old kernel cache `%s'\n", path);
+    }
+    g_free(path);
+  }
+  g_dir_close(dir);
+}
+
+static void _opencl_build_options(const int dev, char *options, const size_t len)
+{
+  snprintf(options, len, "-cl-fast-relaxed-math -cl-strict-aliasing%s", darktable.opencl->dev[dev].nvidia_sm_20 ? " -DNVIDIA_SM_20=1" : "");
+}
+
 void dt_opencl_init(dt_opencl_t *cl, const int argc, char *argv[])
 {
   dt_pthread_mutex_init(&cl->lock, NULL);
+  dt_pthread_mutex_init(&cl->cache_lock, NULL);
+  pthread_cond_init(&cl->built, NULL);
   cl->inited = 0;
   cl->enabled = 0;
   cl->dlocl = NULL;
@@ -128,10 +271,28 @@ void dt_opencl_init(dt_opencl_t *cl, const int argc, char *argv[])
   dt_print(DT_DEBUG_OPENCL, "[opencl_init] found %d device%s\n", num_devices, num_devices > 1 ? "s" : "");
   if(num_devices == 0) goto finally;
 
+  // only look up which programs there are. they are built when a kernel of theirs is first used,
+  // or by a background job, so startup doesn't wait for the compiler.
+  if(_opencl_read_programs(cl))
+    goto finally;
+
+  char dtcache[DT_MAX_PATH_LEN];
+  dt_loc_get_user_cache_dir(dtcache, DT_MAX_PATH_LEN);
+  cl->cachedir = g_strdup_printf("%s/cached_kernels", dtcache);
+  if (mkdir(cl->cachedir, 0700) && (errno != EEXIST))
+  {
+    dt_print(DT_DEBUG_OPENCL, "[opencl_init] failed to create directory `%s'!\n", cl->cachedir);
+    goto finally;
+  }
+  _opencl_remove_old_caches(dtcache);
+  _opencl_cache_index_read(cl);
+
   int dev = 0;
   for(int k=0; k<num_devices; k++)
   {
     memset(cl->dev[dev].program_used, 0x0, sizeof(int)*DT_OPENCL_MAX_PROGRAMS);
+    memset(cl->dev[dev].program_state, 0x0, sizeof(int)*DT_OPENCL_MAX_PROGRAMS);
+    memset(cl->dev[dev].kernel, 0x0, sizeof(cl_kernel)*DT_OPENCL_MAX_KERNELS);
     memset(cl->dev[dev].kernel_used,  0x0, sizeof(int)*DT_OPENCL_MAX_KERNELS);
     cl->dev[dev].eventlist = NULL;
     cl->dev[dev].eventtags = NULL;
@@ -219,81 +380,14 @@ void dt_opencl_init(dt_opencl_t *cl, const int argc, char *argv[])
       goto finally;
     }
 
-    char dtcache[DT_MAX_PATH_LEN];
-    char cachedir[DT_MAX_PATH_LEN];
     char devname[1024];
-    double tstart, tend, tdiff;
-    dt_loc_get_user_cache_dir(dtcache, DT_MAX_PATH_LEN);
-
     int len = strlen(infostr);
     int j=0;
     // remove non-alphanumeric chars from device name
     for (int i=0; i < len; i++) if (isalnum(infostr[i])) devname[j++]=infostr[i];
     devname[j] = 0;
-    snprintf(cachedir, DT_MAX_PATH_LEN, "%s/cached_kernels_for_%s", dtcache, devname);
-    if (mkdir(cachedir, 0700) && (errno != EEXIST))
-    {
-      dt_print(DT_DEBUG_OPENCL, "[opencl_init] failed to create directory `%s'!\n", cachedir);
-      goto finally;
-    }
+    cl->dev[dev].name = g_strdup(devname);
 
-    char dtpath[DT_MAX_PATH_LEN];
-    char filename[DT_MAX_PATH_LEN];
-    char programname[DT_MAX_PATH_LEN];
-    char binname[DT_MAX_PATH_LEN];
-    dt_loc_get_datadir(dtpath, DT_MAX_PATH_LEN);
-    snprintf(filename, DT_MAX_PATH_LEN, "%s/kernels/programs.conf", dtpath);
-
-    // now load all darktable cl kernels.
-    // TODO: compile as a job?
-    tstart = dt_get_wtime();
-    FILE *f = fopen(filename, "rb");
-    if(f)
-    {
-
-      while(!feof(f))
-      {
-        int rd = fscanf(f, "%[^\n]\n", programname);
-        if(rd != 1) continue;
-        // remove comments:
-        for(int pos=0; pos<strlen(programname); pos++)
-          if(programname[pos] == '#')
-          {
-            programname[pos] = '\0';
-            for(int l=pos-1; l>=0; l--)
-            {
-              if (programname[l] == ' ')
-                programname[l] = '\0';
-              else
-                break;
-            }
-            break;
-          }
-        if(programname[0] == '\0') continue;
-        snprintf(filename, DT_MAX_PATH_LEN, "%s/kernels/%s", dtpath, programname);
-        snprintf(binname, DT_MAX_PATH_LEN, "%s/%s.bin", cachedir, programname);
-        dt_print(DT_DEBUG_OPENCL, "[opencl_init] compiling program `%s' ..\n", programname);
-        int loaded_cached;
-        char md5sum[33];
-        const int prog = dt_opencl_load_program(dev, filename, binname, cachedir, md5sum, &loaded_cached);
-        if(dt_opencl_build_program(dev, prog, binname, cachedir, md5sum, loaded_cached) != CL_SUCCESS)
-        {
-          dt_print(DT_DEBUG_OPENCL, "[opencl_init] failed to compile program `%s'!\n", programname);
-          goto finally;
-        }
-
-      }
-
-      fclose(f);
-      tend = dt_get_wtime();
-      tdiff = tend - tstart;
-      dt_print(DT_DEBUG_OPENCL, "[opencl_init] kernel loading time: %2.4lf \n", tdiff);
-    }
-    else
-    {
-      dt_print(DT_DEBUG_OPENCL, "[opencl_init] could not open `%s'!\n", filename);
-      goto finally;
-    }
     ++dev;
   }
   free(devices);
@@ -316,6 +410,14 @@ finally:
   {
     cl->bilateral = dt_bilateral_init_cl_global();
     cl->gaussian = dt_gaussian_init_cl_global();
+    // have the programs built while the user is still looking at the lighttable.
+    if(cl->enabled && dt_control_running())
+    {
+      dt_job_t job;
+      dt_control_job_init(&job, "build opencl programs");
+      job.execute = &_opencl_build_programs_job_run;
+      dt_control_add_job(darktable.control, &job);
+    }
   }
   return;
 }
@@ -329,15 +431,20 @@ void dt_opencl_cleanup(dt_opencl_t *cl)
     for(int i=0; i<cl->num_devs; i++)
     {
       dt_pthread_mutex_destroy(&cl->dev[i].lock);
-      for(int k=0; k<DT_OPENCL_MAX_KERNELS; k++) if(cl->dev[i].kernel_used [k]) (cl->dlocl->symbols->dt_clReleaseKernel) (cl->dev[i].kernel [k]);
+      for(int k=0; k<DT_OPENCL_MAX_KERNELS; k++) if(cl->dev[i].kernel [k]) (cl->dlocl->symbols->dt_clReleaseKernel) (cl->dev[i].kernel [k]);
       for(int k=0; k<DT_OPENCL_MAX_PROGRAMS; k++) if(cl->dev[i].program_used[k]) (cl->dlocl->symbols->dt_clReleaseProgram)(cl->dev[i].program[k]);
       (cl->dlocl->symbols->dt_clReleaseCommandQueue)(cl->dev[i].cmd_queue);
       (cl->dlocl->symbols->dt_clReleaseContext)(cl->dev[i].context);
       dt_opencl_events_reset(i);
       if(cl->dev[i].eventlist) free(cl->dev[i].eventlist);
       if(cl->dev[i].eventtags) free(cl->dev[i].eventtags);
+      g_free(cl->dev[i].name);
     }
+    for(int k=0; k<DT_OPENCL_MAX_KERNELS; k++) g_free(cl->kernel_name[k]);
   }
+  for(int k=0; k<cl->num_programs; k++) g_free(cl->program_name[k]);
+  if(cl->cache_index) g_hash_table_destroy(cl->cache_index);
+  g_free(cl->cachedir);
 
   if(cl->dlocl)
   {
@@ -345,6 +452,8 @@ void dt_opencl_cleanup(dt_opencl_t *cl)
     free(cl->dlocl);
   }
 
+  pthread_cond_destroy(&cl->built);
+  dt_pthread_mutex_destroy(&cl->cache_lock);
   dt_pthread_mutex_destroy(&cl->lock);
 }
 
@@ -413,20 +522,19 @@ static FILE* fopen_stat(const char* filename, struct stat* st)
 }
 
 
-int dt_opencl_load_program(const int dev, const char *filename, const char* binname, const char* cachedir, char* md5sum, int* loaded_cached)
+int dt_opencl_load_program(const int dev, const int prog, const char *filename, char* md5sum, int* loaded_cached)
 {
   cl_int err;
   dt_opencl_t *cl = darktable.opencl;
-
   struct stat filestat, cachedstat;
   *loaded_cached = 0;
-  int k = 0;
+  if(prog < 0 || prog >= DT_OPENCL_MAX_PROGRAMS) return -1;
 
   FILE* f = fopen_stat(filename, &filestat);
   if (!f) return -1;
 
   size_t filesize = filestat.st_size;
-  char* file = (char*)malloc(filesize+1024);
+  char* file = (char*)malloc(filesize+4096);
   size_t rd = fread(file, sizeof(char), filesize, f);
   fclose(f);
   if(rd != filesize)
@@ -436,8 +544,10 @@ int dt_opencl_load_program(const int dev, const char *filename, const char* binn
     return -1;
   }
 
+  // the binary is keyed by the source, the device, its driver and the build options
   char *start = file + filesize;
-  char *end = start + 1024;
+  // leave room for the build options at the end
+  char *end = start + 4096 - 256;
   size_t len;
 
   cl_device_id devid = cl->dev[dev].devid;
@@ -450,92 +560,56 @@ int dt_opencl_load_program(const int dev, const char *filename, const char* binn
   (cl->dlocl->symbols->dt_clGetPlatformInfo)(platform, CL_PLATFORM_VERSION, end-start, start, &len);
   start += len;
 
+  g_strlcpy(start, cl->dev[dev].name, end-start);
+  start += strlen(start);
+  _opencl_build_options(dev, start, 256);
+  start += strlen(start);
+
   char *source_md5 = g_compute_checksum_for_data(G_CHECKSUM_MD5, (guchar *)file, start-file);
   strncpy(md5sum, source_md5, 33);
   g_free(source_md5);
 
   file[filesize] = '\0';
 
-  char linkedfile[1024];
-  ssize_t linkedfile_len = 0;
-
-  FILE *cached = fopen_stat(binname, &cachedstat);
-  if (cached)
+  char binname[DT_MAX_PATH_LEN];
+  snprintf(binname, DT_MAX_PATH_LEN, "%s/%s.bin", cl->cachedir, md5sum);
+  FILE *cached = fopen(binname, "rb");
+  if (cached && !fstat(fileno(cached), &cachedstat))
   {
+    // same key, load cached binary
+    size_t cached_filesize = cachedstat.st_size;
 
-    if ((linkedfile_len=readlink(binname, linkedfile, 1023)) > 0)
+    unsigned char *cached_content = (unsigned char *)malloc(cached_filesize+1);
+    int rd = fread(cached_content, sizeof(char), cached_filesize, cached);
+    if (rd != cached_filesize)
     {
-      linkedfile[linkedfile_len] = '\0';
-
-      if (strncmp(linkedfile, md5sum, 33)==0)
-      {
-        // md5sum matches, load cached binary
-        size_t cached_filesize = cachedstat.st_size;
-
-        unsigned char *cached_content = (unsigned char *)malloc(cached_filesize+1);
-        int rd = fread(cached_content, sizeof(char), cached_filesize, cached);
-        if (rd != cached_filesize)
-        {
-          dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] could not read all of file `%s'!\n", binname);
-        }
-        else
-        {
-          for(k = 0; k<DT_OPENCL_MAX_PROGRAMS; k++) if(!cl->dev[dev].program_used[k])
-            {
-              cl->dev[dev].program[k] = (cl->dlocl->symbols->dt_clCreateProgramWithBinary)(cl->dev[dev].context, 1, &(cl->dev[dev].devid), &cached_filesize, (const unsigned char **)&cached_content, NULL, &err);
-              if(err != CL_SUCCESS)
-              {
-                dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] could not load cached binary program from file `%s'! (%d)\n", binname, err);
-                break;
-              }
-              else
-              {
-                cl->dev[dev].program_used[k] = 1;
-                *loaded_cached = 1;
-                break;
-              }
-            }
-        }
-        free(cached_content);
-      }
-
+      dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] could not read all of file `%s'!\n", binname);
     }
-
-    fclose(cached);
+    else
+    {
+      cl->dev[dev].program[prog] = (cl->dlocl->symbols->dt_clCreateProgramWithBinary)(cl->dev[dev].context, 1, &(cl->dev[dev].devid), &cached_filesize, (const unsigned char **)&cached_content, NULL, &err);
+      if(err != CL_SUCCESS)
+        dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] could not load cached binary program from file `%s'! (%d)\n", binname, err);
+      else
+        *loaded_cached = 1;
+    }
+    free(cached_content);
   }
-
+  if(cached) fclose(cached);
 
   if (*loaded_cached == 0)
   {
-    // if loading cached was unsuccessful for whatever reason,
-    // try to remove cached binary & link
-    if (linkedfile_len>0)
-    {
-      char link_dest[1024];
-      snprintf(link_dest, 1024, "%s/%s", cachedir, linkedfile);
-      unlink(link_dest);
-    }
+    // if loading cached was unsuccessful for whatever reason, try to remove the cached binary
     unlink(binname);
 
-    if (k != DT_OPENCL_MAX_PROGRAMS)
-    {
-      dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] could not load cached binary program, trying to compile source\n");
+    dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] could not load cached binary program, trying to compile source\n");
 
-      for(k=0; k<DT_OPENCL_MAX_PROGRAMS; k++) if(!cl->dev[dev].program_used[k])
-        {
-          cl->dev[dev].program[k] = (cl->dlocl->symbols->dt_clCreateProgramWithSource)(cl->dev[dev].context, 1, (const char**)&file, &filesize, &err);
-          free(file);
-          if(err != CL_SUCCESS)
-          {
-            dt_print(DT_DEBUG_OPENCL, "[opencl_load_source] could not create program from file `%s'! (%d)\n", filename, err);
-            return -1;
-          }
-          else
-          {
-            cl->dev[dev].program_used[k] = 1;
-            break;
-          }
-        }
+    cl->dev[dev].program[prog] = (cl->dlocl->symbols->dt_clCreateProgramWithSource)(cl->dev[dev].context, 1, (const char**)&file, &filesize, &err);
+    free(file);
+    if(err != CL_SUCCESS)
+    {
+      dt_print(DT_DEBUG_OPENCL, "[opencl_load_source] could not create program from file `%s'! (%d)\n", filename, err);
+      return -1;
     }
   }
   else
@@ -544,27 +618,19 @@ int dt_opencl_load_program(const int dev, const char *filename, const char* binn
     dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] loaded cached binary program from file `%s'\n", binname);
   }
 
-
-  if(k < DT_OPENCL_MAX_PROGRAMS)
-  {
-    dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] successfully loaded program from `%s'\n", filename);
-    return k;
-  }
-  else
-  {
-    dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] too many programs! can't load `%s'\n", filename);
-    return -1;
-  }
+  cl->dev[dev].program_used[prog] = 1;
+  dt_print(DT_DEBUG_OPENCL, "[opencl_load_program] successfully loaded program from `%s'\n", filename);
+  return prog;
 }
 
-int dt_opencl_build_program(const int dev, const int prog, const char* binname, const char* cachedir, char* md5sum, int loaded_cached)
+int dt_opencl_build_program(const int dev, const int prog, const char* md5sum, int loaded_cached)
 {
   if(prog < 0 || prog >= DT_OPENCL_MAX_PROGRAMS) return -1;
   dt_opencl_t *cl = darktable.opencl;
   cl_program program = cl->dev[dev].program[prog];
   cl_int err;
   char options[256];
-  snprintf(options, 256, "-cl-fast-relaxed-math -cl-strict-aliasing%s", cl->dev[dev].nvidia_sm_20 ? " -DNVIDIA_SM_20=1" : "");
+  _opencl_build_options(dev, options, sizeof(options));
   err = (cl->dlocl->symbols->dt_clBuildProgram)(program, 1, &cl->dev[dev].devid, options, 0, 0);
   if(err != CL_SUCCESS)
   {
@@ -631,24 +697,22 @@ int dt_opencl_build_program(const int dev, const int prog, const char* binname,
       for (int i=0; i<numdev; i++)
         if (cl->dev[dev].devid == devices[i])
         {
-          // save opencl compiled binary as md5sum-named file
-          char link_dest[1024];
-          snprintf(link_dest, 1024, "%s/%s", cachedir, md5sum);
-          FILE* f = fopen(link_dest, "w+");
+          // save opencl compiled binary as md5sum-named file (e.g. f1430102c53867c162bb60af6c163328.bin),
+          // renamed into place only once it is complete.
+          char binname[DT_MAX_PATH_LEN], tmpname[DT_MAX_PATH_LEN];
+          snprintf(binname, DT_MAX_PATH_LEN, "%s/%s.bin", cl->cachedir, md5sum);
+          // devices can build at the same time, and identical ones share the binary
+          snprintf(tmpname, DT_MAX_PATH_LEN, "%s/%s.%d.tmp", cl->cachedir, md5sum, dev);
+          FILE* f = fopen(tmpname, "wb");
           if(!f) goto ret;
           size_t bytes_written = fwrite(binaries[i], sizeof(char), binary_sizes[i], f);
-          if(bytes_written != binary_sizes[i]) goto ret;
           fclose(f);
-
-          // create link (e.g. basic.cl.bin -> f1430102c53867c162bb60af6c163328)
-          char cwd[1024];
-          if (!getcwd(cwd, 1024)) goto ret;
-          if (chdir(cachedir)!=0) goto ret;
-          char dup[1024];
-          strncpy(dup, binname, 1024);
-          char* bname = basename(dup);
-          if (symlink(md5sum, bname)!=0) goto ret;
-          if (chdir(cwd)!=0) goto ret;
+          if(bytes_written != binary_sizes[i] || rename(tmpname, binname))
+          {
+            unlink(tmpname);
+            goto ret;
+          }
+          _opencl_cache_index_update(cl, dev, prog, md5sum);
         }
 
 ret:
@@ -658,43 +722,134 @@ ret:
   }
 }
 
-int dt_opencl_create_kernel(const int prog, const char *name)
+/* loads and builds program prog on dev unless that happened already, or waits for whoever is building it.
+ * call without cl->lock held, it is only taken to claim and publish the program, not during the compile. */
+static int _opencl_build_lazy(const int dev, const int prog)
 {
   dt_opencl_t *cl = darktable.opencl;
-  if(!cl->inited) return -1;
-  if(prog < 0 || prog >= DT_OPENCL_MAX_PROGRAMS) return -1;
   dt_pthread_mutex_lock(&cl->lock);
-  int k = 0;
-  for(int dev=0; dev<cl->num_devs; dev++)
+  while(cl->dev[dev].program_state[prog] == DT_OPENCL_PROGRAM_BUILDING)
+    dt_pthread_cond_wait(&cl->built, &cl->lock);
+  const int state = cl->dev[dev].program_state[prog];
+  if(state == DT_OPENCL_PROGRAM_NONE) cl->dev[dev].program_state[prog] = DT_OPENCL_PROGRAM_BUILDING;
+  dt_pthread_mutex_unlock(&cl->lock);
+  if(state == DT_OPENCL_PROGRAM_READY) return CL_SUCCESS;
+  // don't try again for every kernel of it, the modules fall back to the cpu.
+  if(state == DT_OPENCL_PROGRAM_FAILED) return -1;
+
+  // this thread owns program[prog] on dev until it publishes the new state.
+  char dtpath[DT_MAX_PATH_LEN];
+  char filename[DT_MAX_PATH_LEN];
+  dt_loc_get_datadir(dtpath, DT_MAX_PATH_LEN);
+  snprintf(filename, DT_MAX_PATH_LEN, "%s/kernels/%s", dtpath, cl->program_name[prog]);
+  dt_print(DT_DEBUG_OPENCL, "[opencl_build_lazy] compiling program `%s' for device %d ..\n", cl->program_name[prog], dev);
+
+  const double start = dt_get_wtime();
+  int loaded_cached;
+  char md5sum[33];
+  int err = -1;
+  if(dt_opencl_load_program(dev, prog, filename, md5sum, &loaded_cached) == prog)
+  {
+    err = dt_opencl_build_program(dev, prog, md5sum, loaded_cached);
+    if(err != CL_SUCCESS)
+    {
+      (cl->dlocl->symbols->dt_clReleaseProgram)(cl->dev[dev].program[prog]);
+      cl->dev[dev].program_used[prog] = 0;
+    }
+  }
+  if(err != CL_SUCCESS)
+    dt_print(DT_DEBUG_OPENCL, "[opencl_build_lazy] failed to compile program `%s'!\n", cl->program_name[prog]);
+  else
+    dt_print(DT_DEBUG_OPENCL, "[opencl_build_lazy] program `%s' ready after %.3f secs\n", cl->program_name[prog], dt_get_wtime() - start);
+
+  dt_pthread_mutex_lock(&cl->lock);
+  cl->dev[dev].program_state[prog] = (err == CL_SUCCESS) ? DT_OPENCL_PROGRAM_READY : DT_OPENCL_PROGRAM_FAILED;
+  pthread_cond_broadcast(&cl->built);
+  dt_pthread_mutex_unlock(&cl->lock);
+  return err;
+}
+
+/* returns the kernel on dev, building its program and creating it on first use. NULL if that fails. */
+static cl_kernel _opencl_get_kernel(const int dev, const int kernel)
+{
+  dt_opencl_t *cl = darktable.opencl;
+  if(dev < 0 || dev >= cl->num_devs || kernel < 0 || kernel >= DT_OPENCL_MAX_KERNELS) return NULL;
+  // once there, a kernel stays until it is freed. pairs with the release store below.
+  cl_kernel k = __atomic_load_n(&cl->dev[dev].kernel[kernel], __ATOMIC_ACQUIRE);
+  if(k) return k;
+
+  dt_pthread_mutex_lock(&cl->lock);
+  const int used = cl->dev[dev].kernel_used[kernel];
+  const int prog = cl->kernel_program[kernel];
+  dt_pthread_mutex_unlock(&cl->lock);
+  if(!used || _opencl_build_lazy(dev, prog) != CL_SUCCESS) return NULL;
+
+  dt_pthread_mutex_lock(&cl->lock);
+  k = cl->dev[dev].kernel[kernel];
+  // the slot may have been freed or created by someone else in the meantime
+  if(!k && cl->dev[dev].kernel_used[kernel] && cl->kernel_program[kernel] == prog)
   {
     cl_int err;
-    for(; k<DT_OPENCL_MAX_KERNELS; k++) if(!cl->dev[dev].kernel_used[k])
-      {
-        cl->dev[dev].kernel_used[k] = 1;
-        cl->dev[dev].kernel[k] = (cl->dlocl->symbols->dt_clCreateKernel)(cl->dev[dev].program[prog], name, &err);
-        if(err != CL_SUCCESS)
-        {
-          dt_print(DT_DEBUG_OPENCL, "[opencl_create_kernel] could not create kernel `%s'! (%d)\n", name, err);
-          cl->dev[dev].kernel_used[k] = 0;
-          goto error;
-        }
-        else break;
-      }
-    if(k < DT_OPENCL_MAX_KERNELS)
+    k = (cl->dlocl->symbols->dt_clCreateKernel)(cl->dev[dev].program[prog], cl->kernel_name[kernel], &err);
+    if(err != CL_SUCCESS)
     {
-      dt_print(DT_DEBUG_OPENCL, "[opencl_create_kernel] successfully loaded kernel `%s' (%d) for device %d\n", name, k, dev);
+      dt_print(DT_DEBUG_OPENCL, "[opencl_get_kernel] could not create kernel `%s'! (%d)\n", cl->kernel_name[kernel], err);
+      k = NULL;
     }
     else
     {
-      dt_print(DT_DEBUG_OPENCL, "[opencl_create_kernel] too many kernels! can't create kernel `%s'\n", name);
-      goto error;
+      __atomic_store_n(&cl->dev[dev].kernel[kernel], k, __ATOMIC_RELEASE);
+      dt_print(DT_DEBUG_OPENCL, "[opencl_get_kernel] successfully created kernel `%s' (%d) for device %d\n", cl->kernel_name[kernel], kernel, dev);
     }
   }
   dt_pthread_mutex_unlock(&cl->lock);
   return k;
-error:
+}
+
+/* builds all programs which are not built yet, so nothing has to wait for the compiler later on.
+ * holds no lock while compiling, so modules can still reserve and use their kernels meanwhile. */
+static int32_t _opencl_build_programs_job_run(dt_job_t *job)
+{
+  dt_opencl_t *cl = darktable.opencl;
+  const double start = dt_get_wtime();
+  for(int dev=0; dev<cl->num_devs; dev++)
+    for(int prog=0; prog<cl->num_programs; prog++)
+    {
+      // give up early when darktable is shutting down
+      if(!dt_control_running()) return 0;
+      _opencl_build_lazy(dev, prog);
+    }
+  dt_print(DT_DEBUG_OPENCL, "[opencl_build_programs] kernel loading time: %2.4lf\n", dt_get_wtime() - start);
+  return 0;
+}
+
+int dt_opencl_create_kernel(const int prog, const char *name)
+{
+  dt_opencl_t *cl = darktable.opencl;
+  if(!cl->inited) return -1;
+  if(prog < 0 || prog >= cl->num_programs) return -1;
+  dt_pthread_mutex_lock(&cl->lock);
+  // only take the slot, the kernel is created on first use.
+  int k = 0;
+  for(; k<DT_OPENCL_MAX_KERNELS; k++) if(!cl->kernel_name[k]) break;
+  if(k < DT_OPENCL_MAX_KERNELS)
+  {
+    cl->kernel_name[k] = g_strdup(name);
+    cl->kernel_program[k] = prog;
+    for(int dev=0; dev<cl->num_devs; dev++)
+    {
+      cl->dev[dev].kernel_used[k] = 1;
+      __atomic_store_n(&cl->dev[dev].kernel[k], NULL, __ATOMIC_RELEASE);
+    }
+    dt_print(DT_DEBUG_OPENCL, "[opencl_create_kernel] reserved kernel `%s' (%d) of program `%s'\n", name, k, cl->program_name[prog]);
+  }
+  else
+  {
+    dt_print(DT_DEBUG_OPENCL, "[opencl_create_kernel] too many kernels! can't create kernel `%s'\n", name);
+    k = -1;
+  }
   dt_pthread_mutex_unlock(&cl->lock);
-  return -1;
+  return k;
 }
 
 void dt_opencl_free_kernel(const int kernel)
@@ -706,8 +861,12 @@ void dt_opencl_free_kernel(const int kernel)
   for(int dev=0; dev<cl->num_devs; dev++)
   {
     cl->dev[dev].kernel_used [kernel] = 0;
-    (cl->dlocl->symbols->dt_clReleaseKernel) (cl->dev[dev].kernel [kernel]);
+    cl_kernel k = cl->dev[dev].kernel[kernel];
+    __atomic_store_n(&cl->dev[dev].kernel[kernel], NULL, __ATOMIC_RELEASE);
+    if(k) (cl->dlocl->symbols->dt_clReleaseKernel) (k);
   }
+  g_free(cl->kernel_name[kernel]);
+  cl->kernel_name[kernel] = NULL;
   dt_pthread_mutex_unlock(&cl->lock);
 }
 
@@ -742,8 +901,10 @@ int dt_opencl_get_kernel_work_group_size(const int dev, const int kernel, size_t
   dt_opencl_t *cl = darktable.opencl;
   if(!cl->inited || dev < 0) return -1;
   if(kernel < 0 || kernel >= DT_OPENCL_MAX_KERNELS) return -1;
+  cl_kernel k = _opencl_get_kernel(dev, kernel);
+  if(!k) return CL_INVALID_KERNEL;
 
-  return (cl->dlocl->symbols->dt_clGetKernelWorkGroupInfo)(cl->dev[dev].kernel[kernel], cl->dev[dev].devid, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), kernelworkgroupsize, NULL);
+  return (cl->dlocl->symbols->dt_clGetKernelWorkGroupInfo)(k, cl->dev[dev].devid, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), kernelworkgroupsize, NULL);
 }
 
 
@@ -752,7 +913,9 @@ int dt_opencl_set_kernel_arg(const int dev, const int kernel, const int num, con
   dt_opencl_t *cl = darktable.opencl;
   if(!cl->inited || dev < 0) return -1;
   if(kernel < 0 || kernel >= DT_OPENCL_MAX_KERNELS) return -1;
-  return (cl->dlocl->symbols->dt_clSetKernelArg)(cl->dev[dev].kernel[kernel], num, size, arg);
+  cl_kernel k = _opencl_get_kernel(dev, kernel);
+  if(!k) return CL_INVALID_KERNEL;
+  return (cl->dlocl->symbols->dt_clSetKernelArg)(k, num, size, arg);
 }
 
 int dt_opencl_enqueue_kernel_2d(const int dev, const int kernel, const size_t *sizes)
@@ -766,12 +929,14 @@ int dt_opencl_enqueue_kernel_2d_with_local(const int dev, const int kernel, cons
   dt_opencl_t *cl = darktable.opencl;
   if(!cl->inited || dev < 0) return -1;
   if(kernel < 0 || kernel >= DT_OPENCL_MAX_KERNELS) return -1;
+  cl_kernel k = _opencl_get_kernel(dev, kernel);
+  if(!k) return CL_INVALID_KERNEL;
   int err;
   char buf[256];
   buf[0]='\0';
-  (cl->dlocl->symbols->dt_clGetKernelInfo)(cl->dev[dev].kernel[kernel], CL_KERNEL_FUNCTION_NAME, 256, buf, NULL);
+  (cl->dlocl->symbols->dt_clGetKernelInfo)(k, CL_KERNEL_FUNCTION_NAME, 256, buf, NULL);
   cl_event *eventp = dt_opencl_events_get_slot(dev, buf);
-  err = (cl->dlocl->symbols->dt_clEnqueueNDRangeKernel)(cl->dev[dev].cmd_queue, cl->dev[dev].kernel[kernel], 2, NULL, sizes, local, 0, NULL, eventp);
+  err = (cl->dlocl->symbols->dt_clEnqueueNDRangeKernel)(cl->dev[dev].cmd_queue, k, 2, NULL, sizes, local, 0, NULL, eventp);
   // if (err == CL_SUCCESS) err = dt_opencl_finish(dev);
   return err;
 }
@@ -58,6 +58,16 @@ typedef struct dt_opencl_eventtag_t
 dt_opencl_eventtag_t;
 
 
+/** how far building a program on a device got. */
+typedef enum dt_opencl_program_state_t
+{
+  DT_OPENCL_PROGRAM_NONE = 0,
+  DT_OPENCL_PROGRAM_BUILDING,
+  DT_OPENCL_PROGRAM_READY,
+  DT_OPENCL_PROGRAM_FAILED
+}
+dt_opencl_program_state_t;
+
 /**
  * to support multi-gpu and mixed systems with cpu support,
  * we encapsulate devices and use separate command queues.
@@ -73,10 +83,17 @@ typedef struct dt_opencl_device_t
   cl_ulong max_mem_alloc;
   cl_ulong max_global_mem;
   cl_ulong used_global_mem;
+  // programs are built, and kernels created, the first time they are needed.
+  // a used kernel slot may still hold a NULL kernel. kernels are published
+  // with an atomic release store, so they can be read without the lock.
   cl_program program[DT_OPENCL_MAX_PROGRAMS];
   cl_kernel  kernel [DT_OPENCL_MAX_KERNELS];
   int program_used[DT_OPENCL_MAX_PROGRAMS];
+  // dt_opencl_program_state_t, guarded by dt_opencl_t.lock
+  int program_state[DT_OPENCL_MAX_PROGRAMS];
   int kernel_used [DT_OPENCL_MAX_KERNELS];
+  // alphanumeric device name, part of the keys of cached binaries
+  char *name;
   cl_event *eventlist;
   dt_opencl_eventtag_t *eventtags;
   int numevents;
@@ -95,12 +112,25 @@ struct dt_bilateral_cl_global_t;
  */
 typedef struct dt_opencl_t
 {
+  // guards the kernel slots and the program states. programs are compiled without it.
   dt_pthread_mutex_t lock;
+  // signalled whenever a program finished building, successfully or not
+  pthread_cond_t built;
   int inited;
   int enabled;
   int num_devs;
   dt_opencl_device_t *dev;
   dt_dlopencl_t *dlocl;
+  // programs as listed in programs.conf, by number
+  int num_programs;
+  char *program_name[DT_OPENCL_MAX_PROGRAMS];
+  // what dt_opencl_create_kernel() was asked for, to create the kernels on first use
+  char *kernel_name[DT_OPENCL_MAX_KERNELS];
+  int kernel_program[DT_OPENCL_MAX_KERNELS];
+  // directory of cached program binaries, and its index: device/program -> md5sum of the binary in use
+  char *cachedir;
+  GHashTable *cache_index;
+  dt_pthread_mutex_t cache_lock; // guards cache_index and its file
 
   // global kernels for bilateral filtering, to be reused by a few plugins.
   struct dt_bilateral_cl_global_t *bilateral;
@@ -129,13 +159,13 @@ int dt_opencl_lock_device(const int dev);
 /** done with your command queue. */
 void dt_opencl_unlock_device(const int dev);
 
-/** loads the given .cl file and returns a reference to an internal program. */
-int dt_opencl_load_program(const int dev, const char *filename, const char* binname, const char* cachedir, char* md5sum, int* loaded_cached);
+/** loads the given .cl file, or its cached binary, as program number prog. md5sum receives the key of the binary. returns prog or -1 on failure. */
+int dt_opencl_load_program(const int dev, const int prog, const char *filename, char* md5sum, int* loaded_cached);
 
-/** builds the given program. */
-int dt_opencl_build_program(const int dev, const int prog, const char* binname, const char* cachedir, char* md5sum, int loaded_cached);
+/** builds the given program and puts its binary into the cache, unless it came from there. */
+int dt_opencl_build_program(const int dev, const int prog, const char* md5sum, int loaded_cached);
 
-/** inits a kernel. returns the index or -1 if fail. */
+/** inits a kernel. returns the index or -1 if fail. the program is only built when the kernel is first used. */
 int dt_opencl_create_kernel(const int program, const char *name);
 
 /** releases kernel resources again. */
@@ -264,11 +294,11 @@ static inline int dt_opencl_lock_device(const int dev)
   return -1;
 }
 static inline void dt_opencl_unlock_device(const int dev) {}
-static inline int dt_opencl_load_program(const int dev, const char *filename)
+static inline int dt_opencl_load_program(const int dev, const int prog, const char *filename, char* md5sum, int* loaded_cached)
 {
   return -1;
 }
-static inline int dt_opencl_build_program(const int dev, const int program)
+static inline int dt_opencl_build_program(const int dev, const int prog, const char* md5sum, int loaded_cached)
 {
   return -1;
 }
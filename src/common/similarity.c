@@ -22,6 +22,8 @@
 #include "common/darktable.h"
 #include "common/similarity.h"
 
+#include <emmintrin.h>
+
 #ifdef _DEBUG
 static void _similarity_dump_histogram(uint32_t imgid, const dt_similarity_histogram_t *histogram)
 {
@@ -32,194 +34,281 @@ static void _similarity_dump_histogram(uint32_t imgid, const dt_similarity_histo
 }
 #endif
 
-/* matches the rgb histogram and returns a score for the match  */
-static float _similarity_match_histogram_rgb(dt_similarity_t *data, const dt_similarity_histogram_t *target, const dt_similarity_histogram_t *source)
-{
-  float score=0;
+#define DT_SIMILARITY_HISTOGRAM_FLOATS (DT_SIMILARITY_HISTOGRAM_BUCKETS*4)
+#define DT_SIMILARITY_LIGHTMAP_BYTES (DT_SIMILARITY_LIGHTMAP_SIZE*DT_SIMILARITY_LIGHTMAP_SIZE*4)
+#define DT_SIMILARITY_VALID_HISTOGRAM 1
+#define DT_SIMILARITY_VALID_LIGHTMAP 2
+#define DT_SIMILARITY_VALID_ALL (DT_SIMILARITY_VALID_HISTOGRAM|DT_SIMILARITY_VALID_LIGHTMAP)
+// minimum score to be listed, and the most matches listed
+#define DT_SIMILARITY_THRESHOLD 0.92f
+#define DT_SIMILARITY_MAX_MATCHES 1000
 
-  for(int k=0; k<DT_SIMILARITY_HISTOGRAM_BUCKETS; k++)
-    for(int j=0; j<3; j++)
-      score += fabs(target->rgbl[k][j] - source->rgbl[k][j])/3.0;
+typedef struct _similarity_match_t
+{
+  uint32_t id;
+  float score;
+}
+_similarity_match_t;
 
-  score/=DT_SIMILARITY_HISTOGRAM_BUCKETS;
+dt_similarity_index_t *dt_similarity_index_init()
+{
+  dt_similarity_index_t *index = (dt_similarity_index_t *)malloc(sizeof(dt_similarity_index_t));
+  memset(index, 0, sizeof(dt_similarity_index_t));
+  dt_pthread_mutex_init(&index->lock, NULL);
+  index->rows = g_hash_table_new(g_direct_hash, g_direct_equal);
+  return index;
+}
 
-  return 1.0 - score;
+void dt_similarity_index_cleanup(dt_similarity_index_t *index)
+{
+  if(!index) return;
+  g_hash_table_destroy(index->rows);
+  free(index->id);
+  free(index->valid);
+  free(index->histogram);
+  free(index->lightmap);
+  dt_pthread_mutex_destroy(&index->lock);
+  free(index);
 }
 
-/* scoring match of lightmap */
-static float _similarity_match_lightmap(dt_similarity_t *data, const dt_similarity_lightmap_t *target, const dt_similarity_lightmap_t *source)
+// returns the row of the image, appending an empty one if needed. expects index->lock to be held.
+static int _similarity_index_row(dt_similarity_index_t *index, const uint32_t imgid)
 {
-  float score=0;
-  int channel = 3;
+  const int row = GPOINTER_TO_INT(g_hash_table_lookup(index->rows, GINT_TO_POINTER(imgid))) - 1;
+  if(row >= 0) return row;
+
+  if(index->count == index->capacity)
+  {
+    // rows are kept contiguous and 16-byte aligned for the batch scoring:
+    const uint32_t capacity = MAX(1024, 2*index->capacity);
+    uint32_t *id = (uint32_t *)malloc(sizeof(uint32_t)*capacity);
+    uint32_t *valid = (uint32_t *)malloc(sizeof(uint32_t)*capacity);
+    float *histogram = (float *)dt_alloc_align(64, sizeof(float)*DT_SIMILARITY_HISTOGRAM_FLOATS*capacity);
+    uint8_t *lightmap = (uint8_t *)dt_alloc_align(64, DT_SIMILARITY_LIGHTMAP_BYTES*capacity);
+    if(index->count)
+    {
+      memcpy(id, index->id, sizeof(uint32_t)*index->count);
+      memcpy(valid, index->valid, sizeof(uint32_t)*index->count);
+      memcpy(histogram, index->histogram, sizeof(float)*DT_SIMILARITY_HISTOGRAM_FLOATS*index->count);
+      memcpy(lightmap, index->lightmap, DT_SIMILARITY_LIGHTMAP_BYTES*index->count);
+    }
+    free(index->id);
+    free(index->valid);
+    free(index->histogram);
+    free(index->lightmap);
+    index->id = id;
+    index->valid = valid;
+    index->histogram = histogram;
+    index->lightmap = lightmap;
+    index->capacity = capacity;
+  }
+  const int new_row = index->count++;
+  index->id[new_row] = imgid;
+  index->valid[new_row] = 0;
+  g_hash_table_insert(index->rows, GINT_TO_POINTER(imgid), GINT_TO_POINTER(new_row+1));
+  return new_row;
+}
 
-  /* sum up the score */
-  for(int j=0; j<(DT_SIMILARITY_LIGHTMAP_SIZE*DT_SIMILARITY_LIGHTMAP_SIZE); j++)
-    score += fabs((float)(target->pixels[4*j+channel] - source->pixels[4*j+channel]) / 0xff);
+// expects index->lock to be held.
+static void _similarity_index_set_histogram(dt_similarity_index_t *index, const uint32_t imgid, const dt_similarity_histogram_t *histogram)
+{
+  const int row = _similarity_index_row(index, imgid);
+  float *h = index->histogram + row*DT_SIMILARITY_HISTOGRAM_FLOATS;
+  memcpy(h, histogram, sizeof(dt_similarity_histogram_t));
+  // only rgb is matched, zero luma so whole buckets can be compared:
+  for(int k=0; k<DT_SIMILARITY_HISTOGRAM_BUCKETS; k++) h[4*k+3] = 0.0f;
+  index->valid[row] |= DT_SIMILARITY_VALID_HISTOGRAM;
+}
 
-  /* scale down score */
-  score /= (DT_SIMILARITY_LIGHTMAP_SIZE * DT_SIMILARITY_LIGHTMAP_SIZE);
+// expects index->lock to be held.
+static void _similarity_index_set_lightmap(dt_similarity_index_t *index, const uint32_t imgid, const dt_similarity_lightmap_t *lightmap)
+{
+  const int row = _similarity_index_row(index, imgid);
+  memcpy(index->lightmap + row*DT_SIMILARITY_LIGHTMAP_BYTES, lightmap, DT_SIMILARITY_LIGHTMAP_BYTES);
+  index->valid[row] |= DT_SIMILARITY_VALID_LIGHTMAP;
+}
 
-  return 1.0 - score;
+static void _similarity_index_invalidate(dt_similarity_index_t *index, const uint32_t imgid, const uint32_t flags)
+{
+  if(!index) return;
+  dt_pthread_mutex_lock(&index->lock);
+  const int row = GPOINTER_TO_INT(g_hash_table_lookup(index->rows, GINT_TO_POINTER(imgid))) - 1;
+  if(row >= 0) index->valid[row] &= ~flags;
+  dt_pthread_mutex_unlock(&index->lock);
 }
 
-/* scoring match of colormap */
-static float _similarity_match_colormap(dt_similarity_t *data, const dt_similarity_lightmap_t *target, const dt_similarity_lightmap_t *source)
+void dt_similarity_index_remove(dt_similarity_index_t *index, uint32_t imgid)
 {
-  float redscore = 0;
-  float greenscore = 0;
-  float bluescore = 0;
-  float score = 0;
+  _similarity_index_invalidate(index, imgid, DT_SIMILARITY_VALID_ALL);
+}
 
-  /* sum up the score */
-  for (int j=0; j<(DT_SIMILARITY_LIGHTMAP_SIZE*DT_SIMILARITY_LIGHTMAP_SIZE); j++)
+// reads all signatures from the library, once. afterwards the index is kept up to date by
+// the store and dirty functions. expects index->lock to be held.
+static void _similarity_index_load(dt_similarity_index_t *index)
+{
+  if(index->loaded) return;
+  sqlite3_stmt *stmt;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select id,histogram,lightmap from images", -1, &stmt, NULL);
+  while(sqlite3_step(stmt) == SQLITE_ROW)
   {
-    redscore    +=  fabs((float)(target->pixels[4*j+0] - source->pixels[4*j+0]) / 0xff);
-    greenscore  += fabs((float)(target->pixels[4*j+1] - source->pixels[4*j+1]) / 0xff);
-    bluescore   += fabs((float)(target->pixels[4*j+2] - source->pixels[4*j+2]) / 0xff);
+    const uint32_t imgid = sqlite3_column_int(stmt, 0);
+    if(sqlite3_column_bytes(stmt, 1) == sizeof(dt_similarity_histogram_t))
+      _similarity_index_set_histogram(index, imgid, (const dt_similarity_histogram_t *)sqlite3_column_blob(stmt, 1));
+    if(sqlite3_column_bytes(stmt, 2) == sizeof(dt_similarity_lightmap_t))
+      _similarity_index_set_lightmap(index, imgid, (const dt_similarity_lightmap_t *)sqlite3_column_blob(stmt, 2));
   }
+  sqlite3_finalize(stmt);
+  index->loaded = 1;
+  dt_print(DT_DEBUG_PERF, "[similarity] loaded %d signatures\n", index->count);
+}
 
-  /* scale down score */
-  redscore    /= (DT_SIMILARITY_LIGHTMAP_SIZE * DT_SIMILARITY_LIGHTMAP_SIZE);
-  greenscore  /= (DT_SIMILARITY_LIGHTMAP_SIZE * DT_SIMILARITY_LIGHTMAP_SIZE);
-  bluescore   /= (DT_SIMILARITY_LIGHTMAP_SIZE * DT_SIMILARITY_LIGHTMAP_SIZE);
+/*
+ * scores all rows of the index against the given one. per row this is:
+ *  - the rgb histogram match, mean absolute difference of the buckets,
+ *  - the lightmap match, mean absolute difference of the luma channel,
+ *  - the colormap match, weighted mean absolute differences of r, g and b,
+ * combined as histogram^histogram_weight * lightmap^lightmap_weight * colormap^redmap_weight.
+ * rows without complete signatures score -1.
+ */
+static void _similarity_score(const dt_similarity_t *data, const dt_similarity_index_t *index, const int target, float *score)
+{
+  const __m128 *target_histogram = (const __m128 *)(index->histogram + target*DT_SIMILARITY_HISTOGRAM_FLOATS);
+  const __m128i *target_lightmap = (const __m128i *)(index->lightmap + target*DT_SIMILARITY_LIGHTMAP_BYTES);
+  const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  // pixels are rgba, pick one channel out of a register of absolute differences:
+  const __m128i channel_mask[4] =
+  {
+    _mm_set1_epi32(0x000000ff), _mm_set1_epi32(0x0000ff00), _mm_set1_epi32(0x00ff0000), _mm_set1_epi32(0xff000000)
+  };
+  const float lightmap_norm = 1.0f/(0xff * DT_SIMILARITY_LIGHTMAP_SIZE*DT_SIMILARITY_LIGHTMAP_SIZE);
+  const int count = index->count;
 
-  //  fprintf(stderr,"weight: %f\n",data->redmap_weight+data->bluemap_weight+data->greenmap_weight);
-  score = ((redscore*data->redmap_weight) + (greenscore * data->greenmap_weight) + (bluescore*data->bluemap_weight)) / 3.0;
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for(int i=0; i<count; i++)
+  {
+    if(index->valid[i] != DT_SIMILARITY_VALID_ALL)
+    {
+      score[i] = -1.0f;
+      continue;
+    }
 
-  /* now we have each score for r,g and b channel, lets weight them and calculate
-      a main score for the match. */
-  // fprintf(stderr,"Color score %f,%f,%f total weighted score = %f\n",redscore,greenscore,bluescore,score);
+    const __m128 *histogram = (const __m128 *)(index->histogram + i*DT_SIMILARITY_HISTOGRAM_FLOATS);
+    __m128 hsum = _mm_setzero_ps();
+    for(int k=0; k<DT_SIMILARITY_HISTOGRAM_BUCKETS; k++)
+      hsum = _mm_add_ps(hsum, _mm_and_ps(abs_mask, _mm_sub_ps(target_histogram[k], histogram[k])));
+    float h[4];
+    _mm_storeu_ps(h, hsum);
+    const float score_histogram = 1.0f - (h[0] + h[1] + h[2])/(3.0f*DT_SIMILARITY_HISTOGRAM_BUCKETS);
+
+    const __m128i *lightmap = (const __m128i *)(index->lightmap + i*DT_SIMILARITY_LIGHTMAP_BYTES);
+    __m128i sad[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+    for(int j=0; j<DT_SIMILARITY_LIGHTMAP_BYTES/16; j++)
+    {
+      const __m128i a = _mm_load_si128(target_lightmap + j), b = _mm_load_si128(lightmap + j);
+      const __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+      for(int c=0; c<4; c++)
+        sad[c] = _mm_add_epi64(sad[c], _mm_sad_epu8(_mm_and_si128(diff, channel_mask[c]), _mm_setzero_si128()));
+    }
+    float channel[4];
+    for(int c=0; c<4; c++)
+    {
+      sad[c] = _mm_add_epi64(sad[c], _mm_srli_si128(sad[c], 8));
+      channel[c] = _mm_cvtsi128_si32(sad[c]) * lightmap_norm;
+    }
+    const float score_lightmap = 1.0f - channel[3];
+    const float score_colormap = 1.0f - (channel[0]*data->redmap_weight + channel[1]*data->greenmap_weight
+                                        + channel[2]*data->bluemap_weight)/3.0f;
+
+    score[i] = powf(score_histogram, data->histogram_weight) *
+               powf(score_lightmap, data->lightmap_weight) *
+               powf(score_colormap, data->redmap_weight);
+  }
+}
 
-  return 1.0 - score;
+static int _similarity_match_cmp(const void *a, const void *b)
+{
+  const float sa = ((const _similarity_match_t *)a)->score, sb = ((const _similarity_match_t *)b)->score;
+  return (sa < sb) - (sa > sb);
 }
 
 void dt_similarity_match_image(uint32_t imgid,dt_similarity_t *data)
 {
   sqlite3_stmt *stmt;
-  gboolean all_ok_for_match = TRUE;
-  dt_similarity_histogram_t orginal_histogram,test_histogram;
-  dt_similarity_lightmap_t orginal_lightmap,test_lightmap;
+  dt_similarity_index_t *index = darktable.similarity_index;
 
   /* create temporary mem table for matches */
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "create temporary table if not exists similar_images (id integer,score real)", NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "delete from similar_images", NULL, NULL, NULL);
 
   /*
-   * get the histogram and lightmap data for image to match against
+   * score the whole index in one go, and keep the best matches
    */
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select histogram,lightmap from images where id = ?1", -1, &stmt, NULL);
-  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
-  if (sqlite3_step(stmt) == SQLITE_ROW)
+  const double start = dt_get_wtime();
+  dt_pthread_mutex_lock(&index->lock);
+  _similarity_index_load(index);
+  const int target = GPOINTER_TO_INT(g_hash_table_lookup(index->rows, GINT_TO_POINTER(imgid))) - 1;
+  if(target < 0 || index->valid[target] != DT_SIMILARITY_VALID_ALL)
   {
-    /* get the histogram data */
-    uint32_t size = sqlite3_column_bytes(stmt,0);
-    if (size!=sizeof(dt_similarity_histogram_t))
-    {
-      all_ok_for_match = FALSE;
-      dt_control_log(_("this image has not been indexed yet."));
-    }
-    else
-      memcpy(&orginal_histogram, sqlite3_column_blob(stmt, 0), sizeof(dt_similarity_histogram_t));
+    dt_pthread_mutex_unlock(&index->lock);
+    dt_control_log(_("this image has not been indexed yet."));
+    return;
+  }
 
-    /* get the lightmap data */
-    size = sqlite3_column_bytes(stmt,1);
-    if (size!=sizeof(dt_similarity_lightmap_t))
-    {
-      all_ok_for_match = FALSE;
-      dt_control_log(_("this image has not been indexed yet."));
-    }
-    else
-      memcpy(&orginal_lightmap, sqlite3_column_blob(stmt, 1), sizeof(dt_similarity_lightmap_t));
+  float *score = (float *)malloc(sizeof(float)*index->count);
+  _similarity_score(data, index, target, score);
 
-  }
-  else
+  int num_matches = 0;
+  _similarity_match_t *matches = (_similarity_match_t *)malloc(sizeof(_similarity_match_t)*index->count);
+  for(int i=0; i<index->count; i++)
   {
-    all_ok_for_match = FALSE;
-    dt_control_log(_("this image has not been indexed yet."));
+    if(i == target || score[i] < DT_SIMILARITY_THRESHOLD) continue;
+    matches[num_matches].id = index->id[i];
+    matches[num_matches].score = score[i];
+    num_matches++;
   }
-  sqlite3_reset(stmt);
-  sqlite3_clear_bindings(stmt);
+  const int searched = index->count;
+  dt_pthread_mutex_unlock(&index->lock);
+  free(score);
 
+  if(num_matches > DT_SIMILARITY_MAX_MATCHES)
+  {
+    qsort(matches, num_matches, sizeof(_similarity_match_t), _similarity_match_cmp);
+    num_matches = DT_SIMILARITY_MAX_MATCHES;
+  }
 
   /*
-   * if all ok lets begin matching
+   * write back all results in one transaction. the target image goes in with 100.0,
+   * to ensure it is always shown on top.
    */
-  if (all_ok_for_match)
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "begin", NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "insert into similar_images(id,score) values(?1,?2)", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+  DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 2, 100.0);
+  sqlite3_step(stmt);
+  for(int i=0; i<num_matches; i++)
   {
-    char query[4096]= {0};
-
-    /* add target image with 100.0 in score into result to ensure it always shown in top */
-    sprintf(query,"insert into similar_images(id,score) values(%d,%f)",imgid,100.0);
-    DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query, NULL, NULL, NULL);
-
-
-    /* set an extended collection query for viewing the result of match */
-    dt_collection_set_extended_where(darktable.collection, ", similar_images where images.id = similar_images.id order by similar_images.score desc");
-    dt_collection_set_query_flags( darktable.collection,
-                                   dt_collection_get_query_flags(darktable.collection) | COLLECTION_QUERY_USE_ONLY_WHERE_EXT);
-    dt_collection_update(darktable.collection);
-    dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
-
-
-    /* loop thru images and generate score table */
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select id,histogram,lightmap from images", -1, &stmt, NULL);
-    while (sqlite3_step(stmt) == SQLITE_ROW)
-    {
-      float score_histogram=0, score_lightmap=0, score_colormap=0;
-
-      /* verify size of histogram and lightmap blob of test image */
-      if (
-        (sqlite3_column_bytes(stmt,1) == sizeof(dt_similarity_histogram_t)) &&
-        (sqlite3_column_bytes(stmt,2) == sizeof(dt_similarity_lightmap_t))
-      )
-      {
-        /*
-         * Get the histogram blob and calculate the similarity score
-         */
-        memcpy(&test_histogram, sqlite3_column_blob(stmt, 1), sizeof(dt_similarity_histogram_t));
-        score_histogram = _similarity_match_histogram_rgb(data, &orginal_histogram, &test_histogram);
-
-        /*
-         * Get the lightmap blob and calculate the similarity score
-         *  1.08 is a tuned constant that works well with threshold
-         */
-        memcpy(&test_lightmap, sqlite3_column_blob(stmt, 2), sizeof(dt_similarity_lightmap_t));
-        score_lightmap = _similarity_match_lightmap(data, &orginal_lightmap, &test_lightmap);
-
-        /*
-         * then calculate the colormap similarity score
-         */
-        score_colormap = _similarity_match_colormap(data, &orginal_lightmap, &test_lightmap);
-
-
-        /*
-         * calculate the similarity score
-         */
-        float score =  (pow(score_histogram, data->histogram_weight) *
-                        pow(score_lightmap, data->lightmap_weight) *
-                        pow(score_colormap, data->redmap_weight));
-
-        // fprintf(stderr,"score: %f, histo: %f, light: %f, color: %f\n",score,score_histogram,score_lightmap,score_colormap);
-
-
-        /*
-         * If current images scored, lets add it to similar_images table
-         */
-        if(score >= 0.92)
-        {
-          sprintf(query,"insert into similar_images(id,score) values(%d,%f)",sqlite3_column_int(stmt, 0),score);
-          DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query, NULL, NULL, NULL);
-
-          /* lets redraw the view */
-          dt_control_queue_redraw_center();
-        }
-      }
-      else
-        fprintf(stderr,"Image has inconsisten similarity matching data..\n");
-    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, matches[i].id);
+    DT_DEBUG_SQLITE3_BIND_DOUBLE(stmt, 2, matches[i].score);
+    sqlite3_step(stmt);
   }
-  sqlite3_finalize (stmt);
-
+  sqlite3_finalize(stmt);
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "commit", NULL, NULL, NULL);
+  free(matches);
+
+  dt_print(DT_DEBUG_PERF, "[similarity] matched %d of %d images in %.3f secs\n",
+           num_matches, searched, dt_get_wtime() - start);
+
+  /* set an extended collection query for viewing the result of match */
+  dt_collection_set_extended_where(darktable.collection, ", similar_images where images.id = similar_images.id order by similar_images.score desc");
+  dt_collection_set_query_flags( darktable.collection,
+                                 dt_collection_get_query_flags(darktable.collection) | COLLECTION_QUERY_USE_ONLY_WHERE_EXT);
+  dt_collection_update(darktable.collection);
+  dt_control_signal_raise(darktable.signals, DT_SIGNAL_COLLECTION_CHANGED);
+  dt_control_queue_redraw_center();
 }
 
 void dt_similarity_image_dirty(uint32_t imgid)
@@ -230,6 +319,8 @@ void dt_similarity_image_dirty(uint32_t imgid)
 
 void dt_similarity_histogram_dirty(uint32_t imgid)
 {
+  _similarity_index_invalidate(darktable.similarity_index, imgid, DT_SIMILARITY_VALID_HISTOGRAM);
+
   sqlite3_stmt *stmt;
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "update images set histogram = NULL where id = ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
@@ -248,6 +339,13 @@ void dt_similarity_histogram_store(uint32_t imgid, const dt_similarity_histogram
 #ifdef _DEBUG
   _similarity_dump_histogram(imgid,histogram);
 #endif
+
+  // nothing to update before the first match loads the index:
+  dt_similarity_index_t *index = darktable.similarity_index;
+  if(!index) return;
+  dt_pthread_mutex_lock(&index->lock);
+  if(index->loaded) _similarity_index_set_histogram(index, imgid, histogram);
+  dt_pthread_mutex_unlock(&index->lock);
 }
 
 void dt_similarity_lightmap_store(uint32_t imgid, const dt_similarity_lightmap_t *lightmap)
@@ -258,10 +356,18 @@ void dt_similarity_lightmap_store(uint32_t imgid, const dt_similarity_lightmap_t
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, imgid);
   sqlite3_step(stmt);
   sqlite3_finalize (stmt);
+
+  dt_similarity_index_t *index = darktable.similarity_index;
+  if(!index) return;
+  dt_pthread_mutex_lock(&index->lock);
+  if(index->loaded) _similarity_index_set_lightmap(index, imgid, lightmap);
+  dt_pthread_mutex_unlock(&index->lock);
 }
 
 void dt_similarity_lightmap_dirty(uint32_t imgid)
 {
+  _similarity_index_invalidate(darktable.similarity_index, imgid, DT_SIMILARITY_VALID_LIGHTMAP);
+
   sqlite3_stmt *stmt;
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "update images set lightmap = NULL where id = ?1", -1, &stmt, NULL);
   DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
@@ -18,7 +18,9 @@
 #ifndef DT_SIMILARITY_H
 #define DT_SIMILARITY_H
 
+#include "common/dtpthread.h"
 #include <inttypes.h>
+#include <glib.h>
 
 typedef struct dt_similarity_t
 {
@@ -41,6 +43,27 @@ typedef struct dt_similarity_imagemap_t
   uint8_t pixels[DT_SIMILARITY_LIGHTMAP_SIZE*DT_SIMILARITY_LIGHTMAP_SIZE*4];
 } dt_similarity_lightmap_t;
 
+/** in-memory copy of all signatures, laid out contiguously for batch scoring. loaded from the
+    library on the first match, and kept up to date by the store and dirty functions. */
+typedef struct dt_similarity_index_t
+{
+  dt_pthread_mutex_t lock;
+  int loaded;
+  uint32_t count, capacity;
+  /* per row: image id, which signatures are valid, the histogram (with zeroed luma) and lightmap */
+  uint32_t *id;
+  uint32_t *valid;
+  float *histogram;
+  uint8_t *lightmap;
+  /* image id -> row + 1 */
+  GHashTable *rows;
+} dt_similarity_index_t;
+
+dt_similarity_index_t *dt_similarity_index_init();
+void dt_similarity_index_cleanup(dt_similarity_index_t *index);
+/** forgets the signatures of an image removed from the library, its id might be reused. */
+void dt_similarity_index_remove(dt_similarity_index_t *index, uint32_t imgid);
+
 void dt_similarity_image_dirty(uint32_t imgid);
 
 /** \brief stores the histogram with the imgid to database
@@ -54,12 +54,12 @@
 #include <string.h>
 #include <glib/gstdio.h>
 #include <gdk/gdkkeysyms.h>
+#include <errno.h>
 
-/* the queue can have scheduled jobs but all
-    the workers is sleeping, so this kicks the workers
-    on timed interval.
-*/
-static void * _control_worker_kicker(void *ptr);
+static guint _control_job_hash(gconstpointer key);
+static gboolean _control_job_equal(gconstpointer a, gconstpointer b);
+static void _control_wake_all(dt_control_t *s);
+static void _control_release_dependents(dt_control_t *s, dt_control_worker_t *w, const dt_job_t *finished);
 
 void dt_ctl_settings_default(dt_control_t *c)
 {
@@ -386,6 +386,9 @@ void dt_control_create_database_schema()
                         "latitude double, color_matrix blob, colorspace integer)", NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "create index if not exists group_id_index on images (group_id)", NULL, NULL, NULL);
+  DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
+                        "create index if not exists film_id_filename_index on images (film_id, filename)",
+                        NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "create table selected_images (imgid integer primary key)", NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
@@ -438,7 +441,6 @@ void dt_control_init(dt_control_t *s)
   if(DT_CONFIG_VERSION > dt_conf_get_int("config_version"))
     dt_ctl_settings_default(s);
 
-  pthread_cond_init(&s->cond, NULL);
   dt_pthread_mutex_init(&s->cond_mutex, NULL);
   dt_pthread_mutex_init(&s->queue_mutex, NULL);
   dt_pthread_mutex_init(&s->run_mutex, NULL);
@@ -447,35 +449,34 @@ void dt_control_init(dt_control_t *s)
   // start threads
   s->num_threads = CLAMP(dt_conf_get_int ("worker_threads"), 1, 8);
   s->thread = (pthread_t *)malloc(sizeof(pthread_t)*s->num_threads);
+  s->worker = (dt_control_worker_t *)calloc(s->num_threads + DT_CTL_WORKER_INTERACTIVE, sizeof(dt_control_worker_t));
+  s->queued = g_hash_table_new(_control_job_hash, _control_job_equal);
+  s->num_queued = s->next_worker = 0;
+  s->scheduled = s->waiting = NULL;
+  s->num_waiting = 0;
+  s->background = NULL;
+  for(int k=0; k<DT_CTL_WORKER_RESERVED; k++)
+    s->new_res[k] = s->running_res[k] = 0;
+  for(int k=0; k<s->num_threads + DT_CTL_WORKER_INTERACTIVE; k++)
+  {
+    dt_control_worker_t *w = s->worker + k;
+    w->control = s;
+    w->id = k;
+    w->interactive = k >= s->num_threads;
+    dt_pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->cond, NULL);
+  }
   dt_pthread_mutex_lock(&s->run_mutex);
   s->running = 1;
   dt_pthread_mutex_unlock(&s->run_mutex);
+  // hold the queue while the thread ids are filled in, workers look themselves up there.
+  dt_pthread_mutex_lock(&s->queue_mutex);
   for(int k=0; k<s->num_threads; k++)
-    pthread_create(&s->thread[k], NULL, dt_control_work, s);
+    pthread_create(&s->thread[k], NULL, dt_control_work, s->worker + k);
 
-  /* create queue kicker thread */
-  pthread_create(&s->kick_on_workers_thread, NULL, _control_worker_kicker, s);
-
-  for(int k=0; k<DT_CTL_WORKER_RESERVED; k++)
-  {
-    s->new_res[k] = 0;
-    pthread_create(&s->thread_res[k], NULL, dt_control_work_res, s);
-
-#if 0
-    /* check if thread created is the worker thread, then
-        set scheduling information for the thread to nice level. */
-    if (k == DT_CTL_WORKER_7)
-    {
-      int res;
-      struct sched_param sched_params;
-      sched_params.sched_priority = sched_get_priority_min(SCHED_RR);
-      if((res=pthread_setschedparam(s->thread_res[k], SCHED_RR, &sched_params))!=0)
-        fprintf(stderr,"Failed to set background thread scheduling to nice level: %d.",res);
-
-    }
-#endif
-
-  }
+  for(int k=0; k<DT_CTL_WORKER_INTERACTIVE; k++)
+    pthread_create(&s->thread_res[k], NULL, dt_control_work_res, s->worker + s->num_threads + k);
+  dt_pthread_mutex_unlock(&s->queue_mutex);
   s->button_down = 0;
   s->button_down_which = 0;
 
@@ -535,6 +536,8 @@ void dt_control_init(dt_control_t *s)
                    "drop index imgid_index", NULL, NULL, NULL);
       sqlite3_exec(dt_database_get(darktable.db),
                    "drop index group_id_index", NULL, NULL, NULL);
+      sqlite3_exec(dt_database_get(darktable.db),
+                   "drop index film_id_filename_index", NULL, NULL, NULL);
       goto create_tables;
     }
     else
@@ -639,6 +642,10 @@ void dt_control_init(dt_control_t *s)
       sqlite3_exec(dt_database_get(darktable.db),
                    "create index if not exists group_id_index on images (group_id)",
                    NULL, NULL, NULL);
+      // import looks up every file by film and name
+      sqlite3_exec(dt_database_get(darktable.db),
+                   "create index if not exists film_id_filename_index on images (film_id, filename)",
+                   NULL, NULL, NULL);
       sqlite3_exec(dt_database_get(darktable.db),
                    "create index if not exists imgid_index on history (imgid)",
                    NULL, NULL, NULL);
@@ -766,20 +773,19 @@ void dt_control_shutdown(dt_control_t *s)
   s->running = 0;
   dt_pthread_mutex_unlock(&s->run_mutex);
   dt_pthread_mutex_unlock(&s->cond_mutex);
-  pthread_cond_broadcast(&s->cond);
+  _control_wake_all(s);
 
   /* cancel background job if any */
-  dt_control_job_cancel(&s->job_res[DT_CTL_WORKER_7]);
-
-  /* first wait for kick_on_workers_thread */
-  pthread_join(s->kick_on_workers_thread, NULL);
+  dt_pthread_mutex_lock(&s->queue_mutex);
+  if(s->background) dt_control_job_cancel(s->background);
+  dt_pthread_mutex_unlock(&s->queue_mutex);
 
   // gdk_threads_leave();
   int k;
   for(k=0; k<s->num_threads; k++)
     // pthread_kill(s->thread[k], 9);
     pthread_join(s->thread[k], NULL);
-  for(k=0; k<DT_CTL_WORKER_RESERVED; k++)
+  for(k=0; k<DT_CTL_WORKER_INTERACTIVE; k++)
     // pthread_kill(s->thread_res[k], 9);
     pthread_join(s->thread_res[k], NULL);
 
@@ -792,6 +798,19 @@ void dt_control_cleanup(dt_control_t *s)
   // vacuum TODO: optional?
   // DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "PRAGMA incremental_vacuum(0)", NULL, NULL, NULL);
   // DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), "vacuum", NULL, NULL, NULL);
+  for(int k=0; k<s->num_threads + DT_CTL_WORKER_INTERACTIVE; k++)
+  {
+    dt_control_worker_t *w = s->worker + k;
+    // jobs still queued are dropped
+    for(int i=0; i<w->count; i++) g_free(w->job[(w->head + i) % DT_CONTROL_MAX_JOBS]);
+    dt_pthread_mutex_destroy(&w->mutex);
+    pthread_cond_destroy(&w->cond);
+  }
+  g_list_free_full(s->scheduled, g_free);
+  g_list_free_full(s->waiting, g_free);
+  g_hash_table_destroy(s->queued);
+  free(s->worker);
+  free(s->thread);
   dt_pthread_mutex_destroy(&s->queue_mutex);
   dt_pthread_mutex_destroy(&s->cond_mutex);
   dt_pthread_mutex_destroy(&s->log_mutex);
@@ -864,21 +883,21 @@ void dt_control_job_wait(dt_job_t *j)
 
 }
 
-int32_t dt_control_run_job_res(dt_control_t *s, int32_t res)
+static void _control_job_execute(dt_control_t *s, dt_control_worker_t *w, dt_job_t *j, int32_t id)
 {
-  assert(res < DT_CTL_WORKER_RESERVED && res >= 0);
-  dt_job_t *j = NULL;
-  dt_pthread_mutex_lock(&s->queue_mutex);
-  if(s->new_res[res]) j = s->job_res + res;
-  s->new_res[res] = 0;
-  dt_pthread_mutex_unlock(&s->queue_mutex);
-  if(!j) return -1;
+  /* make the job visible as cancellation token and to dependent jobs */
+  if(w)
+  {
+    dt_pthread_mutex_lock(&w->mutex);
+    w->current = j;
+    dt_pthread_mutex_unlock(&w->mutex);
+  }
 
   /* change state to running */
   dt_pthread_mutex_lock (&j->wait_mutex);
   if (dt_control_job_get_state (j) == DT_JOB_STATE_QUEUED)
   {
-    dt_print(DT_DEBUG_CONTROL, "[run_job+] %02d %f ", res, dt_get_wtime());
+    dt_print(DT_DEBUG_CONTROL, "[run_job+] %02d %f ", id, dt_get_wtime());
     dt_control_job_print(j);
     dt_print(DT_DEBUG_CONTROL, "\n");
 
@@ -888,103 +907,317 @@ int32_t dt_control_run_job_res(dt_control_t *s, int32_t res)
     j->result = j->execute (j);
 
     _control_job_set_state (j,DT_JOB_STATE_FINISHED);
-    dt_print(DT_DEBUG_CONTROL, "[run_job-] %02d %f ", res, dt_get_wtime());
+    dt_print(DT_DEBUG_CONTROL, "[run_job-] %02d %f ", id, dt_get_wtime());
     dt_control_job_print(j);
     dt_print(DT_DEBUG_CONTROL, "\n");
-
   }
   dt_pthread_mutex_unlock (&j->wait_mutex);
-  return 0;
+
+  if(w)
+  {
+    dt_pthread_mutex_lock(&w->mutex);
+    w->current = NULL;
+    dt_pthread_mutex_unlock(&w->mutex);
+  }
+  _control_release_dependents(s, w, j);
+}
+
+/* jobs are the same if they run the same function on the same parameters */
+static guint _control_job_hash(gconstpointer key)
+{
+  const dt_job_t *j = (const dt_job_t *)key;
+  guint hash = 5381;
+  const uint8_t *str = (const uint8_t *)&j->execute;
+  for(size_t k=0; k<sizeof(j->execute); k++) hash = ((hash << 5) + hash) ^ str[k];
+  str = (const uint8_t *)j->param;
+  for(size_t k=0; k<sizeof(j->param); k++) hash = ((hash << 5) + hash) ^ str[k];
+  return hash;
 }
 
+static gboolean _control_job_equal(gconstpointer a, gconstpointer b)
+{
+  const dt_job_t *ja = (const dt_job_t *)a, *jb = (const dt_job_t *)b;
+  return ja->execute == jb->execute && !memcmp(ja->param, jb->param, sizeof(ja->param));
+}
 
-int32_t dt_control_run_job(dt_control_t *s)
+static gint _control_job_compare_execute(gconstpointer a, gconstpointer b)
 {
-  dt_job_t *j=NULL,*bj=NULL;
-  dt_pthread_mutex_lock(&s->queue_mutex);
+  const dt_job_t *ja = (const dt_job_t *)a, *jb = (const dt_job_t *)b;
+  return (ja->ts_execute > jb->ts_execute) - (ja->ts_execute < jb->ts_execute);
+}
 
-  /* check if queue is empty */
-  if(g_list_length(s->queue) == 0)
+/* the worker struct of the calling thread, or NULL if it is not a general worker */
+static dt_control_worker_t *_control_get_worker(dt_control_t *s)
+{
+  const int32_t id = dt_control_get_threadid();
+  return id < s->num_threads ? s->worker + id : NULL;
+}
+
+/* wake one sleeping worker, trying the given one first. */
+static void _control_wake(dt_control_t *s, int32_t first, const int32_t interactive)
+{
+  // interactive jobs go to the dedicated workers first, but anyone idle may take them.
+  const int32_t num = s->num_threads + (interactive ? DT_CTL_WORKER_INTERACTIVE : 0);
+  if(interactive) first = s->num_threads;
+  for(int k=0; k<num; k++)
   {
-    dt_pthread_mutex_unlock(&s->queue_mutex);
-    return -1;
+    dt_control_worker_t *w = s->worker + (first + k) % num;
+    dt_pthread_mutex_lock(&w->mutex);
+    if(w->sleeping)
+    {
+      w->sleeping = 0;
+      pthread_cond_signal(&w->cond);
+      dt_pthread_mutex_unlock(&w->mutex);
+      return;
+    }
+    dt_pthread_mutex_unlock(&w->mutex);
   }
+}
 
-  /* go thru the queue and find one normal job and a background job
-      that is up for execution.*/
-  time_t ts_now = time(NULL);
-  GList *jobitem=g_list_first(s->queue);
-  if(jobitem)
-    do
-    {
-      dt_job_t *tj = jobitem->data;
+static void _control_wake_all(dt_control_t *s)
+{
+  for(int k=0; k<s->num_threads + DT_CTL_WORKER_INTERACTIVE; k++)
+  {
+    dt_control_worker_t *w = s->worker + k;
+    dt_pthread_mutex_lock(&w->mutex);
+    w->sleeping = 0;
+    pthread_cond_signal(&w->cond);
+    dt_pthread_mutex_unlock(&w->mutex);
+  }
+}
 
-      /* check if it's a scheduled job and is waiting to be executed */
-      if(!bj && (tj->ts_execute > tj->ts_added) && tj->ts_execute <= ts_now)
-        bj = tj;
-      else if ((tj->ts_execute < tj->ts_added) && !j)
-        j = tj;
+/* the worker a new job goes to: the adding one, or round robin if added from outside.
+    needs the queue_mutex. */
+static dt_control_worker_t *_control_pick_worker(dt_control_t *s)
+{
+  dt_control_worker_t *w = _control_get_worker(s);
+  return w ? w : s->worker + (s->next_worker++ % s->num_threads);
+}
 
-      /* if we got a normal job, and a background job, we are finished */
-      if(bj && j) break;
+static void _control_push(dt_control_worker_t *w, dt_job_t *j)
+{
+  dt_pthread_mutex_lock(&w->mutex);
+  w->job[(w->head + w->count) % DT_CONTROL_MAX_JOBS] = j;
+  w->count++;
+  dt_pthread_mutex_unlock(&w->mutex);
+}
 
+/* true if a job equivalent to the given one is queued or running. needs the queue_mutex. */
+static int32_t _control_job_pending(dt_control_t *s, const dt_job_t *job)
+{
+  if(g_hash_table_lookup(s->queued, job)) return 1;
+  int32_t running = 0;
+  for(int k=0; !running && k<s->num_threads + DT_CTL_WORKER_INTERACTIVE; k++)
+  {
+    dt_control_worker_t *w = s->worker + k;
+    dt_pthread_mutex_lock(&w->mutex);
+    running = w->current && _control_job_equal(w->current, job);
+    dt_pthread_mutex_unlock(&w->mutex);
+  }
+  return running;
+}
+
+/* queues the jobs that waited for the finished one, unless an equivalent job is still queued. */
+static void _control_release_dependents(dt_control_t *s, dt_control_worker_t *w, const dt_job_t *finished)
+{
+  int32_t released = 0;
+  // dependents stay on this worker, the results they need are most likely still in its caches
+  dt_control_worker_t *target = w;
+  dt_pthread_mutex_lock(&s->queue_mutex);
+  if(s->waiting && !g_hash_table_lookup(s->queued, finished))
+  {
+    if(!target || target->interactive) target = _control_pick_worker(s);
+    GList *l = s->waiting;
+    while(l)
+    {
+      GList *next = g_list_next(l);
+      // a waiting job is stored in front of a copy of the one it waits for
+      dt_job_t *j = (dt_job_t *)l->data;
+      if(_control_job_equal(j + 1, finished))
+      {
+        s->waiting = g_list_delete_link(s->waiting, l);
+        s->num_waiting--;
+        _control_push(target, j);
+        released++;
+      }
+      l = next;
     }
-    while ((jobitem = g_list_next(jobitem)));
+  }
+  dt_pthread_mutex_unlock(&s->queue_mutex);
+  // this worker picks up one of them itself, others may steal the rest
+  for(int k=(target == w); k<released; k++) _control_wake(s, target->id, 0);
+}
 
-  /* remove the found jobs from queue */
-  if (bj)
-    s->queue = g_list_remove(s->queue, bj);
+/* takes the pending job of an interactive slot that is not running already. */
+static int32_t _control_take_job_res(dt_control_t *s, dt_job_t *job, int32_t res)
+{
+  dt_pthread_mutex_lock(&s->queue_mutex);
+  for(int k=0; k<DT_CTL_WORKER_RESERVED; k++)
+  {
+    if(res >= 0 && k != res) continue;
+    if(s->new_res[k] && !s->running_res[k])
+    {
+      // copy, so a new job can be placed in the slot while this one runs
+      *job = s->job_res[k];
+      s->new_res[k] = 0;
+      s->running_res[k] = 1;
+      dt_pthread_mutex_unlock(&s->queue_mutex);
+      return k;
+    }
+  }
+  dt_pthread_mutex_unlock(&s->queue_mutex);
+  return -1;
+}
 
-  if (j)
-    s->queue = g_list_remove(s->queue, j);
+/* takes the oldest job of the own deque, or steals the newest from another one. */
+static dt_job_t *_control_take_job(dt_control_t *s, dt_control_worker_t *w)
+{
+  dt_job_t *j = NULL;
+  const int32_t first = w ? w->id : 0;
+  for(int k=0; !j && k<s->num_threads; k++)
+  {
+    dt_control_worker_t *v = s->worker + (first + k) % s->num_threads;
+    dt_pthread_mutex_lock(&v->mutex);
+    if(v->count > 0)
+    {
+      if(v == w)
+      {
+        j = v->job[v->head];
+        v->head = (v->head + 1) % DT_CONTROL_MAX_JOBS;
+      }
+      else
+        j = v->job[(v->head + v->count - 1) % DT_CONTROL_MAX_JOBS];
+      v->count--;
+    }
+    dt_pthread_mutex_unlock(&v->mutex);
+  }
+  if(j)
+  {
+    dt_pthread_mutex_lock(&s->queue_mutex);
+    g_hash_table_remove(s->queued, j);
+    s->num_queued--;
+    dt_pthread_mutex_unlock(&s->queue_mutex);
+  }
+  return j;
+}
 
-  /* unlock the queue */
+/* takes the first delayed job if it is due and no other one is running. */
+static dt_job_t *_control_take_scheduled(dt_control_t *s)
+{
+  dt_job_t *j = NULL;
+  dt_pthread_mutex_lock(&s->queue_mutex);
+  if(!s->background && s->scheduled && ((dt_job_t *)s->scheduled->data)->ts_execute <= time(NULL))
+  {
+    j = s->background = (dt_job_t *)s->scheduled->data;
+    s->scheduled = g_list_delete_link(s->scheduled, s->scheduled);
+    g_hash_table_remove(s->queued, j);
+    s->num_queued--;
+  }
   dt_pthread_mutex_unlock(&s->queue_mutex);
+  return j;
+}
 
-  /* push background job on reserved backgruond worker */
-  if(bj)
+/* runs one job, in order of the priority classes. returns -1 if there was nothing to do. */
+static int32_t _control_run_job(dt_control_t *s, dt_control_worker_t *w)
+{
+  dt_job_t job;
+  const int32_t res = _control_take_job_res(s, &job, -1);
+  if(res >= 0)
   {
-    dt_control_add_job_res(s,bj,DT_CTL_WORKER_7);
-    g_free (bj);
+    _control_job_execute(s, w, &job, res);
+    dt_pthread_mutex_lock(&s->queue_mutex);
+    s->running_res[res] = 0;
+    dt_pthread_mutex_unlock(&s->queue_mutex);
+    return 0;
   }
-  /* dont continue if we dont have have a job to execute */
-  if(!j)
-    return -1;
+  if(w && w->interactive) return -1;
 
-  /* change state to running */
-  dt_pthread_mutex_lock (&j->wait_mutex);
-  if (dt_control_job_get_state (j) == DT_JOB_STATE_QUEUED)
+  dt_job_t *j = _control_take_job(s, w);
+  if(j)
   {
-    dt_print(DT_DEBUG_CONTROL, "[run_job+] %02d %f ",
-             DT_CTL_WORKER_RESERVED+dt_control_get_threadid(), dt_get_wtime());
-    dt_control_job_print(j);
-    dt_print(DT_DEBUG_CONTROL, "\n");
+    _control_job_execute(s, w, j, DT_CTL_WORKER_RESERVED + (w ? w->id : s->num_threads));
+    g_free(j);
+    return 0;
+  }
 
-    _control_job_set_state (j,DT_JOB_STATE_RUNNING);
+  j = _control_take_scheduled(s);
+  if(j)
+  {
+    _control_job_execute(s, w, j, DT_CTL_WORKER_7);
+    dt_pthread_mutex_lock(&s->queue_mutex);
+    s->background = NULL;
+    dt_pthread_mutex_unlock(&s->queue_mutex);
+    g_free(j);
+    return 0;
+  }
+  return -1;
+}
 
-    /* execute job */
-    j->result = j->execute (j);
+static int32_t _control_has_work(dt_control_t *s, dt_control_worker_t *w)
+{
+  int32_t work = 0;
+  dt_pthread_mutex_lock(&s->queue_mutex);
+  for(int k=0; k<DT_CTL_WORKER_RESERVED; k++)
+    work |= s->new_res[k] && !s->running_res[k];
+  if(!w->interactive)
+    work |= s->num_queued - s->num_waiting > g_list_length(s->scheduled) ||
+            (!s->background && s->scheduled && ((dt_job_t *)s->scheduled->data)->ts_execute <= time(NULL));
+  dt_pthread_mutex_unlock(&s->queue_mutex);
+  return work;
+}
 
-    _control_job_set_state (j,DT_JOB_STATE_FINISHED);
+/* sleeps until a job is added for this worker, or the next delayed job is due. */
+static void _control_worker_sleep(dt_control_t *s, dt_control_worker_t *w)
+{
+  dt_pthread_mutex_lock(&w->mutex);
+  w->sleeping = 1;
+  dt_pthread_mutex_unlock(&w->mutex);
 
-    dt_print(DT_DEBUG_CONTROL, "[run_job-] %02d %f ",
-             DT_CTL_WORKER_RESERVED+dt_control_get_threadid(), dt_get_wtime());
-    dt_control_job_print(j);
-    dt_print(DT_DEBUG_CONTROL, "\n");
+  // anything added from now on wakes us up, so look once more before going to sleep:
+  time_t due = 0;
+  const int32_t work = _control_has_work(s, w);
+  if(!work && !w->interactive)
+  {
+    dt_pthread_mutex_lock(&s->queue_mutex);
+    if(!s->background && s->scheduled) due = ((dt_job_t *)s->scheduled->data)->ts_execute;
+    dt_pthread_mutex_unlock(&s->queue_mutex);
+  }
 
-    /* free job */
-    dt_pthread_mutex_unlock (&j->wait_mutex);
-    g_free(j);
-    j = NULL;
+  dt_pthread_mutex_lock(&w->mutex);
+  while(!work && w->sleeping && dt_control_running())
+  {
+    if(due)
+    {
+      const struct timespec ts = { due, 0 };
+      if(dt_pthread_cond_timedwait(&w->cond, &w->mutex, &ts) == ETIMEDOUT) break;
+    }
+    else dt_pthread_cond_wait(&w->cond, &w->mutex);
   }
-  if(j) dt_pthread_mutex_unlock (&j->wait_mutex);
+  w->sleeping = 0;
+  dt_pthread_mutex_unlock(&w->mutex);
+}
 
+int32_t dt_control_run_job_res(dt_control_t *s, int32_t res)
+{
+  assert(res < DT_CTL_WORKER_RESERVED && res >= 0);
+  dt_job_t job;
+  if(_control_take_job_res(s, &job, res) < 0) return -1;
+  _control_job_execute(s, NULL, &job, res);
+  dt_pthread_mutex_lock(&s->queue_mutex);
+  s->running_res[res] = 0;
+  dt_pthread_mutex_unlock(&s->queue_mutex);
   return 0;
 }
 
+int32_t dt_control_run_job(dt_control_t *s)
+{
+  return _control_run_job(s, _control_get_worker(s));
+}
+
 int32_t dt_control_add_job_res(dt_control_t *s, dt_job_t *job, int32_t res)
 {
   // TODO: pthread cancel and restart in tough cases?
+  if(!s->worker) return -1;
   dt_pthread_mutex_lock(&s->queue_mutex);
   dt_print(DT_DEBUG_CONTROL, "[add_job_res] %d ", res);
   dt_control_job_print(job);
@@ -993,15 +1226,13 @@ int32_t dt_control_add_job_res(dt_control_t *s, dt_job_t *job, int32_t res)
   s->job_res[res] = *job;
   s->new_res[res] = 1;
   dt_pthread_mutex_unlock(&s->queue_mutex);
-  dt_pthread_mutex_lock(&s->cond_mutex);
-  pthread_cond_broadcast(&s->cond);
-  dt_pthread_mutex_unlock(&s->cond_mutex);
+  _control_wake(s, 0, 1);
   return 0;
 }
 
 /* Background jobs will be timestamped and added to queue
     the queue will then check ts and detect if its background job
-    and place it on the job_res if its available...
+    and run it once it is due and no other background job runs...
 */
 int32_t dt_control_add_background_job(dt_control_t *s, dt_job_t *job, time_t delay)
 {
@@ -1013,8 +1244,15 @@ int32_t dt_control_add_background_job(dt_control_t *s, dt_job_t *job, time_t del
   return dt_control_add_job(s,job);
 }
 
-int32_t dt_control_add_job(dt_control_t *s, dt_job_t *job)
+static int32_t _control_add_job(dt_control_t *s, dt_job_t *job, const dt_job_t *dependency)
 {
+  /* without workers (no gui) nothing would ever run the job */
+  if(!s->worker)
+  {
+    _control_job_set_state (job,DT_JOB_STATE_DISCARDED);
+    return -1;
+  }
+
   /* set ts_added if unset */
   if (job->ts_added == 0)
     job->ts_added = time(NULL);
@@ -1023,35 +1261,20 @@ int32_t dt_control_add_job(dt_control_t *s, dt_job_t *job)
 
   /* check if equivalent job exist in queue, and discard job
       if duplicate found .*/
-  GList *jobitem = g_list_first(s->queue);
-  if(jobitem)
-    do
-    {
-      if(!memcmp(job, jobitem->data, sizeof(dt_job_t)))
-      {
-        dt_print(DT_DEBUG_CONTROL, "[add_job] found job already in queue\n");
-        _control_job_set_state (job,DT_JOB_STATE_DISCARDED);
-        dt_pthread_mutex_unlock(&s->queue_mutex);
-        return -1;
-      }
-    }
-    while((jobitem=g_list_next(jobitem)));
+  if(g_hash_table_lookup(s->queued, job))
+  {
+    dt_print(DT_DEBUG_CONTROL, "[add_job] found job already in queue\n");
+    _control_job_set_state (job,DT_JOB_STATE_DISCARDED);
+    dt_pthread_mutex_unlock(&s->queue_mutex);
+    return -1;
+  }
 
-  dt_print(DT_DEBUG_CONTROL, "[add_job] %d ", g_list_length(s->queue));
+  dt_print(DT_DEBUG_CONTROL, "[add_job] %d ", s->num_queued);
   dt_control_job_print(job);
   dt_print(DT_DEBUG_CONTROL, "\n");
 
-  /* add job to queue if not full, otherwise discard the job */
-  if( g_list_length(s->queue) < DT_CONTROL_MAX_JOBS)
-  {
-    /* allocate storage for the job, and set job state */
-    dt_job_t *thejob = g_malloc(sizeof(dt_job_t));
-    memcpy(thejob,job,sizeof(dt_job_t));
-    _control_job_set_state (thejob,DT_JOB_STATE_QUEUED);
-    s->queue = g_list_append(s->queue, thejob);
-    dt_pthread_mutex_unlock(&s->queue_mutex);
-  }
-  else
+  /* discard the job if the queue is full */
+  if(s->num_queued >= DT_CONTROL_MAX_JOBS)
   {
     dt_print(DT_DEBUG_CONTROL, "[add_job] too many jobs in queue!\n");
     _control_job_set_state (job,DT_JOB_STATE_DISCARDED);
@@ -1059,44 +1282,91 @@ int32_t dt_control_add_job(dt_control_t *s, dt_job_t *job)
     return -1;
   }
 
+  /* allocate storage for the job, and set job state. a job that has to wait
+      for another one keeps a copy of that one right behind it. */
+  const int32_t wait = dependency && _control_job_pending(s, dependency);
+  dt_job_t *thejob = g_malloc(sizeof(dt_job_t) * (wait ? 2 : 1));
+  memcpy(thejob,job,sizeof(dt_job_t));
+  if(wait) memcpy(thejob + 1,dependency,sizeof(dt_job_t));
+  _control_job_set_state (thejob,DT_JOB_STATE_QUEUED);
+  g_hash_table_insert(s->queued, thejob, thejob);
+  s->num_queued++;
+
+  /* delayed jobs wait in the schedule, dependent ones until their dependency finished,
+      the others stay on the adding worker or are spread over all of them if added from outside. */
+  dt_control_worker_t *w = NULL;
+  if(wait)
+  {
+    s->waiting = g_list_append(s->waiting, thejob);
+    s->num_waiting++;
+  }
+  else if(thejob->ts_execute > thejob->ts_added)
+    s->scheduled = g_list_insert_sorted(s->scheduled, thejob, _control_job_compare_execute);
+  else
+    w = _control_pick_worker(s);
+  dt_pthread_mutex_unlock(&s->queue_mutex);
+
+  if(w) _control_push(w, thejob);
+
   // notify workers
-  dt_pthread_mutex_lock(&s->cond_mutex);
-  pthread_cond_broadcast(&s->cond);
-  dt_pthread_mutex_unlock(&s->cond_mutex);
+  if(!wait) _control_wake(s, w ? w->id : 0, 0);
   return 0;
 }
 
+int32_t dt_control_add_job(dt_control_t *s, dt_job_t *job)
+{
+  return _control_add_job(s, job, NULL);
+}
+
+int32_t dt_control_add_job_after(dt_control_t *s, dt_job_t *job, const dt_job_t *dependency)
+{
+  return _control_add_job(s, job, dependency);
+}
+
+int dt_control_job_cancelled()
+{
+  dt_control_t *s = darktable.control;
+  if(!s || !s->worker) return 0;
+  int32_t id = dt_control_get_threadid();
+  if(id == s->num_threads)
+  {
+    const int32_t res = dt_control_get_threadid_res();
+    if(res >= DT_CTL_WORKER_INTERACTIVE) return 0;
+    id += res;
+  }
+  // only this thread changes its current job, no need to lock:
+  dt_job_t *j = s->worker[id].current;
+  return j && dt_control_job_get_state(j) == DT_JOB_STATE_CANCELLED;
+}
+
 int32_t dt_control_revive_job(dt_control_t *s, dt_job_t *job)
 {
   int32_t found_j = -1;
-  dt_pthread_mutex_lock(&s->queue_mutex);
+  if(!s->worker) return found_j;
   dt_print(DT_DEBUG_CONTROL, "[revive_job] ");
   dt_control_job_print(job);
   dt_print(DT_DEBUG_CONTROL, "\n");
 
-  /* find equivalent job and move it to top of the stack */
-  GList *jobitem = g_list_first(s->queue);
-  if (jobitem)
-    do
+  /* find equivalent job and move it to the front of its deque */
+  for(int k=0; found_j < 0 && k<s->num_threads; k++)
+  {
+    dt_control_worker_t *w = s->worker + k;
+    dt_pthread_mutex_lock(&w->mutex);
+    for(int i=0; i<w->count; i++)
     {
-      if(!memcmp(job, jobitem->data, sizeof(dt_job_t)))
+      const int32_t pos = (w->head + i) % DT_CONTROL_MAX_JOBS;
+      dt_job_t *j = w->job[pos];
+      if(_control_job_equal(job, j))
       {
-        s->queue = g_list_remove_link(s->queue, jobitem);
-        s->queue = g_list_insert(s->queue, jobitem->data, 0);
-        g_free(jobitem);
+        for(int m=i; m>0; m--)
+          w->job[(w->head + m) % DT_CONTROL_MAX_JOBS] = w->job[(w->head + m - 1) % DT_CONTROL_MAX_JOBS];
+        w->job[w->head] = j;
         found_j = 1;
         break;
       }
     }
-    while((jobitem=g_list_next(jobitem)));
-
-  /* unlock the queue */
-  dt_pthread_mutex_unlock(&s->queue_mutex);
-
-  /* notify workers */
-  dt_pthread_mutex_lock(&s->cond_mutex);
-  pthread_cond_broadcast(&s->cond);
-  dt_pthread_mutex_unlock(&s->cond_mutex);
+    dt_pthread_mutex_unlock(&w->mutex);
+  }
   return found_j;
 }
 
@@ -1109,7 +1379,7 @@ int32_t dt_control_get_threadid()
 
 int32_t dt_control_get_threadid_res()
 {
-  for(int k=0; k<DT_CTL_WORKER_RESERVED; k++)
+  for(int k=0; k<DT_CTL_WORKER_INTERACTIVE; k++)
     if(pthread_equal(darktable.control->thread_res[k], pthread_self())) return k;
   return DT_CTL_WORKER_RESERVED;
 }
@@ -1119,60 +1389,41 @@ void *dt_control_work_res(void *ptr)
 #ifdef _OPENMP // need to do this in every thread
   omp_set_num_threads(darktable.num_openmp_threads);
 #endif
-  dt_control_t *s = (dt_control_t *)ptr;
-  int32_t threadid = dt_control_get_threadid_res();
+  dt_control_worker_t *w = (dt_control_worker_t *)ptr;
+  dt_control_t *s = w->control;
   while(dt_control_running())
   {
-    // dt_print(DT_DEBUG_CONTROL, "[control_work] %d\n", threadid);
-    if(dt_control_run_job_res(s, threadid) < 0)
+    if(_control_run_job(s, w) < 0)
     {
       // wait for a new job.
       int old;
       pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
-      dt_pthread_mutex_lock(&s->cond_mutex);
-      dt_pthread_cond_wait(&s->cond, &s->cond_mutex);
-      dt_pthread_mutex_unlock(&s->cond_mutex);
+      _control_worker_sleep(s, w);
       pthread_setcancelstate(old, NULL);
     }
   }
   return NULL;
 }
 
-void * _control_worker_kicker(void *ptr)
-{
-  dt_control_t *s = (dt_control_t *)ptr;
-  while(dt_control_running())
-  {
-    sleep(2);
-    dt_pthread_mutex_lock(&s->cond_mutex);
-    pthread_cond_broadcast(&s->cond);
-    dt_pthread_mutex_unlock(&s->cond_mutex);
-  }
-  return NULL;
-}
-
 void *dt_control_work(void *ptr)
 {
 #ifdef _OPENMP // need to do this in every thread
   omp_set_num_threads(darktable.num_openmp_threads);
 #endif
-  dt_control_t *s = (dt_control_t *)ptr;
-  // int32_t threadid = dt_control_get_threadid();
+  dt_control_worker_t *w = (dt_control_worker_t *)ptr;
+  dt_control_t *s = w->control;
   while(dt_control_running())
   {
-    // dt_print(DT_DEBUG_CONTROL, "[control_work] %d\n", threadid);
-    if(dt_control_run_job(s) < 0)
+    // dt_print(DT_DEBUG_CONTROL, "[control_work] %d\n", w->id);
+    if(_control_run_job(s, w) < 0)
     {
       // wait for a new job.
-      dt_pthread_mutex_lock(&s->cond_mutex);
-      dt_pthread_cond_wait(&s->cond, &s->cond_mutex);
-      dt_pthread_mutex_unlock(&s->cond_mutex);
+      _control_worker_sleep(s, w);
     }
   }
   return NULL;
 }
 
-
 // ================================================================================
 //  gui functions:
 // ================================================================================
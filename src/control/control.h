@@ -36,7 +36,7 @@
 #define DT_CONTROL_MAX_JOBS 30
 #define DT_CONTROL_JOB_DEBUG
 #define DT_CONTROL_DESCRIPTION_LEN 256
-// reserved workers
+// slots of the interactive job class, a new job replaces a pending one in the same slot
 #define DT_CTL_WORKER_RESERVED 8
 #define DT_CTL_WORKER_1 0 // dev load raw
 #define DT_CTL_WORKER_2 1 // dev zoom 1
@@ -45,6 +45,8 @@
 #define DT_CTL_WORKER_5 4 // dev small prev
 #define DT_CTL_WORKER_6 5 // dev prefetch
 #define DT_CTL_WORKER_7 6 // scheduled jobs nice level
+// workers dedicated to the interactive slots, so these never wait behind long jobs
+#define DT_CTL_WORKER_INTERACTIVE 2
 
 // A mask to strip out the Ctrl, Shift, and Alt mod keys for shortcuts
 #define KEY_STATE_MASK (GDK_CONTROL_MASK | GDK_SHIFT_MASK | GDK_MOD1_MASK)
@@ -183,6 +185,9 @@ void dt_control_job_cancel(dt_job_t *j);
 int dt_control_job_get_state(dt_job_t *j);
 /** wait for a job to finish execution. */
 void dt_control_job_wait(dt_job_t *j);
+/** cooperative cancellation: non-zero if the job run by the calling thread has been cancelled.
+ *  long running code polls this to give up on stale work early. */
+int dt_control_job_cancelled();
 
 //z All the accelerator keys for the key_pressed style shortcuts
 typedef struct dt_control_accels_t
@@ -195,6 +200,28 @@ typedef struct dt_control_accels_t
 
 } dt_control_accels_t;
 
+/**
+ * one worker of the job scheduler. general workers own a deque of pending jobs,
+ * take the oldest of their own and steal the newest of the others when idle.
+ */
+typedef struct dt_control_worker_t
+{
+  struct dt_control_t *control;
+  int32_t id;
+  // only serves the interactive slots
+  int32_t interactive;
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // set while waiting for work, cleared by whoever wakes it up
+  int32_t sleeping;
+  // the job being executed, doubles as cancellation token
+  dt_job_t *current;
+  // ring buffer of pending jobs
+  dt_job_t *job[DT_CONTROL_MAX_JOBS];
+  int32_t head, count;
+}
+dt_control_worker_t;
+
 #define DT_CTL_LOG_SIZE 10
 #define DT_CTL_LOG_MSG_SIZE 200
 #define DT_CTL_LOG_TIMEOUT 20000
@@ -252,13 +279,25 @@ typedef struct dt_control_t
   // job management
   int32_t running;
   dt_pthread_mutex_t queue_mutex, cond_mutex, run_mutex;
-  pthread_cond_t cond;
   int32_t num_threads;
-  pthread_t *thread,kick_on_workers_thread;
-  GList *queue;
+  pthread_t *thread;
+  // num_threads general workers followed by the interactive ones
+  dt_control_worker_t *worker;
+  // protected by queue_mutex:
+  // all queued jobs, hashed by what they run and on what, to discard duplicates
+  GHashTable *queued;
+  int32_t num_queued, next_worker;
+  // interactive class: one pending and at most one running job per slot
   dt_job_t job_res[DT_CTL_WORKER_RESERVED];
   uint8_t new_res[DT_CTL_WORKER_RESERVED];
-  pthread_t thread_res[DT_CTL_WORKER_RESERVED];
+  uint8_t running_res[DT_CTL_WORKER_RESERVED];
+  // jobs waiting for an equivalent of another job to finish
+  GList *waiting;
+  int32_t num_waiting;
+  // background class: delayed jobs sorted by execution time, run one at a time
+  GList *scheduled;
+  dt_job_t *background;
+  pthread_t thread_res[DT_CTL_WORKER_INTERACTIVE];
 
   /* proxy */
   struct
@@ -298,6 +337,9 @@ int dt_control_write_config(dt_control_t *c);
 
 int32_t dt_control_run_job(dt_control_t *s);
 int32_t dt_control_add_job(dt_control_t *s, dt_job_t *job);
+/** adds a job that only runs once no job equivalent to dependency (same function and
+ *  parameters) is queued or running any more, so it can pick up its results from the caches. */
+int32_t dt_control_add_job_after(dt_control_t *s, dt_job_t *job, const dt_job_t *dependency);
 /** adds a job to queue tagged as background job and with a delay */
 int32_t dt_control_add_background_job(dt_control_t *s, dt_job_t *job, time_t delay);
 int32_t dt_control_revive_job(dt_control_t *s, dt_job_t *job);
@@ -383,6 +383,102 @@ envelope(const float xx)
   }
 }
 
+// rows per band of the hdr merge: a band of input, accumulation buffer and output stays in the caches.
+#define DT_CONTROL_MERGE_HDR_BAND 32
+
+// stupid, but we don't know the real sensor saturation level: take the largest value of the raw.
+static uint16_t
+_merge_hdr_saturation(const uint16_t *const in, const int wd, const int ht)
+{
+  const int bands = (ht + DT_CONTROL_MERGE_HDR_BAND - 1)/DT_CONTROL_MERGE_HDR_BAND;
+  uint16_t *band_max = (uint16_t *)malloc(sizeof(uint16_t)*bands);
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) default(none) shared(band_max)
+#endif
+  for(int b=0; b<bands; b++)
+  {
+    const size_t start = (size_t)b*DT_CONTROL_MERGE_HDR_BAND*wd;
+    const size_t end = (size_t)MIN((b+1)*DT_CONTROL_MERGE_HDR_BAND, ht)*wd;
+    uint16_t m = 0;
+    for(size_t k=start; k<end; k++) m = MAX(m, in[k]);
+    band_max[b] = m;
+  }
+  uint16_t saturation = 0;
+  for(int b=0; b<bands; b++) saturation = MAX(saturation, band_max[b]);
+  free(band_max);
+  return saturation;
+}
+
+// adds one exposure to accum, which holds the sum of weighted radiance and the sum of weights per pixel.
+// the first exposure initializes it.
+static void
+_merge_hdr_accumulate(const uint16_t *const in, float *const accum, const int wd, const int ht,
+                      const uint16_t saturation, const float cal, const float photoncnt, const int first)
+{
+  const int bands = (ht + DT_CONTROL_MERGE_HDR_BAND - 1)/DT_CONTROL_MERGE_HDR_BAND;
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) default(none)
+#endif
+  for(int b=0; b<bands; b++)
+  {
+    const size_t start = (size_t)b*DT_CONTROL_MERGE_HDR_BAND*wd;
+    const size_t end = (size_t)MIN((b+1)*DT_CONTROL_MERGE_HDR_BAND, ht)*wd;
+    for(size_t k=start; k<end; k++)
+    {
+      // weights based on siggraph 12 poster
+      // zijian zhu, zhengguo li, susanto rahardja, pasi fraenti
+      // 2d denoising factor for high dynamic range imaging
+      float w = envelope(in[k]/(float)saturation) * photoncnt;
+      // in case we are black and drop to zero weight, give it something
+      // just so numerics don't collapse. blown out whites are handled below.
+      if(w < 1e-3f && in[k] < saturation/3) w = 1e-3f;
+      if(first)
+      {
+        accum[2*k]   = w * in[k] * cal;
+        accum[2*k+1] = w;
+      }
+      else
+      {
+        accum[2*k]   += w * in[k] * cal;
+        accum[2*k+1] += w;
+      }
+    }
+  }
+}
+
+// normalizes the accumulated exposures band by band and streams them to the dng.
+static int
+_merge_hdr_write(FILE *f, const float *const accum, const int wd, const int ht, const float whitelevel)
+{
+  float *band = (float *)dt_alloc_align(64, sizeof(float)*wd*DT_CONTROL_MERGE_HDR_BAND);
+  if(!band) return 1;
+  int err = 0;
+  for(int y0=0; y0<ht && !err; y0+=DT_CONTROL_MERGE_HDR_BAND)
+  {
+    const int rows = MIN(DT_CONTROL_MERGE_HDR_BAND, ht - y0);
+    // normalize by white level to make clipping at 1.0 work as expected (to be sure, scale down one more stop, thus the 0.5):
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) default(none) shared(band, y0)
+#endif
+    for(int j=0; j<rows; j++)
+    {
+      const float *a = accum + 2*((size_t)(y0+j)*wd);
+      float *out = band + (size_t)j*wd;
+      for(int i=0; i<wd; i++)
+      {
+        // in case w == 0, all pixels were overexposed (too dark would have been clamped to w >= eps above)
+        if(a[2*i+1] < 1e-3f)
+          out[i] = 1.f; // mark as blown out.
+        else // normalize:
+          out[i] = fmaxf(0.0f, a[2*i]/(whitelevel*a[2*i+1]));
+      }
+    }
+    err = dt_imageio_dng_write_rows(f, band, wd, rows);
+  }
+  free(band);
+  return err;
+}
+
 int32_t dt_control_merge_hdr_job_run(dt_job_t *job)
 {
   long int imgid = -1;
@@ -395,8 +491,8 @@ int32_t dt_control_merge_hdr_job_run(dt_job_t *job)
 
   const guint *jid = dt_control_backgroundjobs_create(darktable.control, 1, message);
 
-  float *pixels = NULL;
-  float *weight = NULL;
+  // per pixel the sum of weighted radiance and the sum of weights, next to each other
+  float *accum = NULL;
   int wd = 0, ht = 0, first_imgid = -1;
   uint32_t filter = 0;
   float whitelevel = 0.0f;
@@ -406,6 +502,9 @@ int32_t dt_control_merge_hdr_job_run(dt_job_t *job)
     imgid = (long int)t->data;
     dt_mipmap_buffer_t buf;
     dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
+    // have the next raw decoded by another worker while this one is merged.
+    if(t->next)
+      dt_mipmap_cache_read_get(darktable.mipmap_cache, NULL, (long int)t->next->data, DT_MIPMAP_FULL, DT_MIPMAP_PREFETCH);
     // just take a copy. also do it after blocking read, so filters and bpp will make sense.
     const dt_image_t *img = dt_image_cache_read_get(darktable.image_cache, imgid);
     dt_image_t image = *img;
@@ -414,35 +513,37 @@ int32_t dt_control_merge_hdr_job_run(dt_job_t *job)
     {
       dt_control_log(_("exposure bracketing only works on raw images"));
       dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
-      free(pixels);
-      free(weight);
+      free(accum);
       goto error;
     }
-    filter = dt_image_flipped_filter(img);
+    filter = dt_image_flipped_filter(&image);
     if(buf.size != DT_MIPMAP_FULL)
     {
       dt_control_log(_("failed to get raw buffer from image `%s'"), image.filename);
       dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
-      free(pixels);
-      free(weight);
+      free(accum);
       goto error;
     }
 
-    if(!pixels)
+    const int first = (accum == NULL);
+    if(first)
     {
       first_imgid = imgid;
-      pixels = (float *)malloc(sizeof(float)*image.width*image.height);
-      weight = (float *)malloc(sizeof(float)*image.width*image.height);
-      memset(pixels, 0x0, sizeof(float)*image.width*image.height);
-      memset(weight, 0x0, sizeof(float)*image.width*image.height);
       wd = image.width;
       ht = image.height;
+      // filled by the first exposure, no need to clear it.
+      accum = (float *)dt_alloc_align(64, sizeof(float)*2*wd*ht);
+      if(!accum)
+      {
+        dt_control_log(_("not enough memory to merge images"));
+        dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+        goto error;
+      }
     }
     else if(image.width != wd || image.height != ht)
     {
       dt_control_log(_("images have to be of same size!"));
-      free(pixels);
-      free(weight);
+      free(accum);
       dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
       goto error;
     }
@@ -456,29 +557,11 @@ int32_t dt_control_merge_hdr_job_run(dt_job_t *job)
     const float cal = 100.0f/(aperture*exp*iso);
     // about proportional to how many photons we can expect from this shot:
     const float photoncnt = 100.0f*aperture*exp/iso;
-    // stupid, but we don't know the real sensor saturation level:
-    uint16_t saturation = 0;
-    for(int k=0; k<wd*ht; k++)
-      saturation = MAX(saturation, ((uint16_t *)buf.buf)[k]);
     // seems to be around 64500--64700 for 5dm2
+    const uint16_t saturation = _merge_hdr_saturation((const uint16_t *)buf.buf, wd, ht);
     // fprintf(stderr, "saturation: %u\n", saturation);
     whitelevel = fmaxf(whitelevel, saturation*cal);
-#ifdef _OPENMP
-    #pragma omp parallel for schedule(static) default(none) shared(buf, pixels, weight, wd, ht, saturation)
-#endif
-    for(int k=0; k<wd*ht; k++)
-    {
-      const uint16_t in = ((uint16_t *)buf.buf)[k];
-      // weights based on siggraph 12 poster
-      // zijian zhu, zhengguo li, susanto rahardja, pasi fraenti
-      // 2d denoising factor for high dynamic range imaging
-      float w = envelope(in/(float)saturation) * photoncnt;
-      // in case we are black and drop to zero weight, give it something
-      // just so numerics don't collapse. blown out whites are handled below.
-      if(w < 1e-3f && in < saturation/3) w = 1e-3f;
-      pixels[k] += w * in * cal;
-      weight[k] += w;
-    }
+    _merge_hdr_accumulate((const uint16_t *)buf.buf, accum, wd, ht, saturation, cal, photoncnt, first);
 
     t = g_list_delete_link(t, t);
 
@@ -488,18 +571,6 @@ int32_t dt_control_merge_hdr_job_run(dt_job_t *job)
 
     dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
   }
-  // normalize by white level to make clipping at 1.0 work as expected (to be sure, scale down one more stop, thus the 0.5):
-#ifdef _OPENMP
-  #pragma omp parallel for schedule(static) default(none) shared(pixels, wd, ht, weight, whitelevel)
-#endif
-  for(int k=0; k<wd*ht; k++)
-  {
-    // in case w == 0, all pixels were overexposed (too dark would have been clamped to w >= eps above)
-    if(weight[k] < 1e-3f)
-      pixels[k] = 1.f; // mark as blown out.
-    else // normalize:
-      pixels[k] = fmaxf(0.0f, pixels[k]/(whitelevel*weight[k]));
-  }
 
   // output hdr as digital negative with exif data.
   uint8_t exif[65535];
@@ -509,7 +580,16 @@ int32_t dt_control_merge_hdr_job_run(dt_job_t *job)
   char *c = pathname + strlen(pathname);
   while(*c != '.' && c > pathname) c--;
   g_strlcpy(c, "-hdr.dng", sizeof(pathname)-(c-pathname));
-  dt_imageio_write_dng(pathname, pixels, wd, ht, exif, exif_len, filter, 1.0f);
+  FILE *f = dt_imageio_dng_open(pathname, wd, ht, filter, 1.0f);
+  if(!f || _merge_hdr_write(f, accum, wd, ht, whitelevel))
+  {
+    if(f) fclose(f);
+    dt_control_log(_("failed to write merged hdr `%s'"), pathname);
+    free(accum);
+    goto error;
+  }
+  dt_imageio_dng_close(f, pathname, exif, exif_len);
+  free(accum);
 
   dt_control_backgroundjobs_progress(darktable.control, jid, 1.0f);
 
@@ -523,8 +603,6 @@ int32_t dt_control_merge_hdr_job_run(dt_job_t *job)
   dt_image_import(filmid, pathname, TRUE);
   g_free (directory);
 
-  free(pixels);
-  free(weight);
 error:
   dt_control_backgroundjobs_destroy(darktable.control, jid);
   return 0;
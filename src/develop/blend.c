@@ -21,6 +21,8 @@
 #include "common/gaussian.h"
 #include "blend.h"
 
+#include <xmmintrin.h>
+
 #define CLAMP_RANGE(x,y,z)      (CLAMP(x,y,z))
 
 typedef void (_blend_row_func)(dt_iop_colorspace_type_t cst,const float *a, float *b, const float *mask, int stride, int flag);
@@ -302,6 +304,19 @@ static void _blend_make_mask(dt_iop_colorspace_type_t cst,const unsigned int ble
   }
 }
 
+typedef void (_blend_mask_func)(const unsigned int blendif,const float *blendif_parameters,const float opacity,const float *a, const float *b, float *mask, int stride);
+
+/* mask generation with the colorspace switch of _blendif_factor() resolved at compile time */
+static void __attribute__((flatten)) _blend_make_mask_Lab(const unsigned int blendif,const float *blendif_parameters,const float opacity,const float *a, const float *b, float *mask, int stride)
+{
+  _blend_make_mask(iop_cs_Lab, blendif, blendif_parameters, opacity, a, b, mask, stride);
+}
+
+static void __attribute__((flatten)) _blend_make_mask_rgb(const unsigned int blendif,const float *blendif_parameters,const float opacity,const float *a, const float *b, float *mask, int stride)
+{
+  _blend_make_mask(iop_cs_rgb, blendif, blendif_parameters, opacity, a, b, mask, stride);
+}
+
 
 
 /* normal blend */
@@ -1558,90 +1573,169 @@ static void _blend_inverse(dt_iop_colorspace_type_t cst,const float *a, float *b
   }
 }
 
+/* normal and unbounded are by far the most used blend modes. they get hand written sse kernels
+   for Lab and rgb, which blend all channels of a pixel at once. lanes 1 and 2 are copied from the
+   input for lightness only blending, the alpha lane receives the mask. */
+static inline void _blend_normal_sse(const float *a, float *b, const float *mask, const int stride,
+                                     const int Lab, const int lightness, const int clamp)
+{
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 scale = Lab ? _mm_set_ps(1.0f, 1.0f/128.0f, 1.0f/128.0f, 1.0f/100.0f) : one;
+  const __m128 rescale = Lab ? _mm_set_ps(1.0f, 128.0f, 128.0f, 100.0f) : one;
+  const __m128 min = Lab ? _mm_set_ps(0.0f, -1.0f, -1.0f, 0.0f) : _mm_setzero_ps();
+  const __m128 max = one;
+  const __m128 alpha = _mm_cmpneq_ps(_mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f), _mm_setzero_ps());
+  const __m128 keep = _mm_cmpneq_ps(lightness ? _mm_set_ps(0.0f, 1.0f, 1.0f, 0.0f) : _mm_setzero_ps(), _mm_setzero_ps());
+
+  for(int i=0, j=0; j<stride; i++, j+=4)
+  {
+    const __m128 opacity = _mm_set1_ps(mask[i]);
+    const __m128 va = _mm_loadu_ps(a+j);
+    const __m128 ta = _mm_mul_ps(va, scale);
+    const __m128 tb = _mm_mul_ps(_mm_loadu_ps(b+j), scale);
+
+    __m128 t = _mm_add_ps(_mm_mul_ps(ta, _mm_sub_ps(one, opacity)), _mm_mul_ps(tb, opacity));
+    if(clamp) t = _mm_min_ps(_mm_max_ps(t, min), max);
+    t = _mm_mul_ps(t, rescale);
+
+    t = _mm_or_ps(_mm_and_ps(keep, va), _mm_andnot_ps(keep, t));
+    t = _mm_or_ps(_mm_and_ps(alpha, opacity), _mm_andnot_ps(alpha, t));
+    _mm_storeu_ps(b+j, t);
+  }
+}
+
+#define _BLEND_NORMAL_SSE(name, Lab, lightness, clamp) \
+static void name(dt_iop_colorspace_type_t cst,const float *a, float *b, const float *mask, int stride, int flag) \
+{ \
+  _blend_normal_sse(a, b, mask, stride, Lab, lightness, clamp); \
+}
+
+_BLEND_NORMAL_SSE(_blend_normal_Lab, 1, 0, 1)
+_BLEND_NORMAL_SSE(_blend_normal_Lab_lightness, 1, 1, 1)
+_BLEND_NORMAL_SSE(_blend_normal_rgb, 0, 0, 1)
+_BLEND_NORMAL_SSE(_blend_normal_unbounded_Lab, 1, 0, 0)
+_BLEND_NORMAL_SSE(_blend_normal_unbounded_Lab_lightness, 1, 1, 0)
+_BLEND_NORMAL_SSE(_blend_normal_unbounded_rgb, 0, 0, 0)
+
+#undef _BLEND_NORMAL_SSE
+
+
+/* all other blend operators are compiled once per colorspace, and for Lab once more for lightness
+   only blending. cst and flag are constants in these copies, so the branches on them inside the
+   pixel loops fold away and leave straight code the compiler can vectorise. */
+#define _BLEND_SPECIALISE_RAW(op) \
+static void __attribute__((flatten)) op##_RAW(dt_iop_colorspace_type_t cst,const float *a, float *b, const float *mask, int stride, int flag) \
+{ \
+  op(iop_cs_RAW, a, b, mask, stride, 0); \
+}
+
+#define _BLEND_SPECIALISE(op) \
+static void __attribute__((flatten)) op##_Lab(dt_iop_colorspace_type_t cst,const float *a, float *b, const float *mask, int stride, int flag) \
+{ \
+  op(iop_cs_Lab, a, b, mask, stride, 0); \
+} \
+static void __attribute__((flatten)) op##_Lab_lightness(dt_iop_colorspace_type_t cst,const float *a, float *b, const float *mask, int stride, int flag) \
+{ \
+  op(iop_cs_Lab, a, b, mask, stride, 1); \
+} \
+static void __attribute__((flatten)) op##_rgb(dt_iop_colorspace_type_t cst,const float *a, float *b, const float *mask, int stride, int flag) \
+{ \
+  op(iop_cs_rgb, a, b, mask, stride, 0); \
+} \
+_BLEND_SPECIALISE_RAW(op)
+
+_BLEND_SPECIALISE_RAW(_blend_normal)
+_BLEND_SPECIALISE_RAW(_blend_unbounded)
+_BLEND_SPECIALISE(_blend_lighten)
+_BLEND_SPECIALISE(_blend_darken)
+_BLEND_SPECIALISE(_blend_multiply)
+_BLEND_SPECIALISE(_blend_average)
+_BLEND_SPECIALISE(_blend_add)
+_BLEND_SPECIALISE(_blend_substract)
+_BLEND_SPECIALISE(_blend_difference)
+_BLEND_SPECIALISE(_blend_screen)
+_BLEND_SPECIALISE(_blend_overlay)
+_BLEND_SPECIALISE(_blend_softlight)
+_BLEND_SPECIALISE(_blend_hardlight)
+_BLEND_SPECIALISE(_blend_vividlight)
+_BLEND_SPECIALISE(_blend_linearlight)
+_BLEND_SPECIALISE(_blend_pinlight)
+_BLEND_SPECIALISE(_blend_lightness)
+_BLEND_SPECIALISE(_blend_chroma)
+_BLEND_SPECIALISE(_blend_hue)
+_BLEND_SPECIALISE(_blend_color)
+_BLEND_SPECIALISE(_blend_coloradjust)
+_BLEND_SPECIALISE(_blend_inverse)
+
+#undef _BLEND_SPECIALISE
+#undef _BLEND_SPECIALISE_RAW
+
+
+typedef struct _blend_kernels_t
+{
+  _blend_row_func *Lab, *Lab_lightness, *rgb, *RAW;
+}
+_blend_kernels_t;
+
+#define _BLEND_KERNELS(op) { op##_Lab, op##_Lab_lightness, op##_rgb, op##_RAW }
+
+static const _blend_kernels_t _blend_kernels[] =
+{
+  [DEVELOP_BLEND_NORMAL]      = { _blend_normal_Lab, _blend_normal_Lab_lightness, _blend_normal_rgb, _blend_normal_RAW },
+  [DEVELOP_BLEND_LIGHTEN]     = _BLEND_KERNELS(_blend_lighten),
+  [DEVELOP_BLEND_DARKEN]      = _BLEND_KERNELS(_blend_darken),
+  [DEVELOP_BLEND_MULTIPLY]    = _BLEND_KERNELS(_blend_multiply),
+  [DEVELOP_BLEND_AVERAGE]     = _BLEND_KERNELS(_blend_average),
+  [DEVELOP_BLEND_ADD]         = _BLEND_KERNELS(_blend_add),
+  [DEVELOP_BLEND_SUBSTRACT]   = _BLEND_KERNELS(_blend_substract),
+  [DEVELOP_BLEND_DIFFERENCE]  = _BLEND_KERNELS(_blend_difference),
+  [DEVELOP_BLEND_SCREEN]      = _BLEND_KERNELS(_blend_screen),
+  [DEVELOP_BLEND_OVERLAY]     = _BLEND_KERNELS(_blend_overlay),
+  [DEVELOP_BLEND_SOFTLIGHT]   = _BLEND_KERNELS(_blend_softlight),
+  [DEVELOP_BLEND_HARDLIGHT]   = _BLEND_KERNELS(_blend_hardlight),
+  [DEVELOP_BLEND_VIVIDLIGHT]  = _BLEND_KERNELS(_blend_vividlight),
+  [DEVELOP_BLEND_LINEARLIGHT] = _BLEND_KERNELS(_blend_linearlight),
+  [DEVELOP_BLEND_PINLIGHT]    = _BLEND_KERNELS(_blend_pinlight),
+  [DEVELOP_BLEND_LIGHTNESS]   = _BLEND_KERNELS(_blend_lightness),
+  [DEVELOP_BLEND_CHROMA]      = _BLEND_KERNELS(_blend_chroma),
+  [DEVELOP_BLEND_HUE]         = _BLEND_KERNELS(_blend_hue),
+  [DEVELOP_BLEND_COLOR]       = _BLEND_KERNELS(_blend_color),
+  [DEVELOP_BLEND_INVERSE]     = _BLEND_KERNELS(_blend_inverse),
+  [DEVELOP_BLEND_UNBOUNDED]   = { _blend_normal_unbounded_Lab, _blend_normal_unbounded_Lab_lightness, _blend_normal_unbounded_rgb, _blend_unbounded_RAW },
+  [DEVELOP_BLEND_COLORADJUST] = _BLEND_KERNELS(_blend_coloradjust)
+};
+
+#undef _BLEND_KERNELS
+
+/* select the row kernel once per call. unknown modes fall back to normal blend */
+static _blend_row_func *_blend_select(const unsigned int mode, const dt_iop_colorspace_type_t cst, const int flag)
+{
+  const _blend_kernels_t *k = &_blend_kernels[DEVELOP_BLEND_NORMAL];
+  if(mode < sizeof(_blend_kernels)/sizeof(_blend_kernels[0]) && _blend_kernels[mode].Lab)
+    k = &_blend_kernels[mode];
+
+  switch(cst)
+  {
+    case iop_cs_Lab:
+      return flag ? k->Lab_lightness : k->Lab;
+    case iop_cs_RAW:
+      return k->RAW;
+    case iop_cs_rgb:
+    default:
+      return k->rgb;
+  }
+}
+
+
 void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *i, void *o, const struct dt_iop_roi_t *roi_in, const struct dt_iop_roi_t *roi_out)
 {
 
   int ch = piece->colors;
-  _blend_row_func *blend = NULL;
   dt_develop_blend_params_t *d = (dt_develop_blend_params_t *)piece->blendop_data;
 
   /* check if blend is disabled */
   if (!d || d->mode==0) return;
 
-  /* select the blend operator */
-  switch (d->mode)
-  {
-    case DEVELOP_BLEND_LIGHTEN:
-      blend = _blend_lighten;
-      break;
-    case DEVELOP_BLEND_DARKEN:
-      blend = _blend_darken;
-      break;
-    case DEVELOP_BLEND_MULTIPLY:
-      blend = _blend_multiply;
-      break;
-    case DEVELOP_BLEND_AVERAGE:
-      blend = _blend_average;
-      break;
-    case DEVELOP_BLEND_ADD:
-      blend = _blend_add;
-      break;
-    case DEVELOP_BLEND_SUBSTRACT:
-      blend = _blend_substract;
-      break;
-    case DEVELOP_BLEND_DIFFERENCE:
-      blend = _blend_difference;
-      break;
-    case DEVELOP_BLEND_SCREEN:
-      blend = _blend_screen;
-      break;
-    case DEVELOP_BLEND_OVERLAY:
-      blend = _blend_overlay;
-      break;
-    case DEVELOP_BLEND_SOFTLIGHT:
-      blend = _blend_softlight;
-      break;
-    case DEVELOP_BLEND_HARDLIGHT:
-      blend = _blend_hardlight;
-      break;
-    case DEVELOP_BLEND_VIVIDLIGHT:
-      blend = _blend_vividlight;
-      break;
-    case DEVELOP_BLEND_LINEARLIGHT:
-      blend = _blend_linearlight;
-      break;
-    case DEVELOP_BLEND_PINLIGHT:
-      blend = _blend_pinlight;
-      break;
-    case DEVELOP_BLEND_LIGHTNESS:
-      blend = _blend_lightness;
-      break;
-    case DEVELOP_BLEND_CHROMA:
-      blend = _blend_chroma;
-      break;
-    case DEVELOP_BLEND_HUE:
-      blend = _blend_hue;
-      break;
-    case DEVELOP_BLEND_COLOR:
-      blend = _blend_color;
-      break;
-    case DEVELOP_BLEND_INVERSE:
-      blend = _blend_inverse;
-      break;
-    case DEVELOP_BLEND_UNBOUNDED:
-      blend = _blend_unbounded;
-      break;
-    case DEVELOP_BLEND_COLORADJUST:
-      blend = _blend_coloradjust;
-      break;
-
-      /* fallback to normal blend */
-    case DEVELOP_BLEND_NORMAL:
-    default:
-      blend = _blend_normal;
-      break;
-  }
-
   /* allocate space for blend mask */
   float *mask = dt_alloc_align(64, roi_out->width*roi_out->height*sizeof(float));
   if(!mask)
@@ -1670,25 +1764,49 @@ void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixel
     if(cst==iop_cs_RAW)
       ch = 1;
 
+    /* select the blend operator */
+    _blend_row_func *blend = _blend_select(d->mode, cst, blendflag);
+
     /* only true if mask_display was set by an _earlier_ module */
     const int mask_display = piece->pipe->mask_display;
 
+    if(!(d->blendif & (1<<DEVELOP_BLENDIF_active)) || (cst != iop_cs_Lab && cst != iop_cs_rgb))
+    {
+      /* no blendif: the mask is just the global opacity */
 #ifdef _OPENMP
 #if !defined(__SUNOS__) && !defined(__NetBSD__)
-    #pragma omp parallel for default(none) shared(i,roi_out,o,mask,blend,d,stderr,ch)
+      #pragma omp parallel for default(none) shared(roi_out,mask)
 #else
-    #pragma omp parallel for shared(i,roi_out,o,mask,blend,d,ch)
+      #pragma omp parallel for shared(roi_out,mask)
 #endif
 
 #endif
-    for (int y=0; y<roi_out->height; y++)
+      for (int k=0; k<roi_out->height*roi_out->width; k++)
+      {
+        mask[k] = opacity;
+      }
+    }
+    else
     {
-      int index = ch * y * roi_out->width;
-      int stride = ch * roi_out->width;
-      float *in = (float *)i + index;
-      float *out = (float *)o + index;
-      float *m = (float *)mask + y * roi_out->width;
-      _blend_make_mask(cst, d->blendif, d->blendif_parameters, opacity, in, out, m, stride);
+      _blend_mask_func *make_mask = cst == iop_cs_Lab ? _blend_make_mask_Lab : _blend_make_mask_rgb;
+
+#ifdef _OPENMP
+#if !defined(__SUNOS__) && !defined(__NetBSD__)
+      #pragma omp parallel for default(none) shared(i,roi_out,o,mask,make_mask,d,stderr,ch)
+#else
+      #pragma omp parallel for shared(i,roi_out,o,mask,make_mask,d,ch)
+#endif
+
+#endif
+      for (int y=0; y<roi_out->height; y++)
+      {
+        int index = ch * y * roi_out->width;
+        int stride = ch * roi_out->width;
+        float *in = (float *)i + index;
+        float *out = (float *)o + index;
+        float *m = (float *)mask + y * roi_out->width;
+        make_mask(d->blendif, d->blendif_parameters, opacity, in, out, m, stride);
+      }
     }
 
     if(maskblur)
@@ -60,6 +60,7 @@ struct dt_develop_tiling_t;
 #define IOP_FLAGS_ALLOW_TILING         16                       // Does allow tile-wise processing (valid for CPU and GPU processing)
 #define IOP_FLAGS_HIDDEN               32                       // Hide the iop from userinterface
 #define IOP_FLAGS_TILING_FULL_ROI      64                       // Tiling code has to expect arbitrary roi's for this module (incl. flipping, mirroring etc.)
+#define IOP_FLAGS_ALLOW_PARALLEL_TILING 128                     // process() is reentrant and leaves processed_maximum alone: cpu tiles may be processed concurrently
 
 typedef struct dt_iop_params_t
 {
@@ -20,6 +20,8 @@
 #include "develop/pixelpipe_hb.h"
 #include "libs/lib.h"
 #include <stdlib.h>
+#include <float.h>
+#include <math.h>
 
 
 // TODO: make cache global (needs to be thread safe then)
@@ -31,14 +33,27 @@
 //   ping, pong, and priority buffer (focused plugin)
 // - drop read by the time another is requested (with priority, drop that, or alternating ping and pong?)
 
+#define DT_DEV_PIXELPIPE_CACHE_INVALID ((uint64_t)-1)
+
 int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, int size)
 {
-  cache->entries = entries;
-  cache->data = (void **)malloc(sizeof(void *)*entries);
-  cache->size = (size_t *)malloc(sizeof(size_t)*entries);
-  cache->hash = (uint64_t *)malloc(sizeof(uint64_t)*entries);
-  cache->used = (int32_t *)malloc(sizeof(int32_t)*entries);
-  memset(cache->data,0,sizeof(void *)*entries);
+  // allow more, smaller lines within the same budget:
+  const int max_entries = 4*entries;
+  cache->entries = 0;
+  cache->max_entries = max_entries;
+  cache->data = (void **)malloc(sizeof(void *)*max_entries);
+  cache->size = (size_t *)malloc(sizeof(size_t)*max_entries);
+  cache->hash = (uint64_t *)malloc(sizeof(uint64_t)*max_entries);
+  cache->used = (int64_t *)malloc(sizeof(int64_t)*max_entries);
+  cache->cost = (float *)malloc(sizeof(float)*max_entries);
+  memset(cache->data,0,sizeof(void *)*max_entries);
+  cache->lines = g_hash_table_new(g_int64_hash, g_int64_equal);
+  cache->memory = 0;
+  cache->max_memory = (size_t)entries*size;
+  cache->mru = -1;
+  cache->pinned = NULL;
+  cache->tick = 0;
+  // allocate the expected working set right away, so we fail early:
   for(int k=0; k<entries; k++)
   {
     cache->data[k] = (void *)dt_alloc_align(16, size);
@@ -48,10 +63,14 @@ int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, in
 #ifdef _DEBUG
     memset(cache->data[k], 0x5d, size);
 #endif
-    cache->hash[k] = -1;
+    cache->hash[k] = DT_DEV_PIXELPIPE_CACHE_INVALID;
     cache->used[k] = 0;
+    cache->cost[k] = 0.0f;
+    cache->entries++;
+    cache->memory += size;
   }
-  cache->queries = cache->misses = 0;
+  cache->queries = cache->misses = cache->evictions = cache->allocations = 0;
+  cache->peak_memory = cache->memory;
   return 1;
 
 alloc_memory_fail:
@@ -65,6 +84,8 @@ alloc_memory_fail:
   free(cache->size);
   free(cache->hash);
   free(cache->used);
+  free(cache->cost);
+  g_hash_table_destroy(cache->lines);
 
   return 0;
 
@@ -77,6 +98,8 @@ void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache)
   free(cache->hash);
   free(cache->used);
   free(cache->size);
+  free(cache->cost);
+  g_hash_table_destroy(cache->lines);
 }
 
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_pixelpipe_t *pipe, int module)
@@ -114,11 +137,128 @@ uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_
   return hash;
 }
 
+static inline int _line_of_hash(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
+{
+  return GPOINTER_TO_INT(g_hash_table_lookup(cache->lines, &hash)) - 1;
+}
+
+static inline int _line_of_data(dt_dev_pixelpipe_cache_t *cache, const void *data)
+{
+  for(int k=0; k<cache->entries; k++) if(cache->data[k] == data) return k;
+  return -1;
+}
+
+static void _set_hash(dt_dev_pixelpipe_cache_t *cache, const int k, const uint64_t hash)
+{
+  if(cache->hash[k] != DT_DEV_PIXELPIPE_CACHE_INVALID && _line_of_hash(cache, cache->hash[k]) == k)
+    g_hash_table_remove(cache->lines, &cache->hash[k]);
+  cache->hash[k] = hash;
+  // the table keys point into cache->hash, which is never reallocated.
+  if(hash != DT_DEV_PIXELPIPE_CACHE_INVALID)
+    g_hash_table_replace(cache->lines, &cache->hash[k], GINT_TO_POINTER(k+1));
+}
+
+// lower is more valuable. buffers that took 2^n milliseconds to compute are kept n requests longer.
+static inline float _score(const dt_dev_pixelpipe_cache_t *cache, const int k)
+{
+  if(cache->hash[k] == DT_DEV_PIXELPIPE_CACHE_INVALID) return FLT_MAX;
+  return (float)(cache->tick - cache->used[k]) - log2f(1.0f + 1000.0f*cache->cost[k]);
+}
+
+// round up to 1/8 octave, so lines for similar roi can be recycled.
+static inline size_t _bucket_size(const size_t size)
+{
+  size_t step = 1;
+  while(step < size/8) step <<= 1;
+  return ((size + step - 1)/step)*step;
+}
+
+static int _victim(const dt_dev_pixelpipe_cache_t *cache)
+{
+  int victim = -1;
+  float max = -FLT_MAX;
+  for(int k=0; k<cache->entries; k++)
+  {
+    if(k == cache->mru || cache->data[k] == cache->pinned) continue;
+    const float score = _score(cache, k);
+    if(victim < 0 || score > max)
+    {
+      max = score;
+      victim = k;
+    }
+  }
+  return victim;
+}
+
+static void _free_line(dt_dev_pixelpipe_cache_t *cache, const int k)
+{
+  _set_hash(cache, k, DT_DEV_PIXELPIPE_CACHE_INVALID);
+  free(cache->data[k]);
+  cache->memory -= cache->size[k];
+  // move last line into the gap:
+  const int last = --cache->entries;
+  if(k != last)
+  {
+    const uint64_t hash = cache->hash[last];
+    _set_hash(cache, last, DT_DEV_PIXELPIPE_CACHE_INVALID);
+    cache->data[k] = cache->data[last];
+    cache->size[k] = cache->size[last];
+    cache->used[k] = cache->used[last];
+    cache->cost[k] = cache->cost[last];
+    cache->hash[k] = DT_DEV_PIXELPIPE_CACHE_INVALID;
+    _set_hash(cache, k, hash);
+    if(cache->mru == last) cache->mru = k;
+  }
+  cache->data[last] = NULL;
+}
+
+// find or make room for a line of at least size bytes.
+static int _get_line(dt_dev_pixelpipe_cache_t *cache, const size_t size)
+{
+  // recycle an invalid line of about the right size:
+  for(int k=0; k<cache->entries; k++)
+    if(k != cache->mru && cache->data[k] != cache->pinned &&
+        cache->hash[k] == DT_DEV_PIXELPIPE_CACHE_INVALID && cache->size[k] >= size && cache->size[k] <= 2*size)
+      return k;
+
+  const size_t bucket = _bucket_size(size);
+  while(1)
+  {
+    if(cache->memory + bucket <= cache->max_memory && cache->entries < cache->max_entries) break;
+    const int victim = _victim(cache);
+    // only the mru and pinned lines left: go over budget rather than fail.
+    if(victim < 0) break;
+    if(cache->hash[victim] != DT_DEV_PIXELPIPE_CACHE_INVALID) cache->evictions++;
+    if(cache->size[victim] >= size && cache->size[victim] <= 2*size)
+    {
+      _set_hash(cache, victim, DT_DEV_PIXELPIPE_CACHE_INVALID);
+      return victim;
+    }
+    _free_line(cache, victim);
+  }
+
+  const int k = cache->entries;
+  if(k >= cache->max_entries) return -1;
+  cache->data[k] = (void *)dt_alloc_align(16, bucket);
+  if(!cache->data[k])
+  {
+    fprintf(stderr, "[pixelpipe_cache] failed to allocate %zu bytes\n", bucket);
+    return -1;
+  }
+  cache->size[k] = bucket;
+  cache->hash[k] = DT_DEV_PIXELPIPE_CACHE_INVALID;
+  cache->used[k] = cache->tick;
+  cache->cost[k] = 0.0f;
+  cache->entries++;
+  cache->memory += bucket;
+  cache->allocations++;
+  if(cache->memory > cache->peak_memory) cache->peak_memory = cache->memory;
+  return k;
+}
+
 int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
 {
-  // search for hash in cache
-  for(int k=0; k<cache->entries; k++) if(cache->hash[k] == hash) return 1;
-  return 0;
+  return _line_of_hash(cache, hash) >= 0;
 }
 
 int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data)
@@ -134,74 +274,58 @@ int dt_dev_pixelpipe_cache_get(dt_dev_pixelpipe_cache_t *cache, const uint64_t h
 int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data, int weight)
 {
   cache->queries ++;
+  cache->tick ++; // age all entries
   *data = NULL;
-  int max_used = -1, max = 0;
-  size_t sz = 0;
-  for(int k=0; k<cache->entries; k++)
+  int k = _line_of_hash(cache, hash);
+  if(k >= 0 && cache->size[k] >= size)
   {
-    // search for hash in cache
-    if(cache->used[k] > max_used)
-    {
-      max_used = cache->used[k];
-      max = k;
-    }
-    cache->used[k]++; // age all entries
-    if(cache->hash[k] == hash)
-    {
-      *data = cache->data[k];
-      sz = cache->size[k];
-      cache->used[k] = weight; // this is the MRU entry
-    }
+    *data = cache->data[k];
+    cache->used[k] = cache->tick - weight; // this is the MRU entry
+    cache->mru = k;
+    return 0;
   }
 
-  if(!*data || sz < size)
-  {
-    // kill LRU entry
-    // printf("[pixelpipe_cache_get] hash not found, returning slot %d/%d age %d\n", max, cache->entries, weight);
-    if(cache->size[max] < size)
-    {
-      free(cache->data[max]);
-      cache->data[max] = (void *)dt_alloc_align(16, size);
-      cache->size[max] = size;
-    }
-    *data = cache->data[max];
-    cache->hash[max] = hash;
-    cache->used[max] = weight;
-    cache->misses++;
-    return 1;
-  }
-  else return 0;
+  // stale line with this hash is too small, it will be recycled first.
+  if(k >= 0) _set_hash(cache, k, DT_DEV_PIXELPIPE_CACHE_INVALID);
+  cache->misses++;
+  k = _get_line(cache, size);
+  // no buffer at all, *data stays NULL:
+  if(k < 0) return -1;
+  *data = cache->data[k];
+  _set_hash(cache, k, hash);
+  cache->used[k] = cache->tick - weight;
+  cache->cost[k] = 0.0f;
+  cache->mru = k;
+  return 1;
 }
 
 void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache)
 {
+  g_hash_table_remove_all(cache->lines);
   for(int k=0; k<cache->entries; k++)
   {
-    cache->hash[k] = -1;
+    cache->hash[k] = DT_DEV_PIXELPIPE_CACHE_INVALID;
     cache->used[k] = 0;
+    cache->cost[k] = 0.0f;
   }
 }
 
 void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data)
 {
-  for(int k=0; k<cache->entries; k++)
-  {
-    if(cache->data[k] == data)
-    {
-      cache->used[k] = -cache->entries;
-    }
-  }
+  const int k = _line_of_data(cache, data);
+  if(k >= 0) cache->used[k] = cache->tick + cache->entries;
+}
+
+void dt_dev_pixelpipe_cache_set_cost(dt_dev_pixelpipe_cache_t *cache, void *data, const float cost)
+{
+  const int k = _line_of_data(cache, data);
+  if(k >= 0) cache->cost[k] = cost;
 }
 
 void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *data)
 {
-  for(int k=0; k<cache->entries; k++)
-  {
-    if(cache->data[k] == data)
-    {
-      cache->hash[k] = -1;
-    }
-  }
+  const int k = _line_of_data(cache, data);
+  if(k >= 0) _set_hash(cache, k, DT_DEV_PIXELPIPE_CACHE_INVALID);
 }
 
 void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache)
@@ -209,10 +333,12 @@ void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache)
   for(int k=0; k<cache->entries; k++)
   {
     printf("pixelpipe cacheline %d ", k);
-    printf("used %d by %"PRIu64"", cache->used[k], cache->hash[k]);
+    printf("age %"PRId64" cost %.3fs size %zu by %"PRIu64"", cache->tick - cache->used[k], cache->cost[k], cache->size[k], cache->hash[k]);
     printf("\n");
   }
   printf("cache hit rate so far: %.3f\n", (cache->queries - cache->misses)/(float)cache->queries);
+  printf("cache memory %zu/%zu bytes (peak %zu), %"PRIu64" allocations, %"PRIu64" evictions\n",
+         cache->memory, cache->max_memory, cache->peak_memory, cache->allocations, cache->evictions);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
@@ -19,29 +19,50 @@
 #define DT_PIXELPIPE_CACHE_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <glib.h>
 /**
- * implements a simple pixel cache suitable for caching float images
+ * implements a pixel cache suitable for caching float images
  * corresponding to history items and zoom/pan settings in the develop module.
- * it is optimized for very few entries (~5), so most operations are O(N).
+ * cache lines have variable size and are evicted once a byte budget is exceeded.
+ * lines are looked up by hash, the victim is chosen by age, where buffers that
+ * took long to compute age slower than cheap ones.
  */
 struct dt_dev_pixelpipe_t;
 typedef struct dt_dev_pixelpipe_cache_t
 {
-  int32_t  entries;
+  // number of allocated cache lines and maximum number of lines
+  int32_t  entries, max_entries;
   void    **data;
   size_t   *size;
   uint64_t *hash;
-  int32_t  *used;
+  // time stamp of last use, shifted by the weight of the request
+  int64_t  *used;
+  // processing time in seconds that went into the buffer
+  float    *cost;
 #ifdef HAVE_OPENCL
   void    **gpu_mem;
 #endif
+  // hash -> line+1
+  GHashTable *lines;
+  // most recently requested line, never evicted (it is the input of the current module)
+  int32_t  mru;
+  // buffer currently shown as the pipe's backbuf, never recycled (read concurrently by the gui)
+  void    *pinned;
+  int64_t  tick;
+  // allocated bytes and soft budget
+  size_t   memory, max_memory;
   // profiling:
   uint64_t queries;
   uint64_t misses;
+  uint64_t evictions;
+  uint64_t allocations;
+  size_t   peak_memory;
 }
 dt_dev_pixelpipe_cache_t;
 
 /** constructs a new cache with given cache line count (entries) and float buffer entry size in bytes.
+  * the product of both is the memory budget, up to 4*entries lines of smaller size can be held.
 	\param[out] returns 0 if fail to allocate mem cache.
 */
 int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, int size);
@@ -53,7 +74,7 @@ uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const struct dt_iop_roi_t *roi,
 
 /** returns the float data buffer for the given hash from the cache. if the hash does not match any
   * cache line, the least recently used cache line will be cleared and an empty buffer is returned
-  * together with a non-zero return value. */
+  * together with a return value of 1. if no buffer can be had at all, -1 is returned and data is NULL. */
 int dt_dev_pixelpipe_cache_get(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data);
 int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data);
 int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data, int weight);
@@ -67,6 +88,9 @@ void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache);
 /** makes this buffer very important after it has been pulled from the cache. */
 void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data);
 
+/** record how long it took (in seconds) to compute this buffer, expensive buffers are kept longer. */
+void dt_dev_pixelpipe_cache_set_cost(dt_dev_pixelpipe_cache_t *cache, void *data, const float cost);
+
 /** mark the given cache line pointer as invalid. */
 void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *data);
 
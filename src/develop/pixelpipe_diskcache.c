@@ -0,0 +1,514 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "common/file_location.h"
+#include "common/image.h"
+#include "control/conf.h"
+#include "develop/pixelpipe_diskcache.h"
+#include "develop/pixelpipe_hb.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <glib/gstdio.h>
+
+#define DT_PIXELPIPE_DISKCACHE_MAGIC 0xD7CAC4E
+#define DT_PIXELPIPE_DISKCACHE_VERSION 2
+#define DT_PIXELPIPE_DISKCACHE_DIR "pixelpipe"
+// conservative sustained write rate in bytes/second. buffers that were cheaper
+// to compute than to write are not stored.
+#define DT_PIXELPIPE_DISKCACHE_BANDWIDTH (100.0*1024.0*1024.0)
+// most bytes of copied buffers waiting for the writer thread. larger buffers are not stored,
+// and nothing is queued while the writer is that far behind.
+#define DT_PIXELPIPE_DISKCACHE_MAX_PENDING (512*1024*1024)
+
+typedef struct dt_dev_pixelpipe_diskcache_header_t
+{
+  int32_t magic;
+  int32_t version;
+  uint64_t hash;
+  uint64_t size;
+  // identity of the input file, see dt_dev_pixelpipe_diskcache_image()
+  uint64_t image;
+  int32_t imgid;
+  float processed_maximum[3];
+}
+dt_dev_pixelpipe_diskcache_header_t;
+
+typedef struct dt_dev_pixelpipe_diskcache_entry_t
+{
+  uint64_t hash;
+  uint64_t size;
+  uint64_t tick;
+  int32_t imgid;
+}
+dt_dev_pixelpipe_diskcache_entry_t;
+
+// a copy of a module output, queued for the writer thread.
+typedef struct dt_dev_pixelpipe_diskcache_job_t
+{
+  dt_dev_pixelpipe_diskcache_header_t header;
+  void *data;
+  gchar *op;
+  double cost;
+}
+dt_dev_pixelpipe_diskcache_job_t;
+
+static void
+_entry_filename(const dt_dev_pixelpipe_diskcache_t *cache, const uint64_t hash, char *filename, size_t len)
+{
+  snprintf(filename, len, "%s/%016"PRIx64".pc", cache->path, hash);
+}
+
+// the in-memory hash does not know about the input file, buffer dimensions or pipe type, which
+// may differ between pipes that see the same image id (full, export, another library ...). also
+// entries of other darktable versions are never picked up, module code might have changed.
+static uint64_t
+_disk_hash(const dt_dev_pixelpipe_t *pipe, const uint64_t hash)
+{
+  uint64_t h = hash;
+  h = ((h << 5) + h) ^ pipe->diskcache_image;
+  const char *version = PACKAGE_VERSION;
+  for(int i=0; version[i]; i++) h = ((h << 5) + h) ^ version[i];
+  h = ((h << 5) + h) ^ pipe->type;
+  h = ((h << 5) + h) ^ pipe->iwidth;
+  h = ((h << 5) + h) ^ pipe->iheight;
+  return h;
+}
+
+// colorout and everything after it depend on display and export profile settings, which
+// are not part of the params hash.
+static int
+_piece_before_colorout(const dt_dev_pixelpipe_t *pipe, const dt_dev_pixelpipe_iop_t *piece)
+{
+  for(GList *nodes = pipe->nodes; nodes; nodes = g_list_next(nodes))
+  {
+    const dt_dev_pixelpipe_iop_t *p = (const dt_dev_pixelpipe_iop_t *)nodes->data;
+    if(!strcmp(p->module->op, "colorout")) return 0;
+    if(p == piece) return 1;
+  }
+  return 0;
+}
+
+static int
+_pipe_enabled(const dt_dev_pixelpipe_t *pipe, const dt_dev_pixelpipe_iop_t *piece)
+{
+  if(!darktable.pixelpipe_diskcache || !piece || !pipe->diskcache_image) return 0;
+  if(pipe->type != DT_DEV_PIXELPIPE_FULL && pipe->type != DT_DEV_PIXELPIPE_EXPORT) return 0;
+  return _piece_before_colorout(pipe, piece);
+}
+
+static void
+_remove_entry(dt_dev_pixelpipe_diskcache_t *cache, dt_dev_pixelpipe_diskcache_entry_t *entry)
+{
+  char filename[DT_MAX_PATH_LEN];
+  _entry_filename(cache, entry->hash, filename, sizeof(filename));
+  g_unlink(filename);
+  cache->size -= entry->size;
+  // frees entry:
+  g_hash_table_remove(cache->entries, &entry->hash);
+}
+
+// expects cache->lock to be held.
+static void
+_evict(dt_dev_pixelpipe_diskcache_t *cache, const uint64_t required)
+{
+  while(cache->size + required > cache->max_size && g_hash_table_size(cache->entries) > 0)
+  {
+    dt_dev_pixelpipe_diskcache_entry_t *lru = NULL;
+    GHashTableIter it;
+    gpointer key, value;
+    g_hash_table_iter_init(&it, cache->entries);
+    while(g_hash_table_iter_next(&it, &key, &value))
+    {
+      dt_dev_pixelpipe_diskcache_entry_t *entry = (dt_dev_pixelpipe_diskcache_entry_t *)value;
+      if(!lru || entry->tick < lru->tick) lru = entry;
+    }
+    dt_print(DT_DEBUG_CACHE, "[pixelpipe_diskcache] evicting %016"PRIx64" (%"PRIu64" bytes)\n", lru->hash, lru->size);
+    _remove_entry(cache, lru);
+  }
+}
+
+typedef struct _mtime_t
+{
+  time_t mtime;
+  dt_dev_pixelpipe_diskcache_entry_t *entry;
+}
+_mtime_t;
+
+static gint
+_sort_by_mtime(gconstpointer a, gconstpointer b)
+{
+  const time_t ta = ((const _mtime_t *)a)->mtime, tb = ((const _mtime_t *)b)->mtime;
+  return (ta > tb) - (ta < tb);
+}
+
+static void
+_free_job(dt_dev_pixelpipe_diskcache_job_t *job)
+{
+  free(job->data);
+  g_free(job->op);
+  free(job);
+}
+
+// expects cache->lock to be held.
+static int
+_pending(const dt_dev_pixelpipe_diskcache_t *cache, const uint64_t hash)
+{
+  for(GList *l = cache->pending->head; l; l = g_list_next(l))
+    if(((const dt_dev_pixelpipe_diskcache_job_t *)l->data)->header.hash == hash) return 1;
+  return 0;
+}
+
+static void
+_write_job(dt_dev_pixelpipe_diskcache_t *cache, const dt_dev_pixelpipe_diskcache_job_t *job)
+{
+  const uint64_t h = job->header.hash;
+  const size_t size = job->header.size;
+  const uint64_t filesize = sizeof(dt_dev_pixelpipe_diskcache_header_t) + size;
+  char filename[DT_MAX_PATH_LEN], tmpname[DT_MAX_PATH_LEN];
+  _entry_filename(cache, h, filename, sizeof(filename));
+  snprintf(tmpname, sizeof(tmpname), "%s/%016"PRIx64".tmp", cache->path, h);
+
+  // write to a temporary and rename, so an interrupted write never leaves a valid looking entry.
+  FILE *f = fopen(tmpname, "wb");
+  if(!f) return;
+  int written = fwrite(&job->header, sizeof(job->header), 1, f) == 1 && fwrite(job->data, 1, size, f) == size;
+  written = (fclose(f) == 0) && written;
+  if(!written)
+  {
+    fprintf(stderr, "[pixelpipe_diskcache] failed to write `%s'\n", tmpname);
+    g_unlink(tmpname);
+    return;
+  }
+
+  dt_pthread_mutex_lock(&cache->lock);
+  int exists = g_hash_table_lookup(cache->entries, &h) != NULL;
+  if(!exists)
+  {
+    _evict(cache, filesize);
+    if(g_rename(tmpname, filename) == 0)
+    {
+      dt_dev_pixelpipe_diskcache_entry_t *entry = (dt_dev_pixelpipe_diskcache_entry_t *)malloc(sizeof(dt_dev_pixelpipe_diskcache_entry_t));
+      entry->hash = h;
+      entry->size = filesize;
+      entry->imgid = job->header.imgid;
+      entry->tick = ++cache->tick;
+      g_hash_table_insert(cache->entries, &entry->hash, entry);
+      cache->size += filesize;
+      cache->writes++;
+    }
+    else exists = 1;
+  }
+  dt_pthread_mutex_unlock(&cache->lock);
+  if(exists) g_unlink(tmpname);
+  else dt_print(DT_DEBUG_CACHE, "[pixelpipe_diskcache] stored output of `%s' as %016"PRIx64" (%zu bytes, cost %.3fs)\n",
+                  job->op, h, size, job->cost);
+}
+
+// writes queued buffers one after the other. a job stays queued until it is on disk,
+// so the same buffer isn't queued twice in the meantime.
+static void *
+_writer(void *arg)
+{
+  dt_dev_pixelpipe_diskcache_t *cache = (dt_dev_pixelpipe_diskcache_t *)arg;
+  dt_pthread_mutex_lock(&cache->lock);
+  while(1)
+  {
+    while(!cache->shutdown && g_queue_is_empty(cache->pending))
+      dt_pthread_cond_wait(&cache->cond, &cache->lock);
+    if(cache->shutdown) break;
+    dt_dev_pixelpipe_diskcache_job_t *job = (dt_dev_pixelpipe_diskcache_job_t *)g_queue_peek_head(cache->pending);
+    dt_pthread_mutex_unlock(&cache->lock);
+    _write_job(cache, job);
+    dt_pthread_mutex_lock(&cache->lock);
+    g_queue_pop_head(cache->pending);
+    cache->pending_size -= job->header.size;
+    _free_job(job);
+  }
+  dt_pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+dt_dev_pixelpipe_diskcache_t *dt_dev_pixelpipe_diskcache_init()
+{
+  if(!dt_conf_get_bool("cache_disk_pixelpipe")) return NULL;
+  const int max_mb = dt_conf_get_int("cache_disk_pixelpipe_size");
+  if(max_mb <= 0) return NULL;
+
+  char cachedir[DT_MAX_PATH_LEN];
+  dt_loc_get_user_cache_dir(cachedir, sizeof(cachedir));
+  gchar *path = g_build_filename(cachedir, DT_PIXELPIPE_DISKCACHE_DIR, NULL);
+  if(g_mkdir_with_parents(path, 0750))
+  {
+    fprintf(stderr, "[pixelpipe_diskcache] could not create directory `%s'\n", path);
+    g_free(path);
+    return NULL;
+  }
+
+  dt_dev_pixelpipe_diskcache_t *cache = (dt_dev_pixelpipe_diskcache_t *)malloc(sizeof(dt_dev_pixelpipe_diskcache_t));
+  memset(cache, 0, sizeof(dt_dev_pixelpipe_diskcache_t));
+  dt_pthread_mutex_init(&cache->lock, NULL);
+  cache->path = path;
+  cache->max_size = (uint64_t)max_mb * 1024 * 1024;
+  cache->entries = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free);
+  cache->pending = g_queue_new();
+  pthread_cond_init(&cache->cond, NULL);
+
+  // scan the directory. the file modification time is bumped on every hit,
+  // so it gives us the lru order of the previous session.
+  GDir *dir = g_dir_open(path, 0, NULL);
+  if(dir)
+  {
+    GArray *order = g_array_new(FALSE, FALSE, sizeof(_mtime_t));
+    const gchar *name;
+    while((name = g_dir_read_name(dir)))
+    {
+      char filename[DT_MAX_PATH_LEN];
+      snprintf(filename, sizeof(filename), "%s/%s", path, name);
+      if(!g_str_has_suffix(name, ".pc"))
+      {
+        // leftovers from interrupted writes:
+        if(g_str_has_suffix(name, ".tmp")) g_unlink(filename);
+        continue;
+      }
+      dt_dev_pixelpipe_diskcache_header_t header;
+      struct stat st;
+      FILE *f = fopen(filename, "rb");
+      int valid = f && fread(&header, sizeof(header), 1, f) == 1 && !fstat(fileno(f), &st);
+      if(f) fclose(f);
+      valid = valid &&
+              header.magic == DT_PIXELPIPE_DISKCACHE_MAGIC &&
+              header.version == DT_PIXELPIPE_DISKCACHE_VERSION &&
+              (uint64_t)st.st_size == sizeof(header) + header.size;
+      if(!valid || g_hash_table_lookup(cache->entries, &header.hash))
+      {
+        g_unlink(filename);
+        continue;
+      }
+      dt_dev_pixelpipe_diskcache_entry_t *entry = (dt_dev_pixelpipe_diskcache_entry_t *)malloc(sizeof(dt_dev_pixelpipe_diskcache_entry_t));
+      entry->hash = header.hash;
+      entry->size = st.st_size;
+      entry->imgid = header.imgid;
+      entry->tick = 0;
+      g_hash_table_insert(cache->entries, &entry->hash, entry);
+      cache->size += entry->size;
+      const _mtime_t o = { st.st_mtime, entry };
+      g_array_append_val(order, o);
+    }
+    g_dir_close(dir);
+
+    g_array_sort(order, _sort_by_mtime);
+    for(int k=0; k<order->len; k++)
+      g_array_index(order, _mtime_t, k).entry->tick = ++cache->tick;
+    g_array_free(order, TRUE);
+  }
+  // budget might have been reduced in the meantime:
+  _evict(cache, 0);
+
+  dt_print(DT_DEBUG_CACHE, "[pixelpipe_diskcache] %d entries, %"PRIu64"/%"PRIu64" MB in `%s'\n",
+           g_hash_table_size(cache->entries), cache->size/(1024*1024), cache->max_size/(1024*1024), cache->path);
+
+  // without the writer thread, reading stored entries still works.
+  cache->writer_running = !pthread_create(&cache->writer, NULL, _writer, cache);
+  if(!cache->writer_running)
+    fprintf(stderr, "[pixelpipe_diskcache] could not start writer thread, not storing new buffers\n");
+  return cache;
+}
+
+void dt_dev_pixelpipe_diskcache_cleanup(dt_dev_pixelpipe_diskcache_t *cache)
+{
+  if(!cache) return;
+  if(cache->writer_running)
+  {
+    // buffers still waiting are dropped, they are only a cache.
+    dt_pthread_mutex_lock(&cache->lock);
+    cache->shutdown = 1;
+    pthread_cond_signal(&cache->cond);
+    dt_pthread_mutex_unlock(&cache->lock);
+    pthread_join(cache->writer, NULL);
+  }
+  dt_dev_pixelpipe_diskcache_job_t *job;
+  while((job = (dt_dev_pixelpipe_diskcache_job_t *)g_queue_pop_head(cache->pending))) _free_job(job);
+  g_queue_free(cache->pending);
+  pthread_cond_destroy(&cache->cond);
+  if(darktable.unmuted & DT_DEBUG_CACHE) dt_dev_pixelpipe_diskcache_print(cache);
+  g_hash_table_destroy(cache->entries);
+  g_free(cache->path);
+  dt_pthread_mutex_destroy(&cache->lock);
+  free(cache);
+}
+
+uint64_t dt_dev_pixelpipe_diskcache_image(dt_dev_pixelpipe_diskcache_t *cache, const int imgid)
+{
+  if(!cache || imgid <= 0) return 0;
+  char filename[DT_MAX_PATH_LEN];
+  dt_image_full_path(imgid, filename, sizeof(filename));
+  struct stat st;
+  if(stat(filename, &st)) return 0;
+  uint64_t h = 5381;
+  for(int i=0; filename[i]; i++) h = ((h << 5) + h) ^ filename[i];
+  h = ((h << 5) + h) ^ (uint64_t)st.st_size;
+  h = ((h << 5) + h) ^ (uint64_t)st.st_mtime;
+  // 0 means unusable:
+  return h ? h : 1;
+}
+
+int dt_dev_pixelpipe_diskcache_available(dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece, const uint64_t hash, const size_t size)
+{
+  if(!_pipe_enabled(pipe, piece)) return 0;
+  dt_dev_pixelpipe_diskcache_t *cache = darktable.pixelpipe_diskcache;
+  const uint64_t h = _disk_hash(pipe, hash);
+  dt_pthread_mutex_lock(&cache->lock);
+  cache->queries++;
+  const dt_dev_pixelpipe_diskcache_entry_t *entry = g_hash_table_lookup(cache->entries, &h);
+  const int available = entry && entry->size == sizeof(dt_dev_pixelpipe_diskcache_header_t) + size;
+  dt_pthread_mutex_unlock(&cache->lock);
+  return available;
+}
+
+int dt_dev_pixelpipe_diskcache_read(dt_dev_pixelpipe_t *pipe, const uint64_t hash, const size_t size, void *data, float *processed_maximum)
+{
+  dt_dev_pixelpipe_diskcache_t *cache = darktable.pixelpipe_diskcache;
+  if(!cache) return 1;
+  const uint64_t h = _disk_hash(pipe, hash);
+  dt_dev_pixelpipe_diskcache_entry_t *entry = NULL;
+  dt_dev_pixelpipe_diskcache_header_t header;
+  char filename[DT_MAX_PATH_LEN];
+  _entry_filename(cache, h, filename, sizeof(filename));
+
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0) goto error;
+  if(read(fd, &header, sizeof(header)) != sizeof(header) ||
+     header.magic != DT_PIXELPIPE_DISKCACHE_MAGIC || header.hash != h || header.size != size ||
+     header.image != pipe->diskcache_image)
+  {
+    close(fd);
+    goto error;
+  }
+  // straight into the cache line:
+  size_t done = 0;
+  while(done < size)
+  {
+    const ssize_t rd = read(fd, (char *)data + done, size - done);
+    if(rd <= 0) break;
+    done += rd;
+  }
+  close(fd);
+  if(done != size) goto error;
+  for(int k=0; k<3; k++) processed_maximum[k] = header.processed_maximum[k];
+
+  // bump lru order, in memory and for the next session:
+  utimes(filename, NULL);
+  dt_pthread_mutex_lock(&cache->lock);
+  entry = g_hash_table_lookup(cache->entries, &h);
+  if(entry) entry->tick = ++cache->tick;
+  cache->hits++;
+  dt_pthread_mutex_unlock(&cache->lock);
+  dt_print(DT_DEBUG_CACHE, "[pixelpipe_diskcache] hit %016"PRIx64" (%zu bytes)\n", h, size);
+  return 0;
+
+error:
+  dt_print(DT_DEBUG_CACHE, "[pixelpipe_diskcache] could not read `%s', dropping it\n", filename);
+  dt_pthread_mutex_lock(&cache->lock);
+  entry = g_hash_table_lookup(cache->entries, &h);
+  if(entry) _remove_entry(cache, entry);
+  dt_pthread_mutex_unlock(&cache->lock);
+  return 1;
+}
+
+int dt_dev_pixelpipe_diskcache_write(dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece, const uint64_t hash, const size_t size, const void *data, const float *processed_maximum, const double cost)
+{
+  if(!_pipe_enabled(pipe, piece)) return 1;
+  dt_dev_pixelpipe_diskcache_t *cache = darktable.pixelpipe_diskcache;
+  if(!cache->writer_running) return 1;
+  const uint64_t filesize = sizeof(dt_dev_pixelpipe_diskcache_header_t) + size;
+  // not worth it, or would flush most of the cache:
+  if(cost < size / DT_PIXELPIPE_DISKCACHE_BANDWIDTH) return 1;
+  if(filesize > cache->max_size / 4 || size > DT_PIXELPIPE_DISKCACHE_MAX_PENDING) return 1;
+
+  const uint64_t h = _disk_hash(pipe, hash);
+  dt_pthread_mutex_lock(&cache->lock);
+  const int exists = g_hash_table_lookup(cache->entries, &h) != NULL || _pending(cache, h);
+  const int busy = cache->pending_size + size > DT_PIXELPIPE_DISKCACHE_MAX_PENDING;
+  dt_pthread_mutex_unlock(&cache->lock);
+  if(exists) return 0;
+  if(busy) return 1;
+
+  dt_dev_pixelpipe_diskcache_job_t *job = (dt_dev_pixelpipe_diskcache_job_t *)malloc(sizeof(dt_dev_pixelpipe_diskcache_job_t));
+  if(!job) return 1;
+  job->data = dt_alloc_align(16, size);
+  if(!job->data)
+  {
+    free(job);
+    return 1;
+  }
+  memcpy(job->data, data, size);
+  memset(&job->header, 0, sizeof(job->header));
+  job->header.magic = DT_PIXELPIPE_DISKCACHE_MAGIC;
+  job->header.version = DT_PIXELPIPE_DISKCACHE_VERSION;
+  job->header.hash = h;
+  job->header.size = size;
+  job->header.image = pipe->diskcache_image;
+  job->header.imgid = pipe->image.id;
+  for(int k=0; k<3; k++) job->header.processed_maximum[k] = processed_maximum[k];
+  job->op = g_strdup(piece->module->op);
+  job->cost = cost;
+
+  dt_pthread_mutex_lock(&cache->lock);
+  g_queue_push_tail(cache->pending, job);
+  cache->pending_size += size;
+  pthread_cond_signal(&cache->cond);
+  dt_pthread_mutex_unlock(&cache->lock);
+  return 0;
+}
+
+void dt_dev_pixelpipe_diskcache_remove_image(dt_dev_pixelpipe_diskcache_t *cache, const int imgid)
+{
+  if(!cache) return;
+  dt_pthread_mutex_lock(&cache->lock);
+  GList *victims = NULL;
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, cache->entries);
+  while(g_hash_table_iter_next(&it, &key, &value))
+    if(((dt_dev_pixelpipe_diskcache_entry_t *)value)->imgid == imgid) victims = g_list_prepend(victims, value);
+  for(GList *v = victims; v; v = g_list_next(v))
+    _remove_entry(cache, (dt_dev_pixelpipe_diskcache_entry_t *)v->data);
+  g_list_free(victims);
+  dt_pthread_mutex_unlock(&cache->lock);
+}
+
+void dt_dev_pixelpipe_diskcache_print(dt_dev_pixelpipe_diskcache_t *cache)
+{
+  if(!cache) return;
+  dt_pthread_mutex_lock(&cache->lock);
+  printf("[pixelpipe_diskcache] %d entries, %"PRIu64"/%"PRIu64" MB, %"PRIu64" writes\n",
+         g_hash_table_size(cache->entries), cache->size/(1024*1024), cache->max_size/(1024*1024), cache->writes);
+  printf("[pixelpipe_diskcache] hit rate so far: %.3f\n", cache->queries ? cache->hits/(float)cache->queries : 0.0f);
+  dt_pthread_mutex_unlock(&cache->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,89 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_PIXELPIPE_DISKCACHE_H
+#define DT_PIXELPIPE_DISKCACHE_H
+
+#include "common/dtpthread.h"
+#include <inttypes.h>
+#include <glib.h>
+
+/**
+ * optional second tier behind dt_dev_pixelpipe_cache_t: a size capped directory of
+ * module outputs in the user cache dir, keyed by dt_dev_pixelpipe_cache_hash().
+ * entries survive pipe teardown and restarts, so reopening an image in darkroom or
+ * re-exporting it resumes at the deepest stored module. least recently used entries
+ * are evicted once the byte budget is exceeded. only modules before colorout are
+ * stored, since later ones depend on display/export settings not covered by the hash.
+ */
+typedef struct dt_dev_pixelpipe_diskcache_t
+{
+  dt_pthread_mutex_t lock;
+  // directory holding the entries
+  gchar *path;
+  // uint64_t hash -> dt_dev_pixelpipe_diskcache_entry_t
+  GHashTable *entries;
+  // bytes on disk and budget
+  uint64_t size, max_size;
+  // monotonic access counter for lru order
+  uint64_t tick;
+  // buffers waiting for the writer thread, and their bytes
+  GQueue *pending;
+  uint64_t pending_size;
+  pthread_t writer;
+  pthread_cond_t cond;
+  int writer_running, shutdown;
+  // profiling:
+  uint64_t queries;
+  uint64_t hits;
+  uint64_t writes;
+}
+dt_dev_pixelpipe_diskcache_t;
+
+struct dt_dev_pixelpipe_t;
+struct dt_dev_pixelpipe_iop_t;
+
+/** reads the index of stored entries from disk. returns the cache or NULL if disabled in prefs. */
+dt_dev_pixelpipe_diskcache_t *dt_dev_pixelpipe_diskcache_init();
+void dt_dev_pixelpipe_diskcache_cleanup(dt_dev_pixelpipe_diskcache_t *cache);
+
+/** identifies the file of the image by its full path, size and modification time, so entries are never
+ *  shared between different files which happen to have the same id (in another library, for example).
+ *  returns 0 if the disk cache is disabled or the file can't be found. */
+uint64_t dt_dev_pixelpipe_diskcache_image(dt_dev_pixelpipe_diskcache_t *cache, const int imgid);
+
+/** test if the output of this piece for the given hash can be read from disk. */
+int dt_dev_pixelpipe_diskcache_available(struct dt_dev_pixelpipe_t *pipe, struct dt_dev_pixelpipe_iop_t *piece, const uint64_t hash, const size_t size);
+
+/** copies the stored buffer into data, returns non-zero if that fails. */
+int dt_dev_pixelpipe_diskcache_read(struct dt_dev_pixelpipe_t *pipe, const uint64_t hash, const size_t size, void *data, float *processed_maximum);
+
+/** stores the output of the piece if the accumulated processing cost (in seconds)
+ *  outweighs the time to write it. the buffer is copied and written by a background thread,
+ *  so the pipe doesn't wait for the disk. returns non-zero if the buffer was not taken. */
+int dt_dev_pixelpipe_diskcache_write(struct dt_dev_pixelpipe_t *pipe, struct dt_dev_pixelpipe_iop_t *piece, const uint64_t hash, const size_t size, const void *data, const float *processed_maximum, const double cost);
+
+/** drops all stored buffers of the given image, for example when it is removed from the library. */
+void dt_dev_pixelpipe_diskcache_remove_image(dt_dev_pixelpipe_diskcache_t *cache, const int imgid);
+
+/** print out hit rate and usage (debug). */
+void dt_dev_pixelpipe_diskcache_print(dt_dev_pixelpipe_diskcache_t *cache);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
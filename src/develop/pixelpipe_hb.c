@@ -19,6 +19,7 @@
 #include "develop/pixelpipe.h"
 #include "develop/blend.h"
 #include "develop/tiling.h"
+#include "develop/pixelpipe_diskcache.h"
 #include "gui/gtk.h"
 #include "control/control.h"
 #include "control/signal.h"
@@ -98,6 +99,7 @@ int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, int32_t size, int32_t
   pipe->processed_height = pipe->backbuf_height = pipe->iheight = 0;
   pipe->nodes = NULL;
   pipe->backbuf_size = size;
+  dt_dev_pixelpipe_scratch_init(&(pipe->scratch));
   if(!dt_dev_pixelpipe_cache_init(&(pipe->cache), entries, pipe->backbuf_size))
     return 0;
   pipe->backbuf = NULL;
@@ -107,6 +109,8 @@ int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, int32_t size, int32_t
   pipe->tiling = 0;
   pipe->mask_display = 0;
   pipe->input_timestamp = 0;
+  pipe->diskcache_cost = 0.0;
+  pipe->diskcache_image = 0;
   dt_pthread_mutex_init(&(pipe->backbuf_mutex), NULL);
   dt_pthread_mutex_init(&(pipe->busy_mutex), NULL);
   return 1;
@@ -120,6 +124,9 @@ void dt_dev_pixelpipe_set_input(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, flo
   pipe->iscale = iscale;
   pipe->input = input;
   pipe->image = dev->image_storage;
+  // the preview pipe never goes to the disk cache, spare it the lookup:
+  pipe->diskcache_image = pipe->type == DT_DEV_PIXELPIPE_PREVIEW ? 0 :
+                          dt_dev_pixelpipe_diskcache_image(darktable.pixelpipe_diskcache, pipe->image.id);
 }
 
 void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe)
@@ -130,6 +137,7 @@ void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe)
   dt_dev_pixelpipe_cleanup_nodes(pipe);
   // so now it's safe to clean up cache:
   dt_dev_pixelpipe_cache_cleanup(&(pipe->cache));
+  dt_dev_pixelpipe_scratch_cleanup(&(pipe->scratch));
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
   dt_pthread_mutex_destroy(&(pipe->backbuf_mutex));
   dt_pthread_mutex_destroy(&(pipe->busy_mutex));
@@ -179,6 +187,9 @@ void dt_dev_pixelpipe_create_nodes(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev)
       piece->pipe    = pipe;
       piece->data = NULL;
       piece->hash = 0;
+      piece->process_time = 0.0;
+      piece->process_count = 0;
+      piece->scratch_factor = 0.0f;
       dt_iop_init_pipe(piece->module, pipe,piece);
       pipe->nodes = g_list_append(pipe->nodes, piece);
     }
@@ -338,6 +349,32 @@ pixelpipe_picker(dt_iop_module_t *module, const float *img, const dt_iop_roi_t *
 }
 
 
+// processes the module on the cpu, in tiles if it needs more memory than it may use.
+// untiled runs record how much memory the module really needed, scratch buffers included:
+// modules taking their temporaries from pipe->scratch may need more than they announce.
+static void
+pixelpipe_process_on_cpu(dt_dev_pixelpipe_t *pipe, dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece,
+                         void *input, void *output, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out,
+                         const int in_bpp, const int bpp, const dt_develop_tiling_t *tiling)
+{
+  const size_t width = max(roi_in->width, roi_out->width);
+  const size_t height = max(roi_in->height, roi_out->height);
+  const float factor = fmax(tiling->factor, piece->scratch_factor);
+  if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
+      !dt_tiling_piece_fits_host_memory(width, height, max(in_bpp, bpp), factor, tiling->overhead))
+  {
+    module->process_tiling(module, piece, input, output, roi_in, roi_out, in_bpp);
+    return;
+  }
+
+  // no scratch buffers are held between modules, so the peak is what this one used
+  dt_dev_pixelpipe_scratch_reset_peak(&pipe->scratch);
+  module->process(module, piece, input, output, roi_in, roi_out);
+  const size_t used = (size_t)roi_in->width*roi_in->height*in_bpp + (size_t)roi_out->width*roi_out->height*bpp
+                      + dt_dev_pixelpipe_scratch_get_peak(&pipe->scratch);
+  piece->scratch_factor = used / ((float)width*height*max(in_bpp, bpp));
+}
+
 // recursive helper for process:
 static int
 dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void **output, void **cl_mem_output, int *out_bpp,
@@ -380,12 +417,43 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     else      for(int k=0; k<3; k++) pipe->processed_maximum[k] = 1.0f;
     (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    if(!*output) return 1;
     if(!modules) return 0;
     // go to post-collect directly:
     goto post_process_collect_info;
   }
   else dt_pthread_mutex_unlock(&pipe->busy_mutex);
 
+  // 1b) if an earlier pipe stored this buffer on disk, load it into a new cache line
+  if(dt_dev_pixelpipe_diskcache_available(pipe, piece, hash, bufsize))
+  {
+    dt_pthread_mutex_lock(&pipe->busy_mutex);
+    if(pipe->shutdown)
+    {
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+      return 1;
+    }
+    (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
+    dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    if(!*output) return 1;
+    // read without holding the pipe, so changing or shutting it down doesn't wait for the disk.
+    // the line is only used by this thread, and the cache is freed only once processing is over.
+    float processed_maximum[3];
+    const int failed = dt_dev_pixelpipe_diskcache_read(pipe, hash, bufsize, *output, processed_maximum);
+    dt_pthread_mutex_lock(&pipe->busy_mutex);
+    if(!failed && !pipe->shutdown)
+    {
+      for(int k=0; k<3; k++) pipe->processed_maximum[k] = piece->processed_maximum[k] = processed_maximum[k];
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+      goto post_process_collect_info;
+    }
+    // read failed, don't leave garbage behind under this hash:
+    dt_dev_pixelpipe_cache_invalidate(&(pipe->cache), *output);
+    const int shutdown = pipe->shutdown;
+    dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    if(shutdown) return 1;
+  }
+
   // 2) if history changed or exit event, abort processing?
   // preview pipe: abort on all but zoom events (same buffer anyways)
   if(dt_iop_breakpoint(dev, pipe)) return 1;
@@ -413,9 +481,9 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       {
         *output = pipe->input;
       }
-      else if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output))
+      else if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output) > 0)
       {
-        memset(*output, 0, pipe->backbuf_size);
+        memset(*output, 0, bufsize);
         if(roi_in.scale == 1.0f)
         {
           // fast branch for 1:1 pixel copies.
@@ -450,7 +518,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     else
     {
       // reserve new cache line: output
-      if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output))
+      if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output) > 0)
       {
         roi_in.x /= roi_out->scale;
         roi_in.y /= roi_out->scale;
@@ -462,6 +530,8 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     }
     dt_show_times(&start, "[dev_pixelpipe]", "initing base buffer [%s]", _pipe_type_to_str(pipe->type));
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    // out of cache lines or memory:
+    if(!*output) return 1;
   }
   else
   {
@@ -482,9 +552,9 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     if(dt_dev_pixelpipe_process_rec(pipe, dev, &input, &cl_mem_input, &in_bpp, &roi_in, g_list_previous(modules), g_list_previous(pieces), pos-1)) return 1;
     piece = (dt_dev_pixelpipe_iop_t *)pieces->data;
 
-    // reserve new cache line: output
+    // reserve new cache line: output. give up before the next module if our job was cancelled.
     dt_pthread_mutex_lock(&pipe->busy_mutex);
-    if(pipe->shutdown)
+    if(pipe->shutdown || dt_control_job_cancelled())
     {
       dt_pthread_mutex_unlock(&pipe->busy_mutex);
       return 1;
@@ -494,6 +564,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     else
       (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    if(!*output) return 1;
 
     // if(module) printf("reserving new buf in cache for module %s %s: %ld buf %lX\n", module->op, pipe == dev->preview_pipe ? "[preview]" : "", hash, (long int)*output);
 
@@ -573,6 +644,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
 
     dt_times_t start;
     dt_get_times(&start);
+    const double wstart = dt_get_wtime();
 
     dt_develop_tiling_t tiling = { 0 };
     dt_develop_tiling_t tiling_blendop = { 0 };
@@ -768,12 +840,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
           }
 
           /* process module on cpu. use tiling if needed and possible. */
-          if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-              !dt_tiling_piece_fits_host_memory(max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
-                                                max(in_bpp, bpp), tiling.factor, tiling.overhead))
-            module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
-          else
-            module->process(module, piece, input, *output, &roi_in, roi_out);
+          pixelpipe_process_on_cpu(pipe, module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling);
 
           /* process blending on cpu */
           dt_develop_blend_process(module, piece, input, *output, &roi_in, roi_out);
@@ -815,12 +882,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
         }
 
         /* process module on cpu. use tiling if needed and possible. */
-        if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-            !dt_tiling_piece_fits_host_memory(max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
-                                              max(in_bpp, bpp), tiling.factor, tiling.overhead))
-          module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
-        else
-          module->process(module, piece, input, *output, &roi_in, roi_out);
+        pixelpipe_process_on_cpu(pipe, module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling);
 
         /* process blending */
         dt_develop_blend_process(module, piece, input, *output, &roi_in, roi_out);
@@ -841,12 +903,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       /* opencl is not inited or not enabled or we got no resource/device -> everything runs on cpu */
 
       /* process module on cpu. use tiling if needed and possible. */
-      if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-          !dt_tiling_piece_fits_host_memory(max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
-                                            max(in_bpp, bpp), tiling.factor, tiling.overhead))
-        module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
-      else
-        module->process(module, piece, input, *output, &roi_in, roi_out);
+      pixelpipe_process_on_cpu(pipe, module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling);
 
       // Lab color picking for module
       if(dev->gui_attached && pipe == dev->preview_pipe && // pick from preview pipe to get pixels outside the viewport
@@ -876,12 +933,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     }
 #else
     /* process module on cpu. use tiling if needed and possible. */
-    if((module->flags() & IOP_FLAGS_ALLOW_TILING) &&
-        !dt_tiling_piece_fits_host_memory(max(roi_in.width, roi_out->width), max(roi_in.height, roi_out->height),
-                                          max(in_bpp, bpp), tiling.factor, tiling.overhead))
-      module->process_tiling(module, piece, input, *output, &roi_in, roi_out, in_bpp);
-    else
-      module->process(module, piece, input, *output, &roi_in, roi_out);
+    pixelpipe_process_on_cpu(pipe, module, piece, input, *output, &roi_in, roi_out, in_bpp, bpp, &tiling);
 
     // Lab color picking for module
     if(dev->gui_attached && pipe == dev->preview_pipe && // pick from preview pipe to get pixels outside the viewport
@@ -914,6 +966,16 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
                   _pipe_type_to_str(pipe->type));
     // in case we get this buffer from the cache, also get the processed max:
     for(int k=0; k<3; k++) piece->processed_maximum[k] = pipe->processed_maximum[k];
+    // expensive buffers are kept longer in the cache:
+    const double wtime = dt_get_wtime() - wstart;
+    piece->process_time += wtime;
+    piece->process_count++;
+    dt_dev_pixelpipe_cache_set_cost(&(pipe->cache), *output, wtime);
+    // hand expensive results (accumulated since the last stored buffer) to the disk cache:
+    pipe->diskcache_cost += wtime;
+    if(*cl_mem_output == NULL &&
+        !dt_dev_pixelpipe_diskcache_write(pipe, piece, hash, bufsize, *output, piece->processed_maximum, pipe->diskcache_cost))
+      pipe->diskcache_cost = 0.0;
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
     if(module == darktable.develop->gui_module)
     {
@@ -1375,6 +1437,7 @@ restart:
 
   // mask display off as a starting point
   pipe->mask_display = 0;
+  pipe->diskcache_cost = 0.0;
 
   void *buf = NULL;
   void *cl_mem_out = NULL;
@@ -1384,6 +1447,9 @@ restart:
   // run pixelpipe recursively and get error status
   int err = dt_dev_pixelpipe_process_rec_and_backcopy(pipe, dev, &buf, &cl_mem_out, &out_bpp, &roi, modules, pieces, pos);
 
+  // keep the temporary buffers used in this run for the next one, free the others
+  dt_dev_pixelpipe_scratch_trim(&pipe->scratch);
+
   // get status summary of opencl queue by checking the eventlist
   if(pipe->devid >= 0) oclerr = (dt_opencl_events_flush(pipe->devid, 1) != 0);
 
@@ -1422,6 +1488,7 @@ restart:
   dt_pthread_mutex_lock(&pipe->backbuf_mutex);
   pipe->backbuf_hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, &roi, pipe, 0);
   pipe->backbuf = buf;
+  pipe->cache.pinned = buf;
   pipe->backbuf_width  = width;
   pipe->backbuf_height = height;
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
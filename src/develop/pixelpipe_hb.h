@@ -22,6 +22,7 @@
 #include "develop/imageop.h"
 #include "develop/develop.h"
 #include "develop/pixelpipe_cache.h"
+#include "develop/pixelpipe_scratch.h"
 
 /**
  * struct used by iop modules to connect to pixelpipe.
@@ -54,6 +55,9 @@ typedef struct dt_dev_pixelpipe_iop_t
   dt_iop_roi_t buf_in, buf_out;    // theoretical full buffer regions of interest, as passed through modify_roi_out
   int process_cl_ready;            // set this to 0 in commit_params to temporarily disable the use of process_cl
   float processed_maximum[3];      // sensor saturation after this iop, used internally for caching
+  double process_time;             // accumulated wall time of process() and blending, for benchmarks
+  int process_count;               // how often the piece was processed (not taken from cache)
+  float scratch_factor;            // memory the last untiled process() really used, in units of tiling->factor
 }
 dt_dev_pixelpipe_iop_t;
 
@@ -86,6 +90,8 @@ typedef struct dt_dev_pixelpipe_t
 {
   // store history/zoom caches
   dt_dev_pixelpipe_cache_t cache;
+  // temporary buffers of the modules
+  dt_dev_pixelpipe_scratch_t scratch;
   // input buffer
   float *input;
   // width and height of input buffer
@@ -120,6 +126,10 @@ typedef struct dt_dev_pixelpipe_t
   int tiling;
   // should this pixelpipe display a mask in the end?
   int mask_display;
+  // processing time spent since the last buffer was handed to the disk cache:
+  double diskcache_cost;
+  // identifies the input file (path, size and mtime) in the disk cache, 0 if it can't be used:
+  uint64_t diskcache_image;
   // input data based on this timestamp:
   int input_timestamp;
   dt_dev_pixelpipe_type_t type;
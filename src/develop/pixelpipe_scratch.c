@@ -0,0 +1,179 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "common/darktable.h"
+#include "develop/pixelpipe_scratch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct dt_dev_pixelpipe_scratch_buf_t
+{
+  void *data;
+  size_t size;
+  // pipe run the buffer was last handed out in
+  uint32_t run;
+}
+dt_dev_pixelpipe_scratch_buf_t;
+
+// four size classes per power of two, the smallest ones 1k apart: a request
+// gets at most a quarter more than it asked for, and buffers for the same
+// roi in successive runs always land in the same class.
+static size_t
+_class_size(const size_t size)
+{
+  size_t step = 1024;
+  while(size > 8*step) step <<= 1;
+  return MAX(4*step, (size + step - 1) / step * step);
+}
+
+static void
+_buf_free(dt_dev_pixelpipe_scratch_buf_t *buf)
+{
+  free(buf->data);
+  free(buf);
+}
+
+// frees idle buffers last used before the given run. call with lock held.
+static void
+_release_idle(dt_dev_pixelpipe_scratch_t *scratch, const uint32_t run)
+{
+  GList *l = scratch->idle;
+  while(l)
+  {
+    GList *next = g_list_next(l);
+    dt_dev_pixelpipe_scratch_buf_t *buf = (dt_dev_pixelpipe_scratch_buf_t *)l->data;
+    if(buf->run < run)
+    {
+      scratch->idle_size -= buf->size;
+      scratch->idle = g_list_delete_link(scratch->idle, l);
+      _buf_free(buf);
+    }
+    l = next;
+  }
+}
+
+void dt_dev_pixelpipe_scratch_init(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  memset(scratch, 0, sizeof(dt_dev_pixelpipe_scratch_t));
+  dt_pthread_mutex_init(&scratch->lock, NULL);
+  scratch->used = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)_buf_free);
+}
+
+void dt_dev_pixelpipe_scratch_cleanup(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  if(scratch->used == NULL) return;
+  if(g_hash_table_size(scratch->used))
+    dt_print(DT_DEBUG_MEMORY, "[pixelpipe_scratch] %d buffers still in use at cleanup\n", g_hash_table_size(scratch->used));
+  g_list_free_full(scratch->idle, (GDestroyNotify)_buf_free);
+  g_hash_table_destroy(scratch->used);
+  scratch->idle = NULL;
+  scratch->used = NULL;
+  dt_pthread_mutex_destroy(&scratch->lock);
+}
+
+void *dt_dev_pixelpipe_scratch_alloc(dt_dev_pixelpipe_scratch_t *scratch, const size_t size)
+{
+  const size_t class_size = _class_size(size);
+  dt_dev_pixelpipe_scratch_buf_t *buf = NULL;
+
+  dt_pthread_mutex_lock(&scratch->lock);
+  scratch->requests++;
+  for(GList *l = scratch->idle; l; l = g_list_next(l))
+  {
+    dt_dev_pixelpipe_scratch_buf_t *b = (dt_dev_pixelpipe_scratch_buf_t *)l->data;
+    if(b->size == class_size)
+    {
+      buf = b;
+      scratch->idle = g_list_delete_link(scratch->idle, l);
+      scratch->idle_size -= buf->size;
+      break;
+    }
+  }
+  if(!buf)
+  {
+    buf = (dt_dev_pixelpipe_scratch_buf_t *)malloc(sizeof(dt_dev_pixelpipe_scratch_buf_t));
+    buf->size = class_size;
+    buf->data = dt_alloc_align(64, class_size);
+    if(!buf->data)
+    {
+      // make room by dropping everything we kept, and try again
+      _release_idle(scratch, UINT32_MAX);
+      buf->data = dt_alloc_align(64, class_size);
+    }
+    if(!buf->data)
+    {
+      free(buf);
+      dt_pthread_mutex_unlock(&scratch->lock);
+      return NULL;
+    }
+    scratch->allocations++;
+  }
+  buf->run = scratch->run;
+  g_hash_table_insert(scratch->used, buf->data, buf);
+  scratch->in_use += buf->size;
+  scratch->peak = MAX(scratch->peak, scratch->in_use);
+  dt_pthread_mutex_unlock(&scratch->lock);
+  return buf->data;
+}
+
+void dt_dev_pixelpipe_scratch_free(dt_dev_pixelpipe_scratch_t *scratch, void *data)
+{
+  if(!data) return;
+  dt_pthread_mutex_lock(&scratch->lock);
+  dt_dev_pixelpipe_scratch_buf_t *buf = (dt_dev_pixelpipe_scratch_buf_t *)g_hash_table_lookup(scratch->used, data);
+  if(buf)
+  {
+    g_hash_table_steal(scratch->used, data);
+    scratch->in_use -= buf->size;
+    scratch->idle_size += buf->size;
+    scratch->idle = g_list_prepend(scratch->idle, buf);
+  }
+  else
+    dt_print(DT_DEBUG_MEMORY, "[pixelpipe_scratch] freeing unknown buffer %p\n", data);
+  dt_pthread_mutex_unlock(&scratch->lock);
+}
+
+void dt_dev_pixelpipe_scratch_reset_peak(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  dt_pthread_mutex_lock(&scratch->lock);
+  scratch->peak = scratch->in_use;
+  dt_pthread_mutex_unlock(&scratch->lock);
+}
+
+size_t dt_dev_pixelpipe_scratch_get_peak(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  dt_pthread_mutex_lock(&scratch->lock);
+  const size_t peak = scratch->peak;
+  dt_pthread_mutex_unlock(&scratch->lock);
+  return peak;
+}
+
+void dt_dev_pixelpipe_scratch_trim(dt_dev_pixelpipe_scratch_t *scratch)
+{
+  dt_pthread_mutex_lock(&scratch->lock);
+  _release_idle(scratch, scratch->run);
+  scratch->run++;
+  dt_print(DT_DEBUG_MEMORY, "[pixelpipe_scratch] %.1f MB kept, %"PRIu64" requests, %"PRIu64" allocations\n",
+           scratch->idle_size/(1024.0*1024.0), scratch->requests, scratch->allocations);
+  dt_pthread_mutex_unlock(&scratch->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
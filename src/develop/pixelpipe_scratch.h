@@ -0,0 +1,71 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_PIXELPIPE_SCRATCH_H
+#define DT_PIXELPIPE_SCRATCH_H
+
+#include "common/dtpthread.h"
+#include <inttypes.h>
+#include <stddef.h>
+#include <glib.h>
+
+/**
+ * per pixelpipe pool of the temporary buffers modules need while processing.
+ * released buffers are kept, sorted into size classes, and handed out again to
+ * the next request of the same class, so running a pipe again (while dragging a
+ * slider, say) does not map and fault in fresh memory every time. buffers which
+ * were not asked for during a whole run of the pipe are given back to the system.
+ * the pool also records how much of it is in use, which tells the pipe what
+ * modules really need besides their input and output.
+ */
+typedef struct dt_dev_pixelpipe_scratch_t
+{
+  dt_pthread_mutex_t lock;
+  // released buffers, most recent first
+  GList *idle;
+  // buffers handed out: data -> buffer
+  GHashTable *used;
+  // bytes handed out, bytes kept idle, highest use since the last reset
+  size_t in_use, idle_size, peak;
+  // number of finished pipe runs, idle buffers remember the last one they were used in
+  uint32_t run;
+  // profiling:
+  uint64_t requests;
+  uint64_t allocations;
+}
+dt_dev_pixelpipe_scratch_t;
+
+void dt_dev_pixelpipe_scratch_init(dt_dev_pixelpipe_scratch_t *scratch);
+void dt_dev_pixelpipe_scratch_cleanup(dt_dev_pixelpipe_scratch_t *scratch);
+
+/** returns a 64 byte aligned buffer of at least size bytes, with undefined content, or NULL. */
+void *dt_dev_pixelpipe_scratch_alloc(dt_dev_pixelpipe_scratch_t *scratch, const size_t size);
+/** returns the buffer to the pool. data may be NULL. */
+void dt_dev_pixelpipe_scratch_free(dt_dev_pixelpipe_scratch_t *scratch, void *data);
+
+/** starts measuring the highest use from what is in use now. */
+void dt_dev_pixelpipe_scratch_reset_peak(dt_dev_pixelpipe_scratch_t *scratch);
+/** highest number of bytes in use since the last reset. */
+size_t dt_dev_pixelpipe_scratch_get_peak(dt_dev_pixelpipe_scratch_t *scratch);
+
+/** to be called once per pipe run: frees the idle buffers nobody asked for during the run. */
+void dt_dev_pixelpipe_scratch_trim(dt_dev_pixelpipe_scratch_t *scratch);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
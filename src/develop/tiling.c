@@ -592,44 +592,18 @@ _fit_output_to_input_roi(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_i
 }
 
 
-/* simple tiling algorithm for roi_in == roi_out, i.e. for pixel to pixel modules/operations */
-static void
-_default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp)
+/* tile dimensions and count of the ptp tiling for tiles of at most singlebuffer bytes */
+typedef struct _ptp_layout_t
 {
-  void *input = NULL;
-  void *output = NULL;
-
-  const int out_bpp = self->output_bpp(self, piece->pipe, piece);
-  const int ipitch = roi_in->width * in_bpp;
-  const int opitch = roi_out->width * out_bpp;
-  const int max_bpp = _max(in_bpp, out_bpp);
-
-  /* get tiling requirements of module */
-  dt_develop_tiling_t tiling = { 0 };
-  self->tiling_callback(self, piece, roi_in, roi_out, &tiling);
-
-  /* tiling really does not make sense in these cases. standard process() is not better or worse than we are */
-  if(tiling.factor < 2.2f && tiling.overhead < 0.2f * roi_in->width * roi_in->height * max_bpp)
-  {
-    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] no need to use tiling for module '%s' as no real memory saving to be expected\n", self->op);
-    goto fallback;
-  }
-
-  /* calculate optimal size of tiles */
-  float available = (float)dt_conf_get_int("host_memory_limit")*1024.0f*1024.0f;
-  assert(available >= 500.0f*1024.0f*1024.0f);
-  /* correct for size of ivoid and ovoid which are needed on top of tiling */
-  available = fmax(available - (roi_out->width*roi_out->height*out_bpp) - (roi_in->width*roi_in->height*in_bpp) - tiling.overhead, 0);
-
-  /* we ignore the above value if singlebuffer_limit (is defined and) is higher than available/tiling.factor.
-     this will mainly allow tiling for modules with high and "unpredictable" memory demand which is
-     reflected in high values of tiling.factor (take bilateral noise reduction as an example). */
-  float singlebuffer = (float)dt_conf_get_int("singlebuffer_limit")*1024.0f*1024.0f;
-  singlebuffer = fmax(singlebuffer, 2.0f*1024.0f*1024.0f);
-  float factor = fmax(tiling.factor, 1.0f);
-  float maxbuf = fmax(tiling.maxbuf, 1.0f);
-  singlebuffer = fmax(available / factor, singlebuffer);
+  int width, height, overlap;
+  int tile_wd, tile_ht;
+  int tiles_x, tiles_y;
+}
+_ptp_layout_t;
 
+static void
+_ptp_layout(const dt_iop_roi_t *roi_in, const dt_develop_tiling_t *tiling, const int max_bpp, const float maxbuf, const float singlebuffer, _ptp_layout_t *l)
+{
   int width = roi_in->width;
   int height = roi_in->height;
 
@@ -655,7 +629,7 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   }
 
   /* make sure we have a reasonably effective tile dimension. if not try square tiles */
-  if(3*tiling.overlap > width || 3*tiling.overlap > height)
+  if(3*tiling->overlap > width || 3*tiling->overlap > height)
   {
     width = height = floorf(sqrtf((float)width*height));
   }
@@ -667,7 +641,7 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
      We guarantee alignment by selecting image width/height and overlap accordingly. For a tile width/height
      that is identical to image width/height no special alignment is needed. */
 
-  const unsigned int xyalign = _lcm(tiling.xalign, tiling.yalign);
+  const unsigned int xyalign = _lcm(tiling->xalign, tiling->yalign);
 
   assert(xyalign != 0);
 
@@ -676,15 +650,82 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   if(height < roi_in->height) height = (height / xyalign) * xyalign;
 
   /* also make sure that overlap follows alignment rules by making it wider when needed */
-  const int overlap = tiling.overlap % xyalign != 0 ? (tiling.overlap / xyalign + 1) * xyalign : tiling.overlap;
+  l->overlap = tiling->overlap % xyalign != 0 ? (tiling->overlap / xyalign + 1) * xyalign : tiling->overlap;
 
   /* calculate effective tile size */
-  const int tile_wd = width - 2*overlap > 0 ? width - 2*overlap : 1;
-  const int tile_ht = height - 2*overlap > 0 ? height - 2*overlap : 1;
+  l->tile_wd = width - 2*l->overlap > 0 ? width - 2*l->overlap : 1;
+  l->tile_ht = height - 2*l->overlap > 0 ? height - 2*l->overlap : 1;
 
   /* calculate number of tiles */
-  const int tiles_x = width < roi_in->width ? ceilf(roi_in->width /(float)tile_wd) : 1;
-  const int tiles_y = height < roi_in->height ? ceilf(roi_in->height/(float)tile_ht) : 1;
+  l->tiles_x = width < roi_in->width ? ceilf(roi_in->width /(float)l->tile_wd) : 1;
+  l->tiles_y = height < roi_in->height ? ceilf(roi_in->height/(float)l->tile_ht) : 1;
+  l->width = width;
+  l->height = height;
+}
+
+/* simple tiling algorithm for roi_in == roi_out, i.e. for pixel to pixel modules/operations */
+static void
+_default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp)
+{
+  void *input[DT_TILING_MAXPARALLEL] = { NULL };
+  void *output[DT_TILING_MAXPARALLEL] = { NULL };
+  int parallel = 1;
+
+  const int out_bpp = self->output_bpp(self, piece->pipe, piece);
+  const int ipitch = roi_in->width * in_bpp;
+  const int opitch = roi_out->width * out_bpp;
+  const int max_bpp = _max(in_bpp, out_bpp);
+
+  /* get tiling requirements of module */
+  dt_develop_tiling_t tiling = { 0 };
+  self->tiling_callback(self, piece, roi_in, roi_out, &tiling);
+
+  /* tiling really does not make sense in these cases. standard process() is not better or worse than we are */
+  if(tiling.factor < 2.2f && tiling.overhead < 0.2f * roi_in->width * roi_in->height * max_bpp)
+  {
+    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] no need to use tiling for module '%s' as no real memory saving to be expected\n", self->op);
+    goto fallback;
+  }
+
+  /* calculate optimal size of tiles */
+  float available = (float)dt_conf_get_int("host_memory_limit")*1024.0f*1024.0f;
+  assert(available >= 500.0f*1024.0f*1024.0f);
+  /* correct for size of ivoid and ovoid which are needed on top of tiling */
+  available = fmax(available - (roi_out->width*roi_out->height*out_bpp) - (roi_in->width*roi_in->height*in_bpp) - tiling.overhead, 0);
+
+  /* we ignore the above value if singlebuffer_limit (is defined and) is higher than available/tiling.factor.
+     this will mainly allow tiling for modules with high and "unpredictable" memory demand which is
+     reflected in high values of tiling.factor (take bilateral noise reduction as an example). */
+  float singlebuffer = (float)dt_conf_get_int("singlebuffer_limit")*1024.0f*1024.0f;
+  singlebuffer = fmax(singlebuffer, 2.0f*1024.0f*1024.0f);
+  float factor = fmax(tiling.factor, 1.0f);
+  float maxbuf = fmax(tiling.maxbuf, 1.0f);
+  singlebuffer = fmax(available / factor, singlebuffer);
+
+  _ptp_layout_t l;
+  _ptp_layout(roi_in, &tiling, max_bpp, maxbuf, singlebuffer, &l);
+
+  /* modules which declare their process() reentrant may get several tiles processed at once, each
+     by one thread with its own tile buffers. nested parallelism is off, so the module code of such a
+     tile runs on that one thread only: this only pays off with a tile for every thread. take the
+     tiles as they are if that many fit into memory at once, else try smaller ones sharing the budget. */
+  if(self->flags() & IOP_FLAGS_ALLOW_PARALLEL_TILING)
+  {
+    const int threads = _min(_max(dt_get_num_threads(), 1), DT_TILING_MAXPARALLEL);
+    _ptp_layout_t p = l;
+    if(threads > 1 && (p.tiles_x * p.tiles_y < threads || available < threads * (float)p.width*p.height*max_bpp*factor))
+      _ptp_layout(roi_in, &tiling, max_bpp, maxbuf, fmax(available / (factor*threads), 2.0f*1024.0f*1024.0f), &p);
+    if(threads > 1 && p.tiles_x * p.tiles_y >= threads && p.tiles_x * p.tiles_y <= DT_TILING_MAXTILES &&
+       available >= threads * (float)p.width*p.height*max_bpp*factor)
+    {
+      l = p;
+      parallel = threads;
+    }
+  }
+
+  const int width = l.width, height = l.height, overlap = l.overlap;
+  const int tile_wd = l.tile_wd, tile_ht = l.tile_ht;
+  const int tiles_x = l.tiles_x, tiles_y = l.tiles_y;
 
   /* sanity check: don't run wild on too many tiles */
   if(tiles_x * tiles_y > DT_TILING_MAXTILES)
@@ -693,21 +734,34 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
     goto error;
   }
 
-
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] use tiling on module '%s' for image with full size %d x %d\n", self->op, roi_in->width, roi_in->height);
-  dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] (%d x %d) tiles with max dimensions %d x %d and overlap %d\n", tiles_x, tiles_y, width, height, overlap);
+  dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] (%d x %d) tiles with max dimensions %d x %d and overlap %d, %d at once\n", tiles_x, tiles_y, width, height, overlap, parallel);
 
-  /* reserve input and output buffers for tiles */
-  input = dt_alloc_align(64, width*height*in_bpp);
-  if(input == NULL)
+  /* reserve input and output buffers for tiles, one pair per concurrent tile.
+     if memory is short, work on less tiles at once. */
+  for(int t=0; t<parallel; t++)
   {
-    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] could not alloc input buffer for module '%s'\n", self->op);
-    goto error;
+    input[t] = dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, width*height*in_bpp);
+    output[t] = dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, width*height*out_bpp);
+    if(input[t] == NULL || output[t] == NULL)
+    {
+      dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, input[t]);
+      dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, output[t]);
+      input[t] = output[t] = NULL;
+      /* less tiles at once than threads leave cores idle, rather do them one after the other */
+      for(int u=1; u<t; u++)
+      {
+        dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, input[u]);
+        dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, output[u]);
+        input[u] = output[u] = NULL;
+      }
+      parallel = _min(t, 1);
+      break;
+    }
   }
-  output = dt_alloc_align(64, width*height*out_bpp);
-  if(output == NULL)
+  if(parallel == 0)
   {
-    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] could not alloc output buffer for module '%s'\n", self->op);
+    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] could not alloc tile buffers for module '%s'\n", self->op);
     goto error;
   }
 
@@ -717,47 +771,67 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   for(int k=0; k<3; k++)
     processed_maximum_saved[k] = piece->pipe->processed_maximum[k];
 
+  piece->pipe->tiling = 1;
 
-  /* iterate over tiles */
-  for(int tx=0; tx<tiles_x; tx++)
-    for(int ty=0; ty<tiles_y; ty++)
-    {
-      piece->pipe->tiling = 1;
+  /* iterate over tiles. concurrent tiles all start from the original processed_maximum,
+     modules allowing that must not change it. */
+  const int num_tiles = tiles_x * tiles_y;
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(parallel) schedule(dynamic) if(parallel > 1)
+#endif
+  for(int t=0; t<num_tiles; t++)
+  {
+    const int tx = t / tiles_y;
+    const int ty = t % tiles_y;
+#ifdef _OPENMP
+    void *tinput = input[parallel > 1 ? omp_get_thread_num() : 0];
+    void *toutput = output[parallel > 1 ? omp_get_thread_num() : 0];
+#else
+    void *tinput = input[0];
+    void *toutput = output[0];
+#endif
 
-      size_t wd = tx * tile_wd + width > roi_in->width  ? roi_in->width - tx * tile_wd : width;
-      size_t ht = ty * tile_ht + height > roi_in->height ? roi_in->height- ty * tile_ht : height;
+    size_t wd = tx * tile_wd + width > roi_in->width  ? roi_in->width - tx * tile_wd : width;
+    size_t ht = ty * tile_ht + height > roi_in->height ? roi_in->height- ty * tile_ht : height;
 
-      /* no need to process end-tiles that are smaller than overlap */
-      if((wd <= overlap && tx > 0) || (ht <= overlap && ty > 0)) continue;
+    /* no need to process end-tiles that are smaller than overlap */
+    if((wd <= overlap && tx > 0) || (ht <= overlap && ty > 0)) continue;
 
-      /* origin and region of effective part of tile, which we want to store later */
-      size_t origin[] = { 0, 0, 0 };
-      size_t region[] = { wd, ht, 1 };
+    /* origin and region of effective part of tile, which we want to store later */
+    size_t origin[] = { 0, 0, 0 };
+    size_t region[] = { wd, ht, 1 };
 
-      /* roi_in and roi_out for process_cl on subbuffer */
-      dt_iop_roi_t iroi = { roi_in->x+tx*tile_wd, roi_in->y+ty*tile_ht, wd, ht, roi_in->scale };
-      dt_iop_roi_t oroi = { roi_out->x+tx*tile_wd, roi_out->y+ty*tile_ht, wd, ht, roi_out->scale };
+    /* roi_in and roi_out for process_cl on subbuffer */
+    dt_iop_roi_t iroi = { roi_in->x+tx*tile_wd, roi_in->y+ty*tile_ht, wd, ht, roi_in->scale };
+    dt_iop_roi_t oroi = { roi_out->x+tx*tile_wd, roi_out->y+ty*tile_ht, wd, ht, roi_out->scale };
 
-      /* offsets of tile into ivoid and ovoid */
-      size_t ioffs = (ty * tile_ht)*ipitch + (tx * tile_wd)*in_bpp;
-      size_t ooffs = (ty * tile_ht)*opitch + (tx * tile_wd)*out_bpp;
+    /* offsets of tile into ivoid and ovoid */
+    size_t ioffs = (ty * tile_ht)*ipitch + (tx * tile_wd)*in_bpp;
+    size_t ooffs = (ty * tile_ht)*opitch + (tx * tile_wd)*out_bpp;
 
 
-      dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, wd, ht, tx*tile_wd, ty*tile_ht);
+    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, wd, ht, tx*tile_wd, ty*tile_ht);
 
-      /* prepare input tile buffer */
+    /* prepare input tile buffer */
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(input,width,ivoid,ioffs,wd,ht) schedule(static)
+    #pragma omp parallel for default(none) shared(tinput,width,ivoid,ioffs,wd,ht) schedule(static)
 #endif
-      for(int j=0; j<ht; j++)
-        memcpy((char *)input+j*wd*in_bpp, (char *)ivoid+ioffs+j*ipitch, wd*in_bpp);
+    for(int j=0; j<ht; j++)
+      memcpy((char *)tinput+j*wd*in_bpp, (char *)ivoid+ioffs+j*ipitch, wd*in_bpp);
 
+    if(parallel > 1)
+    {
+      /* call process() of module, concurrently with other tiles */
+      self->process(self, piece, tinput, toutput, &iroi, &oroi);
+    }
+    else
+    {
       /* take original processed_maximum as starting point */
       for(int k=0; k<3; k++)
         piece->pipe->processed_maximum[k] = processed_maximum_saved[k];
 
       /* call process() of module */
-      self->process(self, piece, input, output, &iroi, &oroi);
+      self->process(self, piece, tinput, toutput, &iroi, &oroi);
 
       /* aggregate resulting processed_maximum */
       /* TODO: check if there really can be differences between tiles and take
@@ -768,36 +842,50 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
           dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] processed_maximum[%d] differs between tiles in module '%s'\n", k, self->op);
         processed_maximum_new[k] = piece->pipe->processed_maximum[k];
       }
+    }
 
-      /* correct origin and region of tile for overlap.
-         make sure that we only copy back the "good" part. */
-      if(tx > 0)
-      {
-        origin[0] += overlap;
-        region[0] -= overlap;
-        ooffs += overlap*out_bpp;
-      }
-      if(ty > 0)
-      {
-        origin[1] += overlap;
-        region[1] -= overlap;
-        ooffs += overlap*opitch;
-      }
+    /* correct origin and region of tile for overlap.
+       make sure that we only copy back the "good" part. */
+    if(tx > 0)
+    {
+      origin[0] += overlap;
+      region[0] -= overlap;
+      ooffs += overlap*out_bpp;
+    }
+    if(ty > 0)
+    {
+      origin[1] += overlap;
+      region[1] -= overlap;
+      ooffs += overlap*opitch;
+    }
 
-      /* copy "good" part of tile to output buffer */
+    /* copy "good" part of tile to output buffer */
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(ovoid,ooffs,output,width,origin,region,wd) schedule(static)
+    #pragma omp parallel for default(none) shared(ovoid,ooffs,toutput,width,origin,region,wd) schedule(static)
 #endif
-      for(int j=0; j<region[1]; j++)
-        memcpy((char *)ovoid+ooffs+j*opitch, (char *)output+((j+origin[1])*wd+origin[0])*out_bpp, region[0]*out_bpp);
+    for(int j=0; j<region[1]; j++)
+      memcpy((char *)ovoid+ooffs+j*opitch, (char *)toutput+((j+origin[1])*wd+origin[0])*out_bpp, region[0]*out_bpp);
+  }
+
+  if(parallel > 1)
+  {
+    for(int k=0; k<3; k++)
+    {
+      if(fabs(processed_maximum_saved[k] - piece->pipe->processed_maximum[k]) > 1.0e-6f)
+        dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] module '%s' changed processed_maximum[%d] during parallel tiling\n", self->op, k);
+      processed_maximum_new[k] = piece->pipe->processed_maximum[k];
     }
+  }
 
   /* copy back final processed_maximum */
   for(int k=0; k<3; k++)
     piece->pipe->processed_maximum[k] = processed_maximum_new[k];
 
-  if(input != NULL) free(input);
-  if(output != NULL) free(output);
+  for(int t=0; t<DT_TILING_MAXPARALLEL; t++)
+  {
+    dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, input[t]);
+    dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, output[t]);
+  }
   piece->pipe->tiling = 0;
   return;
 
@@ -806,8 +894,11 @@ error:
   // fall through
 
 fallback:
-  if(input != NULL) free(input);
-  if(output != NULL) free(output);
+  for(int t=0; t<DT_TILING_MAXPARALLEL; t++)
+  {
+    dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, input[t]);
+    dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, output[t]);
+  }
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] fall back to standard processing for module '%s'\n", self->op);
   self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
@@ -824,6 +915,7 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
 {
   void *input = NULL;
   void *output = NULL;
+  size_t input_size = 0, output_size = 0;
 
   //_print_roi(roi_in, "module roi_in");
   //_print_roi(roi_out, "module roi_out");
@@ -1037,18 +1129,28 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
       dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, iroi_full.width, iroi_full.height, iroi_full.x, iroi_full.y);
 
 
-      /* prepare input tile buffer */
-      input = dt_alloc_align(64, iroi_full.width*iroi_full.height*in_bpp);
-      if(input == NULL)
+      /* prepare input tile buffer. tiles differ slightly in size, buffers are only reallocated when they grow */
+      if(iroi_full.width*iroi_full.height*in_bpp > input_size)
       {
-        dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc input buffer for module '%s'\n", self->op);
-        goto error;
+        dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, input);
+        input_size = iroi_full.width*iroi_full.height*in_bpp;
+        input = dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, input_size);
+        if(input == NULL)
+        {
+          dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc input buffer for module '%s'\n", self->op);
+          goto error;
+        }
       }
-      output = dt_alloc_align(64, oroi_full.width*oroi_full.height*out_bpp);
-      if(output == NULL)
+      if(oroi_full.width*oroi_full.height*out_bpp > output_size)
       {
-        dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc output buffer for module '%s'\n", self->op);
-        goto error;
+        dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, output);
+        output_size = oroi_full.width*oroi_full.height*out_bpp;
+        output = dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, output_size);
+        if(output == NULL)
+        {
+          dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc output buffer for module '%s'\n", self->op);
+          goto error;
+        }
       }
 
 #ifdef _OPENMP
@@ -1082,18 +1184,14 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
 #endif
       for(int j=0; j<oroi_good.height; j++)
         memcpy((char *)ovoid+ooffs+j*opitch, (char *)output+((j+origin_y)*oroi_full.width+origin_x)*out_bpp, oroi_good.width*out_bpp);
-
-      free(input);
-      free(output);
-      input = output = NULL;
     }
 
   /* copy back final processed_maximum */
   for(int k=0; k<3; k++)
     piece->pipe->processed_maximum[k] = processed_maximum_new[k];
 
-  if(input != NULL) free(input);
-  if(output != NULL) free(output);
+  dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, input);
+  dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, output);
   piece->pipe->tiling = 0;
   return;
 
@@ -1102,8 +1200,8 @@ error:
   // fall through
 
 fallback:
-  if(input != NULL) free(input);
-  if(output != NULL) free(output);
+  dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, input);
+  dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, output);
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] fall back to standard processing for module '%s'\n", self->op);
   self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
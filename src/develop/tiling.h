@@ -20,6 +20,8 @@
 #define DT_DEVELOP_TILING_H
 
 #define DT_TILING_MAXTILES 500
+/* maximum number of tiles processed at once, see IOP_FLAGS_ALLOW_PARALLEL_TILING */
+#define DT_TILING_MAXPARALLEL 64
 
 #include "develop/imageop.h"
 #include "develop/develop.h"
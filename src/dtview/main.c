@@ -242,6 +242,7 @@ process_next_image()
   static int counter = 0;
   dt_imageio_module_format_t buf;
   dt_imageio_module_data_t dat;
+  memset(&buf, 0, sizeof(buf));
   buf.mime = mime;
   buf.bpp = bpp;
   buf.write_image = write_image;
@@ -33,6 +33,11 @@
 #include "singlecolourfit.h"
 #include "csquish.h"
 
+#include <string.h>
+#if SQUISH_USE_SSE >= 2
+#include <emmintrin.h>
+#endif
+
 namespace squish {
 
 static int FixFlags( int flags )
@@ -148,7 +153,8 @@ void CompressImage( u8 const* rgba, const int width, const int height, void* blo
 	for( int y = 0; y < height; y += 4 )
 	{
     // initialise the block output
-    u8* targetBlock = reinterpret_cast< u8* >( blocks ) + bytesPerBlock*(width/4)*(y/4);
+    // blocks of the last column are stored even for partial ones, see GetStorageRequirements()
+    u8* targetBlock = reinterpret_cast< u8* >( blocks ) + bytesPerBlock*((width+3)/4)*(y/4);
 
 		for( int x = 0; x < width; x += 4 )
 		{
@@ -192,12 +198,110 @@ void CompressImage( u8 const* rgba, const int width, const int height, void* blo
 	}
 }
 
+// builds the four dxt1 colours of a block as rgba words, exactly as DecompressColour() does
+static void Dxt1Palette( u8 const* bytes, unsigned int* palette )
+{
+	u8 codes[16];
+	int const a = ( int )bytes[0] | ( ( int )bytes[1] << 8 );
+	int const b = ( int )bytes[2] | ( ( int )bytes[3] << 8 );
+	int const c[2] = { a, b };
+	for( int k = 0; k < 2; ++k )
+	{
+		u8 const red = ( u8 )( ( c[k] >> 11 ) & 0x1f );
+		u8 const green = ( u8 )( ( c[k] >> 5 ) & 0x3f );
+		u8 const blue = ( u8 )( c[k] & 0x1f );
+		codes[4*k + 0] = ( red << 3 ) | ( red >> 2 );
+		codes[4*k + 1] = ( green << 2 ) | ( green >> 4 );
+		codes[4*k + 2] = ( blue << 3 ) | ( blue >> 2 );
+		codes[4*k + 3] = 255;
+	}
+	for( int i = 0; i < 3; ++i )
+	{
+		int const c0 = codes[i];
+		int const d0 = codes[4 + i];
+		if( a <= b )
+		{
+			codes[8 + i] = ( u8 )( ( c0 + d0 )/2 );
+			codes[12 + i] = 0;
+		}
+		else
+		{
+			codes[8 + i] = ( u8 )( ( 2*c0 + d0 )/3 );
+			codes[12 + i] = ( u8 )( ( c0 + 2*d0 )/3 );
+		}
+	}
+	codes[8 + 3] = 255;
+	codes[12 + 3] = ( a <= b ) ? 0 : 255;
+	memcpy( palette, codes, sizeof( codes ) );
+}
+
+// dxt1 only: decodes straight into the image instead of going through a temporary
+// block, and selects the four colours of a row at once with sse2.
+static void DecompressImageDxt1( u8* rgba, const int width, const int height, void const* blocks )
+{
+	const int blocksPerRow = ( width + 3 )/4;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) shared(blocks, rgba)
+#endif
+	for( int y = 0; y < height; y += 4 )
+	{
+		u8 const* sourceBlock = reinterpret_cast< u8 const* >( blocks ) + 8*blocksPerRow*(y/4);
+		const int rows = ( height - y < 4 ) ? height - y : 4;
+
+		for( int x = 0; x < width; x += 4, sourceBlock += 8 )
+		{
+			unsigned int palette[4];
+			Dxt1Palette( sourceBlock, palette );
+			const int cols = ( width - x < 4 ) ? width - x : 4;
+
+#if SQUISH_USE_SSE >= 2
+			if( cols == 4 )
+			{
+				// index k of pixel i in a row is at bits 2i, so compare against k << 2i:
+				const __m128i mask = _mm_set_epi32( 3 << 6, 3 << 4, 3 << 2, 3 );
+				const __m128i k1 = _mm_set_epi32( 1 << 6, 1 << 4, 1 << 2, 1 );
+				const __m128i k2 = _mm_set_epi32( 2 << 6, 2 << 4, 2 << 2, 2 );
+				const __m128i pal = _mm_loadu_si128( ( __m128i const* )palette );
+				const __m128i c0 = _mm_shuffle_epi32( pal, _MM_SHUFFLE( 0, 0, 0, 0 ) );
+				const __m128i d1 = _mm_xor_si128( c0, _mm_shuffle_epi32( pal, _MM_SHUFFLE( 1, 1, 1, 1 ) ) );
+				const __m128i d2 = _mm_xor_si128( c0, _mm_shuffle_epi32( pal, _MM_SHUFFLE( 2, 2, 2, 2 ) ) );
+				const __m128i d3 = _mm_xor_si128( c0, _mm_shuffle_epi32( pal, _MM_SHUFFLE( 3, 3, 3, 3 ) ) );
+				for( int py = 0; py < rows; ++py )
+				{
+					const __m128i idx = _mm_and_si128( _mm_set1_epi32( sourceBlock[4 + py] ), mask );
+					__m128i col = c0;
+					col = _mm_xor_si128( col, _mm_and_si128( _mm_cmpeq_epi32( idx, k1 ), d1 ) );
+					col = _mm_xor_si128( col, _mm_and_si128( _mm_cmpeq_epi32( idx, k2 ), d2 ) );
+					col = _mm_xor_si128( col, _mm_and_si128( _mm_cmpeq_epi32( idx, mask ), d3 ) );
+					_mm_storeu_si128( ( __m128i* )( rgba + 4*( width*( y + py ) + x ) ), col );
+				}
+				continue;
+			}
+#endif
+			for( int py = 0; py < rows; ++py )
+			{
+				const u8 packed = sourceBlock[4 + py];
+				unsigned int* targetPixel = reinterpret_cast< unsigned int* >( rgba + 4*( width*( y + py ) + x ) );
+				for( int px = 0; px < cols; ++px )
+					memcpy( targetPixel + px, palette + ( ( packed >> 2*px ) & 0x3 ), sizeof( unsigned int ) );
+			}
+		}
+	}
+}
+
 void DecompressImage( u8* rgba, const int width, const int height, void const* blocks, int flags_in )
 {
 	// fix any bad flags
 	const int flags = FixFlags( flags_in );
 
-	const int bytesPerBlock = ( ( flags & kDxt1 ) != 0 ) ? 8 : 16;
+	if( ( flags & kDxt1 ) != 0 )
+	{
+		DecompressImageDxt1( rgba, width, height, blocks );
+		return;
+	}
+
+	const int bytesPerBlock = 16;
 
 	// loop over blocks
 #ifdef _OPENMP
@@ -206,7 +310,7 @@ void DecompressImage( u8* rgba, const int width, const int height, void const* b
 	for( int y = 0; y < height; y += 4 )
 	{
     // initialise the block input
-    u8 const* sourceBlock = reinterpret_cast< u8 const* >( blocks ) + bytesPerBlock*(width/4)*(y/4);
+    u8 const* sourceBlock = reinterpret_cast< u8 const* >( blocks ) + bytesPerBlock*((width+3)/4)*(y/4);
 
 		for( int x = 0; x < width; x += 4 )
 		{
@@ -28,6 +28,7 @@
 #include <memory>
 #include <OpenEXR/ImfFrameBuffer.h>
 #include <OpenEXR/ImfTiledOutputFile.h>
+#include <OpenEXR/ImfOutputFile.h>
 #include <OpenEXR/ImfChannelList.h>
 #include <OpenEXR/ImfStandardAttributes.h>
 
@@ -100,6 +101,65 @@ extern "C"
     return 0;
   }
 
+  // streaming writes use scanlines, the tiled file above needs the whole image at once.
+  void *write_image_begin (dt_imageio_exr_t *exr, const char *filename, void *exif, int exif_len, int imgid)
+  {
+    try
+    {
+      Imf::Blob exif_blob(exif_len, (uint8_t*)exif);
+      Imf::Header header(exr->width,exr->height,1,Imath::V2f (0, 0),1,Imf::INCREASING_Y,Imf::PIZ_COMPRESSION);
+      header.insert("comment",Imf::StringAttribute("Developed using Darktable "PACKAGE_VERSION));
+      header.insert("exif", Imf::BlobAttribute(exif_blob));
+      header.channels().insert("R",Imf::Channel(Imf::FLOAT));
+      header.channels().insert("B",Imf::Channel(Imf::FLOAT));
+      header.channels().insert("G",Imf::Channel(Imf::FLOAT));
+      return new Imf::OutputFile(filename, header);
+    }
+    catch(const std::exception &e)
+    {
+      fprintf(stderr, "[exr export] %s\n", e.what());
+      return NULL;
+    }
+  }
+
+  int write_image_rows (dt_imageio_exr_t *exr, void *handle, const float *in, const int num_rows)
+  {
+    Imf::OutputFile *file = (Imf::OutputFile *)handle;
+    // the frame buffer is addressed in image coordinates, so shift the band to its position:
+    const size_t xstride = 4*sizeof(float), ystride = xstride*exr->width;
+    const char *base = (const char *)in - file->currentScanLine()*ystride;
+    Imf::FrameBuffer data;
+    data.insert("R",Imf::Slice(Imf::FLOAT,(char *)base+0*sizeof(float),xstride,ystride));
+    data.insert("G",Imf::Slice(Imf::FLOAT,(char *)base+1*sizeof(float),xstride,ystride));
+    data.insert("B",Imf::Slice(Imf::FLOAT,(char *)base+2*sizeof(float),xstride,ystride));
+    try
+    {
+      file->setFrameBuffer(data);
+      file->writePixels(num_rows);
+    }
+    catch(const std::exception &e)
+    {
+      fprintf(stderr, "[exr export] %s\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
+  int write_image_end (dt_imageio_exr_t *exr, void *handle)
+  {
+    Imf::OutputFile *file = (Imf::OutputFile *)handle;
+    try
+    {
+      delete file;
+    }
+    catch(const std::exception &e)
+    {
+      fprintf(stderr, "[exr export] %s\n", e.what());
+      return 1;
+    }
+    return 0;
+  }
+
   void*
   get_params(dt_imageio_module_format_t *self, int *size)
   {
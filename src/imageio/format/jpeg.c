@@ -21,6 +21,7 @@
 #include "config.h"
 #endif
 #include "common/darktable.h"
+#include "common/imageio.h"
 #include "common/imageio_module.h"
 #include "common/colorspaces.h"
 #include "control/conf.h"
@@ -454,22 +455,40 @@ read_icc_profile (j_decompress_ptr cinfo,
 #undef MAX_SEQ_NO
 
 
-int
-write_image (dt_imageio_jpeg_t *jpg, const char *filename, const uint8_t *in, void *exif, int exif_len, int imgid)
+typedef struct dt_imageio_jpeg_stream_t
 {
   struct dt_imageio_jpeg_error_mgr jerr;
+  FILE *f;
+  uint8_t *row;
+  int failed;
+}
+dt_imageio_jpeg_stream_t;
 
-  jpg->cinfo.err = jpeg_std_error(&jerr.pub);
-  jerr.pub.error_exit = dt_imageio_jpeg_error_exit;
-  if (setjmp(jerr.setjmp_buffer))
+void *
+write_image_begin (dt_imageio_jpeg_t *jpg, const char *filename, void *exif, int exif_len, int imgid)
+{
+  dt_imageio_jpeg_stream_t *s = (dt_imageio_jpeg_stream_t *)malloc(sizeof(dt_imageio_jpeg_stream_t));
+  memset(s, 0, sizeof(dt_imageio_jpeg_stream_t));
+
+  jpg->cinfo.err = jpeg_std_error(&s->jerr.pub);
+  s->jerr.pub.error_exit = dt_imageio_jpeg_error_exit;
+  if (setjmp(s->jerr.setjmp_buffer))
   {
     jpeg_destroy_compress(&(jpg->cinfo));
-    return 1;
+    if(s->f) fclose(s->f);
+    free(s->row);
+    free(s);
+    return NULL;
   }
   jpeg_create_compress(&(jpg->cinfo));
-  FILE *f = fopen(filename, "wb");
-  if(!f) return 1;
-  jpeg_stdio_dest(&(jpg->cinfo), f);
+  s->f = fopen(filename, "wb");
+  if(!s->f)
+  {
+    jpeg_destroy_compress(&(jpg->cinfo));
+    free(s);
+    return NULL;
+  }
+  jpeg_stdio_dest(&(jpg->cinfo), s->f);
 
   jpg->cinfo.image_width = jpg->width;
   jpg->cinfo.image_height = jpg->height;
@@ -505,22 +524,57 @@ write_image (dt_imageio_jpeg_t *jpg, const char *filename, const uint8_t *in, vo
   if(exif && exif_len > 0 && exif_len < 65534)
     jpeg_write_marker(&(jpg->cinfo), JPEG_APP0+1, exif, exif_len);
 
-  uint8_t row[3*jpg->width];
-  const uint8_t *buf;
-  while(jpg->cinfo.next_scanline < jpg->cinfo.image_height)
+  s->row = (uint8_t *)malloc(3*jpg->width);
+  return s;
+}
+
+int
+write_image_rows (dt_imageio_jpeg_t *jpg, void *handle, const uint8_t *in, const int num_rows)
+{
+  dt_imageio_jpeg_stream_t *s = (dt_imageio_jpeg_stream_t *)handle;
+  if(s->failed) return 1;
+  if (setjmp(s->jerr.setjmp_buffer))
+  {
+    s->failed = 1;
+    return 1;
+  }
+  for(int j=0; j<num_rows && jpg->cinfo.next_scanline < jpg->cinfo.image_height; j++)
   {
     JSAMPROW tmp[1];
-    buf = in + jpg->cinfo.next_scanline * jpg->cinfo.image_width * 4;
-    for(int i=0; i<jpg->width; i++) for(int k=0; k<3; k++) row[3*i+k] = buf[4*i+k];
-    tmp[0] = row;
+    const uint8_t *buf = in + (size_t)j * jpg->cinfo.image_width * 4;
+    dt_imageio_convert(s->row, buf, 8, 8, jpg->width, 1, DT_IMAGEIO_CONVERT_PACK_RGB);
+    tmp[0] = s->row;
     jpeg_write_scanlines(&(jpg->cinfo), tmp, 1);
   }
-  jpeg_finish_compress (&(jpg->cinfo));
-  jpeg_destroy_compress(&(jpg->cinfo));
-  fclose(f);
   return 0;
 }
 
+int
+write_image_end (dt_imageio_jpeg_t *jpg, void *handle)
+{
+  dt_imageio_jpeg_stream_t *s = (dt_imageio_jpeg_stream_t *)handle;
+  if(!s->failed)
+  {
+    if (setjmp(s->jerr.setjmp_buffer)) s->failed = 1;
+    else jpeg_finish_compress (&(jpg->cinfo));
+  }
+  jpeg_destroy_compress(&(jpg->cinfo));
+  fclose(s->f);
+  const int failed = s->failed;
+  free(s->row);
+  free(s);
+  return failed;
+}
+
+int
+write_image (dt_imageio_jpeg_t *jpg, const char *filename, const uint8_t *in, void *exif, int exif_len, int imgid)
+{
+  void *handle = write_image_begin(jpg, filename, exif, exif_len, imgid);
+  if(!handle) return 1;
+  write_image_rows(jpg, handle, in, jpg->height);
+  return write_image_end(jpg, handle);
+}
+
 int read_header(const char *filename, dt_imageio_jpeg_t *jpg)
 {
   jpg->f = fopen(filename, "rb");
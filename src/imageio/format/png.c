@@ -21,6 +21,7 @@
 #include "config.h"
 #endif
 #include "common/darktable.h"
+#include "common/imageio.h"
 #include "common/imageio_module.h"
 #include "common/colorspaces.h"
 #include "control/conf.h"
@@ -119,13 +120,24 @@ static void PNGwriteRawProfile(png_struct *ping,
   png_free(ping, text);
 }
 
-int
-write_image (dt_imageio_png_t *p, const char *filename, const void *in_void, void *exif, int exif_len, int imgid)
+typedef struct dt_imageio_png_stream_t
+{
+  FILE *f;
+  png_structp png_ptr;
+  png_infop info_ptr;
+  void *exif;
+  int exif_len;
+  png_byte *row;
+  int failed;
+}
+dt_imageio_png_stream_t;
+
+void *
+write_image_begin (dt_imageio_png_t *p, const char *filename, void *exif, int exif_len, int imgid)
 {
   const int width = p->width, height = p->height;
-  const uint8_t *in = (uint8_t *)in_void;
   FILE *f = fopen(filename, "wb");
-  if (!f) return 1;
+  if (!f) return NULL;
 
   png_structp png_ptr;
   png_infop info_ptr;
@@ -134,7 +146,7 @@ write_image (dt_imageio_png_t *p, const char *filename, const void *in_void, voi
   if (!png_ptr)
   {
     fclose(f);
-    return 1;
+    return NULL;
   }
 
   info_ptr = png_create_info_struct(png_ptr);
@@ -142,14 +154,14 @@ write_image (dt_imageio_png_t *p, const char *filename, const void *in_void, voi
   {
     fclose(f);
     png_destroy_write_struct(&png_ptr, NULL);
-    return 1;
+    return NULL;
   }
 
   if (setjmp(png_jmpbuf(png_ptr)))
   {
     fclose(f);
     png_destroy_write_struct(&png_ptr, NULL);
-    return 1;
+    return NULL;
   }
 
   png_init_io(png_ptr, f);
@@ -167,40 +179,85 @@ write_image (dt_imageio_png_t *p, const char *filename, const void *in_void, voi
 
   png_write_info(png_ptr, info_ptr);
 
-  // png_bytep row_pointer = (png_bytep) in;
-  png_byte row[6*width];
-  // unsigned long rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+  dt_imageio_png_stream_t *s = (dt_imageio_png_stream_t *)malloc(sizeof(dt_imageio_png_stream_t));
+  s->f = f;
+  s->png_ptr = png_ptr;
+  s->info_ptr = info_ptr;
+  s->exif = exif;
+  s->exif_len = exif_len;
+  s->row = (png_byte *)malloc(6*width);
+  s->failed = 0;
+  return s;
+}
+
+int
+write_image_rows (dt_imageio_png_t *p, void *handle, const void *in_void, const int num_rows)
+{
+  dt_imageio_png_stream_t *s = (dt_imageio_png_stream_t *)handle;
+  const int width = p->width;
+  const uint8_t *in = (uint8_t *)in_void;
+  png_byte *row = s->row;
+  if(s->failed) return 1;
+  if (setjmp(png_jmpbuf(s->png_ptr)))
+  {
+    s->failed = 1;
+    return 1;
+  }
 
   if(p->bpp > 8)
   {
-    for (int y = 0; y < height; y++)
+    for (int y = 0; y < num_rows; y++)
     {
-      for(int x=0; x<width; x++) for(int k=0; k<3; k++)
-        {
-          uint16_t pix = ((uint16_t *)in)[4*width*y + 4*x + k];
-          uint16_t swapped = (0xff00 & (pix<<8)) | (pix>>8);
-          ((uint16_t *)row)[3*x+k] = swapped;
-        }
-      png_write_row(png_ptr, row);
+      dt_imageio_convert(row, (uint16_t *)in + (size_t)4*width*y, 16, 16, width, 1,
+                         DT_IMAGEIO_CONVERT_PACK_RGB | DT_IMAGEIO_CONVERT_BIG_ENDIAN);
+      png_write_row(s->png_ptr, row);
     }
   }
   else
   {
-    for (int y = 0; y < height; y++)
+    for (int y = 0; y < num_rows; y++)
     {
-      for(int x=0; x<width; x++) for(int k=0; k<3; k++) row[3*x+k] = in[4*width*y + 4*x + k];
-      png_write_row(png_ptr, row);
+      dt_imageio_convert(row, in + (size_t)4*width*y, 8, 8, width, 1, DT_IMAGEIO_CONVERT_PACK_RGB);
+      png_write_row(s->png_ptr, row);
     }
   }
+  return 0;
+}
+
+int
+write_image_end (dt_imageio_png_t *p, void *handle)
+{
+  dt_imageio_png_stream_t *s = (dt_imageio_png_stream_t *)handle;
+  if(!s->failed)
+  {
+    if (setjmp(png_jmpbuf(s->png_ptr)))
+    {
+      s->failed = 1;
+    }
+    else
+    {
+      PNGwriteRawProfile(s->png_ptr, s->info_ptr, "exif", s->exif, s->exif_len);
 
-  PNGwriteRawProfile(png_ptr, info_ptr, "exif", exif, exif_len);
+      // TODO: embed icc profile!
 
-  // TODO: embed icc profile!
+      png_write_end(s->png_ptr, s->info_ptr);
+    }
+  }
+  png_destroy_write_struct(&s->png_ptr, &s->info_ptr);
+  fclose(s->f);
+  const int failed = s->failed;
+  free(s->row);
+  free(s);
+  return failed;
+}
 
-  png_write_end(png_ptr, info_ptr);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
-  fclose(f);
-  return 0;
+int
+write_image (dt_imageio_png_t *p, const char *filename, const void *in_void, void *exif, int exif_len, int imgid)
+{
+  void *handle = write_image_begin(p, filename, exif, exif_len, imgid);
+  if(!handle) return 1;
+  write_image_rows(p, handle, in_void, p->height);
+  return write_image_end(p, handle);
 }
 
 int read_header(const char *filename, dt_imageio_png_t *png)
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include "common/darktable.h"
+#include "common/imageio.h"
 #include "common/imageio_module.h"
 
 DT_MODULE(1)
@@ -30,24 +31,24 @@ void cleanup(dt_imageio_module_format_t *self) {}
 int write_image (dt_imageio_module_data_t *ppm, const char *filename, const uint16_t *in, void *exif, int exif_len, int imgid)
 {
   int status=0;
-  uint16_t *row=(uint16_t*)in;
-  uint16_t swapped[3];
   FILE *f = fopen(filename, "wb");
   if(f)
   {
+    uint16_t *row = (uint16_t *)malloc(sizeof(uint16_t)*3*ppm->width);
     (void)fprintf(f, "P6\n%d %d\n65535\n", ppm->width, ppm->height);
     for(int y=0; y<ppm->height; y++)
     {
-      for(int x=0; x<ppm->width; x++)
+      dt_imageio_convert(row, in + (size_t)4*ppm->width*y, 16, 16, ppm->width, 1,
+                         DT_IMAGEIO_CONVERT_PACK_RGB | DT_IMAGEIO_CONVERT_BIG_ENDIAN);
+      int cnt = fwrite(row, sizeof(uint16_t), 3*ppm->width, f);
+      if(cnt != 3*ppm->width)
       {
-        for(int c=0; c<3; c++) swapped[c] = (0xff00 & (row[c]<<8))|(row[c]>>8);
-        int cnt = fwrite(&swapped, sizeof(uint16_t), 3, f);
-        if(cnt != 3) break;
-        row+=4;
+        status=1;
+        break;
       }
     }
+    free(row);
     fclose(f);
-    status=0;
   }
   return status;
 }
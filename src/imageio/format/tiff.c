@@ -21,6 +21,7 @@
 #include <inttypes.h>
 #include <tiffio.h>
 #include "common/darktable.h"
+#include "common/imageio.h"
 #include "common/imageio_module.h"
 #include "common/exif.h"
 #include "common/colorspaces.h"
@@ -45,12 +46,26 @@ typedef struct dt_imageio_tiff_gui_t
 dt_imageio_tiff_gui_t;
 
 
-int write_image (dt_imageio_tiff_t *d, const char *filename, const void *in_void, void *exif, int exif_len, int imgid)
+typedef struct dt_imageio_tiff_stream_t
+{
+  TIFF *tif;
+  char *filename;
+  void *exif;
+  int exif_len;
+  uint8_t *profile;
+  // one stripe of interleaved rgb data:
+  uint8_t *rowdata;
+  uint32_t rowsize;
+  int rows;
+  uint32_t stripe;
+}
+dt_imageio_tiff_stream_t;
+
+void *write_image_begin (dt_imageio_tiff_t *d, const char *filename, void *exif, int exif_len, int imgid)
 {
   // Fetch colorprofile into buffer if wanted
   uint8_t *profile = NULL;
   uint32_t profile_len = 0;
-  int rc = 0;
 
   if(imgid > 0)
   {
@@ -66,6 +81,11 @@ int write_image (dt_imageio_tiff_t *d, const char *filename, const void *in_void
 
   // Create tiff image
   TIFF *tif=TIFFOpen(filename,"wb");
+  if(!tif)
+  {
+    free(profile);
+    return NULL;
+  }
   if(d->bpp == 8) TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
   else            TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 16);
   TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_DEFLATE);
@@ -84,71 +104,55 @@ int write_image (dt_imageio_tiff_t *d, const char *filename, const void *in_void
   TIFFSetField(tif, TIFFTAG_YRESOLUTION, 300.0);
   TIFFSetField(tif, TIFFTAG_ZIPQUALITY, 9);
 
-  const uint8_t  *in8 =(const uint8_t  *)in_void;
-  const uint16_t *in16=(const uint16_t *)in_void;
-  if(d->bpp == 16)
+  dt_imageio_tiff_stream_t *s = (dt_imageio_tiff_stream_t *)malloc(sizeof(dt_imageio_tiff_stream_t));
+  s->tif = tif;
+  s->filename = g_strdup(filename);
+  s->exif = exif;
+  s->exif_len = exif_len;
+  s->profile = profile;
+  s->rowsize = d->width*3*(d->bpp == 16 ? sizeof(uint16_t) : sizeof(uint8_t));
+  s->rowdata = (uint8_t *)malloc(s->rowsize*DT_TIFFIO_STRIPE);
+  s->rows = 0;
+  s->stripe = 0;
+  return s;
+}
+
+int write_image_rows (dt_imageio_tiff_t *d, void *handle, const void *in_void, const int num_rows)
+{
+  dt_imageio_tiff_stream_t *s = (dt_imageio_tiff_stream_t *)handle;
+  for (int y = 0; y < num_rows;)
   {
-    uint32_t rowsize=(d->width*3)*sizeof(uint16_t);
-    uint32_t stripesize=rowsize*DT_TIFFIO_STRIPE;
-    uint16_t *rowdata = (uint16_t *)malloc(stripesize);
-    uint16_t *wdata = rowdata;
-    uint32_t stripe=0;
-    // uint32_t insize=((d->width*d->height)*3)*sizeof(uint16_t);
-    // while(stripedata<(in8+insize)-(stripesize)) {
-    // TIFFWriteEncodedStrip(tif,stripe++,stripedata,stripesize);
-    // stripedata+=stripesize;
-    // }
-    for (int y = 0; y < d->height; y++)
+    // fill as much of the current strip as we can in one go:
+    const int n = MIN(num_rows - y, DT_TIFFIO_STRIPE - s->rows);
+    const uint8_t *in8 = (const uint8_t *)in_void + (size_t)4*(d->bpp/8)*d->width*y;
+    dt_imageio_convert(s->rowdata + s->rowsize*s->rows, in8, d->bpp, d->bpp, d->width, n, DT_IMAGEIO_CONVERT_PACK_RGB);
+    y += n;
+    s->rows += n;
+    if(s->rows == DT_TIFFIO_STRIPE)
     {
-      for(int x=0; x<d->width; x++)
-        for(int k=0; k<3; k++)
-        {
-          (wdata)[0] = in16[4*d->width*y + 4*x + k];
-          wdata++;
-        }
-      if((wdata-stripesize/sizeof(uint16_t))==rowdata)
-      {
-        TIFFWriteEncodedStrip(tif,stripe++,rowdata,rowsize*DT_TIFFIO_STRIPE);
-        wdata=rowdata;
-      }
+      if(TIFFWriteEncodedStrip(s->tif,s->stripe++,s->rowdata,s->rowsize*DT_TIFFIO_STRIPE) < 0) return 1;
+      s->rows = 0;
     }
-    if((wdata-stripesize/sizeof(uint16_t))!=rowdata)
-      TIFFWriteEncodedStrip(tif,stripe,rowdata,(wdata-rowdata)*sizeof(uint16_t));
-    TIFFClose(tif);
-    free(rowdata);
   }
-  else
-  {
-    uint32_t rowsize=(d->width*3)*sizeof(uint8_t);
-    uint32_t stripesize=rowsize*DT_TIFFIO_STRIPE;
-    uint8_t *rowdata = (uint8_t *)malloc(stripesize);
-    uint8_t *wdata = rowdata;
-    uint32_t stripe=0;
+  return 0;
+}
 
-    for (int y = 0; y < d->height; y++)
-    {
-      for(int x=0; x<d->width; x++)
-        for(int k=0; k<3; k++)
-        {
-          (wdata)[0] = in8[4*d->width*y + 4*x + k];
-          wdata++;
-        }
-      if((wdata-stripesize)==rowdata)
-      {
-        TIFFWriteEncodedStrip(tif,stripe++,rowdata,rowsize*DT_TIFFIO_STRIPE);
-        wdata=rowdata;
-      }
-    }
-    if((wdata-stripesize)!=rowdata)
-      TIFFWriteEncodedStrip(tif,stripe,rowdata,wdata-rowdata);
-    TIFFClose(tif);
-    free(rowdata);
-  }
+int write_image_end (dt_imageio_tiff_t *d, void *handle)
+{
+  dt_imageio_tiff_stream_t *s = (dt_imageio_tiff_stream_t *)handle;
+  int rc = 0;
 
-  if(exif)
-    rc = dt_exif_write_blob(exif,exif_len,filename);
+  if(s->rows > 0)
+    TIFFWriteEncodedStrip(s->tif,s->stripe,s->rowdata,s->rowsize*s->rows);
+  TIFFClose(s->tif);
 
-  free(profile);
+  if(s->exif)
+    rc = dt_exif_write_blob(s->exif,s->exif_len,s->filename);
+
+  free(s->rowdata);
+  free(s->profile);
+  g_free(s->filename);
+  free(s);
 
   /*
    * Until we get symbolic error status codes, if rc is 1, return 0.
@@ -156,6 +160,14 @@ int write_image (dt_imageio_tiff_t *d, const char *filename, const void *in_void
   return ((rc == 1) ? 0 : 1);
 }
 
+int write_image (dt_imageio_tiff_t *d, const char *filename, const void *in_void, void *exif, int exif_len, int imgid)
+{
+  void *handle = write_image_begin(d, filename, exif, exif_len, imgid);
+  if(!handle) return 1;
+  write_image_rows(d, handle, in_void, d->height);
+  return write_image_end(d, handle);
+}
+
 #if 0
 int dt_imageio_tiff_read_header(const char *filename, dt_imageio_tiff_t *tiff)
 {
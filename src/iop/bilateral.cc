@@ -77,7 +77,7 @@ extern "C"
 
   int flags()
   {
-    return IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_SUPPORTS_BLENDING;
+    return IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_PARALLEL_TILING;
   }
 
   void init_key_accels(dt_iop_module_so_t *self)
@@ -19,6 +19,7 @@
 #include "config.h"
 #endif
 #include "bauhaus/bauhaus.h"
+#include "common/box_blur.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
 #include "control/control.h"
@@ -102,8 +103,15 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
 
   /* gather light by threshold */
   float *blurlightness = malloc(roi_out->width*roi_out->height*sizeof(float));
-  memset(blurlightness,0,(roi_out->width*roi_out->height*sizeof(float)));
   memcpy(out,in,roi_out->width*roi_out->height*ch*sizeof(float));
+  if(blurlightness == NULL)
+  {
+    // out is a copy of the input, leave it at that
+    dt_print(DT_DEBUG_MEMORY, "[bloom] failed to allocate temporary buffer\n");
+    dt_control_log(_("bloom: not enough memory, skipped"));
+    return;
+  }
+  memset(blurlightness,0,(roi_out->width*roi_out->height*sizeof(float)));
 
   int rad = 256*(fmin(100.0,data->size+1)/100.0);
   const int radius = MIN(256, ceilf(rad * roi_in->scale / piece->iscale));
@@ -125,76 +133,11 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   }
 
 
-  /* horizontal blur into memchannel lightness */
-  const int range = 2*radius+1;
-  const int hr = range/2;
-
-  const int size = roi_out->width>roi_out->height?roi_out->width:roi_out->height;
-  float *scanline = malloc(size*sizeof(float));
-
-  for(int iteration=0; iteration<8; iteration++)
+  if(dt_box_blur_1c(blurlightness, roi_out->width, roi_out->height, radius, 8))
   {
-    int index=0;
-    for(int y=0; y<roi_out->height; y++)
-    {
-      float L=0;
-      int hits = 0;
-      for(int x=-hr; x<roi_out->width; x++)
-      {
-        int op = x - hr-1;
-        int np = x+hr;
-        if(op>=0)
-        {
-          L-=blurlightness[index+op];
-          hits--;
-        }
-        if(np < roi_out->width)
-        {
-          L+=blurlightness[index+np];
-          hits++;
-        }
-        if(x>=0)
-          scanline[x] = L/hits;
-      }
-
-      for (int x=0; x<roi_out->width; x++)
-        blurlightness[index+x]=scanline[x];
-
-      index+=roi_out->width;
-    }
-
-    /* vertical pass on blurlightness */
-    const int opoffs = -(hr+1)*roi_out->width;
-    const int npoffs = (hr)*roi_out->width;
-    for(int x=0; x < roi_out->width; x++)
-    {
-      float L=0;
-      int hits=0;
-      int index = -hr*roi_out->width+x;
-      for(int y=-hr; y<roi_out->height; y++)
-      {
-        int op=y-hr-1;
-        int np= y + hr;
-
-        if(op>=0)
-        {
-          L-=blurlightness[index+opoffs];
-          hits--;
-        }
-        if(np < roi_out->height)
-        {
-          L+=blurlightness[index+npoffs];
-          hits++;
-        }
-        if(y>=0)
-          scanline[y] = L/hits;
-        index += roi_out->width;
-      }
-
-      for (int y=0; y<roi_out->height; y++)
-        blurlightness[y*roi_out->width+x]=scanline[y];
-
-    }
+    dt_control_log(_("bloom: not enough memory, skipped"));
+    free(blurlightness);
+    return;
   }
 
   /* screen blend lightness with orginal */
@@ -214,8 +157,6 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   if(piece->pipe->mask_display)
     dt_iop_alpha_copy(ivoid, ovoid, roi_out->width, roi_out->height);
 
-  if(scanline)
-    free(scanline);
   if(blurlightness)
     free(blurlightness);
 }
@@ -22,6 +22,7 @@
 #include "common/colorspaces.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
+#include "develop/tiling.h"
 #include "control/control.h"
 #include "dtgtk/slider.h"
 #include "dtgtk/resetlabel.h"
@@ -37,12 +38,25 @@
 
 #define ROUND_POSISTIVE(f) ((unsigned int)((f)+0.5))
 
-DT_MODULE(1)
+// smallest tile edge of the tiled method, in pixels
+#define RLCE_MIN_TILE 16
+
+DT_MODULE(2)
+
+typedef enum dt_iop_rlce_method_t
+{
+  // histogram of the window around every single pixel. slow, the only method up to version 1
+  DT_IOP_RLCE_SLIDING = 0,
+  // histograms of a grid of tiles, interpolated in between
+  DT_IOP_RLCE_TILES = 1
+}
+dt_iop_rlce_method_t;
 
 typedef struct dt_iop_rlce_params_t
 {
   double radius;
   double slope;
+  dt_iop_rlce_method_t method;
 }
 dt_iop_rlce_params_t;
 
@@ -51,6 +65,8 @@ typedef struct dt_iop_rlce_gui_data_t
   GtkVBox   *vbox1,  *vbox2;
   GtkWidget  *label1,*label2;
   GtkDarktableSlider *scale1,*scale2;       // radie pixels, slope
+  GtkWidget  *label3;
+  GtkComboBox *method;
 }
 dt_iop_rlce_gui_data_t;
 
@@ -58,9 +74,33 @@ typedef struct dt_iop_rlce_data_t
 {
   double radius;
   double slope;
+  dt_iop_rlce_method_t method;
 }
 dt_iop_rlce_data_t;
 
+int
+legacy_params (dt_iop_module_t *self, const void *const old_params, const int old_version, void *new_params, const int new_version)
+{
+  if(old_version == 1 && new_version == 2)
+  {
+    typedef struct dt_iop_rlce_params_v1_t
+    {
+      double radius;
+      double slope;
+    }
+    dt_iop_rlce_params_v1_t;
+
+    const dt_iop_rlce_params_v1_t *o = (dt_iop_rlce_params_v1_t *)old_params;
+    dt_iop_rlce_params_t *n = (dt_iop_rlce_params_t *)new_params;
+    n->radius = o->radius;
+    n->slope = o->slope;
+    // keep old edits looking exactly the same
+    n->method = DT_IOP_RLCE_SLIDING;
+    return 0;
+  }
+  return 1;
+}
+
 const char *name()
 {
   return _("local contrast");
@@ -74,40 +114,48 @@ groups ()
 
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED | IOP_FLAGS_ALLOW_TILING;
 }
 
-void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+// clips the histogram at limit and spreads what was cut off evenly over all bins, until nothing is left to clip.
+static void
+clip_histogram(int *clippedhist, const int bins, const int limit)
 {
-  dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
-  const int ch = piece->colors;
-
-  // PASS1: Get a luminance map of image...
-  float *luminance=(float *)malloc((roi_out->width*roi_out->height)*sizeof(float));
-  //double lsmax=0.0,lsmin=1.0;
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,roi_out,ivoid)
-#endif
-  for(int j=0; j<roi_out->height; j++)
+  int ce = 0, ceb=0;
+  do
   {
-    float *in=(float *)ivoid+j*roi_out->width*ch;
-    float *lm=luminance+j*roi_out->width;
-    for(int i=0; i<roi_out->width; i++)
+    ceb = ce;
+    ce = 0;
+    for ( int b = 0; b <= bins; b++ )
     {
-      double pmax=CLIP(fmax(in[0],fmax(in[1],in[2]))); // Max value in RGB set
-      double pmin=CLIP(fmin(in[0],fmin(in[1],in[2]))); // Min value in RGB set
-      *lm=(pmax+pmin)/2.0;        // Pixel luminocity
-      in+=ch;
-      lm++;
+      int d = clippedhist[ b ] - limit;
+      if ( d > 0 )
+      {
+        ce += d;
+        clippedhist[ b ] = limit;
+      }
     }
-  }
 
+    int d = (ce / (float) ( bins + 1 ));
+    int m = ce % ( bins + 1 );
+    for ( int h = 0; h <= bins; h++)
+      clippedhist[ h ] += d;
 
-  // Params
-  const int rad=data->radius*roi_in->scale/piece->iscale;
+    if ( m != 0 )
+    {
+      int s = bins / (float)m;
+      for ( int h = 0; h <= bins; h += s )
+        ++clippedhist[ h ];
+    }
+  }
+  while ( ce != ceb);
+}
 
+// the original method: clipped histogram of the (2*rad+1)^2 window around every pixel.
+static void
+process_sliding(const float *const luminance, void *ivoid, void *ovoid, const int ch, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out, const int rad, const float slope)
+{
   const int bins=256;
-  const float slope=data->slope;
 
   // CLAHE
 #ifdef _OPENMP
@@ -166,34 +214,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
 
       /* clip histogram and redistribute clipped entries */
       memcpy(clippedhist,hist,(bins+1)*sizeof(int));
-      int ce = 0, ceb=0;
-      do
-      {
-        ceb = ce;
-        ce = 0;
-        for ( int b = 0; b <= bins; b++ )
-        {
-          int d = clippedhist[ b ] - limit;
-          if ( d > 0 )
-          {
-            ce += d;
-            clippedhist[ b ] = limit;
-          }
-        }
-
-        int d = (ce / (float) ( bins + 1 ));
-        int m = ce % ( bins + 1 );
-        for ( int h = 0; h <= bins; h++)
-          clippedhist[ h ] += d;
-
-        if ( m != 0 )
-        {
-          int s = bins / (float)m;
-          for ( int h = 0; h <= bins; h += s )
-            ++clippedhist[ h ];
-        }
-      }
-      while ( ce != ceb);
+      clip_histogram(clippedhist, bins, limit);
 
       /* build cdf of clipped histogram */
       int hMin = bins;
@@ -230,12 +251,168 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
     }
 
   }
+}
+
+// standard tiled clahe: clipped histograms of tiles about as large as the window of the sliding
+// method, each turned into a tone curve, and every pixel mapped through the curves of the four
+// tiles around it, weighted by distance. the tiles sit on a grid fixed in image coordinates, so
+// pixelpipe tiling (with enough overlap) doesn't change the result.
+static void
+process_tiles(const float *const luminance, void *ivoid, void *ovoid, const int ch, const dt_iop_roi_t *const roi_in, const dt_iop_roi_t *const roi_out, const int rad, const float slope)
+{
+  const int bins=256;
+  const int width = roi_out->width, height = roi_out->height;
+  const int size = MAX(RLCE_MIN_TILE, 2*rad+1);
+  // grid tiles overlapping the roi
+  const int tx0 = roi_in->x / size, ty0 = roi_in->y / size;
+  const int ntx = (roi_in->x + width - 1) / size - tx0 + 1;
+  const int nty = (roi_in->y + height - 1) / size - ty0 + 1;
+
+  float *curves = (float *)malloc(sizeof(float)*(bins+1)*ntx*nty);
+  // tile to the left of each column and weight of the one to the right
+  int *xtile = (int *)malloc(sizeof(int)*width);
+  float *xweight = (float *)malloc(sizeof(float)*width);
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(dynamic) shared(luminance,roi_in,curves)
+#endif
+  for(int t=0; t<ntx*nty; t++)
+  {
+    const int x0 = MAX(0, (tx0 + t%ntx)*size - roi_in->x);
+    const int x1 = MIN(width, (tx0 + t%ntx + 1)*size - roi_in->x);
+    const int y0 = MAX(0, (ty0 + t/ntx)*size - roi_in->y);
+    const int y1 = MIN(height, (ty0 + t/ntx + 1)*size - roi_in->y);
+
+    int hist[bins+1];
+    memset(hist,0,(bins+1)*sizeof(int));
+    for(int y=y0; y<y1; y++)
+      for(int x=x0; x<x1; x++)
+        ++hist[ ROUND_POSISTIVE(luminance[y*width+x] * (float)bins) ];
+
+    const int n = (x1 - x0)*(y1 - y0);
+    const int limit = ( int )( slope * n /  bins + 0.5f );
+    clip_histogram(hist, bins, limit);
+
+    // same cdf as the sliding window, for all bins at once
+    int hMin = bins;
+    for ( int h = 0; h < hMin; h++ )
+      if ( hist[ h ] != 0 ) hMin = h;
+    const int cdfMin = hist[ hMin ];
+    int cdfMax = 0;
+    for ( int h = hMin; h <= bins; h++ )
+      cdfMax += hist[ h ];
+    const float norm = 1.0f / MAX(1, cdfMax - cdfMin);
+
+    float *curve = curves + (bins+1)*t;
+    int cdf = 0;
+    for ( int h = 0; h <= bins; h++ )
+    {
+      if ( h >= hMin ) cdf += hist[ h ];
+      curve[ h ] = ( cdf - cdfMin ) * norm;
+    }
+  }
+
+  for(int i=0; i<width; i++)
+  {
+    // position in units of tiles, relative to the center of the first one
+    const float fx = (roi_in->x + i + 0.5f) / size - 0.5f - tx0;
+    const int t = floorf(fx);
+    xtile[i] = CLAMPS(t, 0, ntx-1);
+    xweight[i] = (t < 0 || t >= ntx-1) ? 0.0f : fx - t;
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,ivoid,ovoid,curves,xtile,xweight)
+#endif
+  for(int j=0; j<height; j++)
+  {
+    const float fy = (roi_in->y + j + 0.5f) / size - 0.5f - ty0;
+    const int t = floorf(fy);
+    const int ty = CLAMPS(t, 0, nty-1);
+    const float wy = (t < 0 || t >= nty-1) ? 0.0f : fy - t;
+    const float *const row0 = curves + (bins+1)*ntx*ty;
+    const float *const row1 = curves + (bins+1)*ntx*MIN(ty+1, nty-1);
+
+    const float *lm = luminance + j*width;
+    float *in = ((float *)ivoid) + j*width*ch;
+    float *out = ((float *)ovoid) + j*width*ch;
+    for(int i=0; i<width; i++)
+    {
+      const int v = ROUND_POSISTIVE(lm[i] * (float)bins);
+      const int c0 = (bins+1)*xtile[i] + v;
+      const int c1 = (bins+1)*MIN(xtile[i]+1, ntx-1) + v;
+      const float wx = xweight[i];
+      const float top = row0[c0] + wx * (row0[c1] - row0[c0]);
+      const float bottom = row1[c0] + wx * (row1[c1] - row1[c0]);
+
+      float H, S, L;
+      rgb2hsl(in,&H,&S,&L);
+      hsl2rgb(out,H,S,top + wy * (bottom - top));
+      out += ch;
+      in += ch;
+    }
+  }
+
+  free(curves);
+  free(xtile);
+  free(xweight);
+}
+
+void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+{
+  dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
+  const int ch = piece->colors;
+
+  // PASS1: Get a luminance map of image...
+  float *luminance=(float *)malloc((roi_out->width*roi_out->height)*sizeof(float));
+  //double lsmax=0.0,lsmin=1.0;
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,roi_out,ivoid)
+#endif
+  for(int j=0; j<roi_out->height; j++)
+  {
+    float *in=(float *)ivoid+j*roi_out->width*ch;
+    float *lm=luminance+j*roi_out->width;
+    for(int i=0; i<roi_out->width; i++)
+    {
+      double pmax=CLIP(fmax(in[0],fmax(in[1],in[2]))); // Max value in RGB set
+      double pmin=CLIP(fmin(in[0],fmin(in[1],in[2]))); // Min value in RGB set
+      *lm=(pmax+pmin)/2.0;        // Pixel luminocity
+      in+=ch;
+      lm++;
+    }
+  }
+
+
+  // Params
+  const int rad=data->radius*roi_in->scale/piece->iscale;
+  const float slope=data->slope;
+
+  if(data->method == DT_IOP_RLCE_TILES)
+    process_tiles(luminance, ivoid, ovoid, ch, roi_in, roi_out, rad, slope);
+  else
+    process_sliding(luminance, ivoid, ovoid, ch, roi_in, roi_out, rad, slope);
 
   // Cleanup
   free(luminance);
 
 }
 
+void tiling_callback (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, struct dt_develop_tiling_t *tiling)
+{
+  dt_iop_rlce_data_t *d = (dt_iop_rlce_data_t *)piece->data;
+  const int rad = d->radius*roi_in->scale/piece->iscale;
+
+  tiling->factor = 2.25f;  // in + out + luminance
+  tiling->maxbuf = 1.0f;
+  tiling->overhead = 0;
+  // a pixel depends on the window around it, or on the tiles up to one and a half tile sizes away
+  tiling->overlap = d->method == DT_IOP_RLCE_TILES ? 2*MAX(RLCE_MIN_TILE, 2*rad+1) : rad+1;
+  tiling->xalign = 1;
+  tiling->yalign = 1;
+  return;
+}
+
 static void
 radius_callback (GtkDarktableSlider *slider, gpointer user_data)
 {
@@ -246,6 +423,16 @@ radius_callback (GtkDarktableSlider *slider, gpointer user_data)
   dt_dev_add_history_item(darktable.develop, self, TRUE);
 }
 
+static void
+method_callback (GtkComboBox *combo, gpointer user_data)
+{
+  dt_iop_module_t *self = (dt_iop_module_t *)user_data;
+  if(self->dt->gui->reset) return;
+  dt_iop_rlce_params_t *p = (dt_iop_rlce_params_t *)self->params;
+  p->method = gtk_combo_box_get_active(combo);
+  dt_dev_add_history_item(darktable.develop, self, TRUE);
+}
+
 static void
 slope_callback (GtkDarktableSlider *slider, gpointer user_data)
 {
@@ -268,6 +455,7 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
   dt_iop_rlce_data_t *d = (dt_iop_rlce_data_t *)piece->data;
   d->radius = p->radius;
   d->slope = p->slope;
+  d->method = p->method;
 #endif
 }
 
@@ -301,6 +489,7 @@ void gui_update(struct dt_iop_module_t *self)
   dt_iop_rlce_params_t *p = (dt_iop_rlce_params_t *)module->params;
   dtgtk_slider_set_value(g->scale1, p->radius);
   dtgtk_slider_set_value(g->scale2, p->slope);
+  gtk_combo_box_set_active(g->method, p->method);
 }
 
 void init(dt_iop_module_t *module)
@@ -313,7 +502,7 @@ void init(dt_iop_module_t *module)
   module->gui_data = NULL;
   dt_iop_rlce_params_t tmp = (dt_iop_rlce_params_t)
   {
-    64,1.25
+    64,1.25,DT_IOP_RLCE_TILES
   };
   memcpy(module->params, &tmp, sizeof(dt_iop_rlce_params_t));
   memcpy(module->default_params, &tmp, sizeof(dt_iop_rlce_params_t));
@@ -343,6 +532,8 @@ void gui_init(struct dt_iop_module_t *self)
   gtk_box_pack_start(GTK_BOX(g->vbox1), g->label1, TRUE, TRUE, 0);
   g->label2 = dtgtk_reset_label_new(_("amount"), self, &p->slope, sizeof(float));
   gtk_box_pack_start(GTK_BOX(g->vbox1), g->label2, TRUE, TRUE, 0);
+  g->label3 = dtgtk_reset_label_new(_("method"), self, &p->method, sizeof(dt_iop_rlce_method_t));
+  gtk_box_pack_start(GTK_BOX(g->vbox1), g->label3, TRUE, TRUE, 0);
 
   g->scale1 = DTGTK_SLIDER(dtgtk_slider_new_with_range(DARKTABLE_SLIDER_BAR,0.0, 256.0, 1.0, p->radius, 0));
   g->scale2 = DTGTK_SLIDER(dtgtk_slider_new_with_range(DARKTABLE_SLIDER_BAR,1.0, 3.0, 0.05, p->slope, 2));
@@ -350,13 +541,21 @@ void gui_init(struct dt_iop_module_t *self)
 
   gtk_box_pack_start(GTK_BOX(g->vbox2), GTK_WIDGET(g->scale1), TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(g->vbox2), GTK_WIDGET(g->scale2), TRUE, TRUE, 0);
+  g->method = GTK_COMBO_BOX(gtk_combo_box_new_text());
+  gtk_combo_box_append_text(g->method, _("sliding window"));
+  gtk_combo_box_append_text(g->method, _("tiles"));
+  gtk_combo_box_set_active(g->method, p->method);
+  gtk_box_pack_start(GTK_BOX(g->vbox2), GTK_WIDGET(g->method), TRUE, TRUE, 0);
   g_object_set(G_OBJECT(g->scale1), "tooltip-text", _("size of features to preserve"), (char *)NULL);
   g_object_set(G_OBJECT(g->scale2), "tooltip-text", _("strength of the effect"), (char *)NULL);
+  g_object_set(G_OBJECT(g->method), "tooltip-text", _("sliding window is the slow method of old edits, tiles look much the same and are many times faster"), (char *)NULL);
 
   g_signal_connect (G_OBJECT (g->scale1), "value-changed",
                     G_CALLBACK (radius_callback), self);
   g_signal_connect (G_OBJECT (g->scale2), "value-changed",
                     G_CALLBACK (slope_callback), self);
+  g_signal_connect (G_OBJECT (g->method), "changed",
+                    G_CALLBACK (method_callback), self);
 }
 
 void gui_cleanup(struct dt_iop_module_t *self)
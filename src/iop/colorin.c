@@ -217,6 +217,22 @@ dt_XYZ_to_Lab_SSE(const __m128 XYZ)
   return _mm_mul_ps(coef,_mm_sub_ps(_mm_shuffle_ps(f,f,_MM_SHUFFLE(3,1,0,1)),_mm_shuffle_ps(f,f,_MM_SHUFFLE(3,2,1,3))));
 }
 
+// dampens deeply saturated blues before they go through lcms, like the matrix path does for raw images.
+static inline void
+dampen_blues(float *cam)
+{
+  const float YY = cam[0]+cam[1]+cam[2];
+  const float zz = cam[2]/YY;
+  const float bound_z = 0.5f, bound_Y = 0.5f;
+  const float amount = 0.11f;
+  if (zz > bound_z)
+  {
+    const float t = (zz - bound_z)/(1.0f-bound_z) * fminf(1.0, YY/bound_Y);
+    cam[1] += t*amount;
+    cam[2] -= t*amount;
+  }
+}
+
 void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, void *o, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
   const dt_iop_colorin_data_t *const d = (dt_iop_colorin_data_t *)piece->data;
@@ -284,6 +300,39 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
     }
     _mm_sfence();
   }
+  else if(d->clut)
+  {
+    // profile baked into a 3d lut, lcms only sees the pixels outside of it.
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) shared(roi_out, out, in) schedule(static)
+#endif
+    for(int k=0; k<roi_out->height; k++)
+    {
+      const int m=(k*(roi_out->width*ch));
+      float cam[3*roi_out->width];
+      float Lab[3*roi_out->width];
+      int outside[roi_out->width];
+
+      for (int l=0; l<roi_out->width; l++)
+      {
+        cam[3*l+0] = in[m+ch*l+0];
+        cam[3*l+1] = in[m+ch*l+1];
+        cam[3*l+2] = in[m+ch*l+2];
+        dampen_blues(cam + 3*l);
+      }
+
+      const int num_outside = dt_color_lut_apply(d->clut, cam, 3, out+m, ch, roi_out->width, outside);
+      if(num_outside)
+      {
+        // indices are increasing, so the pixels can be packed in place
+        for (int l=0; l<num_outside; l++)
+          for(int c=0; c<3; c++) cam[3*l+c] = cam[3*outside[l]+c];
+        cmsDoTransform (d->xform[dt_get_thread_num()], cam, Lab, num_outside);
+        for (int l=0; l<num_outside; l++)
+          for(int c=0; c<3; c++) out[m+ch*outside[l]+c] = Lab[3*l+c];
+      }
+    }
+  }
   else
   {
     // use general lcms2 fallback
@@ -306,17 +355,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
         cam[ci+0] = in[m+ii+0];
         cam[ci+1] = in[m+ii+1];
         cam[ci+2] = in[m+ii+2];
-
-        const float YY = cam[ci+0]+cam[ci+1]+cam[ci+2];
-        const float zz = cam[ci+2]/YY;
-        const float bound_z = 0.5f, bound_Y = 0.5f;
-        const float amount = 0.11f;
-        if (zz > bound_z)
-        {
-          const float t = (zz - bound_z)/(1.0f-bound_z) * fminf(1.0, YY/bound_Y);
-          cam[ci+1] += t*amount;
-          cam[ci+2] -= t*amount;
-        }
+        dampen_blues(cam + ci);
       }
       // convert to (L,a/L,b/L) to be able to change L without changing saturation.
       // lcms is not thread safe, so work on one copy for each thread :(
@@ -348,6 +387,8 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
       cmsDeleteTransform(d->xform[t]);
       d->xform[t] = NULL;
     }
+  dt_color_lut_cache_release(darktable.color_lut_cache, d->clut);
+  d->clut = NULL;
   d->cmatrix[0] = -666.0f;
   d->lut[0][0] = -1.0f;
   d->lut[1][0] = -1.0f;
@@ -457,6 +498,9 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
       for(int t=0; t<num_threads; t++) d->xform[t] = cmsCreateTransform(d->input, TYPE_RGB_FLT, d->Lab, TYPE_Lab_FLT, p->intent, 0);
     }
   }
+  // the lut is sampled for input -> Lab transforms only
+  int lut_xform = 1;
+
   // user selected a non-supported output profile, check that:
   if(!d->xform[0] && d->cmatrix[0] == -666.0f)
   {
@@ -468,9 +512,20 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
       piece->process_cl_ready = 0;
       d->cmatrix[0] = -666.0f;
       for(int t=0; t<num_threads; t++) d->xform[t] = cmsCreateTransform(d->Lab, TYPE_RGB_FLT, d->input, TYPE_Lab_FLT, p->intent, 0);
+      // not the camera rgb -> Lab transform the lut is sampled for, leave it to lcms
+      lut_xform = 0;
     }
   }
 
+  // bake the lcms transform into a lut, shared with all pipes using the same profile:
+  if(lut_xform && d->xform[0] && d->cmatrix[0] == -666.0f)
+  {
+    const float offset[3] = {0.0f, 0.0f, 0.0f}, scale[3] = {1.0f, 1.0f, 1.0f};
+    gchar *key = dt_color_lut_key(d->input, TYPE_RGB_FLT, d->Lab, TYPE_Lab_FLT, NULL, p->intent, 0);
+    d->clut = dt_color_lut_cache_get(darktable.color_lut_cache, key, d->xform[0], NULL, offset, scale);
+    g_free(key);
+  }
+
   // now try to initialize unbounded mode:
   // we do a extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -499,6 +554,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->input = NULL;
   d->xform = (cmsHTRANSFORM *)malloc(sizeof(cmsHTRANSFORM)*dt_get_num_threads());
   for(int t=0; t<dt_get_num_threads(); t++) d->xform[t] = NULL;
+  d->clut = NULL;
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -510,6 +566,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
   dt_colorspaces_cleanup_profile(d->Lab);
   for(int t=0; t<dt_get_num_threads(); t++) if(d->xform[t]) cmsDeleteTransform(d->xform[t]);
   free(d->xform);
+  dt_color_lut_cache_release(darktable.color_lut_cache, d->clut);
   free(piece->data);
 }
 
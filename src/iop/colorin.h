@@ -19,6 +19,7 @@
 #define DARKTABLE_IOP_COLORIN_H
 
 #include "common/colorspaces.h"
+#include "common/color_lut.h"
 #include "develop/imageop.h"
 #include <gtk/gtk.h>
 #include <inttypes.h>
@@ -66,6 +67,7 @@ typedef struct dt_iop_colorin_data_t
   cmsHPROFILE input;
   cmsHPROFILE Lab;
   cmsHTRANSFORM *xform;
+  const dt_color_lut_t *clut;         // xform baked into a 3d lut, if that is accurate enough
   float lut[3][LUT_SAMPLES];
   float cmatrix[9];
   float unbounded_coeffs[3][3];       // approximation for extrapolation of shaper curves
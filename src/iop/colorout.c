@@ -428,6 +428,33 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
       }
     }
   }
+  else if(d->clut)
+  {
+    // profile baked into a 3d lut, lcms only sees the pixels outside of it.
+    // never used for gamut check, so no need to mark anything here.
+    float *in  = (float*)ivoid;
+    float *out = (float*)ovoid;
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) default(none) shared(out, roi_out, in)
+#endif
+    for (int k=0; k<roi_out->height; k++)
+    {
+      const int m=(k*(roi_out->width*ch));
+      float Lab[3*roi_out->width];
+      float rgb[3*roi_out->width];
+      int outside[roi_out->width];
+
+      const int num_outside = dt_color_lut_apply(d->clut, in+m, ch, out+m, ch, roi_out->width, outside);
+      if(num_outside)
+      {
+        for (int l=0; l<num_outside; l++)
+          for(int c=0; c<3; c++) Lab[3*l+c] = in[m+ch*outside[l]+c];
+        cmsDoTransform (d->xform, Lab, rgb, num_outside);
+        for (int l=0; l<num_outside; l++)
+          for(int c=0; c<3; c++) out[m+ch*outside[l]+c] = rgb[3*l+c];
+      }
+    }
+  }
   else
   {
     float *in  = (float*)ivoid;
@@ -541,6 +568,8 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     dt_iop_colorout_gui_data_t *g = (dt_iop_colorout_gui_data_t *)self->gui_data;
     g->softproof_enabled = p->softproof_enabled;
   }
+  dt_color_lut_cache_release(darktable.color_lut_cache, d->clut);
+  d->clut = NULL;
   if (d->xform)
   {
     cmsDeleteTransform(d->xform);
@@ -631,6 +660,23 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     }
   }
 
+  // bake the lcms transform into a lut, shared with all pipes using the same profiles. not for
+  // gamut check, which needs the exact boundary, nor if the user asked for lcms on export.
+  if(d->xform && !(transformFlags & cmsFLAGS_GAMUTCHECK) &&
+     !(pipe->type == DT_DEV_PIXELPIPE_EXPORT && high_quality_processing))
+  {
+    // to compare lut and lcms in Lab
+    cmsHTRANSFORM to_lab = cmsCreateTransform(d->output, TYPE_RGB_FLT, d->Lab, TYPE_Lab_FLT, INTENT_RELATIVE_COLORIMETRIC, 0);
+    if(to_lab)
+    {
+      const float offset[3] = {0.0f, -128.0f, -128.0f}, scale[3] = {1.0f/100.0f, 1.0f/256.0f, 1.0f/256.0f};
+      gchar *key = dt_color_lut_key(d->Lab, TYPE_Lab_FLT, d->output, TYPE_RGB_FLT, d->softproof, outintent, transformFlags);
+      d->clut = dt_color_lut_cache_get(darktable.color_lut_cache, key, d->xform, to_lab, offset, scale);
+      g_free(key);
+      cmsDeleteTransform(to_lab);
+    }
+  }
+
   // now try to initialize unbounded mode:
   // we do extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -663,6 +709,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->softproof_enabled = 0;
   d->softproof = d->output = NULL;
   d->xform = 0;
+  d->clut = NULL;
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -677,6 +724,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
     cmsDeleteTransform(d->xform);
     d->xform = 0;
   }
+  dt_color_lut_cache_release(darktable.color_lut_cache, d->clut);
 
   free(piece->data);
 }
@@ -406,7 +406,8 @@ green_equilibration_favg(float *out, const float *const in, const int width, con
 
 /** 1:1 demosaic from in to out, in is full buf, out is translated/cropped (scale == 1.0!) */
 static void
-demosaic_ppg(float *out, const float *in, dt_iop_roi_t *roi_out, const dt_iop_roi_t *roi_in, const int filters, const float thrs)
+demosaic_ppg(float *out, const float *in, dt_iop_roi_t *roi_out, const dt_iop_roi_t *roi_in, const int filters, const float thrs,
+             dt_dev_pixelpipe_scratch_t *scratch)
 {
   // snap to start of mosaic block:
   roi_out->x = 0;//MAX(0, roi_out->x & ~1);
@@ -448,7 +449,7 @@ demosaic_ppg(float *out, const float *in, dt_iop_roi_t *roi_out, const dt_iop_ro
   // if(median) fbdd_green(out, in, roi_out, roi_in, filters);
   if(median)
   {
-    float *med_in = (float *)dt_alloc_align(16, roi_in->height*roi_in->width*sizeof(float));
+    float *med_in = (float *)dt_dev_pixelpipe_scratch_alloc(scratch, roi_in->height*roi_in->width*sizeof(float));
     pre_median(med_in, in, roi_in, filters, 1, thrs);
     in = med_in;
   }
@@ -604,10 +605,97 @@ demosaic_ppg(float *out, const float *in, dt_iop_roi_t *roi_out, const dt_iop_ro
   }
   // _mm_sfence();
   if (median)
-    free((float*)in);
+    dt_dev_pixelpipe_scratch_free(scratch, (float*)in);
 }
 
 
+// lines of the full resolution image demosaiced at once when downscaling in bands
+#define DT_DEMOSAIC_BAND_LINES 512
+// amaze works on tiles of 512 lines, overlapping by 32
+#define DT_DEMOSAIC_AMAZE_TILE_STEP 480
+
+/** first line of the full resolution image demosaiced for output line oy */
+static int
+demosaic_band_first_line(const struct dt_interpolation *itor, const dt_iop_roi_t *const roi_out,
+                         const dt_iop_roi_t *const roo, const int oy, const int margin)
+{
+  dt_iop_roi_t roi = *roi_out;
+  roi.x = 0;
+  roi.y = oy;
+  roi.height = 1;
+  int y0, y1;
+  dt_interpolation_resample_lines(itor, &roi, roo, &y0, &y1);
+  return MAX(0, y0 - margin) & ~1;
+}
+
+/**
+ * demosaics the mosaic in (roi_in) in bands of lines and resamples every band to its part of
+ * out (roi_out, scale < 1) right away, so the full resolution image never exists in rgb.
+ * every band is demosaiced with enough lines around it to cover the interpolator and the
+ * neighbourhood the demosaic algorithm reads, so the result is the same as demosaicing
+ * everything first and then calling dt_iop_clip_and_zoom().
+ */
+static void
+demosaic_and_zoom_bands(struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, float *out,
+                        const float *const in, const dt_iop_roi_t *const roi_out, const dt_iop_roi_t *const roi_in,
+                        const int filters, const float thrs, const int method)
+{
+  const struct dt_interpolation *itor = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
+
+  // the full resolution image, as process() would demosaic it in one go
+  dt_iop_roi_t roo = *roi_out;
+  roo.x = roo.y = 0;
+  roo.width  = roi_out->width / roi_out->scale;
+  roo.height = roi_out->height / roi_out->scale;
+  roo.scale = 1.0f;
+
+  // lines around a pixel which go into its demosaiced value, with some to spare
+  const int amaze = method == DT_IOP_DEMOSAIC_AMAZE;
+  const int margin = amaze ? 32 : 8;
+  // bands start every that many lines, a few times more than neighbouring bands share.
+  // amaze results depend on where its tiles start, so its bands start on the tile grid
+  // it uses for the whole image.
+  int lines = MAX(amaze ? 4 * DT_DEMOSAIC_AMAZE_TILE_STEP : DT_DEMOSAIC_BAND_LINES,
+                  8 * (int)(itor->width / roi_out->scale + margin));
+  if(amaze) lines = (lines + DT_DEMOSAIC_AMAZE_TILE_STEP - 1) / DT_DEMOSAIC_AMAZE_TILE_STEP * DT_DEMOSAIC_AMAZE_TILE_STEP;
+
+  int oy = 0;
+  for(int y0 = 0; oy < roi_out->height; y0 += lines)
+  {
+    // output lines which don't need anything above the next band go into this one
+    int oe = oy + 1;
+    while(oe < roi_out->height && demosaic_band_first_line(itor, roi_out, &roo, oe, margin) < y0 + lines) oe++;
+
+    dt_iop_roi_t roi = *roi_out;
+    roi.x = 0;
+    roi.y = oy;
+    roi.height = oe - oy;
+
+    int y1, unused;
+    dt_interpolation_resample_lines(itor, &roi, &roo, &unused, &y1);
+    y1 = MIN(roo.height, y1 + margin);
+
+    dt_iop_roi_t rbi = *roi_in, rbo = roo;
+    rbi.y = roi_in->y + y0;
+    // the last band sees the lines below roo, like demosaicing everything would
+    rbi.height = (y1 == roo.height ? roi_in->height : y1) - y0;
+    rbo.height = y1 - y0;
+
+    // bands are about the same size, so this is the same buffer every time
+    float *tmp = (float *)dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, (size_t)rbo.width*rbo.height*4*sizeof(float));
+    const float *band_in = in + (size_t)y0*roi_in->width;
+    if(!amaze)
+      demosaic_ppg(tmp, band_in, &rbo, &rbi, filters, thrs, &piece->pipe->scratch);
+    else
+      amaze_demosaic_RT(self, piece, band_in, tmp, &rbi, &rbo, filters);
+
+    dt_interpolation_resample_band(itor, out + (size_t)4*roi_out->width*oy, &roi, 4*sizeof(float)*roi_out->width,
+                                   tmp, y0, &roo, 4*sizeof(float)*roo.width);
+    dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, tmp);
+    oy = oe;
+  }
+}
+
 // which roi input is needed to process to this output?
 // roi_out is unchanged, full buffer in is full buffer out.
 void
@@ -672,7 +760,7 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, v
     // green eq:
     if(data->green_eq != DT_IOP_GREEN_EQ_NO)
     {
-      float *in = (float *)dt_alloc_align(16, roi_in->height*roi_in->width*sizeof(float));
+      float *in = (float *)dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, roi_in->height*roi_in->width*sizeof(float));
       switch(data->green_eq)
       {
         case DT_IOP_GREEN_EQ_FULL:
@@ -691,15 +779,15 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, v
           break;
       }
       if (demosaicing_method != DT_IOP_DEMOSAIC_AMAZE)
-        demosaic_ppg((float *)o, in, &roo, &roi, data->filters, data->median_thrs);
+        demosaic_ppg((float *)o, in, &roo, &roi, data->filters, data->median_thrs, &piece->pipe->scratch);
       else
         amaze_demosaic_RT(self, piece, in, (float *)o, &roi, &roo, data->filters);
-      free(in);
+      dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, in);
     }
     else
     {
       if (demosaicing_method != DT_IOP_DEMOSAIC_AMAZE)
-        demosaic_ppg((float *)o, pixels, &roo, &roi, data->filters, data->median_thrs);
+        demosaic_ppg((float *)o, pixels, &roo, &roi, data->filters, data->median_thrs, &piece->pipe->scratch);
       else
         amaze_demosaic_RT(self, piece, pixels, (float *)o, &roi, &roo, data->filters);
     }
@@ -715,10 +803,10 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, v
     roo.height = roi_out->height / roi_out->scale;
     roo.scale = 1.0f;
 
-    float *tmp = (float *)dt_alloc_align(16, roo.width*roo.height*4*sizeof(float));
+    float *in = NULL;
     if(data->green_eq != DT_IOP_GREEN_EQ_NO)
     {
-      float *in = (float *)dt_alloc_align(16, roi_in->height*roi_in->width*sizeof(float));
+      in = (float *)dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, roi_in->height*roi_in->width*sizeof(float));
       switch(data->green_eq)
       {
         case DT_IOP_GREEN_EQ_FULL:
@@ -736,25 +824,30 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, v
                                    data->filters, roi_in->x, roi_in->y, 1);
           break;
       }
-      // wanted ppg or zoomed out a lot and quality is limited to 1
-      if(demosaicing_method != DT_IOP_DEMOSAIC_AMAZE)
-        demosaic_ppg(tmp, in, &roo, &roi, data->filters, data->median_thrs);
-      else
-        amaze_demosaic_RT(self, piece, in, tmp, &roi, &roo, data->filters);
-      free(in);
+    }
+    const float *mosaic = in ? in : pixels;
+
+    if(piece->pipe->type == DT_DEV_PIXELPIPE_EXPORT)
+    {
+      // exports are usually a lot smaller than the sensor, don't hold all of it in rgb
+      demosaic_and_zoom_bands(self, piece, (float *)o, mosaic, roi_out, &roi, data->filters,
+                              data->median_thrs, demosaicing_method);
     }
     else
     {
+      float *tmp = (float *)dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, roo.width*roo.height*4*sizeof(float));
+      // wanted ppg or zoomed out a lot and quality is limited to 1
       if(demosaicing_method != DT_IOP_DEMOSAIC_AMAZE)
-        demosaic_ppg(tmp, pixels, &roo, &roi, data->filters, data->median_thrs);
+        demosaic_ppg(tmp, mosaic, &roo, &roi, data->filters, data->median_thrs, &piece->pipe->scratch);
       else
-        amaze_demosaic_RT(self, piece, pixels, tmp, &roi, &roo, data->filters);
+        amaze_demosaic_RT(self, piece, mosaic, tmp, &roi, &roo, data->filters);
+      roi = *roi_out;
+      roi.x = roi.y = 0;
+      roi.scale = roi_out->scale;
+      dt_iop_clip_and_zoom((float *)o, tmp, &roi, &roo, roi.width, roo.width);
+      dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, tmp);
     }
-    roi = *roi_out;
-    roi.x = roi.y = 0;
-    roi.scale = roi_out->scale;
-    dt_iop_clip_and_zoom((float *)o, tmp, &roi, &roo, roi.width, roo.width);
-    free(tmp);
+    dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, in);
   }
   else
   {
@@ -762,10 +855,10 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *i, v
     const float clip = fminf(piece->pipe->processed_maximum[0], fminf(piece->pipe->processed_maximum[1], piece->pipe->processed_maximum[2]));
     if(piece->pipe->type == DT_DEV_PIXELPIPE_EXPORT && data->median_thrs > 0.0f)
     {
-      float *tmp = (float *)dt_alloc_align(16, sizeof(float)*roi_in->width*roi_in->height);
+      float *tmp = (float *)dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, sizeof(float)*roi_in->width*roi_in->height);
       pre_median_b(tmp, pixels, roi_in, data->filters, 1, data->median_thrs);
       dt_iop_clip_and_zoom_demosaic_half_size_f((float *)o, tmp, &roo, &roi, roo.width, roi.width, data->filters, clip);
-      free(tmp);
+      dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, tmp);
     }
     else
       dt_iop_clip_and_zoom_demosaic_half_size_f((float *)o, pixels, &roo, &roi, roo.width, roi.width, data->filters, clip);
@@ -1105,6 +1198,8 @@ void tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop
 
   if(roi_out->scale > 0.999f)
     tiling->factor += fmax(0.25f, smooth);
+  else if(piece->pipe->type == DT_DEV_PIXELPIPE_EXPORT)
+    tiling->factor += fmax(0.25f, smooth); // demosaiced in bands, see demosaic_and_zoom_bands()
   else if(roi_out->scale > 0.5f)
     tiling->factor += fmax(1.25f, smooth);
   else
@@ -1112,6 +1207,12 @@ void tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop
 
   tiling->maxbuf = 1.0f;
   tiling->overhead = 0;
+  if(roi_out->scale <= 0.999f && piece->pipe->type == DT_DEV_PIXELPIPE_EXPORT)
+  {
+    // one band of full resolution rgb lines, at most
+    const int lines = data->demosaicing_method == DT_IOP_DEMOSAIC_AMAZE ? 4 * DT_DEMOSAIC_AMAZE_TILE_STEP : DT_DEMOSAIC_BAND_LINES;
+    tiling->overhead = roi_in->width * MIN(roi_in->height, 2 * lines) * 4 * sizeof(float);
+  }
   tiling->overlap = 5; // take care of border handling
   tiling->xalign = 2; // Bayer pattern
   tiling->yalign = 2; // Bayer pattern
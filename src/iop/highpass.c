@@ -30,6 +30,7 @@
 #include "develop/imageop.h"
 #include "develop/tiling.h"
 #include "control/control.h"
+#include "common/box_blur.h"
 #include "common/opencl.h"
 #include "gui/accelerators.h"
 #include "gui/gtk.h"
@@ -120,7 +121,7 @@ void tiling_callback (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_
   const float sigma = sqrt((radius * (radius + 1) * BOX_ITERATIONS + 2)/3.0f);
   const int wdh = ceilf(3.0f * sigma);
 
-  tiling->factor = 3.0f;  // in + out + tmp
+  tiling->factor = 3.25f;  // in + out + tmp + blurred lightness (one channel)
   tiling->maxbuf = 1.0f;
   tiling->overhead = 0;
   tiling->overlap = wdh;
@@ -286,86 +287,35 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   const int ch = piece->colors;
 
   /* create inverted image and then blur */
+  float *blurlightness = dt_alloc_align(64, sizeof(float)*roi_out->width*roi_out->height);
+  if(blurlightness == NULL)
+  {
+    dt_print(DT_DEBUG_MEMORY, "[highpass] failed to allocate temporary buffer\n");
+    goto error;
+  }
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(in,out,roi_out) schedule(static)
+  #pragma omp parallel for default(none) shared(in,blurlightness,roi_out) schedule(static)
 #endif
   for(int k=0; k<roi_out->width*roi_out->height; k++)
-    out[ch*k] = 100.0f-LCLIP(in[ch*k]);	// only L in Lab space
+    blurlightness[k] = 100.0f-LCLIP(in[ch*k]);	// only L in Lab space
 
 
   int rad = MAX_RADIUS*(fmin(100.0,data->sharpness+1)/100.0);
   const int radius = MIN(MAX_RADIUS, ceilf(rad * roi_in->scale / piece->iscale));
 
-  /* horizontal blur out into out */
-  const int range = 2*radius+1;
-  const int hr = range/2;
-
-  const int size = roi_out->width>roi_out->height?roi_out->width:roi_out->height;
-  float *scanline = malloc((size*sizeof(float)));
-
-  for(int iteration=0; iteration<BOX_ITERATIONS; iteration++)
+  if(dt_box_blur_1c(blurlightness, roi_out->width, roi_out->height, radius, BOX_ITERATIONS))
   {
-    int index=0;
-    for(int y=0; y<roi_out->height; y++)
-    {
-      float L=0;
-      int hits = 0;
-      for(int x=-hr; x<roi_out->width; x++)
-      {
-        int op = x - hr-1;
-        int np = x+hr;
-        if(op>=0)
-        {
-          L-=out[(index+op)*ch];
-          hits--;
-        }
-        if(np < roi_out->width)
-        {
-          L+=out[(index+np)*ch];
-          hits++;
-        }
-        if(x>=0)
-          scanline[x] = L/hits;
-      }
-
-      for (int x=0; x<roi_out->width; x++)
-        out[(index+x)*ch] = scanline[x];
-      index+=roi_out->width;
-    }
-
-    /* vertical pass on blurlightness */
-    const int opoffs = -(hr+1)*roi_out->width;
-    const int npoffs = (hr)*roi_out->width;
-    for(int x=0; x < roi_out->width; x++)
-    {
-      float L=0;
-      int hits=0;
-      int index = -hr*roi_out->width+x;
-      for(int y=-hr; y<roi_out->height; y++)
-      {
-        int op=y-hr-1;
-        int np= y + hr;
-        if(op>=0)
-        {
-          L-=out[(index+opoffs)*ch];
-          hits--;
-        }
-        if(np < roi_out->height)
-        {
-          L+=out[(index+npoffs)*ch];
-          hits++;
-        }
-        if(y>=0)
-          scanline[y] = L/hits;
-        index += roi_out->width;
-      }
-
-      for (int y=0; y<roi_out->height; y++)
-        out[(y*roi_out->width+x)*ch] = scanline[y];
-    }
+    free(blurlightness);
+    goto error;
   }
 
-  free(scanline);
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(out,blurlightness,roi_out) schedule(static)
+#endif
+  for(int k=0; k<roi_out->width*roi_out->height; k++)
+    out[ch*k] = blurlightness[k];
+
+  free(blurlightness);
 
   const float contrast_scale=((data->contrast/100.0)*7.5);
 #ifdef _OPENMP
@@ -380,6 +330,12 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
     out[index+1] = out[index+2] = 0.0f;		// desaturate a and b in Lab space
     out[index+3] = in[index+3];
   }
+  return;
+
+error:
+  // pass the image through unchanged rather than leave garbage in the output
+  dt_control_log(_("highpass: not enough memory, skipped"));
+  memcpy(ovoid, ivoid, sizeof(float)*ch*roi_out->width*roi_out->height);
 }
 
 static void
@@ -97,6 +97,125 @@ void connect_key_accels(dt_iop_module_t *self)
   dt_accel_connect_slider_iop(self, "tca B", GTK_WIDGET(g->tca_b));
 }
 
+/* returns the lensfun map of the image at this scale. it is only computed again when the parameters
+   (commit_params() invalidates it) or the scale changed. NULL if it could not be allocated. */
+static const dt_iop_lensfun_map_t *
+_get_map(dt_iop_lensfun_data_t *d, const float orig_w, const float orig_h)
+{
+  dt_iop_lensfun_map_t *map = &d->map;
+  if(map->valid && map->orig_w == orig_w && map->orig_h == orig_h) return map;
+  map->valid = 0;
+
+  const int step = DT_IOP_LENSFUN_MAP_STEP;
+  // one extra point beyond the image border on each side, so every pixel lies inside a grid cell
+  const int width = ceilf(orig_w / step) + 2;
+  const int height = ceilf(orig_h / step) + 2;
+  if(map->size < (size_t)width*height)
+  {
+    free(map->coords);
+    free(map->vignette);
+    map->size = (size_t)width*height;
+    map->coords = (float *)dt_alloc_align(16, map->size*6*sizeof(float));
+    map->vignette = (float *)dt_alloc_align(16, map->size*3*sizeof(float));
+    if(!map->coords || !map->vignette)
+    {
+      free(map->coords);
+      free(map->vignette);
+      map->coords = map->vignette = NULL;
+      map->size = 0;
+      return NULL;
+    }
+  }
+
+  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
+  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+
+  const int modflags = lf_modifier_initialize(
+                         modifier, d->lens, LF_PF_F32,
+                         d->focal, d->aperture,
+                         d->distance, d->scale,
+                         d->target_geom, d->modify_flags, d->inverse);
+  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+
+  float *coords = map->coords;
+  float *vignette = map->vignette;
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(coords, vignette, modifier) schedule(static)
+#endif
+  for(int j = 0; j < height; j++)
+  {
+    for(int i = 0; i < width; i++)
+    {
+      float *pi = coords + 6*((size_t)j*width + i);
+      float *v = vignette + 3*((size_t)j*width + i);
+      if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
+                     LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+        lf_modifier_apply_subpixel_geometry_distortion (
+          modifier, i*step, j*step, 1, 1, pi);
+      v[0] = v[1] = v[2] = 1.0f;
+      if(modflags & LF_MODIFY_VIGNETTING)
+        lf_modifier_apply_color_modification (modifier, v, i*step, j*step,
+                                              1, 1, LF_CR_3 (RED, GREEN, BLUE), 3);
+    }
+  }
+  lf_modifier_destroy(modifier);
+
+  map->orig_w = orig_w;
+  map->orig_h = orig_h;
+  map->modflags = modflags;
+  map->width = width;
+  map->height = height;
+  map->valid = 1;
+  return map;
+}
+
+/* grid cell and weights of a pixel in the map */
+static inline void
+_map_cell(const dt_iop_lensfun_map_t *map, const float px, const float py, size_t *cell, float *fx, float *fy)
+{
+  const float gx = px / DT_IOP_LENSFUN_MAP_STEP;
+  const float gy = py / DT_IOP_LENSFUN_MAP_STEP;
+  const int i = CLAMP((int)gx, 0, map->width-2);
+  const int j = CLAMP((int)gy, 0, map->height-2);
+  *cell = (size_t)j*map->width + i;
+  *fx = gx - i;
+  *fy = gy - j;
+}
+
+/* distorted coordinates of a row of pixels, bilinearly interpolated from the map.
+   same layout as lf_modifier_apply_subpixel_geometry_distortion(modifier, x, y, width, 1, pi). */
+static void
+_map_distort_row(const dt_iop_lensfun_map_t *map, const int x, const int y, const int width, float *pi)
+{
+  for(int k = 0; k < width; k++, pi+=6)
+  {
+    size_t cell;
+    float fx, fy;
+    _map_cell(map, x+k, y, &cell, &fx, &fy);
+    const float *c0 = map->coords + 6*cell;
+    const float *c1 = c0 + 6*map->width;
+    for(int c = 0; c < 6; c++)
+      pi[c] = (1.0f-fy)*((1.0f-fx)*c0[c] + fx*c0[6+c]) + fy*((1.0f-fx)*c1[c] + fx*c1[6+c]);
+  }
+}
+
+/* applies the vignetting correction of the map to the first three channels of a row of pixels,
+   like lf_modifier_apply_color_modification() would. */
+static void
+_map_vignette_row(const dt_iop_lensfun_map_t *map, float *buf, const int x, const int y, const int width, const int ch)
+{
+  for(int k = 0; k < width; k++, buf+=ch)
+  {
+    size_t cell;
+    float fx, fy;
+    _map_cell(map, x+k, y, &cell, &fx, &fy);
+    const float *v0 = map->vignette + 3*cell;
+    const float *v1 = v0 + 3*map->width;
+    for(int c = 0; c < 3; c++)
+      buf[c] *= (1.0f-fy)*((1.0f-fx)*v0[c] + fx*v0[3+c]) + fy*((1.0f-fx)*v1[c] + fx*v1[3+c]);
+  }
+}
+
 void
 process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
 {
@@ -107,8 +226,6 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
   const int ch_width = ch*roi_in->width;
   const int mask_display = piece->pipe->mask_display;
 
-  const unsigned int pixelformat = ch == 3 ? LF_CR_3 (RED, GREEN, BLUE) : LF_CR_4 (RED, GREEN, BLUE, UNKNOWN);
-
   if(!d->lens->Maker || d->crop <= 0.0f)
   {
     memcpy(out, in, ch*sizeof(float)*roi_out->width*roi_out->height);
@@ -117,15 +234,15 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  const dt_iop_lensfun_map_t *map = _get_map(d, orig_w, orig_h);
+  if(!map)
+  {
+    memcpy(out, in, ch*sizeof(float)*roi_out->width*roi_out->height);
+    return;
+  }
+  const int modflags = map->modflags;
+  dt_dev_pixelpipe_scratch_t *scratch = &piece->pipe->scratch;
+  float *tmpbuf = NULL, *tmpbuf2 = NULL;
 
   if(d->inverse)
   {
@@ -135,23 +252,17 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
     {
       // acquire temp memory for distorted pixel coords
       const size_t req2 = roi_out->width*2*3*sizeof(float);
-      if(req2 > 0 && d->tmpbuf2_len < req2*dt_get_num_threads())
-      {
-        d->tmpbuf2_len = req2*dt_get_num_threads();
-        free(d->tmpbuf2);
-        d->tmpbuf2 = (float *)dt_alloc_align(16, d->tmpbuf2_len);
-      }
+      tmpbuf2 = (float *)dt_dev_pixelpipe_scratch_alloc(scratch, req2*dt_get_num_threads());
 
       const struct  dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, in, d, ovoid, modifier, interpolation) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, in, tmpbuf2, ovoid, map, interpolation) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
-        float *pi = (float *)(((char *)d->tmpbuf2) + req2*dt_get_thread_num());
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        float *pi = (float *)(((char *)tmpbuf2) + req2*dt_get_thread_num());
+        _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, pi);
         // reverse transform the global coords from lf to our buffer
         float *buf = ((float *)ovoid) + y*roi_out->width*ch;
         for (int x = 0; x < roi_out->width; x++,buf+=ch,pi+=6)
@@ -185,16 +296,14 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
     if (modflags & LF_MODIFY_VIGNETTING)
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, out, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, out, map) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         /* Colour correction: vignetting and CCI */
         // actually this way row stride does not matter.
         float *buf = out;
-        lf_modifier_apply_color_modification (modifier,
-                                              buf + ch*roi_out->width*y, roi_out->x, roi_out->y + y,
-                                              roi_out->width, 1, pixelformat, ch*roi_out->width);
+        _map_vignette_row(map, buf + ch*roi_out->width*y, roi_out->x, roi_out->y + y, roi_out->width, ch);
       }
     }
   }
@@ -202,26 +311,19 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
   {
     // acquire temp memory for image buffer
     const size_t req = roi_in->width*roi_in->height*ch*sizeof(float);
-    if(req > 0 && d->tmpbuf_len < req)
-    {
-      d->tmpbuf_len = req;
-      free(d->tmpbuf);
-      d->tmpbuf = (float *)dt_alloc_align(16, d->tmpbuf_len);
-    }
-    memcpy(d->tmpbuf, in, req);
+    tmpbuf = (float *)dt_dev_pixelpipe_scratch_alloc(scratch, req);
+    memcpy(tmpbuf, in, req);
     if (modflags & LF_MODIFY_VIGNETTING)
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_in, out, modifier, d) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_in, out, map, tmpbuf) schedule(static)
 #endif
       for (int y = 0; y < roi_in->height; y++)
       {
         /* Colour correction: vignetting and CCI */
         // actually this way row stride does not matter.
-        float *buf = d->tmpbuf;
-        lf_modifier_apply_color_modification (modifier,
-                                              buf + ch*roi_in->width*y, roi_in->x, roi_in->y + y,
-                                              roi_in->width, 1, pixelformat, ch*roi_in->width);
+        float *buf = tmpbuf;
+        _map_vignette_row(map, buf + ch*roi_in->width*y, roi_in->x, roi_in->y + y, roi_in->width, ch);
       }
     }
 
@@ -230,23 +332,17 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
                     LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
       // acquire temp memory for distorted pixel coords
-      if(req2 > 0 && d->tmpbuf2_len < req2*dt_get_num_threads())
-      {
-        d->tmpbuf2_len = req2*dt_get_num_threads();
-        free(d->tmpbuf2);
-        d->tmpbuf2 = (float *)dt_alloc_align(16, d->tmpbuf2_len);
-      }
+      tmpbuf2 = (float *)dt_dev_pixelpipe_scratch_alloc(scratch, req2*dt_get_num_threads());
 
       const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_in, roi_out, d, ovoid, modifier, interpolation) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_in, roi_out, tmpbuf, tmpbuf2, ovoid, map, interpolation) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
-        float *pi = (float *)(((char *)d->tmpbuf2) + dt_get_thread_num()*req2);
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        float *pi = (float *)(((char *)tmpbuf2) + dt_get_thread_num()*req2);
+        _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, pi);
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + y*roi_out->width*ch;
         for (int x = 0; x < roi_out->width; x++,pi+=6)
@@ -255,7 +351,7 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
           {
             const float pi0 = pi[c*2] - roi_in->x;
             const float pi1 = pi[c*2+1] - roi_in->y;
-            out[c] = dt_interpolation_compute_sample(interpolation, d->tmpbuf+c, pi0, pi1, roi_in->width, roi_in->height, ch, ch_width);
+            out[c] = dt_interpolation_compute_sample(interpolation, tmpbuf+c, pi0, pi1, roi_in->width, roi_in->height, ch, ch_width);
           }
 
           if(mask_display)
@@ -263,7 +359,7 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
             // take green channel distortion also for alpha channel
             const float pi0 = pi[2] - roi_in->x;
             const float pi1 = pi[3] - roi_in->y;
-            out[3] = dt_interpolation_compute_sample(interpolation, d->tmpbuf+3, pi0, pi1, roi_in->width, roi_in->height, ch, ch_width);
+            out[3] = dt_interpolation_compute_sample(interpolation, tmpbuf+3, pi0, pi1, roi_in->width, roi_in->height, ch, ch_width);
           }
           out += ch;
         }
@@ -272,7 +368,7 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
     else
     {
       const size_t len = sizeof(float)*ch*roi_out->width*roi_out->height;
-      const float *const input = (d->tmpbuf_len >= len) ? d->tmpbuf : in;
+      const float *const input = (req >= len) ? tmpbuf : in;
 #ifdef _OPENMP
       #pragma omp parallel for default(none) shared(roi_out, out) schedule(static)
 #endif
@@ -280,7 +376,8 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
         memcpy(out+ch*y*roi_out->width, input+ch*y*roi_out->width, ch*sizeof(float)*roi_out->width);
     }
   }
-  lf_modifier_destroy(modifier);
+  dt_dev_pixelpipe_scratch_free(scratch, tmpbuf);
+  dt_dev_pixelpipe_scratch_free(scratch, tmpbuf2);
 }
 
 
@@ -295,7 +392,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   cl_int err = -999;
 
   float *tmpbuf = NULL;
-  lfModifier *modifier = NULL;
+  const dt_iop_lensfun_map_t *map = NULL;
 
   const int devid = piece->pipe->devid;
   const int iwidth = roi_in->width;
@@ -309,7 +406,6 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   const int ch = piece->colors;
   const int tmpbufwidth = owidth*2*3;
   const int tmpbuflen = d->inverse ? oheight*owidth*2*3*sizeof(float) : MAX(oheight*owidth*2*3, iheight*iwidth*ch)*sizeof(float);
-  const unsigned int pixelformat = ch == 3 ? LF_CR_3 (RED, GREEN, BLUE) : LF_CR_4 (RED, GREEN, BLUE, UNKNOWN);
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
@@ -350,7 +446,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   }
 
 
-  tmpbuf = (float *)dt_alloc_align(16, tmpbuflen);
+  tmpbuf = (float *)dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, tmpbuflen);
   if(tmpbuf == NULL) goto error;
 
   dev_tmp = dt_opencl_alloc_device(devid, width, height, 4*sizeof(float));
@@ -360,15 +456,9 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   if(dev_tmpbuf == NULL) goto error;
 
 
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  map = _get_map(d, orig_w, orig_h);
+  if(map == NULL) goto error;
+  const int modflags = map->modflags;
 
   if(d->inverse)
   {
@@ -377,13 +467,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, map) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -412,7 +501,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
     if(modflags & LF_MODIFY_VIGNETTING)
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, modifier, d) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, map, d) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
@@ -420,8 +509,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
         // actually this way row stride does not matter.
         float *buf = tmpbuf + y * ch*roi_out->width;
         for (int k=0; k < ch*roi_out->width; k++) buf[k] = 0.5f;
-        lf_modifier_apply_color_modification (modifier, buf, roi_out->x, roi_out->y + y,
-                                              roi_out->width, 1, pixelformat, ch*roi_out->width);
+        _map_vignette_row(map, buf, roi_out->x, roi_out->y + y, roi_out->width, ch);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -451,7 +539,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
     if(modflags & LF_MODIFY_VIGNETTING)
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, modifier, d) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, map, d) schedule(static)
 #endif
       for (int y = 0; y < roi_in->height; y++)
       {
@@ -459,8 +547,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
         // actually this way row stride does not matter.
         float *buf = tmpbuf + y * ch*roi_in->width;
         for (int k=0; k < ch*roi_in->width; k++) buf[k] = 0.5f;
-        lf_modifier_apply_color_modification (modifier, buf, roi_in->x, roi_in->y + y,
-                                              roi_in->width, 1, pixelformat, ch*roi_in->width);
+        _map_vignette_row(map, buf, roi_in->x, roi_in->y + y, roi_in->width, ch);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -486,13 +573,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, map) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -521,15 +607,13 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
 
   dt_opencl_release_mem_object(dev_tmpbuf);
   dt_opencl_release_mem_object(dev_tmp);
-  if (tmpbuf != NULL) free(tmpbuf);
-  if (modifier != NULL) lf_modifier_destroy(modifier);
+  dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, tmpbuf);
   return TRUE;
 
 error:
   if (dev_tmp != NULL) dt_opencl_release_mem_object(dev_tmp);
   if (dev_tmpbuf != NULL) dt_opencl_release_mem_object(dev_tmpbuf);
-  if (tmpbuf != NULL) free(tmpbuf);
-  if (modifier != NULL) lf_modifier_destroy(modifier);
+  dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, tmpbuf);
   dt_print(DT_DEBUG_OPENCL, "[opencl_lens] couldn't enqueue kernel! %d\n", err);
   return FALSE;
 }
@@ -562,32 +646,20 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+  const dt_iop_lensfun_map_t *map = _get_map(d, orig_w, orig_h);
+  if(!map) return;
 
   float xm = INFINITY, xM = - INFINITY, ym = INFINITY, yM = - INFINITY;
 
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-
-  if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
+  if (map->modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
                   LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
   {
     // acquire temp memory for distorted pixel coords
-    const size_t req2 = roi_in->width*2*3*sizeof(float);
-    if(req2 > 0 && d->tmpbuf2_len < req2)
-    {
-      d->tmpbuf2_len = req2;
-      free(d->tmpbuf2);
-      d->tmpbuf2 = (float *)dt_alloc_align(16, d->tmpbuf2_len);
-    }
+    float *tmpbuf2 = (float *)dt_dev_pixelpipe_scratch_alloc(&piece->pipe->scratch, roi_out->width*2*3*sizeof(float));
     for (int y = 0; y < roi_out->height; y++)
     {
-      lf_modifier_apply_subpixel_geometry_distortion (
-        modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, d->tmpbuf2);
-      const float *pi = d->tmpbuf2;
+      _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, tmpbuf2);
+      const float *pi = tmpbuf2;
       // reverse transform the global coords from lf to our buffer
       for (int x = 0; x < roi_out->width; x++)
       {
@@ -601,6 +673,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
         }
       }
     }
+    dt_dev_pixelpipe_scratch_free(&piece->pipe->scratch, tmpbuf2);
 
     const struct dt_interpolation* interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
     roi_in->x = fmaxf(0.0f, xm-interpolation->width);
@@ -608,7 +681,6 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
     roi_in->width = fminf(orig_w-roi_in->x, xM - roi_in->x + interpolation->width);
     roi_in->height = fminf(orig_h-roi_in->y, yM - roi_in->y + interpolation->width);
   }
-  lf_modifier_destroy(modifier);
 }
 
 void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -671,6 +743,7 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
   d->aperture     = p->aperture;
   d->distance     = p->distance;
   d->target_geom  = p->target_geom;
+  d->map.valid    = 0;
 #endif
 }
 
@@ -682,10 +755,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   piece->data = malloc(sizeof(dt_iop_lensfun_data_t));
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
 
-  d->tmpbuf2_len = 0;
-  d->tmpbuf2 = NULL;
-  d->tmpbuf_len = 0;
-  d->tmpbuf = NULL;
+  memset(&d->map, 0, sizeof(dt_iop_lensfun_map_t));
   d->lens = lf_lens_new();
   self->commit_params(self, self->default_params, pipe, piece);
 #endif
@@ -698,8 +768,8 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
 #else
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
   lf_lens_destroy(d->lens);
-  free(d->tmpbuf);
-  free(d->tmpbuf2);
+  free(d->map.coords);
+  free(d->map.vignette);
   free(piece->data);
 #endif
 }
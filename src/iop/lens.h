@@ -67,13 +67,27 @@ typedef struct dt_iop_lensfun_global_data_t
 }
 dt_iop_lensfun_global_data_t;
 
+/** lensfun's coordinate and vignetting corrections of the whole image at one roi scale, sampled on
+ *  a coarse grid. they only depend on the parameters and the scale, so panning and tiling look them
+ *  up here instead of running lensfun over every pixel again. */
+typedef struct dt_iop_lensfun_map_t
+{
+  int valid;
+  float orig_w, orig_h;   // image size at the scale the map was computed for
+  int modflags;           // as returned by lf_modifier_initialize()
+  int width, height;      // grid points, DT_IOP_LENSFUN_MAP_STEP pixels apart
+  size_t size;            // allocated grid points
+  float *coords;          // 6 floats per grid point: distorted r, g and b coordinates
+  float *vignette;        // 3 floats per grid point: vignetting gain per channel
+}
+dt_iop_lensfun_map_t;
+
+#define DT_IOP_LENSFUN_MAP_STEP 8
+
 typedef struct dt_iop_lensfun_data_t
 {
   lfLens *lens;
-  float *tmpbuf;
-  float *tmpbuf2;
-  size_t tmpbuf_len;
-  size_t tmpbuf2_len;
+  dt_iop_lensfun_map_t map;
   int modify_flags;
   int inverse;
   float scale;
@@ -26,6 +26,7 @@
 #include <gegl.h>
 #endif
 #include "bauhaus/bauhaus.h"
+#include "common/box_blur.h"
 #include "common/colorspaces.h"
 #include "common/opencl.h"
 #include "develop/develop.h"
@@ -136,6 +137,7 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
     s*=saturation;
     l*=brightness;
     hsl2rgb(&out[index],h,CLIP(s),CLIP(l));
+    out[index+3] = in[index+3];
   }
 
   const float w = piece->iwidth*piece->iscale;
@@ -144,90 +146,14 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
   int rad = mrad*(fmin(100.0,data->size+1)/100.0);
   const int radius = MIN(mrad, ceilf(rad * roi_in->scale / piece->iscale));
 
-  /* horizontal blur out into out */
-  const int range = 2*radius+1;
-  const int hr = range/2;
-
-  const int size = roi_out->width > roi_out->height ? roi_out->width : roi_out->height;
-  float *scanline[3]= {0};
-  scanline[0]  = malloc((size*sizeof(float))*ch);
-  scanline[1]  = malloc((size*sizeof(float))*ch);
-  scanline[2]  = malloc((size*sizeof(float))*ch);
-
-  for(int iteration=0; iteration<BOX_ITERATIONS; iteration++)
+  if(dt_box_blur_4c(out, roi_out->width, roi_out->height, radius, BOX_ITERATIONS))
   {
-    int index=0;
-    for(int y=0; y<roi_out->height; y++)
-    {
-      for(int k=0; k<3; k++)
-      {
-        float L=0;
-        int hits = 0;
-        for(int x=-hr; x<roi_out->width; x++)
-        {
-          int op = x - hr-1;
-          int np = x+hr;
-          if(op>=0)
-          {
-            L-=out[(index+op)*ch+k];
-            hits--;
-          }
-          if(np < roi_out->width)
-          {
-            L+=out[(index+np)*ch+k];
-            hits++;
-          }
-          if(x>=0)
-            scanline[k][x] = L/hits;
-        }
-      }
-
-      for (int k=0; k<3; k++)
-        for (int x=0; x<roi_out->width; x++)
-          out[(index+x)*ch+k] = scanline[k][x];
-
-      index+=roi_out->width;
-    }
-
-    /* vertical pass on blurlightness */
-    const int opoffs = -(hr+1)*roi_out->width;
-    const int npoffs = (hr)*roi_out->width;
-    for(int x=0; x < roi_out->width; x++)
-    {
-      for(int k=0; k<3; k++)
-      {
-        float L=0;
-        int hits=0;
-        int index = -hr*roi_out->width+x;
-        for(int y=-hr; y<roi_out->height; y++)
-        {
-          int op=y-hr-1;
-          int np= y + hr;
-
-          if(op>=0)
-          {
-            L-=out[(index+opoffs)*ch+k];
-            hits--;
-          }
-          if(np < roi_out->height)
-          {
-            L+=out[(index+npoffs)*ch+k];
-            hits++;
-          }
-          if(y>=0)
-            scanline[k][y] = L/hits;
-          index += roi_out->width;
-        }
-      }
-
-      for(int k=0; k<3; k++)
-        for (int y=0; y<roi_out->height; y++)
-          out[(y*roi_out->width+x)*ch+k] = scanline[k][y];
-
-    }
+    // pass the image through unchanged rather than the unblurred overexposed copy
+    dt_control_log(_("soften: not enough memory, skipped"));
+    memcpy(ovoid, ivoid, sizeof(float)*ch*roi_out->width*roi_out->height);
+    return;
   }
 
-
   const float amount = data->amount/100.0;
 #ifdef _OPENMP
   #pragma omp parallel for default(none) shared(roi_out, in, out, data) schedule(static)
@@ -240,10 +166,6 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
     out[index+2] = in[index+2]*(1-amount) + CLIP(out[index+2])*amount;
     out[index+3] = in[index+3];
   }
-
-  for(int i=0; i<3; ++i)
-    if(scanline[i])
-      free(scanline[i]);
 }
 
 #ifdef HAVE_OPENCL
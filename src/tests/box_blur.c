@@ -0,0 +1,166 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define DT_UNIT_TEST
+// define the little bits of dt the blur code uses, so we don't need to include the rest of dt:
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define DT_DEBUG_MEMORY 0
+// set to make the allocations fail
+static int out_of_memory = 0;
+static inline void *dt_alloc_align(size_t alignment, size_t size)
+{
+  void *ptr = NULL;
+  if(out_of_memory || posix_memalign(&ptr, alignment, size)) return NULL;
+  return ptr;
+}
+static inline void dt_print(const int thread, const char *msg, ...) {}
+#ifdef _OPENMP
+static inline int dt_get_num_threads() { return omp_get_max_threads(); }
+static inline int dt_get_thread_num() { return omp_get_thread_num(); }
+#else
+static inline int dt_get_num_threads() { return 1; }
+static inline int dt_get_thread_num() { return 0; }
+#endif
+
+// unit test and benchmark for the box blur: it has to give bit for bit the same result as the
+// single threaded column by column blur the modules (bloom, soften, highpass) used before.
+#include "common/box_blur.h"
+#include "common/box_blur.c"
+
+static void
+reference(float *buf, const int width, const int height, const int ch, const int radius, const int iterations)
+{
+  const int hr = radius;
+  const int size = width > height ? width : height;
+  float *scanline = malloc(sizeof(float)*size);
+  for(int iteration=0; iteration<iterations; iteration++)
+    for(int k=0; k<ch; k++)
+    {
+      for(int y=0; y<height; y++)
+      {
+        float L = 0;
+        int hits = 0;
+        for(int x=-hr; x<width; x++)
+        {
+          const int op = x - hr - 1, np = x + hr;
+          if(op >= 0) { L -= buf[(y*width+op)*ch+k]; hits--; }
+          if(np < width) { L += buf[(y*width+np)*ch+k]; hits++; }
+          if(x >= 0) scanline[x] = L/hits;
+        }
+        for(int x=0; x<width; x++) buf[(y*width+x)*ch+k] = scanline[x];
+      }
+      for(int x=0; x<width; x++)
+      {
+        float L = 0;
+        int hits = 0;
+        for(int y=-hr; y<height; y++)
+        {
+          const int op = y - hr - 1, np = y + hr;
+          if(op >= 0) { L -= buf[(op*width+x)*ch+k]; hits--; }
+          if(np < height) { L += buf[(np*width+x)*ch+k]; hits++; }
+          if(y >= 0) scanline[y] = L/hits;
+        }
+        for(int y=0; y<height; y++) buf[(y*width+x)*ch+k] = scanline[y];
+      }
+    }
+  free(scanline);
+}
+
+static double
+get_time()
+{
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + (1.0/1000000)*time.tv_usec;
+}
+
+int main(int argc, char *arg[])
+{
+  int failed = 0;
+
+  // odd sizes, so the vertical pass has columns left over after the last block,
+  // and radii up to larger than the image. 4001x10 has rows longer than the column blocks
+  // and not a multiple of four floats, which has to keep each thread's scratch aligned.
+  const int sizes[][2] = { { 1031, 687 }, { 37, 5 }, { 3, 200 }, { 4001, 10 } };
+  const int radii[] = { 0, 1, 7, 64, 300 };
+  for(int s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++)
+    for(int r=0; r<sizeof(radii)/sizeof(radii[0]); r++)
+      for(int ch=1; ch<=4; ch+=3)
+      {
+        const int wd = sizes[s][0], ht = sizes[s][1];
+        const size_t n = (size_t)ch*wd*ht;
+        float *ref = dt_alloc_align(64, sizeof(float)*n);
+        float *out = dt_alloc_align(64, sizeof(float)*n);
+        srand(42);
+        for(size_t k=0; k<n; k++) ref[k] = out[k] = 100.0f*rand()/(float)RAND_MAX;
+        reference(ref, wd, ht, ch, radii[r], 2);
+        const int err = (ch == 4) ? dt_box_blur_4c(out, wd, ht, radii[r], 2) : dt_box_blur_1c(out, wd, ht, radii[r], 2);
+        const int equal = !err && !memcmp(ref, out, sizeof(float)*n);
+        if(!equal) failed++;
+        printf("%4dx%-4d %dc radius %3d %s\n", wd, ht, ch, radii[r], equal ? "ok" : "FAILED");
+        free(ref);
+        free(out);
+      }
+
+  // without memory for the scratch buffers, the blur has to say so and leave the buffer alone.
+  {
+    const size_t n = 4*37*5;
+    float *ref = dt_alloc_align(64, sizeof(float)*n);
+    float *out = dt_alloc_align(64, sizeof(float)*n);
+    for(size_t k=0; k<n; k++) ref[k] = out[k] = k;
+    out_of_memory = 1;
+    const int err = dt_box_blur_4c(out, 37, 5, 3, 2) && dt_box_blur_1c(out, 4*37, 5, 3, 2);
+    out_of_memory = 0;
+    const int ok = err && !memcmp(ref, out, sizeof(float)*n);
+    if(!ok) failed++;
+    printf("out of memory %s\n", ok ? "ok" : "FAILED");
+    free(ref);
+    free(out);
+  }
+
+  // benchmark: 8 iterations like the modules use, on a 12 megapixel image.
+  const int wd = 4288, ht = 2848, radius = 64;
+  for(int ch=1; ch<=4; ch+=3)
+  {
+    const size_t n = (size_t)ch*wd*ht;
+    float *buf = dt_alloc_align(64, sizeof(float)*n);
+    for(size_t k=0; k<n; k++) buf[k] = (k % 1237)*0.1f;
+    double start = get_time();
+    reference(buf, wd, ht, ch, radius, 8);
+    const double t_ref = get_time() - start;
+    start = get_time();
+    if(ch == 4) dt_box_blur_4c(buf, wd, ht, radius, 8);
+    else dt_box_blur_1c(buf, wd, ht, radius, 8);
+    const double t_box = get_time() - start;
+    printf("%dc %dx%d, 8 iterations: reference %.3fs, dt_box_blur %.3fs (%d threads)\n", ch, wd, ht, t_ref, t_box, dt_get_num_threads());
+    free(buf);
+  }
+
+  return failed ? 1 : 0;
+}
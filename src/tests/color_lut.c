@@ -0,0 +1,205 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define DT_UNIT_TEST
+// define the little bits of dt the lut code uses, so we don't need to include the rest of dt:
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define DT_DEBUG_PERF 0
+static inline void *dt_alloc_align(size_t alignment, size_t size)
+{
+  void *ptr = NULL;
+  if(posix_memalign(&ptr, alignment, size)) return NULL;
+  return ptr;
+}
+static inline void dt_print(const int thread, const char *msg, ...) {}
+
+// unit test for the 3d luts colorin and colorout bake their lcms transforms into:
+// they have to agree with cmsDoTransform, and only touch what they are supposed to.
+#include "common/color_lut.h"
+#include "common/color_lut.c"
+
+static float
+delta_e(const float *a, const float *b)
+{
+  const float dL = a[0] - b[0], da = a[1] - b[1], db = a[2] - b[2];
+  return sqrtf(dL*dL + da*da + db*db);
+}
+
+static float
+uniform(uint32_t *seed)
+{
+  *seed = *seed * 1664525u + 1013904223u;
+  return (*seed >> 8)*(1.0f/16777216.0f);
+}
+
+// largest difference to lcms, in Lab, at n random points of the domain of the lut, passed in and
+// out with four floats per pixel. to_lab converts rgb output to Lab, NULL if the output is Lab already.
+// returns -1 if the lut wrote a fourth channel, or left points of its domain to lcms.
+static float
+compare(const dt_color_lut_t *lut, cmsHTRANSFORM xform, cmsHTRANSFORM to_lab, const int n)
+{
+  float *in = malloc(sizeof(float)*4*n), *in3 = malloc(sizeof(float)*3*n);
+  float *out = malloc(sizeof(float)*4*n), *out3 = malloc(sizeof(float)*3*n);
+  float *exact = malloc(sizeof(float)*3*n), *lab_exact = malloc(sizeof(float)*3*n), *lab_out = malloc(sizeof(float)*3*n);
+  int *outside = malloc(sizeof(int)*n);
+  uint32_t seed = 42;
+  for(int i=0; i<n; i++)
+    for(int k=0; k<3; k++)
+      in[4*i+k] = in3[3*i+k] = lut->offset[k] + uniform(&seed)/lut->scale[k];
+  for(int i=0; i<n; i++) out[4*i+3] = in[4*i+3] = 0.5f;
+  float max_delta_e = 0.0f;
+  if(dt_color_lut_apply(lut, in, 4, out, 4, n, outside)) max_delta_e = -1.0f;
+  for(int i=0; i<n; i++)
+  {
+    if(out[4*i+3] != 0.5f) max_delta_e = -1.0f;
+    for(int k=0; k<3; k++) out3[3*i+k] = out[4*i+k];
+  }
+  cmsDoTransform(xform, in3, exact, n);
+  if(max_delta_e == 0.0f)
+  {
+    if(to_lab)
+    {
+      cmsDoTransform(to_lab, exact, lab_exact, n);
+      cmsDoTransform(to_lab, out3, lab_out, n);
+    }
+    const float *a = to_lab ? lab_exact : exact, *b = to_lab ? lab_out : out3;
+    for(int i=0; i<n; i++)
+    {
+      // as _lut_verify: rgb only counts inside the gamut, where lcms doesn't clip
+      if(to_lab && (fminf(exact[3*i], fminf(exact[3*i+1], exact[3*i+2])) < 0.0f ||
+                    fmaxf(exact[3*i], fmaxf(exact[3*i+1], exact[3*i+2])) > 1.0f)) continue;
+      const float d = delta_e(a + 3*i, b + 3*i);
+      if(!(d <= max_delta_e)) max_delta_e = d;
+    }
+  }
+  free(in);
+  free(in3);
+  free(out);
+  free(out3);
+  free(exact);
+  free(lab_exact);
+  free(lab_out);
+  free(outside);
+  return max_delta_e;
+}
+
+int main(int argc, char *arg[])
+{
+  int failed = 0;
+  dt_color_lut_cache_t *cache = dt_color_lut_cache_init();
+
+  // an rgb profile which isn't plain srgb: adobe rgb primaries, gamma 2.2
+  cmsCIExyY d65;
+  cmsWhitePointFromTemp(&d65, 6504);
+  const cmsCIExyYTRIPLE primaries = { { 0.64, 0.33, 1.0 }, { 0.21, 0.71, 1.0 }, { 0.15, 0.06, 1.0 } };
+  cmsToneCurve *gamma = cmsBuildGamma(NULL, 2.2);
+  cmsToneCurve *curves[3] = { gamma, gamma, gamma };
+  cmsHPROFILE rgb = cmsCreateRGBProfile(&d65, &primaries, curves);
+  cmsFreeToneCurve(gamma);
+  cmsHPROFILE srgb = cmsCreate_sRGBProfile();
+  cmsHPROFILE lab = cmsCreateLab4Profile(NULL);
+
+  // colorin: camera rgb -> Lab
+  {
+    cmsHTRANSFORM xform = cmsCreateTransform(rgb, TYPE_RGB_FLT, lab, TYPE_Lab_FLT, INTENT_PERCEPTUAL, 0);
+    const float offset[3] = {0.0f, 0.0f, 0.0f}, scale[3] = {1.0f, 1.0f, 1.0f};
+    gchar *key = dt_color_lut_key(rgb, TYPE_RGB_FLT, lab, TYPE_Lab_FLT, NULL, INTENT_PERCEPTUAL, 0);
+    const dt_color_lut_t *lut = dt_color_lut_cache_get(cache, key, xform, NULL, offset, scale);
+    const float d = lut ? compare(lut, xform, NULL, 100000) : -1.0f;
+    const int ok = d >= 0.0f && d <= DT_COLOR_LUT_MAX_DELTA_E;
+    if(!ok) failed++;
+    printf("rgb -> Lab: %d^3 lut, max delta e %f %s\n", lut ? lut->size : 0, d, ok ? "ok" : "FAILED");
+
+    // the same transform again is the same lut
+    const dt_color_lut_t *again = dt_color_lut_cache_get(cache, key, xform, NULL, offset, scale);
+    if(again != lut) failed++;
+    printf("cached lut reused %s\n", again == lut ? "ok" : "FAILED");
+    dt_color_lut_cache_release(cache, again);
+
+    // pixels outside the domain are left to lcms, and left alone
+    if(lut)
+    {
+      const float in[12] = { 0.5f, 0.5f, 0.5f, 0.0f, -0.1f, 0.5f, 0.5f, 0.0f, 0.5f, 1.5f, NAN, 0.0f };
+      float out[12] = { 0.0f };
+      out[4] = out[8] = 7.0f;
+      int outside[3];
+      const int num_outside = dt_color_lut_apply(lut, in, 4, out, 4, 3, outside);
+      const int ok = num_outside == 2 && outside[0] == 1 && outside[1] == 2 && out[4] == 7.0f && out[8] == 7.0f;
+      if(!ok) failed++;
+      printf("out of domain pixels %s\n", ok ? "ok" : "FAILED");
+    }
+    dt_color_lut_cache_release(cache, lut);
+    g_free(key);
+    cmsDeleteTransform(xform);
+  }
+
+  // colorout: Lab -> display rgb, compared in Lab
+  {
+    cmsHTRANSFORM xform = cmsCreateTransform(lab, TYPE_Lab_FLT, srgb, TYPE_RGB_FLT, INTENT_PERCEPTUAL, 0);
+    cmsHTRANSFORM to_lab = cmsCreateTransform(srgb, TYPE_RGB_FLT, lab, TYPE_Lab_FLT, INTENT_RELATIVE_COLORIMETRIC, 0);
+    const float offset[3] = {0.0f, -128.0f, -128.0f}, scale[3] = {1.0f/100.0f, 1.0f/256.0f, 1.0f/256.0f};
+    gchar *key = dt_color_lut_key(lab, TYPE_Lab_FLT, srgb, TYPE_RGB_FLT, NULL, INTENT_PERCEPTUAL, 0);
+    const dt_color_lut_t *lut = dt_color_lut_cache_get(cache, key, xform, to_lab, offset, scale);
+    // no lut is fine: colorout then uses lcms for every pixel. a lut it gets has to be right, though.
+    if(lut)
+    {
+      const float d = compare(lut, xform, to_lab, 100000);
+      const int ok = d >= 0.0f && d <= DT_COLOR_LUT_MAX_DELTA_E;
+      if(!ok) failed++;
+      printf("Lab -> rgb: %d^3 lut, max delta e %f %s\n", lut->size, d, ok ? "ok" : "FAILED");
+    }
+    else
+      printf("Lab -> rgb: no lut within delta e %f, lcms is used\n", DT_COLOR_LUT_MAX_DELTA_E);
+    dt_color_lut_cache_release(cache, lut);
+    g_free(key);
+    cmsDeleteTransform(to_lab);
+    cmsDeleteTransform(xform);
+  }
+
+  // transforms between the same profiles in the other direction, or with other formats, get their own luts
+  {
+    gchar *keys[4] = {
+      dt_color_lut_key(rgb, TYPE_RGB_FLT, lab, TYPE_Lab_FLT, NULL, INTENT_PERCEPTUAL, 0),
+      dt_color_lut_key(lab, TYPE_RGB_FLT, rgb, TYPE_Lab_FLT, NULL, INTENT_PERCEPTUAL, 0),
+      dt_color_lut_key(rgb, TYPE_RGBA_FLT, lab, TYPE_Lab_FLT, NULL, INTENT_PERCEPTUAL, 0),
+      dt_color_lut_key(rgb, TYPE_RGB_FLT, lab, TYPE_Lab_FLT, NULL, INTENT_RELATIVE_COLORIMETRIC, 0)
+    };
+    gchar *same = dt_color_lut_key(rgb, TYPE_RGB_FLT, lab, TYPE_Lab_FLT, NULL, INTENT_PERCEPTUAL, 0);
+    int ok = !strcmp(keys[0], same);
+    for(int i=0; i<4; i++)
+      for(int j=i+1; j<4; j++) ok &= strcmp(keys[i], keys[j]) != 0;
+    if(!ok) failed++;
+    printf("keys %s\n", ok ? "ok" : "FAILED");
+    for(int i=0; i<4; i++) g_free(keys[i]);
+    g_free(same);
+  }
+
+  cmsCloseProfile(rgb);
+  cmsCloseProfile(srgb);
+  cmsCloseProfile(lab);
+  dt_color_lut_cache_cleanup(cache);
+  return failed ? 1 : 0;
+}
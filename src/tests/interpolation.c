@@ -0,0 +1,153 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2013 darktable developers.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define DT_UNIT_TEST
+// define the little bits of dt the interpolation code uses, so we don't need to include the rest of dt:
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define dt_alloc_align(A, B) malloc(B)
+#define dt_conf_get_string(A) NULL
+#define g_free(A) free(A)
+typedef char gchar;
+#define DT_CPU_FLAG_SSE2 2
+#define DT_CPU_FLAG_AVX2 16
+#define DT_CPU_FLAG_FMA  32
+#define CLAMPS(A, L, H) ((A) > (L) ? ((A) < (H) ? (A) : (H)) : (L))
+static struct { uint32_t cpu_flags; } darktable;
+
+typedef struct dt_iop_roi_t
+{
+  int x, y, width, height;
+  float scale;
+}
+dt_iop_roi_t;
+
+// unit test for the runtime selected resampling code paths: all of them have to agree with the plain c one,
+// which is what dt_interpolation_resample() runs on cpus without sse2.
+// resampling in bands, from buffers holding only the input lines each band needs, has to give the same result, too.
+#include "common/interpolation.h"
+#include "common/interpolation.c"
+
+static float
+compare(const float *a, const float *b, const int n)
+{
+  float err = 0.0f;
+  for(int k=0; k<n; k++)
+    err = fmaxf(err, fabsf(a[k] - b[k]) / fmaxf(1.0f, fabsf(a[k])));
+  return err;
+}
+
+int main(int argc, char *arg[])
+{
+  const int wd = 1031, ht = 687;
+  float *in = dt_alloc_align(16, sizeof(float)*4*wd*ht);
+  srand(42);
+  for(int k=0; k<4*wd*ht; k++) in[k] = rand()/(float)RAND_MAX;
+
+  struct { const char *name; resample_row_func func; } variant[3] =
+  {
+    { "sse", resample_row_sse },
+#ifdef HAVE_RESAMPLE_ROW_AVX2
+    { "avx2", NULL },
+#endif
+  };
+  int variants = 1;
+#ifdef HAVE_RESAMPLE_ROW_AVX2
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) variant[variants++].func = resample_row_avx2;
+  else fprintf(stderr, "cpu has no avx2/fma, not testing that code path\n");
+#endif
+
+  const float scales[] = { 0.1f, 0.33f, 0.5f, 0.77f, 1.5f, 2.3f };
+  const float tolerance = 1e-5f;
+  int failed = 0;
+  darktable.cpu_flags = DT_CPU_FLAG_SSE2;
+
+  for(int t=DT_INTERPOLATION_FIRST; t<DT_INTERPOLATION_LAST; t++)
+  {
+    // not dt_interpolation_new(): DT_INTERPOLATION_USERPREF has the same value as bicubic
+    const struct dt_interpolation *itor = &dt_interpolator[t];
+    for(int s=0; s<sizeof(scales)/sizeof(scales[0]); s++)
+    {
+      const dt_iop_roi_t roi_in = { 0, 0, wd, ht, 1.0f };
+      dt_iop_roi_t roi_out = { 3, 5, wd*scales[s] - 7, ht*scales[s] - 9, scales[s] };
+      if(roi_out.width > 640) roi_out.width = 640;
+      if(roi_out.height > 480) roi_out.height = 480;
+      const int n = 4*roi_out.width*roi_out.height;
+
+      float *ref = dt_alloc_align(16, sizeof(float)*n);
+      float *out = dt_alloc_align(16, sizeof(float)*n);
+      resample(itor, resample_row_plain, ref, &roi_out, 4*sizeof(float)*roi_out.width, in, 0, &roi_in, 4*sizeof(float)*wd);
+
+      // without sse2, the filter kernels are computed in plain c, too. they approximate sines a bit
+      // differently, so only roughly the same. dt_interpolation_resample() has to run exactly that code.
+      {
+        float *plain = dt_alloc_align(16, sizeof(float)*n);
+        darktable.cpu_flags = 0;
+        resample(itor, resample_row_plain, plain, &roi_out, 4*sizeof(float)*roi_out.width, in, 0, &roi_in, 4*sizeof(float)*wd);
+        memset(out, 0, sizeof(float)*n);
+        dt_interpolation_resample(itor, out, &roi_out, 4*sizeof(float)*roi_out.width, in, &roi_in, 4*sizeof(float)*wd);
+        darktable.cpu_flags = DT_CPU_FLAG_SSE2;
+        const float err = compare(ref, plain, n);
+        const int ok = err <= 1e-4f && !memcmp(plain, out, sizeof(float)*n);
+        if(!ok) failed++;
+        printf("%-9s scale %.2f %-5s max error %g %s\n", itor->name, scales[s], "nosse", err, ok ? "ok" : "FAILED");
+        free(plain);
+      }
+
+      for(int v=0; v<variants; v++)
+      {
+        memset(out, 0, sizeof(float)*n);
+        resample(itor, variant[v].func, out, &roi_out, 4*sizeof(float)*roi_out.width, in, 0, &roi_in, 4*sizeof(float)*wd);
+        const float err = compare(ref, out, n);
+        if(err > tolerance) failed++;
+        printf("%-9s scale %.2f %-5s max error %g %s\n", itor->name, scales[s], variant[v].name, err, err > tolerance ? "FAILED" : "ok");
+      }
+
+      // bands of a few lines, every one from a copy of just the input lines it reads
+      const int band = 7;
+      memset(out, 0, sizeof(float)*n);
+      for(int oy=0; oy<roi_out.height; oy+=band)
+      {
+        dt_iop_roi_t roi_band = roi_out;
+        roi_band.y = roi_out.y + oy;
+        roi_band.height = roi_out.height - oy < band ? roi_out.height - oy : band;
+        int y0, y1;
+        dt_interpolation_resample_lines(itor, &roi_band, &roi_in, &y0, &y1);
+        float *lines = dt_alloc_align(16, sizeof(float)*4*wd*(y1-y0));
+        memcpy(lines, in + 4*wd*y0, sizeof(float)*4*wd*(y1-y0));
+        dt_interpolation_resample_band(itor, out + 4*roi_out.width*oy, &roi_band, 4*sizeof(float)*roi_out.width,
+                                       lines, y0, &roi_in, 4*sizeof(float)*wd);
+        free(lines);
+      }
+      const float err = compare(ref, out, n);
+      if(err > tolerance) failed++;
+      printf("%-9s scale %.2f %-5s max error %g %s\n", itor->name, scales[s], "bands", err, err > tolerance ? "FAILED" : "ok");
+      free(ref);
+      free(out);
+    }
+  }
+
+  free(in);
+  return failed ? 1 : 0;
+}
@@ -21,6 +21,7 @@
 #include "common/darktable.h"
 #include "common/collection.h"
 #include "common/image_cache.h"
+#include "common/image_state.h"
 #include "common/mipmap_cache.h"
 #include "common/debug.h"
 #include "common/history.h"
@@ -45,9 +46,6 @@ void dt_view_manager_init(dt_view_manager_t *vm)
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select * from selected_images where imgid = ?1", -1, &vm->statements.is_selected, NULL);
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "delete from selected_images where imgid = ?1", -1, &vm->statements.delete_from_selected, NULL);
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "insert or ignore into selected_images values (?1)", -1, &vm->statements.make_selected, NULL);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select num from history where imgid = ?1", -1, &vm->statements.have_history, NULL);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select color from color_labels where imgid=?1", -1, &vm->statements.get_color, NULL);
-  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select id from images where group_id = (select group_id from images where id=?1) and id != ?2", -1, &vm->statements.get_grouped, NULL);
 
   int res=0, midx=0;
   char *modules[] =
@@ -668,39 +666,24 @@ dt_view_image_expose(
   // this is a gui thread only thing. no mutex required:
   imgsel = darktable.control->global_settings.lib_image_mouse_over_id;
 
+  // selection, history, grouping and color labels come from memory, drawing never queries the library:
+  dt_image_state_entry_t state;
+  dt_image_state_get(darktable.image_state, imgid, &state);
+
 #if DRAW_SELECTED == 1
-  /* clear and reset statements */
-  DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.is_selected);
-  DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.is_selected);
-  /* bind imgid to prepared statments */
-  DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.is_selected, 1, imgid);
-  /* lets check if imgid is selected */
-  if(sqlite3_step(darktable.view_manager->statements.is_selected) == SQLITE_ROW)
-    selected = 1;
+  selected = state.selected;
 #endif
 
 #if DRAW_HISTORY == 1
-  DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.have_history);
-  DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.have_history);
-  DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.have_history, 1, imgid);
-
-  /* lets check if imgid has history */
-  if(sqlite3_step(darktable.view_manager->statements.have_history) == SQLITE_ROW)
-    altered = 1;
+  altered = state.altered;
 #endif
 
   const dt_image_t *img = dt_image_cache_read_testget(darktable.image_cache, imgid);
 
 #if DRAW_GROUPING == 1
-  DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.get_grouped);
-  DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.get_grouped);
-  DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_grouped, 1, imgid);
-  DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_grouped, 2, imgid);
-
-  /* lets check if imgid is in a group */
-  if(sqlite3_step(darktable.view_manager->statements.get_grouped) == SQLITE_ROW)
+  if(state.grouped)
     is_grouped = 1;
-  else if(img && darktable.gui->expanded_group_id == img->group_id)
+  else if(darktable.gui->expanded_group_id == state.group_id)
     darktable.gui->expanded_group_id = -1;
 #endif
 
@@ -885,7 +868,7 @@ dt_view_image_expose(
     float x, y;
     if(zoom != 1) y = 0.90*height;
     else y = .12*fscale;
-    gboolean image_is_rejected = (img && ((img->flags & 0x7) == 6));
+    gboolean image_is_rejected = (img && (state.rating == 6));
 
     if(img) for(int k=0; k<5; k++)
       {
@@ -900,7 +883,7 @@ dt_view_image_expose(
             *image_over = DT_VIEW_STAR_1 + k;
             cairo_fill(cr);
           }
-          else if((img->flags & 0x7) > k)
+          else if(state.rating > k)
           {
             cairo_fill_preserve(cr);
             cairo_set_source_rgb(cr, 1.0-bordercol, 1.0-bordercol, 1.0-bordercol);
@@ -958,7 +941,7 @@ dt_view_image_expose(
         _y = y - (.17*.04)*fscale;
       }
       cairo_save(cr);
-      if(img && (imgid != img->group_id))
+      if(imgid != state.group_id)
         cairo_set_source_rgb(cr, fontcol, fontcol, fontcol);
       dtgtk_cairo_paint_grouping(cr, _x, _y, s, s, 23);
       cairo_restore(cr);
@@ -999,16 +982,10 @@ dt_view_image_expose(
     const float y = zoom == 1 ? 0.17*fscale: 0.1*height;
     const float r = zoom == 1 ? 0.01*fscale : 0.03*width;
 
-    /* clear and reset prepared statement */
-    DT_DEBUG_SQLITE3_CLEAR_BINDINGS(darktable.view_manager->statements.get_color);
-    DT_DEBUG_SQLITE3_RESET(darktable.view_manager->statements.get_color);
-
-    /* setup statement and iterate rows */
-    DT_DEBUG_SQLITE3_BIND_INT(darktable.view_manager->statements.get_color, 1, imgid);
-    while(sqlite3_step(darktable.view_manager->statements.get_color) == SQLITE_ROW)
+    for(int col=0; col<8; col++)
     {
+      if(!(state.colors & (1<<col))) continue;
       cairo_save(cr);
-      int col = sqlite3_column_int(darktable.view_manager->statements.get_color, 0);
       // see src/dtgtk/paint.c
       dtgtk_cairo_paint_label(cr, x+(3*r*col)-5*r, y-r, r*2, r*2, col);
       cairo_restore(cr);